@@ -211,9 +211,9 @@
          (open-single (lambda (flt) (open-iface ifname promisc flt caplen bufsize))))
     (for-each open-single filters)))
 
-(define*-public (open-pcap-multiple n fname #:key (capfilter "") (realtime #f) (localtime #f) (loop #f))
+(define*-public (open-pcap-multiple n fname #:key (capfilter "") (realtime #f) (localtime #f) (loop #f) (mapped #f))
   (let* ((filters     (pcap-filters-for-split n #:capfilter capfilter))
-         (open-single (lambda (flt) (open-pcap fname realtime flt localtime loop))))
+         (open-single (lambda (flt) (open-pcap fname realtime flt localtime loop mapped))))
     (for-each open-single filters)))
 
 (define*-public (set-ifaces-multiple n pattern #:rest r)
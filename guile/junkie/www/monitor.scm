@@ -56,6 +56,7 @@
                                     `(("Del" . ,(lambda (name)
                                                   (slog log-debug "close iface ~s" name)
                                                   (close-iface name))))))
+  (register-crudable (make-crudable "latency" iface-names iface-latency #f #f '()))
   (register-crudable (make-crudable "protocol" proto-names proto-stats #f #f '()))
   (register-crudable (make-crudable "muxer" mux-names mux-stats #f #f '()))
   (register-crudable (make-crudable "array" array-names array-stats #f #f '()))
@@ -3,6 +3,9 @@
 #ifndef CAP_H_100409
 #define CAP_H_100409
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
 #include <junkie/tools/timeval.h>
 #include <junkie/proto/proto.h>
 
@@ -22,8 +25,91 @@ struct cap_proto_info {
 #   define IFACE_UNSET 255
     unsigned dev_id;        ///< Incoming device id
     struct timeval tv;      ///< Date of arrival
+    struct cap_buf *buf;    ///< The buffer holding the frame, if it can be retained (not a ref)
 };
 
+/// A buffer of captured frames, owned by the capture layer
+/** Those who need a frame after its parse (such as waiting lists) may
+ * retain its buffer instead of copying the frame. The capture layer then
+ * stops filling a buffer it's not the only one to hold, and uses a new one.
+ * Only frames that bursts copy out of libpcap end up in such buffers: frames
+ * read in place from AF_PACKET rings or mapped files are never retained. */
+struct cap_buf {
+    unsigned refs;          ///< How many holders (the capture layer being one of them)
+    bool left;              ///< Set once the capture layer stopped filling it (see cap_buf_leave())
+    size_t size;            ///< Size of data
+    uint8_t data[];
+};
+
+/// @returns a new buffer of this size, with a single ref.
+struct cap_buf *cap_buf_new(size_t size);
+
+/// Resize a buffer that no one else holds (content is preserved).
+/** @returns false, leaving it unchanged, if it cannot be reallocated. */
+bool cap_buf_resize(struct cap_buf **, size_t size);
+
+struct cap_buf *cap_buf_ref(struct cap_buf *);
+void cap_buf_unref(struct cap_buf **);
+
+/// For the capture layer to drop a buffer it won't fill anymore.
+/** If others still hold it, its whole size is then accounted in cap_buf_pinned_size until it's freed. */
+void cap_buf_leave(struct cap_buf **);
+
+/// @returns a ref to the buffer of the frame the given info belongs to, if this packet lies within it and it can be retained.
+/** Buffers are not retained when memory is tight, in which case the caller must copy the packet.
+ * Notice that a single retained frame keeps its whole buffer alive: if no one
+ * but the capture layer held it yet, *pinned is set to the size of the buffer
+ * (and to 0 otherwise). */
+struct cap_buf *cap_buf_retain(struct proto_info const *, uint8_t const *packet, size_t len, size_t *pinned);
+
+/// Total size of the existing cap_bufs
+extern size_t cap_buf_tot_size;
+
+/// Total size of the cap_bufs that are kept alive only by those who retained some of their frames
+extern size_t cap_buf_pinned_size;
+
+/// Reorders the outputs of the partitions of a file back into file order
+/** When a file is split into partitions parsed in parallel (see
+ * open-pcap-partitioned), outputs that depend on the order of the frames
+ * (such as capture files, or nettop counts) can be deferred while parsing a
+ * frame, tagged with the rank of this frame in the file. They are then
+ * emitted in rank order once every partition has parsed past this rank, so
+ * that the result is the same as if the file was parsed by a single thread.
+ * Subscribers that need the proto_infos of the frame (such as nettrack
+ * graphs) cannot be deferred, and still see the partitions concurrently.
+ * The total size of the pending outputs is bounded by cap-merge-max-pending. */
+struct cap_merge;
+
+/// @returns a new merge for that many partitions, with a single ref.
+struct cap_merge *cap_merge_new(unsigned num_parts);
+
+struct cap_merge *cap_merge_ref(struct cap_merge *);
+
+/// Once the last ref is gone all pending outputs are emitted.
+void cap_merge_unref(struct cap_merge **);
+
+/// Tells that the current thread is about to parse the frame of this rank from this partition.
+void cap_merge_enter(struct cap_merge *, unsigned part, uint64_t rank);
+
+/// Tells that the current thread is done parsing frames from a partition.
+void cap_merge_leave(void);
+
+typedef void cap_merge_emit_fn(void *ctx, struct timeval const *now, void const *data, size_t len);
+
+/// Defer an output until its turn comes.
+/** The iovecs are copied and will be emitted later, by any thread, with emit(ctx, now, data, len).
+ * @returns false if the current thread is not parsing a partition, in which case the caller should output immediately. */
+bool cap_merge_defer(cap_merge_emit_fn *emit, void *ctx, struct timeval const *now, struct iovec const *iov, unsigned iovcnt);
+
+/// Tells that all frames of this partition which rank is below next_rank were parsed.
+/** Use UINT64_MAX once the partition is over. Emits whatever outputs can be.
+ * If too many outputs are pending, waits until the slower partitions catch up
+ * (so do not call this from within a protected region). */
+void cap_merge_advance(struct cap_merge *, unsigned part, uint64_t next_rank);
+
+/// Emit right away all the pending outputs for this ctx (to be called before ctx is destroyed).
+void cap_merge_forget(void *ctx);
+
 extern bool collapse_ifaces;
 
 void cap_init(void);
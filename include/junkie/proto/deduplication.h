@@ -8,23 +8,56 @@
 #include <junkie/tools/timeval.h>
 #include <junkie/tools/queue.h>
 #include <junkie/tools/ref.h>
-#include <junkie/tools/hash.h>
+#include <junkie/tools/counter.h>
 
-#define DIGEST_SIZE MD4_DIGEST_LENGTH
+#define DIGEST_SIZE 16   // Large enough for all digest engines (see dedup-digest)
 
-struct digest_qcell;
+/// The digest of a frame, computed once and then looked up in any digest_queue
+struct frame_digest {
+    unsigned char digest[DIGEST_SIZE];
+    uint32_t check;         ///< Independent check of the digested bytes, to detect digest collisions
+};
+
+void digest_frame(struct frame_digest *, size_t cap_len, uint8_t const *packet);
+
+/// The digest of a frame, as stored in the dedup window
+struct dedup_entry {
+    uint16_t volatile seq;  ///< Odd while the entry is being written
+    uint8_t dev_id;         ///< Where this frame was received
+    uint8_t unused;
+    uint32_t check;         ///< see struct frame_digest
+    int64_t ts;             ///< Frame timestamp, in microseconds
+    unsigned char digest[DIGEST_SIZE];
+};
 
 struct digest_queue {
     struct ref ref;
     LIST_ENTRY(digest_queue) entry; // All existing digest_queues are chained together
-#   define NB_QUEUES (MIN(CPU_MAX, 256))   /* Must not be greater that 256 since we use only one byte from digest to hash */
-    struct digest_queue_ {
-        struct mutex mutex; // protecting this queue
-        // Previously received packets, indexed by their digests
-        HASH_TABLE(qcells, digest_qcell) qcells;
-    } queues[NB_QUEUES];    // The queue is chosen according to digest hash, so that several distinct threads can perform lookups simultaneously.
+    /* Digests of the frames received during the last max_dup_delay, in as many
+     * open addressing tables as time slices of max_dup_delay we look into. The table of
+     * the oldest slice is reused for the new one, so that we never allocate after construction. */
+#   define NB_DEDUP_SLICES 2
+    struct dedup_slice {
+        int64_t volatile epoch;         // Number of max_dup_delay since the Epoch this slice is for
+        struct dedup_entry *entries;    // size entries, cache line aligned
+    } slices[NB_DEDUP_SLICES];
+    unsigned size;  // Number of entries per slice (a power of 2)
+    void *mem;      // Where the entries are stored
     // Some stats for the user
-    uint_least64_t num_dup_found, num_nodup_found;
+    struct counter num_dup_found, num_nodup_found;
+    struct counter num_collisions;  // digests that matched for distinct frames
+    struct counter num_overflows;   // digests that could not be stored for lack of room
+    // When (in seconds of frame time) and at what values of these counters overflows were last checked (see dedup-overflow-warning)
+    int64_t volatile overflows_checked;
+    uint64_t overflows_at_check, nodups_at_check;
+    /* Dups found per pair of devices (original, duplicate), with the distribution of their delay
+     * in buckets of powers of 2 microseconds. Pairs are added as they are found, never removed. */
+#   define NB_DEDUP_PAIRS 64
+#   define NB_DEDUP_DT_BUCKETS 24
+    struct dedup_pair {
+        uint32_t volatile key;  // 0 if unused, otherwise 1 + (original dev_id << 8 | duplicate dev_id)
+        uint_least64_t dt[NB_DEDUP_DT_BUCKETS];
+    } pairs[NB_DEDUP_PAIRS];
     uint8_t dev_id;
 };
 
@@ -34,7 +67,9 @@ struct digest_queue *digest_queue_get(uint8_t dev_id);
 /// Unref a digest_queue (returns NULL)
 void digest_queue_unref(struct digest_queue **);
 
-bool digest_queue_find(struct digest_queue *dq, size_t cap_len, uint8_t *packet, struct timeval const *frame_tv);
+/** Look for a previous frame with this digest in the last max_dup_delay, storing this one if there is none.
+ * dev_id is the device this frame was received from. */
+bool digest_queue_find(struct digest_queue *dq, struct frame_digest const *, uint8_t dev_id, size_t cap_len, uint8_t const *packet, struct timeval const *frame_tv);
 
 struct dedup_proto_info {
     struct proto_info info;
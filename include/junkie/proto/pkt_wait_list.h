@@ -7,6 +7,8 @@
 #include <junkie/tools/queue.h>
 #include <junkie/tools/timeval.h>
 #include <junkie/tools/mutex.h>
+#include <junkie/tools/timer_wheel.h>
+#include <junkie/tools/counter.h>
 #include <junkie/proto/proto.h>
 
 /** @file
@@ -31,7 +33,8 @@
  * proto_info structures from the stack to the heap, taking care of the
  * pointers in them.  Another problem, easier to solve but probably more
  * expensive, is that due to the way the kernel sends the packets to libpcap we
- * also need to copy the packet itself.
+ * also need to copy the packet itself, unless the capture layer stored it in a
+ * buffer that we can retain (see struct cap_buf).
  *
  * That's why we will try to only push the packets in the waiting list when
  * this is strictly required (or equivalently, the enqueue function will first
@@ -45,8 +48,8 @@
 
 /// A Waiting Packet.
 /** When a packet is enqueued on a waiting list, it is first copied out of the
- * pcap mmap, then all the proto_info description must also be copied out of
- * the stack. We also must preserve all the parameters that are required to
+ * pcap mmap (or its capture buffer is retained), then all the proto_info
+ * description must also be copied out of the stack. We also must preserve all the parameters that are required to
  * eventually call proto_parse, when the missing packets will be received.
  * Everything must be freed when the pkt_wait is deleted, and the subparser
  * must be called whatever the fate of this pkt_wait (parsed, timeouted,
@@ -80,21 +83,23 @@ struct pkt_wait {
     struct proto_info *parent;
     /// Current way at the time when the packet was put on hold
     unsigned way;
-    /// The copy of the total captured packet
-    uint8_t packet[];
+    /// The capture buffer holding the total captured packet, if we retained it instead of copying the packet
+    struct cap_buf *buf;
+    /// The total captured packet (either within buf or our copy)
+    uint8_t const *packet;
+    /// The copy of the total captured packet (if buf is NULL)
+    uint8_t copy[];
 };
 
 struct pkt_wl_config {
     struct pkt_wl_config_list {
-        /// The list of struct pkt_wait_list in no particular order (but on 10 different lists, considered for timeout at 1s interval - a low tech way to timeout incrementaly)
-        LIST_HEAD(pkt_wait_list_list, pkt_wait_list) list[10];
-        /// The mutex that protects the above list
+        /// The timers of the struct pkt_wait_list using this mutex which have pending packets
+        struct timer_wheel wheel;
+        /// The mutex that protects the above wheel (and the waiting lists using it)
         struct supermutex mutex;
-        /// the max timestamp of packet addition in any of these waiting lists (used to give current time to timeouter thread)
+        /// the max timestamp of packet addition in any of these waiting lists (used to give current time to the timers thread)
         struct timeval last_used;
     } lists[CPU_MAX*11];
-    /// Index of next list to be timeouted (1s interval between these lists)
-    unsigned next_to;
     /// Entry in the list of all pkt_wl_configs
     SLIST_ENTRY(pkt_wl_config) entry;
     /// A sequence to choose a lists at random
@@ -115,9 +120,12 @@ struct pkt_wl_config {
     bool allow_partial;
     /// Timeout (s)
     unsigned timeout;
-    /// A thread to timeout WLs more aggressively (otherwise pending packets on a WL which receive no more traffic would have to wait until its parent destruction)
-    bool has_timeouter;             ///< Flag used for thread destruction
-    pthread_t timeouter_pth;        ///< Only set if has_timeouter
+    /// How many bytes of pending packets were copied
+    struct counter bytes_copied;
+    /// How many bytes of pending packets were kept in their capture buffer instead
+    struct counter bytes_referenced;
+    /// How many bytes of capture buffers were kept alive because of these (a buffer is counted once, by the first to retain it)
+    struct counter bytes_pinned;
 };
 
 void pkt_wl_config_ctor(
@@ -145,10 +153,10 @@ struct pkt_wait_list {
     LIST_HEAD(pkt_waits, pkt_wait) pkts;
     /// The global configuration for this pkt_wait_list (never changes during the lifetime of the object)
     struct pkt_wl_config *config;
-    /// The list into this config where this pkt_list is queued
+    /// The list into this config which mutex protects this pkt_list
     struct pkt_wl_config_list *list;
-    /// And the entry in this list
-    LIST_ENTRY(pkt_wait_list) entry;
+    /// Fires when the oldest pending packet may have timeouted (armed in list->wheel only while packets are pending), so that packets of a WL which receive no more traffic do not wait until its parent destruction
+    struct timer timer;
     /// Current number of pending packets
     unsigned num_pkts;
     /// Current pending payload
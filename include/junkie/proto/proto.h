@@ -16,6 +16,8 @@
 #include <junkie/tools/mutex.h>
 #include <junkie/tools/ref.h>
 #include <junkie/tools/bench.h>
+#include <junkie/tools/counter.h>
+#include <junkie/tools/timer_wheel.h>
 
 /** @file
  * @brief Packet inspection
@@ -120,19 +122,42 @@ struct proto_subscriber {
     proto_cb_t *cb;
 };
 
+/// The subscribers of a hook, as seen by the callers of the hook.
+/** Never modified once published: (un)subscribing builds a new one that
+ * replaces the former, which is deleted (by the doomer) once no thread can
+ * be using it any more. */
+struct hook_subscribers {
+    struct ref ref;
+    unsigned num;
+    struct proto_subscriber *subs[];
+};
+
 /// A hook is composed of a list of subscribers and a mutex.
 struct hook {
     char const *name;
-    LIST_HEAD(proto_subscribers, proto_subscriber) subscribers;
-    struct rwlock lock;
+    /// What's called. NULL when there are no subscribers. Readers merely load this pointer.
+    struct hook_subscribers *volatile subscribers;
+    /// The list of subscribers from which the above is built (protected by mutex)
+    LIST_HEAD(proto_subscribers, proto_subscriber) list;
+    struct mutex mutex;     ///< Serializes (un)subscriptions
 };
 
 void hook_ctor(struct hook *, char const *);
 void hook_dtor(struct hook *);
 int hook_subscriber_ctor(struct hook *, struct proto_subscriber *, proto_cb_t *cb);
+/// Once this returns the callback is not called any more, and the subscriber can be freed.
+/** Must not be called from within a protected region (see ref.h), since it waits for
+ * the threads that may be calling the hook to leave theirs (so not from a callback either). */
 void hook_subscriber_dtor(struct hook *, struct proto_subscriber *);
+/// Callers must be in a protected region (see ref.h) unless no one can (un)subscribe concurrently.
 void hook_subscribers_call(struct hook *, struct proto_info *, size_t, uint8_t const *, struct timeval const *);
 
+/// So that callers can save the building of what they would pass to nobody.
+static inline bool hook_has_subscribers(struct hook const *hook)
+{
+    return hook->subscribers != NULL;
+}
+
 /// Call all subscribers of given proto (same as normal hook_subscribers_call but ensure we call it no more than once per packet)
 void proto_subscribers_call(struct proto *proto, struct proto_info *info, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now);
 
@@ -190,8 +215,8 @@ struct proto {
         PROTO_CODE_GTP, PROTO_CODE_VXLAN,
         PROTO_CODE_MAX
     } code;                 ///< Numeric code used for instance to serialize these events
-    uint64_t num_frames;     ///< How many times we called this parse (count frames only if this parser is never called more than once on a frame)
-    uint64_t num_bytes;      ///< How many bytes this proto had on wire
+    struct counter num_frames;  ///< How many times we called this parse (count frames only if this parser is never called more than once on a frame)
+    struct counter num_bytes;   ///< How many bytes this proto had on wire
     /// How many parsers of this proto exists
     unsigned num_parsers;
     /// Entry in the list of all registered protos
@@ -364,6 +389,7 @@ void parser_unref(struct parser **parser);
 
 struct mux_parser;
 struct mux_subparser;
+struct mux_index;
 
 /// If your proto parsers are multiplexer, inherit from mux_proto instead of a mere proto
 /** Multiplexers are the most complicated parsers.
@@ -422,6 +448,19 @@ struct mux_subparser;
  * bonus SNMP statistics for all multiplexers (such as average collision rate
  * in the hash) and guile extensions available for tuning any multiplexers.
  */
+
+/** How valuable a flow (ie. a mux_subparser) is, for when a mux_parser has too
+ * many children and must sacrifice one: the lowest classes are evicted first, and
+ * amongst a class the least recently used of the oldest flows. A flow starts as
+ * MUX_FLOW_EMBRYONIC and may only be promoted, by the parser that knows better
+ * (see mux_subparser_promote()). */
+enum mux_flow_class {
+    MUX_FLOW_EMBRYONIC,     ///< Nothing tells it is more than a probe (a lone SYN, a scan...)
+    MUX_FLOW_ESTABLISHED,   ///< Both peers took part (for instance, the TCP handshake completed)
+    MUX_FLOW_ACTIVE,        ///< A child parser is attached and was given some payload
+    MUX_NB_FLOW_CLASSES
+};
+
 struct mux_proto {
     struct proto proto; ///< The mux_proto is a specialization of this proto
     /// If you do not overload mux_subparser just use &mux_proto_ops
@@ -434,19 +473,29 @@ struct mux_proto {
     LIST_ENTRY(mux_proto) entry;    ///< Entry in the list of mux protos
     unsigned hash_size;             ///< The required size for the hash used to store subparsers
     unsigned num_max_children;       ///< The max number of subparsers (after which old ones are deleted)
-    uint64_t num_infanticide;        ///< Nb children that were deleted because of the previous limitation
-    uint64_t num_collisions;         ///< Nb collisions in the hashes since last change of hash size
-    uint64_t num_lookups;            ///< Nb lookups in the hashes since last change of hash size
-    uint64_t num_timeouts;           ///< Nb subparsers timeouted from the hashes (ie. not how many parsers of this proto were timeouted!)
-    time_t last_used;               ///< last time we had traffic (used to give time to timeouter thread)
+    bool lockfree;                  ///< Should new parsers also index their subparsers for lock-free lookups (see struct mux_index)
+    struct counter num_infanticide;  ///< Nb children that were deleted because of the previous limitation
+    struct counter num_evictions[MUX_NB_FLOW_CLASSES];  ///< The same, per class of the sacrificed child
+    struct counter num_denied;       ///< Nb flows that were not even given a subparser (see for instance tcp-lazy-flows)
+    /// For the memory report of mux-stats: how many subparsers are alive and how many bytes they use on top of their struct
+    struct counter num_subparsers, extra_bytes; // decrements are added as their two's complement, so read them as signed
+    size_t subparser_size;          ///< The size of a subparser, with its key (as last allocated by mux_subparser_alloc())
+    struct counter num_collisions;   ///< Nb collisions in the hashes since last change of hash size
+    struct counter num_lookups;      ///< Nb lookups in the hashes since last change of hash size
+    struct counter num_timeouts;     ///< Nb subparsers timeouted from the hashes (ie. not how many parsers of this proto were timeouted!)
+    struct counter num_unindexed;    ///< Nb subparsers that did not fit in their parser lock-free index (only looked up with locks)
+    struct counter num_cache_hits;   ///< Nb lookups that were answered by the looking up thread flow cache (also counted in num_lookups)
+    time_t last_used;               ///< last time we had traffic (used to give time to the timers thread)
     /** A pool of mutexes so that we have enough for all the subparsers hash lines
      * but not one per hash line (would require too much memory). Also, we turn this
-     * into profit by having only a few timeout queues that can be visited often in order
-     * to timeout subparsers quickly. */
+     * into profit by having only a few timing wheels, protected by these mutexes,
+     * to timeout subparsers. */
     struct per_mutex {
         struct mutex mutex;
-        TAILQ_HEAD(timeout_queue, mux_subparser) timeout_queue;
+        struct timer_wheel wheel;   ///< Timers of the subparsers of the hash lines protected by this mutex
     } mutexes[CPU_MAX];
+    /// Protect the flow classes of the mux_parsers (each mux_parser uses one of them)
+    struct mutex flows_mutexes[CPU_MAX];
 };
 
 /// Generic new/del functions for struct mux_subparser, suitable iff you do not overload mux_subparser
@@ -489,15 +538,19 @@ struct proto *proto_of_scm_name(SCM name);
  * @note Remember to add the packed_ attribute to your keys ! */
 struct mux_subparser {
     struct ref ref;                         ///< Note that being stored in parent's hash does count as a reference
-    TAILQ_ENTRY(mux_subparser) to_entry;    ///< Its entry in its timeout queue (sorted in least recently used first)
-    STAILQ_ENTRY(mux_subparser) h_entry;    ///< Its entry in the hash (sorted in more recently used first - so that lookups are faster)
+    struct timer timer;                     ///< To timeout it once unused for mux-timeout seconds (see last_used)
+    LIST_ENTRY(mux_subparser) h_entry;      ///< Its entry in the hash (more recently created first, lookups do not reorder it)
     struct parser *parser;                  ///< The actual parser
-    struct timeval last_used;               ///< Last time we called its parse method
+    time_t last_used;                       ///< Last second we looked it up (coarse stamp, written only when it changes)
     struct proto *requestor;                ///< The proto that requested its creation
     struct mux_parser *mux_parser;          ///< Backlink to our mux_parser
     struct mux_proto *mux_proto;            ///< Backlink to our mux_proto, for when mux_parser cannot be used (see mux_subparser_del_as_ref())
 #   define NOT_HASHED UNSET
-    unsigned h_idx;                         ///< Our hash index into mux_parser->subparsers (NO_HASHED if not queued in any list)
+    unsigned h_idx;                         ///< Our bucket index in mux_parser hash (NO_HASHED if not queued in any list)
+    /// Its entry in mux_parser->flows, if the mux_parser limits its number of children (protected by mux_parser->flows_mutex)
+    TAILQ_ENTRY(mux_subparser) c_entry;
+    unsigned flow_class:2;                  ///< An enum mux_flow_class
+    unsigned flow_listed:1;                 ///< Set while it is in mux_parser->flows (protected by mux_parser->flows_mutex)
     char key[];                             ///< The key used to identify it (beware of the variable size)
 };
 
@@ -525,13 +578,27 @@ struct mux_subparser {
  */
 struct mux_parser {
     struct parser parser;                                   ///< A mux_parser is a specialization of this parser
-    unsigned hash_size;                                     ///< The hash size for this particular mux_parser (taken from mux_proto at creation time, constant)
+    unsigned hash_size;                                     ///< The initial hash size for this particular mux_parser (taken from mux_proto at creation time, constant)
     unsigned num_max_children;                               ///< The max number of children allowed (0 if not limited)
     unsigned num_children;                                   ///< Current number of children
+    struct mux_index *index;                                ///< Optional lock-free index of the subparsers (NULL unless mux_proto->lockfree when created)
+    /** The hash grows one bucket at a time (linear hashing), from hash_size to
+     * at most hash_size << NB_MUX_SEGMENTS, when lookups meet too many collisions.
+     * Buckets beyond hash_size are allocated by segments, so that existing ones
+     * never move (see h_list_of_h_idx()). */
+    unsigned volatile num_buckets;                          ///< Current number of buckets (from hash_size up)
+    unsigned num_to_split;                                  ///< How many buckets remain to be split before we reconsider growing
+    unsigned num_lookups, num_collisions;                   ///< Since last time we considered growing (not exact)
+    int volatile splitting;                                 ///< Set while a thread is splitting a bucket
+#   define NB_MUX_SEGMENTS 16
+    struct subparsers **segments;                           ///< The buckets after the first hash_size ones (allocated on first growth, NB_MUX_SEGMENTS entries)
+    struct mutex *flows_mutex;                              ///< Protects flows (one of mux_proto->flows_mutexes)
+    /// If num_max_children, all the indexed subparsers per class, the most recently promoted first
+    TAILQ_HEAD(mux_flows, mux_subparser) flows[MUX_NB_FLOW_CLASSES];
     /// The hash of subparsers (Beware of the variable size)
     struct subparsers {
         /// These two fields are protected by one of the mux_proto->mutexes
-        STAILQ_HEAD(mux_subparsers, mux_subparser) list;    ///< The list of all subparsers with same hash value (least recently used last)
+        LIST_HEAD(mux_subparsers, mux_subparser) list;      ///< The list of all subparsers with same hash value
     } subparsers[];
 };
 
@@ -580,6 +647,17 @@ void mux_subparser_dtor(
     struct mux_subparser *mux_subparser ///< The mux_subparser to destruct
 );
 
+/// Parsing threads call these around each burst of frames they parse.
+/** Meanwhile they own their flow cache, which is cleaned of the subparsers that were deindexed
+ * when they leave it (otherwise the timeouter cleans it). */
+void mux_flow_cache_enter(void);
+void mux_flow_cache_leave(void);
+
+/// The last subparser returned by mux_subparser_lookup() in this thread.
+/** No ref is held, so it must not be dereferenced outside the protected region it was found in.
+ * Used to prefetch the state of flows ahead of their next frame. */
+extern __thread struct mux_subparser *mux_subparser_last;
+
 /// Search (and optionally create) a subparser
 /* Note: in both cases a new ref is returned. */
 struct mux_subparser *mux_subparser_lookup(
@@ -606,6 +684,13 @@ void mux_subparser_unref(struct mux_subparser **);
 /// Remove a mux_subparser from its mux_proto hash, thus probably killing the only left ref apart yours.
 void mux_subparser_deindex(struct mux_subparser *);
 
+/// Tell that this subparser allocated (or freed, if bytes is negative) some memory of its own, for mux-stats.
+void mux_subparser_account(struct mux_subparser *, ssize_t bytes);
+
+/// Tell that this flow is now at least of this class (it's never demoted).
+/** Cheap when the class does not change, so it can be called for every packet. */
+void mux_subparser_promote(struct mux_subparser *, enum mux_flow_class);
+
 /// Construct a mux_parser
 int mux_parser_ctor(struct mux_parser *mux_parser, struct mux_proto *mux_proto, unsigned hash_size, unsigned num_max_children);
 
@@ -113,6 +113,30 @@ static inline void bench_event_stop(struct bench_event *e, uint64_t start)
 #   define bench_event_stop(e, start) ((void)e, (void)start)
 #endif
 
+#ifdef WITH_BENCH
+/// Same as bench_event_stop, but accounts for n events that took place since start (so that tot_duration/count stays the per event duration)
+static inline void bench_event_stop_n(struct bench_event *e, uint64_t start, unsigned n)
+{
+    if (! n) return;
+#   ifdef __GNUC__
+    __sync_fetch_and_add(&e->count.count, n);
+#   else
+    e->count.count += n;
+#   endif
+    uint64_t duration = rdtsc() - start;
+#   ifdef __GNUC__
+    __sync_fetch_and_add(&e->tot_duration, duration);
+#   else
+    e->tot_duration += duration;
+#   endif
+    duration /= n;
+    if (duration < e->min_duration) e->min_duration = duration;
+    if (duration > e->max_duration) e->max_duration = duration;
+}
+#else
+#   define bench_event_stop_n(e, start, n) ((void)e, (void)start, (void)n)
+#endif
+
 /** Init */
 
 void bench_init(void);
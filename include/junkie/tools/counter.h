@@ -0,0 +1,70 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef COUNTER_H_261018
+#define COUNTER_H_261018
+#include <stdint.h>
+#include <junkie/cpp.h>
+
+/** @file
+ * @brief Statistic counters that many threads can increment without sharing any cache line.
+ *
+ * Each thread adds into its own copy of every counter (a plain addition, no
+ * atomic nor lock), and the copies are summed only when the counter is read.
+ * Reading is thus much more expensive than adding, and does not see the
+ * additions that are being performed concurrently; which is what we want for
+ * statistics that are incremented for every frame and read from time to time
+ * from the command line.
+ *
+ * When a thread terminates, its copies are merged into a global one so that
+ * the values of the counters never decrease.
+ */
+
+/// Number of counters per block of per-thread copies
+#define COUNTER_BLOCK_SIZE 256
+/// Max number of blocks (so max number of counters is COUNTER_BLOCK_SIZE*COUNTER_MAX_BLOCKS)
+#define COUNTER_MAX_BLOCKS 64
+
+struct counter {
+    unsigned idx;       ///< Location of this counter's copies in every thread's blocks
+    uint64_t base;      ///< Value of the sum when this counter was (re)set
+};
+
+/// The per-thread copies of the counters
+struct counter_thread {
+    uint64_t *blocks[COUNTER_MAX_BLOCKS];   ///< Allocated on demand
+    struct counter_thread *next;            ///< In the list of all threads copies (protected by counters mutex)
+};
+
+extern __thread struct counter_thread *counter_thread;
+
+/// Allocate (and register) the given block for the current thread.
+uint64_t *counter_block_new(unsigned block);
+
+/// Add v to this counter (on behalf of the current thread only).
+static inline void counter_add(struct counter *counter, uint64_t v)
+{
+    unsigned const block = counter->idx / COUNTER_BLOCK_SIZE;
+    uint64_t *copies = likely_(counter_thread) ? counter_thread->blocks[block] : NULL;
+    if (unlikely_(! copies)) copies = counter_block_new(block);
+    copies[counter->idx % COUNTER_BLOCK_SIZE] += v;
+}
+
+static inline void counter_inc(struct counter *counter)
+{
+    counter_add(counter, 1);
+}
+
+/// @returns the sum of all the additions to this counter since it was constructed or reset.
+uint64_t counter_read(struct counter const *);
+
+/// Reset the counter to 0.
+/** Additions that are being performed concurrently may or may not be lost. */
+void counter_reset(struct counter *);
+
+void counter_ctor(struct counter *);
+void counter_dtor(struct counter *);
+
+void counter_init(void);
+void counter_fini(void);
+
+#endif
@@ -7,6 +7,7 @@
 #include <junkie/tools/objalloc.h>
 #include <junkie/tools/miscmacs.h>
 #include <junkie/tools/log.h>
+#include <junkie/tools/key_hash.h>
 
 /** @file
  * @brief simple hash implementation in the spirit of the BSD queues.
@@ -67,7 +68,7 @@ struct name_ { \
     for (unsigned __hash_l = 0; __hash_l < (hash)->base.num_lists; __hash_l++) \
         LIST_FOREACH_SAFE(var, (hash)->lists+__hash_l, field, tvar)
 
-#define HASH_FUNC(key) hashfun(key, sizeof(*(key)))
+#define HASH_FUNC(key) key_hash(key, sizeof(*(key)))
 #define HASH_LIST(hash, key) ((hash)->lists + (HASH_FUNC(key) % (hash)->base.num_lists))
 
 #define HASH_FOREACH_SAME_KEY(var, hash, key, key_field, field) \
@@ -120,7 +121,7 @@ struct name_ { \
 } while (0)
 
 /*
- * And in case you need one, a simple and fast (for small keys) hash function:
+ * And in case you need one, a simple hash function (but see key_hash() for fixed size keys):
  */
 
 static inline uint_least32_t hashfun(void const *k_, size_t len)
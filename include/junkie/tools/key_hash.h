@@ -0,0 +1,137 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef KEY_HASH_H_261018
+#define KEY_HASH_H_261018
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#   include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32) && defined(__aarch64__)
+#   include <arm_acle.h>
+#endif
+
+/** @file
+ * @brief Hash function for the fixed size keys of our hashes.
+ *
+ * Keys are hashed 8 bytes at a time, using the CRC32C instruction when the
+ * target has one (SSE4.2 or ARMv8 CRC extension, selected at compile time;
+ * on x86_64 SSE4.2 is also detected at startup when not targeted at compile
+ * time) or a multiply-xorshift otherwise. The most common key sizes (ports, IPv4
+ * address pairs, IPv6 addresses, IP keys) are hashed without any loop nor
+ * branch, and so are all keys which size is known at compile time once
+ * key_hash() is inlined.
+ *
+ * Note that hash values depend on the target (and its endianness), so they
+ * must not be stored nor sent anywhere.
+ */
+
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#   define KEY_HASH_IMPL "crc32c (sse4.2)"
+static inline uint64_t key_hash_word(uint64_t h, uint64_t w)
+{
+    return _mm_crc32_u64(h, w);
+}
+#elif defined(__ARM_FEATURE_CRC32) && defined(__aarch64__)
+#   define KEY_HASH_IMPL "crc32c (armv8)"
+static inline uint64_t key_hash_word(uint64_t h, uint64_t w)
+{
+    return __crc32cd(h, w);
+}
+#elif defined(__x86_64__) && defined(__GNUC__)
+/// Set once and for all at load time (before any hash is computed) if the CPU has SSE4.2
+extern bool key_hash_has_crc32c;
+#   define KEY_HASH_IMPL (key_hash_has_crc32c ? "crc32c (sse4.2, detected)" : "multiply-xorshift")
+static inline uint64_t key_hash_word(uint64_t h, uint64_t w)
+{
+    if (__builtin_expect(key_hash_has_crc32c, 1)) {
+        // The assembler does not care about -msse4.2, unlike the intrinsic
+        __asm__ ("crc32q %1, %0" : "+r" (h) : "rm" (w));
+        return h;
+    }
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+#else
+#   define KEY_HASH_IMPL "multiply-xorshift"
+static inline uint64_t key_hash_word(uint64_t h, uint64_t w)
+{
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+#endif
+
+static inline uint64_t key_hash_load64(uint8_t const *k)
+{
+    uint64_t w;
+    memcpy(&w, k, sizeof(w));   // compiles into a mere (unaligned) load
+    return w;
+}
+
+static inline uint64_t key_hash_load32(uint8_t const *k)
+{
+    uint32_t w;
+    memcpy(&w, k, sizeof(w));
+    return w;
+}
+
+/// Spread the entropy of the accumulator into the 32 low bits (which are used as is by modulos)
+static inline uint_least32_t key_hash_final(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/// Hash a key of any size
+static inline uint_least32_t key_hash_bytes(uint8_t const *k, size_t len)
+{
+    uint64_t h = len;
+    for (; len >= 8; k += 8, len -= 8) h = key_hash_word(h, key_hash_load64(k));
+    if (len >= 4) {
+        h = key_hash_word(h, key_hash_load32(k));
+        k += 4; len -= 4;
+    }
+    if (len > 0) {
+        uint32_t w = 0;
+        memcpy(&w, k, len);
+        h = key_hash_word(h, w);
+    }
+    return key_hash_final(h);
+}
+
+/// @returns the hash of this key (same value than key_hash_bytes())
+static inline uint_least32_t key_hash(void const *key, size_t len)
+{
+    uint8_t const *k = key;
+    uint64_t h = len;
+
+    switch (len) {
+        case 4:     // port keys
+            return key_hash_final(key_hash_word(h, key_hash_load32(k)));
+        case 8:     // pairs of IPv4 addresses
+            return key_hash_final(key_hash_word(h, key_hash_load64(k)));
+        case 16:    // IPv6 addresses
+            h = key_hash_word(h, key_hash_load64(k));
+            return key_hash_final(key_hash_word(h, key_hash_load64(k+8)));
+        case 36:    // pairs of IPv6 addresses and a protocol
+            h = key_hash_word(h, key_hash_load64(k));
+            h = key_hash_word(h, key_hash_load64(k+8));
+            h = key_hash_word(h, key_hash_load64(k+16));
+            h = key_hash_word(h, key_hash_load64(k+24));
+            return key_hash_final(key_hash_word(h, key_hash_load32(k+32)));
+        case 44:    // struct ip_key
+            h = key_hash_word(h, key_hash_load64(k));
+            h = key_hash_word(h, key_hash_load64(k+8));
+            h = key_hash_word(h, key_hash_load64(k+16));
+            h = key_hash_word(h, key_hash_load64(k+24));
+            h = key_hash_word(h, key_hash_load64(k+32));
+            return key_hash_final(key_hash_word(h, key_hash_load32(k+40)));
+    }
+
+    return key_hash_bytes(k, len);
+}
+
+#endif
@@ -22,6 +22,8 @@ struct mutex {
 
 void mutex_lock(struct mutex *);
 void mutex_unlock(struct mutex *);
+/// @returns true if we got the lock, false if it's owned already.
+bool mutex_trylock(struct mutex *);
 void mutex_unlock_(void *);   ///< Same as mutex_unlock but comply to scm_dynwind_unwind_handler signature
 /// Grab the two mutexes, first the one with smaller address.
 /** Useful to avoid some deadlocks. */
@@ -41,6 +43,23 @@ void mutex_pool_ctor(struct mutex_pool *, char const *name);
 void mutex_pool_dtor(struct mutex_pool *);
 struct mutex *mutex_pool_anyone(struct mutex_pool *);
 
+/// Condition variables, to wait for some state protected by a mutex
+struct condvar {
+    pthread_cond_t cond;
+    char const *name;
+};
+
+/// Beware that the name is *not* strduped
+void condvar_ctor(struct condvar *, char const *name);
+void condvar_dtor(struct condvar *);
+/// Release the mutex (that you must own), wait until signaled, then reacquire the mutex.
+/** Beware of spurious wakeups: always check again your condition. */
+void condvar_wait(struct condvar *, struct mutex *);
+/// Wake up one of the waiters (if any).
+void condvar_signal(struct condvar *);
+/// Wake up all the waiters.
+void condvar_broadcast(struct condvar *);
+
 /// Assert you own a lock (works only for mutex created without the RECURSIVE attribute !)
 #define PTHREAD_ASSERT_LOCK(mutex) assert(EDEADLK == pthread_mutex_lock(mutex))
 
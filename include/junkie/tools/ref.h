@@ -20,10 +20,17 @@
  *
  * - then we prevent a thread to delete an object which count reaches 0, since
  * this object address may be known by another thread that is about to inc the
- * count.  Refcounted object deletions are thus delayed until a safe point in
- * the program where all threads meet together without any pointer to any
- * refcounted object. As a consequence, it is not impossible for an object
- * count to be raised from 0 to 1.
+ * count.  Refcounted object deletions are thus delayed until all the threads
+ * that were in a protected region when the count reached 0 have left it
+ * (meaning they no longer hold any unrefed pointer to any refcounted object).
+ * As a consequence, it is not impossible for an object count to be raised
+ * from 0 to 1.
+ *
+ * - to know when this is the case without any shared lock, threads entering
+ * a protected region merely write the current "epoch" in a per-thread
+ * record. The doomer thread advances the global epoch once all threads in a
+ * protected region have seen the current one, and deletes the objects that
+ * were doomed two epochs ago (unless their count was raised in between).
  *
  * Note: ref counters gives you the assurance that a refed object won't
  * disapear, but does not prevent in any way another thread than yours to
@@ -34,7 +41,7 @@ struct ref {
     /** NOT_IN_DEATH_ROW:
      * entry.sle_next is set to NOT_IN_DEATH_ROW at creation and will be set to a proper value only
      * when the object is queued for deletion. It is then guaranteed that it will never be set to
-     * NOT_IN_DEATH_ROW again, except in mono_region, when the object is rescued by doomer_thread.
+     * NOT_IN_DEATH_ROW again, except when the object is rescued by the doomer.
      * You may be able to make some limited use of this, at your peril.
      *
      * Note: We Cannot use 0 as the magic value since sle_next will be NULL at end of list. */
@@ -81,8 +88,8 @@ static inline void *ref(struct ref *ref)
     return ref;
 }
 
-extern SLIST_HEAD(refs, ref) death_row;
-extern struct mutex death_row_mutex;
+/// Queue this object, which count just reached 0, for deletion.
+void ref_doom(struct ref *);
 
 static inline void unref(struct ref *ref)
 {
@@ -100,29 +107,30 @@ static inline void unref(struct ref *ref)
     mutex_unlock(&ref->mutex);
 #   endif
 
-    if (unreachable) {
-        // The thread that downs the count to 0 is responsible for queuing the object onto the death row.
-        mutex_lock(&death_row_mutex);
-        assert(ref->entry.sle_next == NOT_IN_DEATH_ROW);    // If it was already on the death row, then where did this ref come from?
-        SLIST_INSERT_HEAD(&death_row, ref, entry);
-        assert(ref->entry.sle_next != NOT_IN_DEATH_ROW);
-        mutex_unlock(&death_row_mutex);
-    }
+    // The thread that downs the count to 0 is responsible for queuing the object onto the death row.
+    if (unreachable) ref_doom(ref);
 }
 
 /// Enter the region where multiple threads can enter
+/** Only writes into a per-thread record, unless a thread is in the mono region. */
 void enter_multi_region(void);
 
 /// Enter the region where only this thread can enter
+/** Waits for all threads to leave their protected region, and prevents them to enter a new one. */
 void enter_mono_region(void);
 
 /// Leave the protected region (ie. all threads allowed)
 void leave_protected_region(void);
 
+/// @returns true if the calling thread is in a protected region (and thus must not wait for the others to leave theirs)
+bool in_protected_region(void);
+
 /// Will stop the doomer_thread (must be called bedore ref_fini(), and probably before any parser_fini()
 void doomer_stop(void);
 
 /// Will run the doomer thread to kill all unreachable objects (safe for multithread)
+/** Objects that were doomed while other threads were (and still are) in a
+ * protected region are not killed until a later run. */
 void doomer_run(void);
 
 void ref_init(void);
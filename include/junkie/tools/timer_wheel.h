@@ -0,0 +1,102 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef TIMER_WHEEL_H_261018
+#define TIMER_WHEEL_H_261018
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <junkie/tools/queue.h>
+#include <junkie/tools/bench.h>
+
+/** @file
+ * @brief Hierarchical timing wheels, and the thread that advances them.
+ *
+ * A timing wheel holds timers expiring at a given second. The first level of
+ * the wheel has one slot per second for the next TIMER_WHEEL_SLOTS seconds,
+ * the next level one slot per TIMER_WHEEL_SLOTS seconds, and so on. When time
+ * reaches the start of a slot of an upper level its timers are redistributed
+ * into the lower levels. Thus arming, rearming or cancelling a timer is O(1)
+ * and advancing a wheel costs only for the slots that are not empty; expired
+ * timers are collected and then fired in a batch.
+ *
+ * A wheel has no lock of its own: it is meant to be protected by the lock that
+ * already protects the objects which timers it holds, so that arming a timer
+ * usually takes no additional lock.
+ *
+ * Rather than rearming a timer each time its object is used, users merely
+ * record when it was last used, and when the timer fires they rearm it if the
+ * object was used since. So a busy object costs nothing more than a plain
+ * store per use.
+ *
+ * Since the current time is given by the captured packets, each user advances
+ * its wheels to the last time it saw, from a "ticker" that the single
+ * J-timers thread calls every second.
+ */
+
+#define TIMER_WHEEL_BITS 4
+#define TIMER_WHEEL_SLOTS (1U << TIMER_WHEEL_BITS)  ///< Slots per level
+#define TIMER_WHEEL_LEVELS 4                        ///< Timers further than 2^(TIMER_WHEEL_BITS*TIMER_WHEEL_LEVELS) seconds are redistributed several times
+
+struct timer {
+    LIST_ENTRY(timer) entry;    ///< In its wheel slot (or in the list of expired timers)
+    time_t expiry;              ///< When it fires (if armed)
+#   define TIMER_UNARMED UINT16_MAX
+#   define TIMER_EXPIRED (UINT16_MAX-1)
+    uint16_t where;             ///< The slot where it is, or TIMER_UNARMED, or TIMER_EXPIRED (about to be fired)
+};
+
+void timer_ctor(struct timer *);
+
+static inline bool timer_is_armed(struct timer const *timer)
+{
+    return timer->where != TIMER_UNARMED;
+}
+
+struct timer_wheel {
+    /// Called for each expired timer, which is then unarmed (but can be rearmed, or cancel any other timer)
+    void (*fire)(struct timer_wheel *, struct timer *, time_t now);
+    time_t now;                 ///< All timers expiring before this second were fired (0 until the wheel is first armed or advanced)
+    unsigned num_timers;        ///< Number of armed timers
+    uint32_t used[TIMER_WHEEL_LEVELS];  ///< Bitmap of the non empty slots, per level
+    LIST_HEAD(timers, timer) slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_ctor(struct timer_wheel *, void (*fire)(struct timer_wheel *, struct timer *, time_t now));
+/// Timers that are still armed are merely forgotten.
+void timer_wheel_dtor(struct timer_wheel *);
+
+/// Arm the timer (or rearm it, if it's armed already) to fire when the wheel reaches expiry.
+/** If expiry is already past it will fire at next timer_wheel_advance(). */
+void timer_arm(struct timer_wheel *, struct timer *, time_t expiry);
+
+/// Disarm this timer (nop if it's not armed).
+void timer_cancel(struct timer_wheel *, struct timer *);
+
+/// Fire all timers expiring before or at now.
+/** @returns the number of fired timers. */
+unsigned timer_wheel_advance(struct timer_wheel *, time_t now);
+
+/// Fire all the armed timers, whatever their expiry.
+/** @returns the number of fired timers. */
+unsigned timer_wheel_flush(struct timer_wheel *, time_t now);
+
+/// @returns one of the armed timers, or NULL if there are none.
+struct timer *timer_wheel_first(struct timer_wheel const *);
+
+/// Something the J-timers thread does every second (typically: advancing some wheels)
+/** Tickers must not be constructed nor destructed from within a protected
+ * region, since tick functions are allowed to enter the mono region. */
+struct timer_ticker {
+    char const *name;
+    void (*tick)(struct timer_ticker *);
+    LIST_ENTRY(timer_ticker) entry;
+    struct bench_event ticking;
+};
+
+void timer_ticker_ctor(struct timer_ticker *, char const *name, void (*tick)(struct timer_ticker *));
+void timer_ticker_dtor(struct timer_ticker *);
+
+void timer_wheel_init(void);
+void timer_wheel_fini(void);
+
+#endif
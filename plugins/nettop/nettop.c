@@ -19,6 +19,7 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <signal.h>     // for sig_atomic_t
@@ -511,7 +512,13 @@ static void handle_key(char c)
  * Callback
  */
 
-static void pkt_callback(struct proto_subscriber unused_ *s, struct proto_info const *last, size_t unused_ cap_len, uint8_t const unused_ *packet, struct timeval const *now)
+// What's counted for each frame
+struct nettop_count {
+    struct nettop_key key;
+    size_t payload;
+};
+
+static void nettop_count(struct nettop_count const *count, struct timeval const *now)
 {
     mutex_lock(&cells_lock);
 
@@ -519,27 +526,45 @@ static void pkt_callback(struct proto_subscriber unused_ *s, struct proto_info c
 
     if (! display_help) try_display(now);
 
-    ASSIGN_INFO_CHK(cap, last, );
-
-    struct nettop_key k;
-    nettop_key_ctor(&k, last);
-
     struct nettop_cell *cell;
-    HASH_LOOKUP(cell, &nettop_cells, &k, key, entry);
+    HASH_LOOKUP(cell, &nettop_cells, &count->key, key, entry);
     if (! cell) {
-        cell = nettop_cell_new(&k);
+        cell = nettop_cell_new(&count->key);
         if (! cell) goto quit;
     }
 
-    cell->volume += cap->info.payload;
+    cell->volume += count->payload;
     cell->packets ++;
 
     packets_count ++;
-    bytes_count += cap->info.payload;
+    bytes_count += count->payload;
 quit:
     mutex_unlock(&cells_lock);
 }
 
+static void nettop_count_emit(void unused_ *ctx, struct timeval const *now, void const *data, size_t len)
+{
+    struct nettop_count count;
+    assert(len == sizeof(count));
+    memcpy(&count, data, sizeof(count));    // data may not be aligned
+    nettop_count(&count, now);
+}
+
+static void pkt_callback(struct proto_subscriber unused_ *s, struct proto_info const *last, size_t unused_ cap_len, uint8_t const unused_ *packet, struct timeval const *now)
+{
+    ASSIGN_INFO_CHK(cap, last, );
+
+    struct nettop_count count;
+    nettop_key_ctor(&count.key, last);
+    count.payload = cap->info.payload;
+
+    // When parsing the partitions of a file, frames are counted in file order so that each display covers the same frames
+    struct iovec iov = { .iov_base = &count, .iov_len = sizeof(count) };
+    if (cap_merge_defer(nettop_count_emit, &nettop_cells, now, &iov, 1)) return;
+
+    nettop_count(&count, now);
+}
+
 static struct proto_subscriber subscription;
 
 /*
@@ -567,6 +592,7 @@ void on_unload(void)
     term_fini();
 
     hook_subscriber_dtor(&pkt_hook, &subscription);
+    cap_merge_forget(&nettop_cells);
     HASH_DEINIT(&nettop_cells);
 //    mutex_dtor(&cells_lock); nope since another thread may keep sending a few more packets
     cli_unregister(nettop_opts);
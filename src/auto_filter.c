@@ -0,0 +1,264 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2018, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <libguile.h>
+#include "junkie/tools/log.h"
+#include "junkie/tools/ext.h"
+#include "junkie/tools/mutex.h"
+#include "junkie/tools/tempstr.h"
+#include "junkie/tools/miscmacs.h"
+#include "junkie/proto/proto.h"
+#include "junkie/proto/port_muxer.h"
+#include "junkie/proto/tcp.h"
+#include "junkie/proto/udp.h"
+#include "auto_filter.h"
+
+LOG_CATEGORY_DEF(auto_filter);
+#undef LOG_CAT
+#define LOG_CAT auto_filter_log_category
+
+static bool auto_filter = false;
+EXT_PARAM_RW(auto_filter, "auto-filter", bool, "Should live packet sources be filtered according to the enabled protocols (see (? 'auto-filter-expr)) ?")
+
+/*
+ * Building the filter
+ */
+
+struct filter_buf {
+    char str[TEMPSTR_SIZE/2];   // the VLAN variant doubles it
+    size_t len;
+    unsigned num_terms;
+    bool overflow;
+};
+
+static void add_term(struct filter_buf *buf, char const *fmt, ...)
+{
+    if (buf->overflow) return;
+
+    char term[128];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(term, sizeof(term), fmt, ap);
+    va_end(ap);
+
+    int const len = snprintf(buf->str + buf->len, sizeof(buf->str) - buf->len, "%s(%s)", buf->num_terms > 0 ? " or ":"", term);
+    if (len < 0 || (size_t)len >= sizeof(buf->str) - buf->len) {
+        buf->overflow = true;
+        return;
+    }
+    buf->len += len;
+    buf->num_terms ++;
+}
+
+static bool proto_enabled(char const *name)
+{
+    struct proto const *proto = proto_of_name(name);
+    return proto && proto->enabled;
+}
+
+static void add_port_range(struct filter_buf *buf, char const *transport, uint16_t port_min, uint16_t port_max)
+{
+    if (port_min == port_max) {
+        add_term(buf, "%s port %"PRIu16, transport, port_min);
+    } else {
+        add_term(buf, "%s portrange %"PRIu16"-%"PRIu16, transport, port_min, port_max);
+    }
+}
+
+static void add_port_muxers(struct filter_buf *buf, char const *transport, struct port_muxer_list *muxers)
+{
+    mutex_lock(&muxers->mutex);
+    struct port_muxer *muxer;
+    TAILQ_FOREACH(muxer, &muxers->muxers, entry) {
+        if (! muxer->proto->enabled) continue;
+        add_port_range(buf, transport, muxer->port_min, muxer->port_max);
+    }
+    mutex_unlock(&muxers->mutex);
+}
+
+/* Protocols that spawn connections on well known ports that are not in a port muxer.
+ * Connections on ports negotiated at runtime (FTP passive mode, RTP...) are
+ * not let through: adding all unprivileged ports to the filter would let
+ * through most of the traffic, defeating its purpose. */
+static struct {
+    char const *proto_name;
+    char const *transport;
+    uint16_t port_min, port_max;
+} const tracked_ports[] = {
+    { "FTP",    "tcp", 20, 20 },        // active mode data
+};
+
+// Like tempstr_printf, but returns NULL instead of a truncated string (that would be an unbalanced filter)
+static char const *filter_printf(char const *fmt, ...)
+{
+    char *str = tempstr();
+    va_list ap;
+    va_start(ap, fmt);
+    int const len = vsnprintf(str, TEMPSTR_SIZE, fmt, ap);
+    va_end(ap);
+    if (len < 0 || len >= TEMPSTR_SIZE) return NULL;
+    return str;
+}
+
+// Returns the filter corresponding to the current configuration, in a tempstr
+static char const *auto_filter_expr(void)
+{
+    struct filter_buf buf = { .len = 0, .num_terms = 0, .overflow = false };
+    buf.str[0] = '\0';
+
+    if (proto_enabled("ARP")) add_term(&buf, "arp");
+    if (proto_enabled("FCoE")) add_term(&buf, "ether proto 0x8906");
+
+    bool const ip = proto_enabled("IPv4"), ip6 = proto_enabled("IPv6");
+    if (ip || ip6) {
+        if (ip && proto_enabled("ICMP")) add_term(&buf, "icmp");
+        if (ip6 && proto_enabled("ICMPv6")) add_term(&buf, "icmp6");
+        if (proto_enabled("GRE")) add_term(&buf, "ip proto 47 or ip6 proto 47");
+
+        bool const tcp = proto_enabled("TCP"), udp = proto_enabled("UDP");
+        if (tcp) add_port_muxers(&buf, "tcp", &tcp_port_muxers);
+        if (udp) add_port_muxers(&buf, "udp", &udp_port_muxers);
+        for (unsigned t = 0; t < NB_ELEMS(tracked_ports); t++) {
+            bool const transport_ok = tracked_ports[t].transport[0] == 't' ? tcp : udp;
+            if (! transport_ok || ! proto_enabled(tracked_ports[t].proto_name)) continue;
+            add_port_range(&buf, tracked_ports[t].transport, tracked_ports[t].port_min, tracked_ports[t].port_max);
+        }
+
+        // Non first fragments have no ports but are needed for reassembly
+        if ((tcp || udp) && ip) add_term(&buf, "ip[6:2] & 0x1fff != 0");
+        if ((tcp || udp) && ip6) add_term(&buf, "ip6 and ip6[6] == 44");
+    }
+
+    if (buf.overflow) {
+        SLOG(LOG_WARNING, "Auto filter would be too long, not filtering");
+        return "";
+    }
+    if (buf.num_terms == 0) return "less 1";  // no enabled proto is interested in anything
+
+    // Same with a VLAN tag
+    char const *expr = filter_printf("%s or (vlan and (%s))", buf.str, buf.str);
+    if (! expr) {
+        SLOG(LOG_WARNING, "Auto filter would be too long, not filtering");
+        return "";
+    }
+    return expr;
+}
+
+char const *auto_filter_combine(char const *user_filter)
+{
+    bool enabled;
+    WITH_EXT_LOCK(auto_filter, enabled = auto_filter);
+    if (! enabled) return user_filter;
+
+    char const *expr = auto_filter_expr();
+    if (! user_filter || user_filter[0] == '\0') return expr;
+    if (expr[0] == '\0') return user_filter;
+    char const *combined = filter_printf("(%s) and (%s)", user_filter, expr);
+    if (! combined) {
+        SLOG(LOG_WARNING, "Auto filter and user filter would be too long together, using user filter only");
+        return user_filter;
+    }
+    return combined;
+}
+
+/*
+ * Watching configuration changes
+ */
+
+static void (*install)(void);
+static pthread_t watcher_pth;
+
+static void *watcher_thread(void unused_ *dummy)
+{
+    set_thread_name("J-auto-filter");
+    disable_cancel();
+
+    static char last[TEMPSTR_SIZE];
+    last[0] = '\0';
+
+    while (1) {
+        char const *current = auto_filter_combine(NULL);
+        if (! current) current = "";
+        if (0 != strcmp(current, last)) {
+            SLOG(LOG_NOTICE, "Auto filter is now '%s'", current);
+            snprintf(last, sizeof(last), "%s", current);
+            if (install) install();
+        }
+        cancellable_sleep(1);
+    }
+    return NULL;
+}
+
+/*
+ * Extensions
+ */
+
+static struct ext_function sg_auto_filter_expr;
+static SCM g_auto_filter_expr(void)
+{
+    return scm_from_latin1_string(auto_filter_expr());
+}
+
+/*
+ * Init
+ */
+
+static unsigned inited;
+void auto_filter_init(void (*install_)(void))
+{
+    if (inited++) return;
+    mutex_init();
+    ext_init();
+
+    install = install_;
+    log_category_auto_filter_init();
+    ext_param_auto_filter_init();
+
+    ext_function_ctor(&sg_auto_filter_expr,
+        "auto-filter-expr", 0, 0, 0, g_auto_filter_expr,
+        "(auto-filter-expr): returns the BPF filter computed from the enabled protocols and port muxers.\n"
+        "It is installed on all live packet sources (in addition to their own filter) when auto-filter is set.\n"
+        "Notice that connections on ports negotiated at runtime (such as FTP passive data or RTP) are then filtered out.\n"
+        "See also (? 'set-proto-enabled) and (? 'tcp-add-port).\n");
+
+    int err = pthread_create(&watcher_pth, NULL, watcher_thread, NULL);
+    if (err) {
+        SLOG(LOG_ERR, "Cannot pthread_create(): %s", strerror(err));
+    }
+}
+
+void auto_filter_fini(void)
+{
+    if (--inited) return;
+
+    SLOG(LOG_DEBUG, "Terminating auto filter thread...");
+    (void)pthread_cancel(watcher_pth);
+    (void)pthread_join(watcher_pth, NULL);
+
+    ext_param_auto_filter_fini();
+    log_category_auto_filter_fini();
+
+    ext_fini();
+    mutex_fini();
+}
@@ -0,0 +1,28 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef AUTO_FILTER_H_261018
+#define AUTO_FILTER_H_261018
+
+/** @file
+ * @brief Compute a BPF filter from the protocols we are configured to parse.
+ *
+ * When the auto-filter parameter is set, live packet sources are filtered
+ * in the kernel so that only the frames that some enabled protocol is
+ * interested in are copied to us: ports registered in TCP and UDP port
+ * muxers for enabled protocols, FTP active mode data, and a few protocols
+ * recognized without ports (ARP, ICMP, GRE...). Connections on ports
+ * negotiated at runtime (FTP passive mode, RTP...) are not let through.
+ *
+ * Should the filter not fit in a tempstr, sources are not auto filtered.
+ */
+
+/// @returns the filter to install on a live source which user filter is user_filter (may be NULL)
+/** If auto-filter is not set this is just user_filter, otherwise it's the
+ * combination of both (in a tempstr). */
+char const *auto_filter_combine(char const *user_filter);
+
+/// @param install is called whenever the auto filter changes, so that it's installed on every live source
+void auto_filter_init(void (*install)(void));
+void auto_filter_fini(void);
+
+#endif
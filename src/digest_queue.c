@@ -18,12 +18,14 @@
  * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <sys/time.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
 #include <openssl/md4.h>
 #include "junkie/config.h"
 #include "junkie/tools/log.h"
@@ -32,16 +34,11 @@
 #include "junkie/tools/timeval.h"
 #include "junkie/tools/queue.h"
 #include "junkie/tools/ext.h"
-#include "junkie/tools/hash.h"
 #include "junkie/proto/cap.h"   // for collapse_ifaces
 #include "junkie/proto/eth.h"   // for collapse_vlans
 #include "junkie/proto/deduplication.h"
 #include "junkie/cpp.h"
 
-// We use directly (the first 32bits of) the MD4 as a hash key
-#undef HASH_FUNC
-#define HASH_FUNC(key) ((key)->hash_key)
-
 LOG_CATEGORY_DEF(digest);
 #undef LOG_CAT
 #define LOG_CAT digest_log_category
@@ -52,53 +49,25 @@ struct hook dup_hook;
 unsigned max_dup_delay = 100000; // microseconds
 EXT_PARAM_RW(max_dup_delay, "max-dup-delay", uint, "Number of microseconds between two packets that can not be duplicates (set to 0 to disable deduplication altogether)")
 
-static LIST_HEAD(digest_queues, digest_queue) digest_queues;    // FIXME: Please do not share me with other threads!
-
-/*
- * Individual digest (digest_qcell)
- */
-
-struct digest_qcell {
-    HASH_ENTRY(digest_qcell) entry;
-    union {
-        unsigned char digest[DIGEST_SIZE];
-        uint32_t hash_key;
-    } u;
-    struct timeval tv;
-};
-
-// Caller must own q->mutex
-static void digest_qcell_ctor(struct digest_qcell *qc, struct digest_queue_ *q, struct timeval const *tv)
-{
-    qc->tv = *tv;
-    HASH_INSERT(&q->qcells, qc, &qc->u, entry);
-}
+static unsigned dedup_window_size = 16384;
+EXT_PARAM_RW(dedup_window_size, "dedup-window-size", uint, "Number of digests stored per slice of max-dup-delay for each deduplicated device, rounded up to a power of 2 (taken into account for new devices). Should be about twice the number of distinct frames received per max-dup-delay, or dups go unnoticed (see dedup-overflow-warning).")
 
-// Note: there is no qcell_new since the qcell is allocated before construction to avoid copying the digest
+static unsigned dedup_overflow_warning = 1;
+EXT_PARAM_RW(dedup_overflow_warning, "dedup-overflow-warning", uint, "Percentage of the distinct frames which digest could not be stored in the dedup window, above which a warning is logged (at most once a second per device, 0 to never warn).")
 
-// Caller must own q->mutex
-static void digest_qcell_dtor(struct digest_qcell *qc, struct digest_queue_ *q)
-{
-    HASH_REMOVE(&q->qcells, qc, entry);
-}
+#define PROBE_LEN 8 // Max number of entries we look at in a slice, ie. 4 cache lines
 
-// Caller must own q->mutex
-static void digest_qcell_del(struct digest_qcell *qc, struct digest_queue_ *q)
-{
-    digest_qcell_dtor(qc, q);
-    objfree(qc);
-}
+static LIST_HEAD(digest_queues, digest_queue) digest_queues;    // FIXME: Please do not share me with other threads!
 
 static void reset_digests(struct digest_queue *dq)
 {
-    for (unsigned i = 0; i < NB_ELEMS(dq->queues); i++) {
-        struct digest_queue_ *const q = dq->queues + i;
-        mutex_lock(&q->mutex);
-        struct digest_qcell *qc, *tmp;
-        HASH_FOREACH_SAFE(qc, &q->qcells, entry, tmp) {
-            digest_qcell_del(qc, q);
+    for (unsigned i = 0; i < NB_ELEMS(dq->slices); i++) {
+        struct dedup_slice *const slice = dq->slices + i;
+        for (unsigned e = 0; e < dq->size; e++) {
+            slice->entries[e].seq = 0;
+            slice->entries[e].ts = INT64_MIN;   // free whatever the epoch
         }
-        mutex_unlock(&q->mutex);
+        slice->epoch = -1;
     }
 }
 
@@ -108,28 +77,54 @@ static void reset_digests(struct digest_queue *dq)
 
 static void digest_queue_del_by_ref(struct ref *);
 
-static void digest_queue_ctor(struct digest_queue *dq, uint8_t dev_id)
+static unsigned round_to_pow2(unsigned n)
 {
-    SLOG(LOG_DEBUG, "Constructing digest_queue@%p for dev_id=%"PRIu8, dq, dev_id);
+    unsigned r = 1;
+    while (r < n && r < (1U << 31)) r <<= 1;
+    return r;
+}
 
-    for (unsigned i = 0; i < NB_ELEMS(dq->queues); i++) {
-        struct digest_queue_ *const q = dq->queues + i;
+static int digest_queue_ctor(struct digest_queue *dq, uint8_t dev_id)
+{
+    SLOG(LOG_DEBUG, "Constructing digest_queue@%p for dev_id=%"PRIu8, dq, dev_id);
 
-        mutex_ctor(&q->mutex, "digest queue");
-        HASH_INIT(&q->qcells, 1024, "digest queue");
+    unsigned size;
+    WITH_EXT_LOCK(dedup_window_size, size = dedup_window_size);
+    dq->size = round_to_pow2(MAX(size, PROBE_LEN));
+
+#   define CACHE_LINE_SIZE 64
+    size_t const slice_size = dq->size * sizeof(struct dedup_entry);
+    // Too large for objalloc, and allocated once per device anyway
+    dq->mem = malloc(NB_ELEMS(dq->slices) * slice_size + CACHE_LINE_SIZE);
+    if (! dq->mem) return -1;
+    uint8_t *const aligned = (uint8_t *)(((uintptr_t)dq->mem + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+    for (unsigned i = 0; i < NB_ELEMS(dq->slices); i++) {
+        dq->slices[i].entries = (struct dedup_entry *)(aligned + i * slice_size);
     }
+    reset_digests(dq);
 
     dq->dev_id = dev_id;
+    counter_ctor(&dq->num_dup_found);
+    counter_ctor(&dq->num_nodup_found);
+    counter_ctor(&dq->num_collisions);
+    counter_ctor(&dq->num_overflows);
+    dq->overflows_checked = INT64_MIN;
+    memset(dq->pairs, 0, sizeof(dq->pairs));
 
     ref_ctor(&dq->ref, digest_queue_del_by_ref);
 
     LIST_INSERT_HEAD(&digest_queues, dq, entry);
+    return 0;
 }
 
 static struct digest_queue *digest_queue_new(uint8_t dev_id)
 {
     struct digest_queue *dq = objalloc(sizeof(*dq), "digest_queue");
-    if (dq) digest_queue_ctor(dq, dev_id);
+    if (! dq) return NULL;
+    if (0 != digest_queue_ctor(dq, dev_id)) {
+        objfree(dq);
+        return NULL;
+    }
     return dq;
 }
 
@@ -139,12 +134,13 @@ static void digest_queue_dtor(struct digest_queue *dq)
 
     LIST_REMOVE(dq, entry);
 
-    reset_digests(dq);
-    for (unsigned i = 0; i < NB_ELEMS(dq->queues); i++) {
-        struct digest_queue_ *const q = dq->queues + i;
-        mutex_dtor(&q->mutex);
-        HASH_DEINIT(&q->qcells);
-    }
+    free(dq->mem);
+    dq->mem = NULL;
+
+    counter_dtor(&dq->num_overflows);
+    counter_dtor(&dq->num_collisions);
+    counter_dtor(&dq->num_nodup_found);
+    counter_dtor(&dq->num_dup_found);
 
     ref_dtor(&dq->ref);
 }
@@ -184,38 +180,163 @@ static void reset_dedup_stats(void)
 {
     struct digest_queue *dq;
     LIST_FOREACH(dq, &digest_queues, entry) {
-        dq->num_dup_found = dq->num_nodup_found = 0;
+        counter_reset(&dq->num_dup_found);
+        counter_reset(&dq->num_nodup_found);
+        counter_reset(&dq->num_collisions);
+        counter_reset(&dq->num_overflows);
+        dq->overflows_checked = INT64_MIN;
+        memset(dq->pairs, 0, sizeof(dq->pairs));
     }
 }
 
 static void incr_dup(struct digest_queue *dq)
 {
-#   ifdef __GNUC__
-    __sync_add_and_fetch(&dq->num_dup_found, 1);
-#   else
-    dq->num_dup_found ++;
-#   endif
-    // as num_dup_found is 64 bits we don't fear a wrap around
+    counter_inc(&dq->num_dup_found);
+    // as counters are 64 bits we don't fear a wrap around
 }
 
 static void incr_nodup(struct digest_queue *dq)
 {
-#   ifdef __GNUC__
-    __sync_add_and_fetch(&dq->num_nodup_found, 1);
-#   else
-    dq->num_nodup_found ++;
-#   endif
-    // as num_nodup_found is 64 bits we don't fear a wrap around
+    counter_inc(&dq->num_nodup_found);
 }
 
 /*
  * Digest Queue
  */
 
-static void digest_frame(unsigned char buf[DIGEST_SIZE], size_t size, uint8_t *restrict packet)
+static void incr_collision(struct digest_queue *dq)
+{
+    counter_inc(&dq->num_collisions);
+}
+
+/* Overflowing frames are not deduplicated any more, so we check, at most
+ * once a second (of frame time), the proportion of overflows since the
+ * previous check, and suggest a window size from the observed rate of
+ * distinct frames. */
+static void check_overflows(struct digest_queue *dq, int64_t ts, unsigned delay)
+{
+    int64_t const sec = ts / 1000000;
+    int64_t const last = dq->overflows_checked;
+    if (sec == last) return;
+    if (! __sync_bool_compare_and_swap(&dq->overflows_checked, last, sec)) return;  // someone else is checking
+
+    uint64_t const overflows = counter_read(&dq->num_overflows);
+    uint64_t const nodups = counter_read(&dq->num_nodup_found);
+    uint64_t const d_overflows = overflows - dq->overflows_at_check;
+    uint64_t const d_nodups = nodups - dq->nodups_at_check;
+    dq->overflows_at_check = overflows;
+    dq->nodups_at_check = nodups;
+    if (last == INT64_MIN || sec < last) return;    // no previous check to compare with
+
+    unsigned const warning = dedup_overflow_warning;    // No need to lock, any value is as good
+    if (! warning || d_overflows * 100 <= d_nodups * warning) return;
+
+    // Distinct frames per slice, that should fill at most half the window
+    uint64_t const per_slice = d_nodups * delay / ((sec - last) * 1000000);
+    unsigned const suggested = round_to_pow2(MAX(2 * MIN(per_slice, 1U << 30), 2 * dq->size));
+    SLOG(LOG_WARNING, "dev=%"PRIu8": %"PRIu64" of the last %"PRIu64" distinct frames could not be stored in the dedup window of %u entries, so their dups went unnoticed; "
+                      "about %"PRIu64" frames per max-dup-delay were seen, consider a dedup-window-size of %u",
+         dq->dev_id, d_overflows, d_nodups, dq->size, per_slice, suggested);
+}
+
+static void incr_overflow(struct digest_queue *dq, int64_t ts, unsigned delay)
 {
-#   define BUFSIZE_TO_HASH 64
+    counter_inc(&dq->num_overflows);
+    check_overflows(dq, ts, delay);
+}
+
+/*
+ * Digest engines
+ *
+ * They all digest the same (at most BUFSIZE_TO_HASH) bytes of the frame,
+ * first copied into 64 bits words with the masked fields zeroed, so that the
+ * frame itself is never written to.
+ */
+
+#define BUFSIZE_TO_HASH 64
+#define NB_WORDS (BUFSIZE_TO_HASH / sizeof(uint64_t))
+
+static void md4_digest(unsigned char buf[DIGEST_SIZE], uint64_t const *words, size_t len)
+{
+    ASSERT_COMPILE(DIGEST_SIZE == MD4_DIGEST_LENGTH);
+    (void)MD4((unsigned char const *)words, len, buf);
+}
+
+static uint64_t rotl64(uint64_t x, unsigned r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= UINT64_C(0xff51afd7ed558ccd);
+    k ^= k >> 33;
+    k *= UINT64_C(0xc4ceb9fe1a85ec53);
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3 x64 128 bits, over 16 bytes blocks (the last one being zero padded)
+static void murmur128_digest(unsigned char buf[DIGEST_SIZE], uint64_t const *words, size_t len)
+{
+    uint64_t const c1 = UINT64_C(0x87c37b91114253d5), c2 = UINT64_C(0x4cf5ad432745937f);
+    uint64_t h1 = 0, h2 = 0;
+
+    for (unsigned w = 0; w < (len + 15) / 16 * 2; w += 2) {
+        uint64_t k1 = words[w], k2 = words[w+1];
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    }
+
+    // The length disambiguates the zero padding
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+
+    ASSERT_COMPILE(DIGEST_SIZE == 2 * sizeof(uint64_t));
+    memcpy(buf, &h1, sizeof(h1));
+    memcpy(buf + sizeof(h1), &h2, sizeof(h2));
+}
+
+static struct digest_engine {
+    char const *name;
+    void (*digest)(unsigned char buf[DIGEST_SIZE], uint64_t const *words, size_t len);
+} const digest_engines[] = {
+    { "md4", md4_digest },
+    { "murmur128", murmur128_digest },
+};
+
+static unsigned dedup_digest = 1;
+EXT_PARAM_RW(dedup_digest, "dedup-digest", uint, "Which digest to use to detect duplicate frames: 0 for MD4, 1 for a 128 bits MurmurHash3 (see (? 'benchmark-dedup-digests)).")
+
+static struct digest_engine const *get_digest_engine(void)
+{
+    unsigned const e = dedup_digest;    // No need to lock, any value is as good
+    return digest_engines + (e < NB_ELEMS(digest_engines) ? e : 0);
+}
+
+/* A check of the digested bytes, independent from the digest, so that we can
+ * tell apart actual duplicates from digest collisions. */
+static uint32_t digest_check(uint64_t const *words, size_t len)
+{
+    uint64_t h = len;
+    for (unsigned w = 0; w < (len + 7) / 8; w++) {
+        h = rotl64(h ^ words[w], 29) * UINT64_C(0x9e3779b97f4a7c15);
+    }
+    return h >> 32;
+}
 
+/*
+ * Digest Queue
+ */
+
+// Copy the bytes to digest into words, returning their length
+static size_t frame_words(uint64_t words[NB_WORDS], size_t size, uint8_t const *restrict packet)
+{
 #   define ETHER_DST_ADDR_OFFSET   0
 #   define ETHER_SRC_ADDR_OFFSET   ETHER_DST_ADDR_OFFSET + 6
 #   define ETHER_ETHERTYPE_OFFSET  ETHER_SRC_ADDR_OFFSET + 6
@@ -265,85 +386,170 @@ static void digest_frame(unsigned char buf[DIGEST_SIZE], size_t size, uint8_t *r
         while (size > 0 && packet[size-1] == 0) size--;
     }
 
+    memset(words, 0, NB_WORDS * sizeof(*words));
+    uint8_t *const bytes = (uint8_t *)words;
+
     if (size < iphdr_offset + IPV4_CHECKSUM_OFFSET) {
         SLOG(LOG_DEBUG, "Small frame (%zu bytes), compute the digest on the whole data", size);
-        ASSERT_COMPILE(sizeof(uint8_t) == 1);
-        (void)MD4((unsigned char *)packet, size, buf);
-        return;
+        size_t const len = MIN(BUFSIZE_TO_HASH, size);
+        memcpy(bytes, packet, len);
+        return len;
     }
 
-    assert(size >= iphdr_offset + IPV4_TOS_OFFSET);
-    assert(size >= iphdr_offset + IPV4_TTL_OFFSET);
-    uint8_t tos = packet[iphdr_offset + IPV4_TOS_OFFSET];
-    uint8_t ttl = packet[iphdr_offset + IPV4_TTL_OFFSET];
-    uint16_t checksum = READ_U16(&packet[iphdr_offset + IPV4_CHECKSUM_OFFSET]);
+    size_t const len = MIN(BUFSIZE_TO_HASH, size - hash_start);
+    memcpy(bytes, packet + hash_start, len);
 
     uint8_t ipversion = (packet[iphdr_offset + IPV4_VERSION_OFFSET] & 0xf0) >> 4;
     if (4 == ipversion) {
         // We must mask different fields which may be rewritten by
         // network equipment (routers, switches, etc), eg. TTL, Diffserv
         // or IP Header Checksum
-        packet[iphdr_offset + IPV4_TOS_OFFSET] = 0x00;
-        packet[iphdr_offset + IPV4_TTL_OFFSET] = 0x00;
-        memset(packet + iphdr_offset + IPV4_CHECKSUM_OFFSET, 0, sizeof(uint16_t));
+        unsigned const ip = iphdr_offset - hash_start;  // where the IP header starts in the copy
+        assert(ip + IPV4_CHECKSUM_OFFSET + 2 <= BUFSIZE_TO_HASH);
+        bytes[ip + IPV4_TOS_OFFSET] = 0x00;
+        bytes[ip + IPV4_TTL_OFFSET] = 0x00;
+        bytes[ip + IPV4_CHECKSUM_OFFSET] = 0x00;
+        bytes[ip + IPV4_CHECKSUM_OFFSET + 1] = 0x00;
     }
 
-    size_t const len = MIN(BUFSIZE_TO_HASH, size - hash_start);
-    (void)MD4((unsigned char *)&packet[hash_start], len, buf);
+    return len;
+}
 
-    if (4 == ipversion) {
-        // Restore the dumped IP header fields
-        packet[iphdr_offset + IPV4_TOS_OFFSET] = tos;
-        packet[iphdr_offset + IPV4_TTL_OFFSET] = ttl;
-        memcpy(packet + iphdr_offset + IPV4_CHECKSUM_OFFSET, &checksum, sizeof checksum);
+// Look for that digest in a slice. Returns the timestamp of the previous frame (and its dev_id), or -1.
+static int64_t slice_lookup(struct digest_queue *dq, struct dedup_slice *slice, uint64_t key, struct frame_digest const *fd, int64_t min_ts, uint8_t *dev_id)
+{
+    for (unsigned p = 0; p < PROBE_LEN; p++) {
+        struct dedup_entry *e = slice->entries + ((key + p) & (dq->size - 1));
+        uint16_t const seq = e->seq;
+        if (seq & 1) continue;  // being written, we would rather miss a dup than wait
+        __sync_synchronize();   // do not read the entry before its seq
+        int64_t const ts = e->ts;
+        bool const same_digest = 0 == memcmp(e->digest, fd->digest, DIGEST_SIZE);
+        bool const same_check = e->check == fd->check;
+        *dev_id = e->dev_id;
+        __sync_synchronize();   // nor the seq again before the entry
+        if (e->seq != seq) continue;
+        // Entries from before the dup window are retransmissions, not dups
+        if (ts < min_ts || ! same_digest) continue;
+        if (! same_check) {
+            SLOG(LOG_DEBUG, "dev=%"PRIu8": Digest collision", dq->dev_id);
+            incr_collision(dq);
+            continue;
+        }
+        return ts;
     }
+    return -1;
 }
 
-bool digest_queue_find(struct digest_queue *dq, size_t cap_len, uint8_t *packet, struct timeval const *frame_tv)
+// Store that digest in the slice for this epoch
+static void slice_insert(struct digest_queue *dq, struct dedup_slice *slice, int64_t epoch, unsigned delay, uint64_t key, struct frame_digest const *fd, uint8_t dev_id, int64_t ts)
 {
-    if (! max_dup_delay) return false;
+    int64_t const slice_start = epoch * delay;
+
+    // Entering a new time slice: the oldest one is dropped by reusing its table
+    int64_t slice_epoch = slice->epoch;
+    while (slice_epoch < epoch) {
+        if (__sync_bool_compare_and_swap(&slice->epoch, slice_epoch, epoch)) break;
+        slice_epoch = slice->epoch;
+    }
+    if (slice->epoch != epoch) return;  // this frame is older than the slices we keep
+
+    for (unsigned p = 0; p < PROBE_LEN; p++) {
+        struct dedup_entry *e = slice->entries + ((key + p) & (dq->size - 1));
+        uint16_t const seq = e->seq;
+        // Entries from previous epochs are free
+        if ((seq & 1) || e->ts >= slice_start) continue;
+        if (! __sync_bool_compare_and_swap(&e->seq, seq, (uint16_t)(seq + 1))) continue;
+        e->ts = ts;
+        e->dev_id = dev_id;
+        e->check = fd->check;
+        memcpy(e->digest, fd->digest, DIGEST_SIZE);
+        __sync_synchronize();   // publish the entry before its seq
+        e->seq = seq + 2;
+        return;
+    }
 
-    // We allocate digest here and will reuse this memory if we keep it (likely).
-    struct digest_qcell *qc_new = objalloc(sizeof(*qc_new), "digest");
-    digest_frame(qc_new->u.digest, cap_len, packet);
+    SLOG(LOG_DEBUG, "dev=%"PRIu8": No room for digest", dq->dev_id);
+    incr_overflow(dq, ts, delay);
+}
 
-    unsigned const h = qc_new->u.digest[8] % NB_ELEMS(dq->queues);
-    struct digest_queue_ *const q = dq->queues + h;
+void digest_frame(struct frame_digest *fd, size_t cap_len, uint8_t const *packet)
+{
+    uint64_t words[NB_WORDS];
+    size_t const len = frame_words(words, cap_len, packet);
+    get_digest_engine()->digest(fd->digest, words, len);
+    fd->check = digest_check(words, len);
+}
 
-    mutex_lock(&q->mutex);
+static unsigned dt_bucket(uint64_t dt)
+{
+    unsigned b = 0;
+    while (dt > 0 && b < NB_DEDUP_DT_BUCKETS-1) {
+        dt >>= 1;
+        b ++;
+    }
+    return b;
+}
 
-    struct timeval min_tv = *frame_tv;
-    timeval_sub_usec(&min_tv, max_dup_delay);
-    // min_tv is set to minimal TS for a packet we want to consider for dup detection.
-    struct digest_qcell *qc, *qc_tmp;
+static void account_pair(struct digest_queue *dq, uint8_t original, uint8_t duplicate, uint64_t dt)
+{
+    uint32_t const key = 1 + ((uint32_t)original << 8 | duplicate);
+    for (unsigned p = 0; p < NB_ELEMS(dq->pairs); p++) {
+        struct dedup_pair *pair = dq->pairs + p;
+        uint32_t k = pair->key;
+        if (k == 0) {
+            if (__sync_bool_compare_and_swap(&pair->key, 0, key)) k = key;
+            else k = pair->key;
+        }
+        if (k != key) continue;
+        __sync_add_and_fetch(pair->dt + dt_bucket(dt), 1);
+        return;
+    }
+    SLOG(LOG_DEBUG, "dev=%"PRIu8": No room for dup stats between dev_id %"PRIu8" and %"PRIu8, dq->dev_id, original, duplicate);
+}
 
-    unsigned count = 0;
-    // now look all qcells for a dup
-    HASH_FOREACH_SAME_KEY_SAFE(qc, &q->qcells, &qc_new->u, u, entry, qc_tmp) {
-        // timeout first (so that retransmissions are eliminated)
-        if (timeval_cmp(&qc->tv, &min_tv) < 0) {
-            digest_qcell_del(qc, q);
-        } else if (0 == memcmp(qc->u.digest, qc_new->u.digest, DIGEST_SIZE)) {
-            // found a dup
+bool digest_queue_find(struct digest_queue *dq, struct frame_digest const *fd, uint8_t dev_id, size_t cap_len, uint8_t const *packet, struct timeval const *frame_tv)
+{
+    unsigned const delay = max_dup_delay;
+    if (! delay) return false;
+
+    uint64_t key;
+    memcpy(&key, fd->digest, sizeof(key));
+
+    int64_t const ts = (int64_t)frame_tv->tv_sec * 1000000 + frame_tv->tv_usec;
+    if (ts < 0) return false;
+    int64_t const epoch = ts / delay;
+    ASSERT_COMPILE(NB_DEDUP_SLICES == 2);   // Slices are delay long, so only the current and previous ones matter
+
+    // Look in the current slice first, then in the previous one
+    for (int64_t e = epoch; e >= epoch - 1 && e >= 0; e--) {
+        struct dedup_slice *slice = dq->slices + (e % NB_DEDUP_SLICES);
+        if (slice->epoch != e) continue;
+        uint8_t prev_dev_id;
+        int64_t const prev_ts = slice_lookup(dq, slice, key, fd, ts - delay, &prev_dev_id);
+        if (prev_ts < 0) continue;
+        // found a dup
+        SLOG(LOG_DEBUG, "dev=%"PRIu8": Found a dup", dq->dev_id);
+        // Note that we do not promote the dup in order to avoid dup + dup + dup + retrans being interpreted as 4 dups.
+        uint64_t const dt = llabs(ts - prev_ts);
+        incr_dup(dq);
+        account_pair(dq, prev_dev_id, dev_id, dt);
+        if (hook_has_subscribers(&dup_hook)) {
             struct dedup_proto_info info;
             proto_info_ctor(&info.info, NULL /* hum */, NULL, 0, cap_len);
-            SLOG(LOG_DEBUG, "dev=%"PRIu8",queue[%u]: Found a dup after %u", dq->dev_id, h, count);
-            // Note that we do not promote the dup in order to avoid dup + dup + dup + retrans being interpreted as 4 dups.
-            info.dt = llabs(timeval_sub(frame_tv, &qc->tv));
-            incr_dup(dq);
-            mutex_unlock(&q->mutex);
-            objfree(qc_new);
+            info.dt = dt;
+            // We are called by the sniffer thread before parsing, ie. out of any protected region
+            enter_multi_region();
             hook_subscribers_call(&dup_hook, &info.info, cap_len, packet, frame_tv);
-            return true;
+            leave_protected_region();
         }
-        count ++;
+        return true;
     }
 
-    // Here we have no dup thus we must store qc_new
-    SLOG(LOG_DEBUG, "dev=%"PRIu8",queue[%u]: No dup found after %u", dq->dev_id, h, count);
+    // Here we have no dup thus we must store this digest
+    SLOG(LOG_DEBUG, "dev=%"PRIu8": No dup found", dq->dev_id);
     incr_nodup(dq);
-    digest_qcell_ctor(qc_new, q, frame_tv);
-    mutex_unlock(&q->mutex);
+    slice_insert(dq, dq->slices + (epoch % NB_DEDUP_SLICES), epoch, delay, key, fd, dev_id, ts);
     return false;
 }
 
@@ -353,6 +559,45 @@ bool digest_queue_find(struct digest_queue *dq, size_t cap_len, uint8_t *packet,
 
 static SCM dup_found_sym;
 static SCM nodup_found_sym;
+static SCM collisions_sym;
+static SCM overflows_sym;
+static SCM intra_iface_sym;
+static SCM cross_iface_sym;
+static SCM original_sym;
+static SCM duplicate_sym;
+static SCM count_sym;
+static SCM dt_sym;
+
+static uint8_t pair_original(struct dedup_pair const *pair)
+{
+    return (pair->key - 1) >> 8;
+}
+
+static uint8_t pair_duplicate(struct dedup_pair const *pair)
+{
+    return (pair->key - 1) & 0xff;
+}
+
+static uint64_t pair_count(struct dedup_pair const *pair)
+{
+    uint64_t count = 0;
+    for (unsigned b = 0; b < NB_ELEMS(pair->dt); b++) count += pair->dt[b];
+    return count;
+}
+
+// Dups first received from the same device, and from another one
+static void count_iface_dups(struct digest_queue const *dq, uint64_t *intra, uint64_t *cross)
+{
+    *intra = *cross = 0;
+    for (unsigned p = 0; p < NB_ELEMS(dq->pairs); p++) {
+        struct dedup_pair const *pair = dq->pairs + p;
+        if (! pair->key) continue;
+        if (pair_original(pair) == pair_duplicate(pair)) *intra += pair_count(pair);
+        else *cross += pair_count(pair);
+    }
+}
+
+static SCM digest_sym;
 
 static struct ext_function sg_dedup_stats;
 static SCM g_dedup_stats(SCM dev_id_)
@@ -362,9 +607,47 @@ static SCM g_dedup_stats(SCM dev_id_)
     LIST_LOOKUP(dq, &digest_queues, entry, dq->dev_id == dev_id);
     if (! dq) return SCM_BOOL_F;
 
-    SCM ret = scm_list_2(
-        scm_cons(dup_found_sym,         scm_from_uint64(dq->num_dup_found)),
-        scm_cons(nodup_found_sym,       scm_from_uint64(dq->num_nodup_found)));
+    uint64_t intra, cross;
+    count_iface_dups(dq, &intra, &cross);
+
+    SCM ret = scm_list_n(
+        scm_cons(dup_found_sym,         scm_from_uint64(counter_read(&dq->num_dup_found))),
+        scm_cons(nodup_found_sym,       scm_from_uint64(counter_read(&dq->num_nodup_found))),
+        scm_cons(intra_iface_sym,       scm_from_uint64(intra)),
+        scm_cons(cross_iface_sym,       scm_from_uint64(cross)),
+        scm_cons(collisions_sym,        scm_from_uint64(counter_read(&dq->num_collisions))),
+        scm_cons(overflows_sym,         scm_from_uint64(counter_read(&dq->num_overflows))),
+        scm_cons(digest_sym,            scm_from_latin1_string(get_digest_engine()->name)),
+        SCM_UNDEFINED);
+
+    return ret;
+}
+
+static struct ext_function sg_dedup_pairs;
+static SCM g_dedup_pairs(SCM dev_id_)
+{
+    uint8_t dev_id = scm_to_uint8(dev_id_);
+    struct digest_queue *dq;
+    LIST_LOOKUP(dq, &digest_queues, entry, dq->dev_id == dev_id);
+    if (! dq) return SCM_BOOL_F;
+
+    SCM ret = SCM_EOL;
+    for (unsigned p = NB_ELEMS(dq->pairs); p-- > 0; ) {
+        struct dedup_pair const *pair = dq->pairs + p;
+        if (! pair->key) continue;
+        SCM dt = SCM_EOL;
+        for (unsigned b = NB_ELEMS(pair->dt); b-- > 0; ) {
+            if (! pair->dt[b]) continue;
+            dt = scm_cons(scm_cons(scm_from_uint64(UINT64_C(1) << b), scm_from_uint64(pair->dt[b])), dt);
+        }
+        ret = scm_cons(
+            scm_list_4(
+                scm_cons(original_sym,  scm_from_uint8(pair_original(pair))),
+                scm_cons(duplicate_sym, scm_from_uint8(pair_duplicate(pair))),
+                scm_cons(count_sym,     scm_from_uint64(pair_count(pair))),
+                scm_cons(dt_sym,        dt)),
+            ret);
+    }
 
     return ret;
 }
@@ -376,6 +659,39 @@ static SCM g_reset_dedup_stats(void)
     return SCM_UNSPECIFIED;
 }
 
+static struct ext_function sg_benchmark_dedup_digests;
+static SCM g_benchmark_dedup_digests(SCM num_)
+{
+    unsigned const num = SCM_UNBNDP(num_) ? 1000000 : scm_to_uint(num_);
+
+    // A TCP/IPv4 frame with some payload, which bytes we change at each round
+    uint8_t frame[128];
+    for (unsigned b = 0; b < sizeof(frame); b++) frame[b] = b * 7 + 1;
+    frame[12] = 0x08; frame[13] = 0x00;   // Ethertype IPv4
+    frame[14] = 0x45;
+
+    SCM ret = SCM_EOL;
+    for (unsigned e = NB_ELEMS(digest_engines); e-- > 0; ) {
+        unsigned char buf[DIGEST_SIZE];
+        unsigned sink = 0;
+        struct timespec start, stop;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned n = 0; n < num; n++) {
+            memcpy(frame + 40, &n, sizeof(n));
+            uint64_t words[NB_WORDS];
+            size_t const len = frame_words(words, sizeof(frame), frame);
+            digest_engines[e].digest(buf, words, len);
+            sink += buf[0];
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        double const ns = (stop.tv_sec - start.tv_sec) * 1e9 + (stop.tv_nsec - start.tv_nsec);
+        SLOG(LOG_DEBUG, "Digest %s: %u rounds in %.0fns (%u)", digest_engines[e].name, num, ns, sink);
+        ret = scm_cons(scm_cons(scm_from_latin1_string(digest_engines[e].name), scm_from_double(num ? ns / num : 0.)), ret);
+    }
+
+    return ret;
+}
+
 static struct ext_function sg_reset_digests;
 static SCM g_reset_digests(void)
 {
@@ -398,13 +714,25 @@ void digest_init(void)
     mutex_init();
     objalloc_init();
     ext_init();
-    hash_init();
+    counter_init();
 
     dup_found_sym       = scm_permanent_object(scm_from_latin1_symbol("dup-found"));
     nodup_found_sym     = scm_permanent_object(scm_from_latin1_symbol("nodup-found"));
+    collisions_sym      = scm_permanent_object(scm_from_latin1_symbol("collisions"));
+    overflows_sym       = scm_permanent_object(scm_from_latin1_symbol("overflows"));
+    intra_iface_sym     = scm_permanent_object(scm_from_latin1_symbol("intra-iface"));
+    cross_iface_sym     = scm_permanent_object(scm_from_latin1_symbol("cross-iface"));
+    original_sym        = scm_permanent_object(scm_from_latin1_symbol("original"));
+    duplicate_sym       = scm_permanent_object(scm_from_latin1_symbol("duplicate"));
+    count_sym           = scm_permanent_object(scm_from_latin1_symbol("count"));
+    dt_sym              = scm_permanent_object(scm_from_latin1_symbol("dt"));
+    digest_sym          = scm_permanent_object(scm_from_latin1_symbol("digest"));
 
     log_category_digest_init();
     ext_param_max_dup_delay_init();
+    ext_param_dedup_digest_init();
+    ext_param_dedup_window_size_init();
+    ext_param_dedup_overflow_warning_init();
 
     LIST_INIT(&digest_queues);
 
@@ -413,13 +741,31 @@ void digest_init(void)
     ext_function_ctor(&sg_dedup_stats,
         "deduplication-stats", 1, 0, 0, g_dedup_stats,
         "(deduplication-stats 1): return some statistics about the deduplication mechanism on device 1.\n"
-        "See also (? 'reset-deduplication-stats).\n");
+        "Collisions are frames which digest matched the one of a previous frame although they were distinct,\n"
+        "    and overflows are frames which digest could not be stored (see (? 'dedup-window-size) and (? 'dedup-overflow-warning)).\n"
+        "Intra-iface dups were first received from the same device, and cross-iface dups from another one\n"
+        "    (only when collapse-ifaces is set, in which case all devices share the deduplication window of device 255).\n"
+        "See also (? 'deduplication-pairs) and (? 'reset-deduplication-stats).\n");
+
+    ext_function_ctor(&sg_dedup_pairs,
+        "deduplication-pairs", 1, 0, 0, g_dedup_pairs,
+        "(deduplication-pairs 255): return, for each pair of devices (original, duplicate) between which dups were found\n"
+        "    in the deduplication window of device 255, how many there were and the distribution of their delay\n"
+        "    (as an alist of upper bound in microseconds, powers of 2, to number of dups).\n"
+        "Useful to set max-dup-delay.\n"
+        "See also (? 'deduplication-stats).\n");
 
     ext_function_ctor(&sg_reset_dedup_stats,
         "reset-deduplication-stats", 0, 0, 0, g_reset_dedup_stats,
         "(reset-deduplication-stats): does what the name suggest.\n"
         "You probably already know (? 'deduplication-stats).\n");
 
+    ext_function_ctor(&sg_benchmark_dedup_digests,
+        "benchmark-dedup-digests", 0, 1, 0, g_benchmark_dedup_digests,
+        "(benchmark-dedup-digests): return how many nanoseconds each digest engine takes per frame.\n"
+        "(benchmark-dedup-digests 100000): the same, measured on that many frames.\n"
+        "See also (? 'dedup-digest).\n");
+
     ext_function_ctor(&sg_reset_digests,
         "reset-digests", 0, 0, 0, g_reset_digests,
         "(reset-digests): clear all stored digests. Usefull when testing.\n");
@@ -438,10 +784,13 @@ void digest_fini(void)
     }
 #   endif
 
+    ext_param_dedup_overflow_warning_fini();
+    ext_param_dedup_window_size_fini();
+    ext_param_dedup_digest_fini();
     ext_param_max_dup_delay_fini();
     log_category_digest_fini();
 
-    hash_fini();
+    counter_fini();
     ext_fini();
     objalloc_fini();
     mutex_fini();
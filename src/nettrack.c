@@ -126,6 +126,15 @@ static struct npc_register *npc_regfile_merge(struct npc_register *prev_regfile,
  * States
  */
 
+// Caller must own state->vertex->mutex
+static void nt_state_arm(struct nt_state *state, time_t now)
+{
+    struct nt_vertex *const vertex = state->vertex;
+    if (vertex->timeout <= 0) return;
+    time_t const expiry = state->last_used.tv_sec + (vertex->timeout + 999999) / 1000000 + 1;
+    timer_arm(&vertex->wheel, &state->timer, MAX(expiry, now + 1));
+}
+
 static int nt_state_ctor(struct nt_state *state, struct nt_state *parent, struct nt_vertex *vertex, struct npc_register *regfile, struct timeval const *now, unsigned h_value, uint64_t run_id)
 {
     SLOG(LOG_DEBUG, "Construct state@%p from state@%p, in vertex %s", state, parent, vertex->name);
@@ -138,12 +147,14 @@ static int nt_state_ctor(struct nt_state *state, struct nt_state *parent, struct
     LIST_INIT(&state->children);
     state->last_used = state->last_enter = *now;
     state->last_moved_run = run_id;
+    timer_ctor(&state->timer);
 
     WITH_LOCK(&vertex->mutex) {
         vertex->num_states ++;
         if (parent) LIST_INSERT_HEAD(&parent->children, state, same_parent);
         TAILQ_INSERT_HEAD(&vertex->index[index], state, same_index);
         TAILQ_INSERT_HEAD(&vertex->age_list, state, same_vertex);
+        nt_state_arm(state, now->tv_sec);
     }
 
     return 0;
@@ -178,6 +189,7 @@ static void nt_state_dtor(struct nt_state *state, struct nt_graph *graph)
         }
         TAILQ_REMOVE(&state->vertex->age_list, state, same_vertex);
         TAILQ_REMOVE(&state->vertex->index[state->h_value % state->vertex->index_size], state, same_index);
+        timer_cancel(&state->vertex->wheel, &state->timer);
         state->vertex->num_states --;
     }
 
@@ -214,6 +226,7 @@ static void nt_state_move(struct nt_state *state, struct nt_vertex *to, unsigned
     mutex_lock2(&from->mutex, &to->mutex);
     TAILQ_REMOVE(&from->age_list, state, same_vertex);
     TAILQ_REMOVE(&from->index[state->h_value % from->index_size], state, same_index);
+    timer_cancel(&from->wheel, &state->timer);
     TAILQ_INSERT_HEAD(&to->age_list, state, same_vertex);
     TAILQ_INSERT_HEAD(&to->index[h_value % to->index_size], state, same_index);
     from->num_states --;
@@ -222,9 +235,30 @@ static void nt_state_move(struct nt_state *state, struct nt_vertex *to, unsigned
     state->last_enter = *now;
     state->vertex = to;
     state->h_value = h_value;
+    nt_state_arm(state, now->tv_sec);
     mutex_unlock2(&from->mutex, &to->mutex);
 }
 
+static struct npc_register empty_rest = { .size = 0, .value = (uintptr_t)NULL };
+
+// Called with the vertex mutex locked
+static void nt_state_timeout(struct timer_wheel *wheel, struct timer *timer, time_t now)
+{
+    struct nt_vertex *const vertex = DOWNCAST(wheel, wheel, nt_vertex);
+    struct nt_state *const state = DOWNCAST(timer, timer, nt_state);
+
+    if (vertex->timeout > 0 && vertex->timeout < timeval_sub(&vertex->graph->last_used, &state->last_used)) {
+        SLOG(LOG_DEBUG, "Timeouting state in vertex %s", vertex->name);
+        if (vertex->timeout_fn) {
+            SLOG(LOG_DEBUG, "Calling timeout function for vertex '%s'", vertex->name);
+            vertex->timeout_fn(NULL, empty_rest, state->regfile, NULL);
+        }
+        nt_state_del(state, vertex->graph);
+    } else {    // not yet
+        nt_state_arm(state, now);
+    }
+}
+
 /*
  * Vertices
  */
@@ -235,6 +269,8 @@ static int nt_vertex_ctor(struct nt_vertex *vertex, char const *name, struct nt_
 
     vertex->name = objalloc_strdup(name);
     mutex_ctor_recursive(&vertex->mutex, "nettrack vertices");
+    vertex->graph = graph;
+    timer_wheel_ctor(&vertex->wheel, nt_state_timeout);
     vertex->index_size = index_size;
     assert(vertex->index_size >= 1);
     LIST_INIT(&vertex->outgoing_edges);
@@ -245,6 +281,7 @@ static int nt_vertex_ctor(struct nt_vertex *vertex, char const *name, struct nt_
         TAILQ_INIT(&vertex->index[i]);
     }
     vertex->num_states = 0;
+    vertex->timeout = 0;
 
     // A vertex named "root" starts with an initial state (and is not timeouted)
     if (0 == strcmp("root", name)) {
@@ -296,6 +333,7 @@ static void nt_vertex_dtor(struct nt_vertex *vertex, struct nt_graph *graph)
         }
     }
     assert(TAILQ_EMPTY(&vertex->age_list));
+    timer_wheel_dtor(&vertex->wheel);
 
     // Then all the edges using us
     struct nt_edge *edge;
@@ -395,7 +433,9 @@ static void nt_edge_del(struct nt_edge *edge)
  */
 
 static LIST_HEAD(nt_graphs, nt_graph) started_graphs;
-static struct mutex graphs_mutex;   // protects above list
+// Graphs which deletion was requested from within a protected region (see free_graph_smob)
+static struct nt_graphs doomed_graphs;
+static struct mutex graphs_mutex;   // protects above lists
 
 static int nt_graph_ctor(struct nt_graph *graph, char const *name, char const *libname)
 {
@@ -439,6 +479,7 @@ static int nt_graph_ctor(struct nt_graph *graph, char const *name, char const *l
     graph->started = false;
     graph->num_frames = 0;
     graph->run_id = 0;
+    timeval_reset(&graph->last_used);
 
     LIST_INIT(&graph->vertices);
     LIST_INIT(&graph->edges);
@@ -468,14 +509,15 @@ static void nt_graph_start(struct nt_graph *graph)
     }
 }
 
-static struct npc_register empty_rest = { .size = 0, .value = (uintptr_t)NULL };
 static void edge_aging(struct nt_edge *, struct timeval const *);
 
 static void nt_graph_stop(struct nt_graph *graph)
 {
     if (! graph->started) return;
     SLOG(LOG_DEBUG, "Stopping nettracking with graph %s", graph->name);
-    LIST_REMOVE(graph, entry);
+    WITH_LOCK(&graphs_mutex) {
+        LIST_REMOVE(graph, entry);
+    }
     graph->started = false;
 
     static struct timeval end_of_time;
@@ -595,16 +637,8 @@ static bool edge_matching(struct nt_edge *edge, struct proto_info const *last, s
         unsigned num_collisions = 0;
         TAILQ_FOREACH_SAFE(state, &edge->from->index[index], same_index, tmp) {  // Beware that this state may move
 
-            // While we are there try to timeout this state?
-            if (edge->from->timeout > 0LL && edge->from->timeout < timeval_sub(now, &state->last_used)) {
-                SLOG(LOG_DEBUG, "Timeouting state in vertex %s", edge->from->name);
-                if (edge->from->timeout_fn) {
-                    SLOG(LOG_DEBUG, "Calling timeout function for vertex '%s'", edge->from->name);
-                    edge->from->timeout_fn(NULL, rest, state->regfile, NULL);
-                }
-                nt_state_del(state, edge->graph);
-                continue;
-            }
+            // Skip timeouted states (their timer will fire soon)
+            if (edge->from->timeout > 0LL && edge->from->timeout < timeval_sub(now, &state->last_used)) continue;
 
             // Prevent multiple update of the same state in a single update run
             if (state->last_moved_run == edge->graph->run_id) continue;
@@ -794,6 +828,7 @@ static void parser_hook(struct proto_subscriber *subscriber, struct proto_info c
     SLOG(LOG_DEBUG, "Updating graph %s with inner info from %s", hook->graph->name, last->parser->proto->name);
 
     hook->graph->run_id ++;
+    timeval_set_max(&hook->graph->last_used, now);
 
     struct nt_edge *edge;
     LIST_FOREACH(edge, &hook->edges, same_hook) {
@@ -805,6 +840,46 @@ static void parser_hook(struct proto_subscriber *subscriber, struct proto_info c
     }
 }
 
+/*
+ * Timeouter
+ */
+
+static struct timer_ticker nettrack_ticker;
+
+// Delete the graphs that free_graph_smob could not (we are out of any protected region)
+static void del_doomed_graphs(void)
+{
+    while (1) {
+        struct nt_graph *graph;
+        WITH_LOCK(&graphs_mutex) {
+            graph = LIST_FIRST(&doomed_graphs);
+            if (graph) LIST_REMOVE(graph, entry);
+        }
+        if (! graph) break;
+        nt_graph_del(graph);
+    }
+}
+
+static void nettrack_tick(struct timer_ticker unused_ *ticker)
+{
+    del_doomed_graphs();
+
+    WITH_LOCK(&graphs_mutex) {
+        struct nt_graph *graph;
+        LIST_FOREACH(graph, &started_graphs, entry) {
+            if (! timeval_is_set(&graph->last_used)) continue;
+            // States are only ever deleted with their vertex mutex, so there is no need to stop the parsers
+            struct nt_vertex *vertex;
+            LIST_FOREACH(vertex, &graph->vertices, same_graph) {
+                if (vertex->timeout <= 0) continue;
+                WITH_LOCK(&vertex->mutex) {
+                    (void)timer_wheel_advance(&vertex->wheel, graph->last_used.tv_sec);
+                }
+            }
+        }
+    }
+}
+
 /*
  * Extensions
  */
@@ -827,6 +902,19 @@ static scm_t_bits graph_tag;
 static size_t free_graph_smob(SCM graph_smob)
 {
     struct nt_graph *graph = (struct nt_graph *)SCM_SMOB_DATA(graph_smob);
+
+    /* The GC may run this finalizer from any thread, including a parser in its
+     * protected region, where we could not wait for the callers of our hooks
+     * before freeing them. Then leave the graph to the ticker. */
+    if (in_protected_region()) {
+        SLOG(LOG_DEBUG, "Deferring deletion of graph %s", graph->name);
+        nt_graph_stop(graph);
+        WITH_LOCK(&graphs_mutex) {
+            LIST_INSERT_HEAD(&doomed_graphs, graph, entry);
+        }
+        return 0;
+    }
+
     nt_graph_del(graph);
     return 0;
 }
@@ -949,9 +1037,12 @@ void nettrack_init(void)
     ext_init();
     mallocer_init();
     objalloc_init();
+    timer_wheel_init();
 
     mutex_ctor(&graphs_mutex, "nettrackk graphs");
     LIST_INIT(&started_graphs);
+    LIST_INIT(&doomed_graphs);
+    timer_ticker_ctor(&nettrack_ticker, "timeout nettrack states", nettrack_tick);
 
     // Create a SMOB for nt_graph
     graph_tag = scm_make_smob_type("nettrack-graph", sizeof(struct nt_graph));
@@ -977,6 +1068,9 @@ void nettrack_fini(void)
 {
     if (--inited) return;
 
+    timer_ticker_dtor(&nettrack_ticker);
+    del_doomed_graphs();
+
 #   ifdef DELETE_ALL_AT_EXIT
     struct nt_graph *graph;
     while (NULL != (graph = LIST_FIRST(&started_graphs))) {
@@ -987,6 +1081,7 @@ void nettrack_fini(void)
     mutex_dtor(&graphs_mutex);
 #   endif
 
+    timer_wheel_fini();
     objalloc_fini();
     mallocer_fini();
     ext_fini();
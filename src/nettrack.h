@@ -8,6 +8,7 @@
 #include "junkie/tools/log.h"
 #include "junkie/tools/timeval.h"
 #include "junkie/tools/mutex.h"
+#include "junkie/tools/timer_wheel.h"
 #include "junkie/netmatch.h"
 
 LOG_CATEGORY_DEC(nettrack);
@@ -16,6 +17,7 @@ struct nt_state {
     LIST_ENTRY(nt_state) same_parent;   // entry on children list
     TAILQ_ENTRY(nt_state) same_index;   // entry on vertex index
     TAILQ_ENTRY(nt_state) same_vertex;  // entry on age_list
+    struct timer timer;                 // in vertex->wheel, if the vertex has a timeout
     /* When a new state is spawned we keep a relationship with parent/children,
      * so that it's possible to terminate a whole family. */
     struct nt_state *parent;
@@ -36,16 +38,18 @@ struct nt_state {
 
 struct nt_vertex {
     char *name;
-    struct mutex mutex; // protects age_list & index & states children list
+    struct mutex mutex; // protects age_list & index & wheel & states children list
+    struct nt_graph *graph; // backlink to the graph
     LIST_ENTRY(nt_vertex) same_graph;
     LIST_HEAD(nt_edges, nt_edge) outgoing_edges;
     struct nt_edges incoming_edges;
     // User defined actions on entry and on timeout
     npc_match_fn *entry_fn, *timeout_fn;
-    int64_t timeout;   // if >0, number of seconds to keep an inactive state in here
+    int64_t timeout;   // if >0, number of microseconds to keep an inactive state in here
     unsigned index_size;   // the index size (>=1)
     unsigned num_states;
     TAILQ_HEAD(nt_states_tq, nt_state) age_list;    // states are ordered here according to their date of entry
+    struct timer_wheel wheel;   // timers of the states, fired when they may have timeouted
     struct nt_states_tq index[];  // the states currently waiting in this node (BEWARE: variable size!)
 };
 
@@ -76,6 +80,7 @@ struct nt_graph {
     lt_dlhandle lib;
     unsigned default_index_size;    // index size if not specified in the vertex
     uint64_t run_id;                // to uniquely (hum) identifies the successive updating runs
+    struct timeval last_used;       // the most recent time the graph was updated (to advance the wheels of its vertices)
     // for statistics
     uint64_t num_frames;
     // The hooks
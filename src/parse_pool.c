@@ -0,0 +1,438 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2018, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <libguile.h>
+#include "junkie/tools/log.h"
+#include "junkie/tools/ext.h"
+#include "junkie/tools/mutex.h"
+#include "junkie/tools/objalloc.h"
+#include "junkie/tools/tempstr.h"
+#include "junkie/tools/miscmacs.h"
+#include "junkie/proto/proto.h"
+#include "pkt_source.h"
+#include "parse_pool.h"
+#include "predecode.h"
+
+LOG_CATEGORY_DEF(parse_pool);
+#undef LOG_CAT
+#define LOG_CAT parse_pool_log_category
+
+static unsigned parse_workers = 0;
+EXT_PARAM_RW(parse_workers, "parse-workers", uint, "Number of threads parsing the frames on behalf of the sniffer threads (0 to parse in the sniffer threads). Must be set before opening the first packet source.")
+
+static unsigned parse_queue_size = 1024;
+EXT_PARAM_RW(parse_queue_size, "parse-queue-size", uint, "How many frames can wait in each queue from a packet source to a parsing worker (taken into account for next opened packet sources).")
+
+/*
+ * Queues
+ *
+ * Each queue is a ring of slots with a single producer (the sniffer thread
+ * owning the lane) and a single consumer (the worker). The producer only
+ * writes head and the consumer only writes tail.
+ */
+
+#define SLOT_DATA_SIZE 2048
+
+struct parse_slot {
+    struct frame frame;
+    uint8_t data[SLOT_DATA_SIZE];   // frames that do not fit are malloced
+};
+
+struct parse_queue {
+    // Producer side
+    unsigned volatile head;
+    uint64_t num_pushed, num_drops;
+    // Consumer side, on its own cache line
+    unsigned volatile tail __attribute__((aligned(64)));
+    struct parse_slot *slots;
+};
+
+struct parse_lane {
+    char const *name;
+    unsigned idx;                   ///< Our index in lanes
+    unsigned size;                  ///< Number of slots of each queue (a power of 2)
+    struct parse_queue queues[];    ///< One per worker
+};
+
+/*
+ * Workers
+ */
+
+static void (*parse_frame)(struct frame *);
+static volatile sig_atomic_t quit;
+
+static struct parse_worker {
+    pthread_t pth;
+    unsigned idx;
+    uint64_t volatile num_loops;    ///< So that we know when a worker cannot see a deleted lane any more
+    uint64_t num_parsed;
+    uint64_t num_drops;             ///< Frames dropped by the lanes that were deleted since (protected by lanes_lock)
+    /* Idle workers sleep until a producer wakes them up. Producers only look
+     * at sleeping after publishing their frames, and the worker looks at the
+     * queues after setting sleeping, so that one of them always sees the other. */
+    struct mutex lock;
+    struct condvar wakeup;
+    bool volatile sleeping;
+} workers[CPU_MAX];
+static unsigned num_workers;    // set once the workers are started (never changes afterward)
+
+#define MAX_LANES 64
+static struct parse_lane *volatile lanes[MAX_LANES];
+static struct mutex lanes_lock; // protects lanes and num_workers
+
+// Parse a batch of frames from this queue. Returns false if there were none.
+static bool parse_queue_drain(struct parse_queue *q, unsigned size, struct parse_worker *worker)
+{
+    unsigned const head = q->head;
+    unsigned tail = q->tail;
+    if (tail == head) return false;
+    __sync_synchronize();   // do not read the slots before head
+
+    unsigned n;
+    mux_flow_cache_enter(); // so that our flow cache is cleaned once per batch rather than once per frame
+    for (n = 0; tail != head && n < 64; tail++, n++) {
+        struct parse_slot *slot = q->slots + (tail & (size-1));
+        parse_frame(&slot->frame);
+        if (slot->frame.data != slot->data) free((void *)slot->frame.data);
+    }
+    mux_flow_cache_leave();
+
+    __sync_synchronize();   // do not release the slots before we are done with them
+    q->tail = tail;
+    worker->num_parsed += n;
+    return true;
+}
+
+static bool worker_has_frames(struct parse_worker const *worker)
+{
+    for (unsigned l = 0; l < NB_ELEMS(lanes); l++) {
+        struct parse_lane *lane = lanes[l];
+        if (lane && lane->queues[worker->idx].head != lane->queues[worker->idx].tail) return true;
+    }
+    return false;
+}
+
+static void worker_sleep(struct parse_worker *worker)
+{
+    mutex_lock(&worker->lock);
+    worker->sleeping = true;
+    __sync_synchronize();   // set sleeping before we look at the queues for the last time
+    if (! quit && ! worker_has_frames(worker)) condvar_wait(&worker->wakeup, &worker->lock);
+    worker->sleeping = false;
+    mutex_unlock(&worker->lock);
+}
+
+static void worker_wakeup(struct parse_worker *worker)
+{
+    mutex_lock(&worker->lock);
+    condvar_signal(&worker->wakeup);
+    mutex_unlock(&worker->lock);
+}
+
+static void *worker_thread_(void *worker_)
+{
+    struct parse_worker *worker = worker_;
+    set_thread_name(tempstr_printf("J-parse-%u", worker->idx));
+
+    unsigned num_idle = 0;
+    while (! quit) {
+        bool busy = false;
+        for (unsigned l = 0; l < NB_ELEMS(lanes); l++) {
+            struct parse_lane *lane = lanes[l];
+            if (! lane) continue;
+            busy |= parse_queue_drain(lane->queues + worker->idx, lane->size, worker);
+        }
+        __sync_synchronize();
+        worker->num_loops ++;
+
+        if (busy) {
+            num_idle = 0;
+        } else if (++num_idle > 100) {  // spin a little before going to sleep
+            worker_sleep(worker);
+            num_idle = 0;
+        }
+    }
+
+    return NULL;
+}
+
+static void *worker_thread(void *worker)
+{
+    return scm_with_guile(worker_thread_, worker);
+}
+
+// Caller must own lanes_lock
+static void start_workers(unsigned n)
+{
+    SLOG(LOG_INFO, "Starting %u parsing workers", n);
+    for (unsigned w = 0; w < n; w++) {
+        workers[w].idx = w;
+        workers[w].num_loops = 0;
+        workers[w].num_parsed = 0;
+        workers[w].num_drops = 0;
+        mutex_ctor(&workers[w].lock, "parse worker");
+        condvar_ctor(&workers[w].wakeup, "parse worker wakeup");
+        workers[w].sleeping = false;
+        int err = pthread_create(&workers[w].pth, NULL, worker_thread, workers + w);
+        if (err) {
+            SLOG(LOG_ERR, "Cannot start parsing worker %u: %s", w, strerror(err));
+            condvar_dtor(&workers[w].wakeup);
+            mutex_dtor(&workers[w].lock);
+            break;
+        }
+        num_workers ++;
+    }
+}
+
+/*
+ * Lanes
+ */
+
+struct parse_lane *parse_lane_new(char const *name)
+{
+    unsigned n;
+    WITH_EXT_LOCK(parse_workers, n = parse_workers);
+    if (n == 0) return NULL;
+    n = MIN(n, NB_ELEMS(workers));
+
+    unsigned size;
+    WITH_EXT_LOCK(parse_queue_size, size = parse_queue_size);
+    size = MAX(size, 2U);
+    while (size & (size-1)) size ++;    // round up to a power of 2
+
+    struct parse_lane *lane = NULL;
+    mutex_lock(&lanes_lock);
+
+    if (num_workers == 0) start_workers(n);
+    if (num_workers == 0) goto quit;
+
+    unsigned l;
+    for (l = 0; l < NB_ELEMS(lanes) && lanes[l]; l++) ;
+    if (l >= NB_ELEMS(lanes)) {
+        SLOG(LOG_ERR, "Too many packet sources, %s will be parsed by its sniffer thread", name);
+        goto quit;
+    }
+
+    lane = objalloc(sizeof(*lane) + num_workers * sizeof(lane->queues[0]), "parse_lanes");
+    if (! lane) goto quit;
+    lane->name = objalloc_strdup(name);
+    lane->idx = l;
+    lane->size = size;
+    for (unsigned w = 0; w < num_workers; w++) {
+        struct parse_queue *q = lane->queues + w;
+        q->head = q->tail = 0;
+        q->num_pushed = q->num_drops = 0;
+        q->slots = malloc(size * sizeof(*q->slots));  // too large for objalloc
+        if (! q->slots) {
+            while (w--) free(lane->queues[w].slots);
+            objfree((void *)lane->name);
+            objfree(lane);
+            lane = NULL;
+            goto quit;
+        }
+    }
+
+    SLOG(LOG_DEBUG, "New parse lane for %s with %u queues of %u frames", name, num_workers, size);
+    lanes[l] = lane;
+quit:
+    mutex_unlock(&lanes_lock);
+    return lane;
+}
+
+void parse_lane_del(struct parse_lane **lane_)
+{
+    struct parse_lane *lane = *lane_;
+    if (! lane) return;
+    *lane_ = NULL;
+
+    // Wait for the workers to parse what's left
+    for (unsigned w = 0; w < num_workers; w++) {
+        struct parse_queue *q = lane->queues + w;
+        while (! quit && q->tail != q->head) usleep(1000);
+    }
+
+    mutex_lock(&lanes_lock);
+    lanes[lane->idx] = NULL;
+    // Keep its drops in the stats
+    for (unsigned w = 0; w < num_workers; w++) workers[w].num_drops += lane->queues[w].num_drops;
+    mutex_unlock(&lanes_lock);
+
+    // Then wait until no worker can be looking at it any more (waking up those that sleep)
+    for (unsigned w = 0; w < num_workers; w++) {
+        uint64_t const loops = workers[w].num_loops;
+        while (! quit && workers[w].num_loops < loops + 2) {
+            worker_wakeup(workers + w);
+            usleep(100);
+        }
+    }
+
+    SLOG(LOG_DEBUG, "Deleting parse lane of %s", lane->name);
+    for (unsigned w = 0; w < num_workers; w++) {
+        struct parse_queue *q = lane->queues + w;
+        for (unsigned t = q->tail; t != q->head; t++) {  // only if the workers quit before
+            struct parse_slot *slot = q->slots + (t & (lane->size-1));
+            if (slot->frame.data != slot->data) free((void *)slot->frame.data);
+        }
+        free(q->slots);
+    }
+    objfree((void *)lane->name);
+    objfree(lane);
+}
+
+bool parse_lane_push(struct parse_lane *lane, struct frame const *frame)
+{
+    return parse_lane_push_hashed(lane, frame, frame_flow_hash(frame->data, frame->cap_len));
+}
+
+bool parse_lane_push_hashed(struct parse_lane *lane, struct frame const *frame, uint32_t flow_hash)
+{
+    unsigned const w = flow_hash % num_workers;
+    struct parse_queue *q = lane->queues + w;
+    unsigned const head = q->head;
+
+    if (head - q->tail >= lane->size) {
+        SLOG(LOG_DEBUG, "Queue from %s to worker %u is full, dropping frame", lane->name, w);
+        q->num_drops ++;
+        return false;
+    }
+
+    struct parse_slot *slot = q->slots + (head & (lane->size-1));
+    slot->frame = *frame;
+    uint8_t *data = slot->data;
+    if (frame->cap_len > sizeof(slot->data)) {
+        data = malloc(frame->cap_len);
+        if (! data) {
+            q->num_drops ++;
+            return false;
+        }
+    }
+    memcpy(data, frame->data, frame->cap_len);
+    slot->frame.data = data;
+    slot->frame.buf = NULL;   // slots are recycled
+
+    __sync_synchronize();   // the slot must be written before it's published
+    q->head = head + 1;
+    q->num_pushed ++;
+
+    __sync_synchronize();   // publish the frame before we look whether the worker sleeps
+    if (workers[w].sleeping) worker_wakeup(workers + w);
+    return true;
+}
+
+/*
+ * Extensions
+ */
+
+static SCM id_sym;
+static SCM num_parsed_sym;
+static SCM queue_depth_sym;
+static SCM num_drops_sym;
+
+static struct ext_function sg_parse_workers_stats;
+static SCM g_parse_workers_stats(void)
+{
+    SCM ret = SCM_EOL;
+
+    mutex_lock(&lanes_lock);
+    for (unsigned w = num_workers; w > 0; ) {
+        w--;
+        unsigned depth = 0;
+        uint64_t drops = workers[w].num_drops;
+        for (unsigned l = 0; l < NB_ELEMS(lanes); l++) {
+            struct parse_lane const *lane = lanes[l];
+            if (! lane) continue;
+            depth += lane->queues[w].head - lane->queues[w].tail;
+            drops += lane->queues[w].num_drops;
+        }
+        ret = scm_cons(
+            scm_list_4(
+                scm_cons(id_sym,          scm_from_uint(w)),
+                scm_cons(num_parsed_sym,  scm_from_uint64(workers[w].num_parsed)),
+                scm_cons(queue_depth_sym, scm_from_uint(depth)),
+                scm_cons(num_drops_sym,   scm_from_uint64(drops))),
+            ret);
+    }
+    mutex_unlock(&lanes_lock);
+
+    return ret;
+}
+
+/*
+ * Init
+ */
+
+static unsigned inited;
+void parse_pool_init(void (*parse)(struct frame *))
+{
+    if (inited++) return;
+    mutex_init();
+    ext_init();
+    objalloc_init();
+    hash_init();
+
+    parse_frame = parse;
+    mutex_ctor(&lanes_lock, "parse lanes");
+    log_category_parse_pool_init();
+    ext_param_parse_workers_init();
+    ext_param_parse_queue_size_init();
+
+    id_sym          = scm_permanent_object(scm_from_latin1_symbol("id"));
+    num_parsed_sym  = scm_permanent_object(scm_from_latin1_symbol("num-parsed"));
+    queue_depth_sym = scm_permanent_object(scm_from_latin1_symbol("queue-depth"));
+    num_drops_sym   = scm_permanent_object(scm_from_latin1_symbol("num-drops"));
+
+    ext_function_ctor(&sg_parse_workers_stats,
+        "parse-workers-stats", 0, 0, 0, g_parse_workers_stats,
+        "(parse-workers-stats): returns, for each parsing worker, the number of frames it parsed,\n"
+        "    how many frames are currently waiting in its queues and how many were dropped\n"
+        "    because its queues were full (including those of the packet sources that are closed since).\n"
+        "See also (? 'parse-workers).\n");
+}
+
+void parse_pool_fini(void)
+{
+    if (--inited) return;
+
+    quit = 1;
+    for (unsigned w = 0; w < num_workers; w++) {
+        worker_wakeup(workers + w);
+        (void)pthread_join(workers[w].pth, NULL);
+#       ifdef DELETE_ALL_AT_EXIT
+        condvar_dtor(&workers[w].wakeup);
+        mutex_dtor(&workers[w].lock);
+#       endif
+    }
+
+    ext_param_parse_queue_size_fini();
+    ext_param_parse_workers_fini();
+    log_category_parse_pool_fini();
+#   ifdef DELETE_ALL_AT_EXIT
+    mutex_dtor(&lanes_lock);
+#   endif
+
+    hash_fini();
+    objalloc_fini();
+    ext_fini();
+    mutex_fini();
+}
@@ -0,0 +1,43 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef PARSE_POOL_H_261018
+#define PARSE_POOL_H_261018
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/** @file
+ * @brief A pool of parsing threads, decoupled from the sniffer threads.
+ *
+ * By default the sniffer thread that receives a frame also parses it.
+ * When the parse-workers parameter is set, frames are instead copied into
+ * single-producer/single-consumer queues toward a pool of parsing workers.
+ * The worker is chosen according to a symmetric hash of the flow 5-tuple
+ * (looking into GRE, VXLAN and GTP tunnels) so that all frames of a flow are
+ * always parsed by the same worker, in order.
+ *
+ * Each producer (ie. each pkt_source) owns a parse_lane, which is made of
+ * one such queue per worker.
+ */
+
+struct frame;
+struct parse_lane;
+
+/// @returns a new lane to push frames to the workers, or NULL if frames are to be parsed by the caller.
+struct parse_lane *parse_lane_new(char const *name);
+
+/// Wait until all frames pushed into this lane are parsed, then delete it (NULL is OK).
+void parse_lane_del(struct parse_lane **);
+
+/// Queue a copy of this frame for the worker in charge of its flow.
+/** @returns false if the frame was dropped because this worker queue is full. */
+bool parse_lane_push(struct parse_lane *, struct frame const *);
+
+/// Same as parse_lane_push() for a frame which flow hash is already known (see frame_flow_hash()).
+bool parse_lane_push_hashed(struct parse_lane *, struct frame const *, uint32_t flow_hash);
+
+/// @param parse is the function the workers will call for each frame
+void parse_pool_init(void (*parse)(struct frame *));
+void parse_pool_fini(void);
+
+#endif
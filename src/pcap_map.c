@@ -0,0 +1,447 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2018, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "junkie/tools/log.h"
+#include "junkie/tools/objalloc.h"
+#include "junkie/tools/miscmacs.h"
+#include "pcap_map.h"
+#include "predecode.h"
+
+LOG_CATEGORY_DEF(pcap_map);
+#undef LOG_CAT
+#define LOG_CAT pcap_map_log_category
+
+#define PCAP_MAGIC_USEC     0xa1b2c3d4U
+#define PCAP_MAGIC_NSEC     0xa1b23c4dU
+#define PCAPNG_SHB          0x0a0d0d0aU
+#define PCAPNG_BYTE_ORDER   0x1a2b3c4dU
+#define PCAPNG_IDB          1U
+#define PCAPNG_EPB          6U
+
+#define MAX_IFACES 64   // per pcapng section
+#define READ_AHEAD (16U << 20)
+
+struct pcap_map {
+    char *filename;
+    int fd;
+    uint8_t *map;
+    size_t size;
+    bool pcapng;
+    bool swapped;               ///< File (or current pcapng section) was written with the other endianness
+    size_t first;               ///< Offset of the first record (or block)
+    size_t next;                ///< Offset of the next record (or block)
+    size_t advised;             ///< Up to where we asked the kernel to read ahead
+    uint64_t ts_units;          ///< For pcap files, number of timestamp units per second
+    unsigned linktype;
+    size_t snaplen;
+    /// For pcapng files, the interfaces of current section
+    unsigned num_ifaces;
+    uint64_t iface_ts_units[MAX_IFACES];
+    bool has_filter;
+    struct bpf_program filter;
+    unsigned part, num_parts;   ///< Partition of the flows we are interested in
+    uint64_t rank;              ///< How many frames were read, including those filtered out or from other partitions (not reset by rewinds)
+    volatile sig_atomic_t stop;
+};
+
+/*
+ * Helpers
+ */
+
+static uint32_t bswap32(uint32_t v)
+{
+    return (v >> 24) | ((v >> 8) & 0xff00U) | ((v << 8) & 0xff0000U) | (v << 24);
+}
+
+static uint32_t rd32(struct pcap_map const *pm, size_t off)
+{
+    uint32_t v;
+    memcpy(&v, pm->map + off, sizeof(v));
+    return pm->swapped ? bswap32(v) : v;
+}
+
+static uint16_t rd16(struct pcap_map const *pm, size_t off)
+{
+    uint16_t v;
+    memcpy(&v, pm->map + off, sizeof(v));
+    return pm->swapped ? (uint16_t)((v >> 8) | (v << 8)) : v;
+}
+
+static void ts_to_timeval(struct timeval *tv, uint64_t ts, uint64_t units)
+{
+    tv->tv_sec = ts / units;
+    uint64_t const frac = ts % units;
+    if (units == 1000000) {
+        tv->tv_usec = frac;
+    } else if (units <= 1000000000000ULL) {
+        tv->tv_usec = (frac * 1000000) / units;
+    } else {
+        tv->tv_usec = frac / (units / 1000000);
+    }
+}
+
+// Ask the kernel to read ahead what we are about to read
+static void read_ahead(struct pcap_map *pm)
+{
+    if (pm->next + READ_AHEAD/2 < pm->advised || pm->advised >= pm->size) return;
+    size_t const len = MIN((size_t)READ_AHEAD, pm->size - pm->advised);
+    (void)madvise(pm->map + pm->advised, len, MADV_WILLNEED);
+    pm->advised += len;
+}
+
+/*
+ * pcap
+ */
+
+static int pcap_read_header(struct pcap_map *pm)
+{
+    if (pm->size < 24) {
+        SLOG(LOG_ERR, "File %s is too small for a pcap file", pm->filename);
+        return -1;
+    }
+
+    uint32_t magic = rd32(pm, 0);
+    if (magic == bswap32(PCAP_MAGIC_USEC) || magic == bswap32(PCAP_MAGIC_NSEC)) {
+        pm->swapped = true;
+        magic = bswap32(magic);
+    }
+    if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+        SLOG(LOG_ERR, "File %s is neither a pcap nor a pcapng file", pm->filename);
+        return -1;
+    }
+    pm->ts_units = magic == PCAP_MAGIC_NSEC ? 1000000000ULL : 1000000ULL;
+    pm->snaplen = rd32(pm, 16);
+    pm->linktype = rd32(pm, 20) & 0xffffU;
+    pm->first = 24;
+    return 0;
+}
+
+static int pcap_read_next(struct pcap_map *pm, struct pcap_pkthdr *hdr, uint8_t **data)
+{
+    if (pm->next + 16 > pm->size) return 0;
+
+    ts_to_timeval(&hdr->ts, (uint64_t)rd32(pm, pm->next) * pm->ts_units + rd32(pm, pm->next + 4), pm->ts_units);
+    hdr->caplen = rd32(pm, pm->next + 8);
+    hdr->len = rd32(pm, pm->next + 12);
+    if (pm->next + 16 + hdr->caplen > pm->size) {
+        SLOG(LOG_WARNING, "Truncated record at offset %zu of %s", pm->next, pm->filename);
+        return 0;
+    }
+
+    *data = pm->map + pm->next + 16;
+    pm->next += 16 + hdr->caplen;
+    return 1;
+}
+
+/*
+ * pcapng
+ */
+
+static int pcapng_read_shb(struct pcap_map *pm, size_t off)
+{
+    if (off + 12 > pm->size) return -1;
+    pm->swapped = false;
+    uint32_t const bom = rd32(pm, off + 8);
+    if (bom == bswap32(PCAPNG_BYTE_ORDER)) {
+        pm->swapped = true;
+    } else if (bom != PCAPNG_BYTE_ORDER) {
+        SLOG(LOG_ERR, "Bad byte order magic in section at offset %zu of %s", off, pm->filename);
+        return -1;
+    }
+    pm->num_ifaces = 0;
+    return 0;
+}
+
+static void pcapng_read_idb(struct pcap_map *pm, size_t off, size_t block_len)
+{
+    if (pm->num_ifaces >= NB_ELEMS(pm->iface_ts_units)) {
+        SLOG(LOG_WARNING, "Too many interfaces in %s", pm->filename);
+        return;
+    }
+    if (block_len < 20) return;
+
+    if (pm->linktype == ~0U) {  // first interface gives the link type used for filters
+        pm->linktype = rd16(pm, off + 8);
+        pm->snaplen = rd32(pm, off + 12);
+    }
+
+    uint64_t units = 1000000;
+    // Look for if_tsresol in options
+    for (size_t o = off + 16; o + 4 <= off + block_len - 4; ) {
+        uint16_t const code = rd16(pm, o), len = rd16(pm, o + 2);
+        if (code == 0) break;   // opt_endofopt
+        if (code == 9 && len == 1) {
+            uint8_t const res = pm->map[o + 4];
+            unsigned const exp = res & 0x7f;
+            if (res & 0x80) {
+                units = exp < 64 ? 1ULL << exp : 0;
+            } else {
+                units = 1;
+                for (unsigned e = 0; e < exp && e < 19; e++) units *= 10;
+            }
+            if (units == 0) units = 1000000;
+        }
+        o += 4 + ((len + 3U) & ~3U);
+    }
+
+    pm->iface_ts_units[pm->num_ifaces++] = units;
+}
+
+static int pcapng_read_next(struct pcap_map *pm, struct pcap_pkthdr *hdr, uint8_t **data)
+{
+    while (pm->next + 12 <= pm->size) {
+        size_t const off = pm->next;
+        uint32_t const type = rd32(pm, off);    // SHB type is a palindrome
+        if (type == PCAPNG_SHB && 0 != pcapng_read_shb(pm, off)) return -1;
+
+        size_t const block_len = rd32(pm, off + 4);
+        if (block_len < 12 || (block_len & 3) || off + block_len > pm->size) {
+            SLOG(LOG_WARNING, "Bad or truncated block at offset %zu of %s", off, pm->filename);
+            return 0;
+        }
+        pm->next += block_len;
+
+        switch (type) {
+            case PCAPNG_IDB:
+                pcapng_read_idb(pm, off, block_len);
+                break;
+            case PCAPNG_EPB:;
+                uint32_t const iface = block_len >= 32 ? rd32(pm, off + 8) : ~0U;
+                if (iface >= pm->num_ifaces) {
+                    SLOG(LOG_DEBUG, "Skipping frame from unknown interface %"PRIu32" in %s", iface, pm->filename);
+                    break;
+                }
+                ts_to_timeval(&hdr->ts, ((uint64_t)rd32(pm, off + 12) << 32) | rd32(pm, off + 16), pm->iface_ts_units[iface]);
+                hdr->caplen = rd32(pm, off + 20);
+                hdr->len = rd32(pm, off + 24);
+                if (hdr->caplen > block_len - 32) {    // block_len >= 32 since iface is known (and beware of overflows)
+                    SLOG(LOG_WARNING, "Bad captured length in block at offset %zu of %s", off, pm->filename);
+                    break;
+                }
+                *data = pm->map + off + 28;
+                return 1;
+            default:    // Other blocks are of no use to us
+                break;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * API
+ */
+
+struct pcap_map *pcap_map_open(char const *filename)
+{
+    struct pcap_map *pm = objalloc(sizeof(*pm), "pcap_maps");
+    if (! pm) return NULL;
+
+    pm->filename = objalloc_strdup(filename);
+    pm->fd = open(filename, O_RDONLY);
+    if (pm->fd < 0) {
+        SLOG(LOG_ERR, "Cannot open %s: %s", filename, strerror(errno));
+        goto err1;
+    }
+
+    struct stat st;
+    if (0 != fstat(pm->fd, &st)) {
+        SLOG(LOG_ERR, "Cannot stat %s: %s", filename, strerror(errno));
+        goto err2;
+    }
+    pm->size = st.st_size;
+    if (pm->size < 12) {
+        SLOG(LOG_ERR, "File %s is too small for a capture file", filename);
+        goto err2;
+    }
+
+    pm->map = mmap(NULL, pm->size, PROT_READ, MAP_PRIVATE, pm->fd, 0);
+    if (pm->map == MAP_FAILED) {
+        SLOG(LOG_ERR, "Cannot mmap %s: %s", filename, strerror(errno));
+        goto err2;
+    }
+    (void)madvise(pm->map, pm->size, MADV_SEQUENTIAL);
+#   ifdef POSIX_FADV_SEQUENTIAL
+    (void)posix_fadvise(pm->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#   endif
+
+    pm->swapped = false;
+    pm->linktype = ~0U;
+    pm->snaplen = 65535;
+    pm->num_ifaces = 0;
+    pm->has_filter = false;
+    pm->part = 0;
+    pm->num_parts = 1;
+    pm->rank = 0;
+    pm->stop = 0;
+
+    if (rd32(pm, 0) == PCAPNG_SHB) {
+        pm->pcapng = true;
+        pm->first = 0;
+        pm->ts_units = 1000000;
+    } else {
+        pm->pcapng = false;
+        if (0 != pcap_read_header(pm)) goto err3;
+    }
+
+    pm->next = pm->first;
+    pm->advised = 0;
+    read_ahead(pm);
+
+    if (pm->pcapng) {   // Read up to the first IDB to learn the link type
+        struct pcap_pkthdr hdr;
+        uint8_t *data;
+        (void)pcapng_read_next(pm, &hdr, &data);
+        pm->next = pm->first;
+        if (pm->linktype == ~0U) pm->linktype = DLT_EN10MB;
+    }
+
+    if (pm->linktype != DLT_EN10MB) {
+        SLOG(LOG_WARNING, "File %s link type is %u rather than Ethernet", filename, pm->linktype);
+    }
+
+    SLOG(LOG_DEBUG, "Mapped %s %s file %s (%zu bytes)", pm->swapped ? "swapped":"native", pm->pcapng ? "pcapng":"pcap", filename, pm->size);
+    return pm;
+
+err3:
+    (void)munmap(pm->map, pm->size);
+err2:
+    (void)close(pm->fd);
+err1:
+    objfree(pm->filename);
+    objfree(pm);
+    return NULL;
+}
+
+void pcap_map_close(struct pcap_map *pm)
+{
+    SLOG(LOG_DEBUG, "Unmapping %s", pm->filename);
+    if (pm->has_filter) pcap_freecode(&pm->filter);
+    (void)munmap(pm->map, pm->size);
+    (void)close(pm->fd);
+    objfree(pm->filename);
+    objfree(pm);
+}
+
+int pcap_map_set_filter(struct pcap_map *pm, char const *filter)
+{
+    if (filter[0] == '\0') return 0;
+
+    pcap_t *dead = pcap_open_dead(pm->linktype, pm->snaplen);
+    if (! dead) {
+        SLOG(LOG_ERR, "Cannot compile filter %s: pcap_open_dead failed", filter);
+        return -1;
+    }
+
+    int ret = -1;
+    if (pm->has_filter) {
+        pcap_freecode(&pm->filter);
+        pm->has_filter = false;
+    }
+    if (0 != pcap_compile(dead, &pm->filter, filter, 1, PCAP_NETMASK_UNKNOWN)) {
+        SLOG(LOG_ERR, "Cannot parse filter %s: %s", filter, pcap_geterr(dead));
+    } else {
+        pm->has_filter = true;
+        ret = 0;
+    }
+
+    pcap_close(dead);
+    return ret;
+}
+
+int pcap_map_next(struct pcap_map *pm, struct pcap_pkthdr *hdr, uint8_t **data)
+{
+    while (! pm->stop) {
+        read_ahead(pm);
+        int const ret = pm->pcapng ?
+            pcapng_read_next(pm, hdr, data) :
+            pcap_read_next(pm, hdr, data);
+        if (ret != 1) return ret;
+        pm->rank ++;
+        if (pm->has_filter && ! pcap_offline_filter(&pm->filter, hdr, *data)) continue;
+        if (pm->num_parts > 1 && frame_flow_hash(*data, hdr->caplen) % pm->num_parts != pm->part) continue;
+        return 1;
+    }
+
+    return 0;
+}
+
+void pcap_map_set_partition(struct pcap_map *pm, unsigned part, unsigned num_parts)
+{
+    assert(part < num_parts);
+    pm->part = part;
+    pm->num_parts = num_parts;
+}
+
+unsigned pcap_map_num_partitions(struct pcap_map const *pm)
+{
+    return pm->num_parts;
+}
+
+unsigned pcap_map_partition(struct pcap_map const *pm)
+{
+    return pm->part;
+}
+
+uint64_t pcap_map_rank(struct pcap_map const *pm)
+{
+    return pm->rank;
+}
+
+void pcap_map_rewind(struct pcap_map *pm)
+{
+    SLOG(LOG_DEBUG, "Rewinding %s", pm->filename);
+    pm->next = pm->first;
+    pm->advised = 0;
+}
+
+void pcap_map_stop(struct pcap_map *pm)
+{
+    pm->stop = 1;
+}
+
+static unsigned inited;
+void pcap_map_init(void)
+{
+    if (inited++) return;
+    log_init();
+    objalloc_init();
+
+    log_category_pcap_map_init();
+}
+
+void pcap_map_fini(void)
+{
+    if (--inited) return;
+
+    log_category_pcap_map_fini();
+
+    objalloc_fini();
+    log_fini();
+}
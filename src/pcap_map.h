@@ -0,0 +1,55 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef PCAP_MAP_H_261018
+#define PCAP_MAP_H_261018
+#include <stdbool.h>
+#include <stdint.h>
+#include <pcap.h>
+
+/** @file
+ * @brief A reader for pcap and pcapng files that mmaps the whole file.
+ *
+ * Frames are returned as pointers right into the mapping, which stays valid
+ * until the file is closed, so there is no need to copy them. Both micro and
+ * nanosecond pcap files are supported, as well as pcapng files with any
+ * if_tsresol (Enhanced Packet Blocks only).
+ */
+
+struct pcap_map;
+
+/// @returns a new reader for this file, or NULL on error.
+struct pcap_map *pcap_map_open(char const *filename);
+
+void pcap_map_close(struct pcap_map *);
+
+/// Compile the filter for this file link type and apply it to all next frames.
+/** @returns 0 on success. */
+int pcap_map_set_filter(struct pcap_map *, char const *filter);
+
+/// Read the next frame.
+/** @returns 1 if a frame was read, 0 at end of file (or once stopped), -1 on error.
+ * @param data will point to the frame, in the mapping. */
+int pcap_map_next(struct pcap_map *, struct pcap_pkthdr *, uint8_t **data);
+
+/// Only return the frames which flow hash (see frame_flow_hash()) falls into this partition.
+void pcap_map_set_partition(struct pcap_map *, unsigned part, unsigned num_parts);
+
+/// @returns the number of partitions the file was split into (1 if it's not partitioned).
+unsigned pcap_map_num_partitions(struct pcap_map const *);
+
+/// @returns the partition of the flows this reader returns.
+unsigned pcap_map_partition(struct pcap_map const *);
+
+/// @returns how many frames were read so far (from any partition, and counting each loop), so that the last frame returned by pcap_map_next() was of rank pcap_map_rank()-1.
+uint64_t pcap_map_rank(struct pcap_map const *);
+
+/// Start reading again from the first frame.
+void pcap_map_rewind(struct pcap_map *);
+
+/// Make pcap_map_next returns 0 from now on (can be called from any thread).
+void pcap_map_stop(struct pcap_map *);
+
+void pcap_map_init(void);
+void pcap_map_fini(void);
+
+#endif
@@ -25,8 +25,24 @@
 #include <ctype.h>
 #include <assert.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
 #include <pcap.h>
 #include <libguile.h>
+#ifdef __linux__
+#   include <linux/if_packet.h>
+#   ifdef TPACKET3_HDRLEN
+#       define WITH_PKT_RING
+#       include <unistd.h>
+#       include <poll.h>
+#       include <net/if.h>
+#       include <sys/mman.h>
+#       include <sys/socket.h>
+#       include <arpa/inet.h>
+#       include <linux/if_ether.h>
+#       include <linux/filter.h>
+#   endif
+#endif
 #include "pkt_source.h"
 #include "junkie/tools/objalloc.h"
 #include "junkie/tools/tempstr.h"
@@ -39,6 +55,11 @@
 #include "junkie/tools/ext.h"
 #include "plugins.h"
 #include "nettrack.h"
+#include "parse_pool.h"
+#include "predecode.h"
+#include "pcap_map.h"
+#include "shedding.h"
+#include "auto_filter.h"
 
 LOG_CATEGORY_DEF(pkt_sources);
 #undef LOG_CAT
@@ -53,6 +74,7 @@ static struct digest_queue *global_digests;
 unsigned pkt_count; // if not 0, max number of packets to parse before exiting
 
 static struct parser *cap_parser;
+static unsigned num_opening;    // number of pkt_sources being opened together (protected by pkt_sources_lock)
 
 // A sequence to uniquely identifies pcap files with a numeric id (also protected with pkt_sources_lock)
 // Starts at 100 so that id below 100 are available for actual interfaces.
@@ -65,6 +87,18 @@ static struct mutex giant_lock;
 static bool quit_when_done = true;
 EXT_PARAM_RW(quit_when_done, "quit-when-done", bool, "Should junkie exits when the last packet source is closed ?")
 
+static unsigned replay_pps = 0;
+EXT_PARAM_RW(replay_pps, "replay-pps", uint, "If not 0, pcaps read at their packet rate are replayed at this many packets per second instead (taken into account for next opened pcaps).")
+
+static uint64_t replay_bps = 0;
+EXT_PARAM_RW(replay_bps, "replay-bps", uint64, "If not 0 (and replay-pps is 0), pcaps read at their packet rate are replayed at this many bits per second (on the wire) instead (taken into account for next opened pcaps).")
+
+static unsigned burst_size = 100;
+EXT_PARAM_RW(burst_size, "burst-size", uint, "Max number of frames read from a packet source and parsed in one go.")
+
+static unsigned prefetch_distance = 0;
+EXT_PARAM_RW(prefetch_distance, "prefetch-distance", uint, "When parsing a burst, how many frames ahead their headers and flow states are prefetched (0, the default, to disable).")
+
 char *default_bpf_filter;
 EXT_PARAM_STRING_RW(default_bpf_filter, "default-filter", "BPF filter that will be used for next opened packet sources.")
 
@@ -104,6 +138,138 @@ static char const *pkt_source_guile_name(struct pkt_source *pkt_source)
  */
 
 static struct bench_event waiting_for_multi;
+static struct bench_event parsing_frames;
+
+static unsigned latency_bucket(int64_t latency)
+{
+    unsigned b = 0;
+    while (latency > 0 && b < NB_LATENCY_BUCKETS-1) {
+        latency >>= 1;
+        b ++;
+    }
+    return b;
+}
+
+/* Latencies are first accounted in this per-thread accumulator, which is added
+ * to the pkt_source histograms once per run of frames from that source. */
+struct latency_acc {
+    struct pkt_source *pkt_source;
+    uint32_t parse[NB_LATENCY_BUCKETS];
+    uint32_t done[NB_LATENCY_BUCKETS];
+};
+
+static void latency_acc_flush(struct latency_acc *acc)
+{
+    if (! acc->pkt_source) return;
+
+    for (unsigned b = 0; b < NB_LATENCY_BUCKETS; b++) {
+        if (acc->parse[b]) counter_add(acc->pkt_source->parse_latency+b, acc->parse[b]);
+        if (acc->done[b]) counter_add(acc->pkt_source->done_latency+b, acc->done[b]);
+        acc->parse[b] = acc->done[b] = 0;
+    }
+    acc->pkt_source = NULL;
+}
+
+static void latency_acc_add(struct latency_acc *acc, struct frame const *frame, struct timeval const *start, struct timeval const *done)
+{
+    // pkt_source counters are updated by the parsers despite frames pointing to const pkt_sources
+    struct pkt_source *pkt_source = (struct pkt_source *)frame->pkt_source;
+    if (! pkt_source->timed) return;
+    if (pkt_source != acc->pkt_source) {
+        latency_acc_flush(acc);
+        acc->pkt_source = pkt_source;
+    }
+    acc->parse[latency_bucket(timeval_sub(start, &frame->tv))] ++;
+    acc->done[latency_bucket(timeval_sub(done, &frame->tv))] ++;
+}
+
+/* Called either by the sniffer thread or by a parsing worker.
+ * If descs is not NULL then it's the predecoded descriptors of the frames,
+ * used to prefetch what the next frames will need while parsing one. */
+static void parse_frames(struct frame *frames, struct frame_desc const *descs, unsigned num_frames)
+{
+#   ifdef WITH_GIANT_LOCK
+    mutex_lock(&giant_lock);
+#   endif
+
+    assert(cap_parser);
+
+    uint64_t start_wait = bench_event_start();
+    enter_multi_region();
+    bench_event_stop(&waiting_for_multi, start_wait);
+    mux_flow_cache_enter();
+
+    uint64_t start_parse = bench_event_start();
+    struct latency_acc acc = { .pkt_source = NULL };
+    struct timeval start, done;
+    timeval_set_now(&start);
+    unsigned const distance = descs ? prefetch_distance : 0;
+    for (unsigned f = 0; f < MIN(distance, num_frames); f++) frame_prefetch(frames + f, descs + f);
+    for (unsigned f = 0; f < num_frames; f++) {
+        struct frame *frame = frames + f;
+        if (distance && f + distance < num_frames) frame_prefetch(frame + distance, descs + f + distance);
+        struct parser *parser = frame->pkt_source->cap_parser ? frame->pkt_source->cap_parser : cap_parser;
+        if (frame->pkt_source->merge) cap_merge_enter(frame->pkt_source->merge, pcap_map_partition(frame->pkt_source->map), frame->rank);
+        (void)proto_parse(parser, NULL, 0, (uint8_t *)frame, frame->cap_len, frame->wire_len, &frame->tv, frame->cap_len, frame->data);
+        if (distance) frame_parsed(descs + f);
+        // Subscribers are called synchronously, so once proto_parse returns the last of them is done
+        timeval_set_now(&done);
+        latency_acc_add(&acc, frame, &start, &done);
+        start = done;   // next frame parse starts now
+    }
+    cap_merge_leave();
+    latency_acc_flush(&acc);
+    bench_event_stop_n(&parsing_frames, start_parse, num_frames);
+
+    mux_flow_cache_leave();
+    leave_protected_region();
+
+#   ifdef WITH_GIANT_LOCK
+    mutex_unlock(&giant_lock);
+#   endif
+}
+
+static void parse_frame(struct frame *frame)
+{
+    parse_frames(frame, NULL, 1);
+}
+
+// Account for n more frames. Returns how many of them we are allowed to parse.
+static unsigned consume_pkt_count(unsigned n)
+{
+    if (pkt_count == 0) return n;
+
+    unsigned old, take;
+#   ifdef __GNUC__
+    do {
+        old = pkt_count;
+        if (old == 0) return n; // someone else already reached the limit
+        take = MIN(n, old);
+    } while (! __sync_bool_compare_and_swap(&pkt_count, old, old - take));
+#   else
+    old = pkt_count;
+    take = MIN(n, old);
+    pkt_count -= take;
+#   endif
+
+    if (old == take) want_exit = 1; // we cannot call exit from pcap callback (since we cannot destroy this pkt_source from pcap callback)
+    return take;
+}
+
+static bool is_duplicate(struct pkt_source *pkt_source, size_t caplen, uint8_t const *packet, struct timeval const *ts)
+{
+    if (! max_dup_delay) return false;
+
+    /* When we collapse ifaces all frames are looked up in the global window only,
+     * which tells apart dups from the same iface from dups from another one. */
+    struct digest_queue *dq = collapse_ifaces && global_digests ? global_digests : pkt_source->digests;
+    if (! dq) return false;
+
+    // drop the frame if we previously saw it in the last max-dedup-delay us.
+    struct frame_digest fd;
+    digest_frame(&fd, caplen, packet);
+    return digest_queue_find(dq, &fd, pkt_source->dev_id, caplen, packet, ts);
+}
 
 static void parse_packet(u_char *pkt_source_, const struct pcap_pkthdr *header, const u_char *packet)
 {
@@ -125,53 +291,218 @@ static void parse_packet(u_char *pkt_source_, const struct pcap_pkthdr *header,
         .cap_len = caplen,
         .wire_len = header->len,
         .pkt_source = pkt_source,
-        .data = (uint8_t *)packet,
+        .data = packet,
     };
 
     if (pkt_source->patch_ts) timeval_set_now(&frame.tv);
 
-    // drop the frame if we previously saw it in the last max-dedup-delay us.
-    if (
-        // Per iface dedup
-        (pkt_source->digests && digest_queue_find(pkt_source->digests, caplen, (uint8_t *)packet, &header->ts)) ||
-        // Additional pass if we collapse ifaces
-        (collapse_ifaces && global_digests && digest_queue_find(global_digests, caplen, (uint8_t *)packet, &header->ts))
-    ) {
+    if (! pkt_source->is_file) {   // files are never shed
+        if (! shedding_keep(packet, caplen)) {
+            SLOG(LOG_DEBUG, "Shed packet");
+            shedding_account(0, 1);
+            return;
+        }
+        shedding_report_latency(timeval_age(&header->ts));
+    }
+    shedding_account(1, 0);
+
+    if (is_duplicate(pkt_source, caplen, packet, &header->ts)) {
         SLOG(LOG_DEBUG, "Drop duplicated packet");
         pkt_source->num_duplicates ++;
         return;
     }
 
-#   ifdef WITH_GIANT_LOCK
-    mutex_lock(&giant_lock);
-#   endif
+    if (0 == consume_pkt_count(1)) return;
 
-    assert(cap_parser);
+    if (pkt_source->lane) {
+        (void)parse_lane_push(pkt_source->lane, &frame);
+    } else {
+        parse_frame(&frame);
+    }
+}
 
-    uint64_t start_wait = bench_event_start();
-    enter_multi_region();
-    bench_event_stop(&waiting_for_multi, start_wait);
+/*
+ * Bursts
+ *
+ * Rather than parsing each frame as soon as it's received, sniffers collect
+ * up to burst-size frames, then deduplicate and parse them all in one go,
+ * so that locks and counters are updated once per burst instead of once per
+ * frame.
+ */
 
-    (void)proto_parse(cap_parser, NULL, 0, (uint8_t *)&frame, frame.cap_len, frame.wire_len, &frame.tv, frame.cap_len, frame.data);
+#define MAX_BURST_SIZE 1024
 
-    leave_protected_region();
+struct pkt_burst {
+    struct pkt_source *pkt_source;
+    unsigned num_frames;
+    struct frame frames[MAX_BURST_SIZE];
+    struct frame_desc descs[MAX_BURST_SIZE];    ///< Filled when the burst is flushed
+    /// Frames which data is not valid for the whole burst are copied here (their data is then NULL until the flush)
+    /** Waiting lists may retain this buffer after the flush, in which case we fill a new one. */
+    struct cap_buf *copies;
+    size_t copies_len;
+    size_t copy_offs[MAX_BURST_SIZE];
+};
+
+static unsigned get_burst_size(void)
+{
+    unsigned const size = burst_size;
+    return size == 0 ? 1 : MIN(size, (unsigned)MAX_BURST_SIZE);
+}
 
-    if (pkt_count > 0) {
-        if (0 ==
-#           ifdef __GNUC__
-            __sync_sub_and_fetch(&pkt_count, 1)
-#           else
-            --pkt_count
-#           endif
-        ) want_exit = 1; // we cannot call exit from pcap callback (since we cannot destroy this pkt_source from pcap callback)
+static struct pkt_burst *pkt_burst_new(struct pkt_source *pkt_source)
+{
+    struct pkt_burst *burst = objalloc(sizeof(*burst), "pkt_bursts");
+    if (! burst) return NULL;
+    burst->pkt_source = pkt_source;
+    burst->num_frames = 0;
+    burst->copies = NULL;
+    burst->copies_len = 0;
+    return burst;
+}
+
+static void pkt_burst_del(struct pkt_burst *burst)
+{
+    cap_buf_leave(&burst->copies);
+    objfree(burst);
+}
+
+static bool pkt_burst_is_full(struct pkt_burst const *burst)
+{
+    return burst->num_frames >= get_burst_size();
+}
+
+// Make room for len more bytes of copies
+static bool pkt_burst_reserve(struct pkt_burst *burst, size_t len)
+{
+    size_t size = burst->copies ? burst->copies->size : 0;
+
+    // Leave the previous buffer to those who retained some of its frames, and fill a new one
+    if (burst->copies_len == 0 && burst->copies && burst->copies->refs > 1) {
+        cap_buf_leave(&burst->copies);
+        burst->copies = cap_buf_new(size);
+        if (! burst->copies) return false;
     }
 
-#   ifdef WITH_GIANT_LOCK
-    mutex_unlock(&giant_lock);
-#   endif
+    if (burst->copies_len + len <= size) return true;
+
+    size = MAX(2 * size, burst->copies_len + len);
+    if (! burst->copies) return NULL != (burst->copies = cap_buf_new(size));
+    return cap_buf_resize(&burst->copies, size);
+}
+
+static void pkt_burst_add(struct pkt_burst *burst, const struct pcap_pkthdr *header, const u_char *packet, bool copy)
+{
+    if (header->len == 0) return;   // should not happen, but does occur sometime
+    assert(burst->num_frames < MAX_BURST_SIZE);
+
+    size_t const caplen = MIN(header->caplen, header->len); // caplen > len was seen in the wild - the correct behavior was to consider caplen was off by a few bytes.
+    struct frame *frame = burst->frames + burst->num_frames;
+    frame->tv = header->ts;
+    frame->cap_len = caplen;
+    frame->wire_len = header->len;
+    frame->pkt_source = burst->pkt_source;
+    frame->data = packet;
+    frame->buf = NULL;
+    frame->rank = burst->pkt_source->merge ? pcap_map_rank(burst->pkt_source->map) - 1 : 0;
+
+    if (copy) {
+        if (! pkt_burst_reserve(burst, caplen)) {
+            SLOG(LOG_ERR, "Cannot alloc for bursts, dropping frame");
+            return;
+        }
+        memcpy(burst->copies->data + burst->copies_len, packet, caplen);
+        burst->copy_offs[burst->num_frames] = burst->copies_len;
+        burst->copies_len += caplen;
+        frame->data = NULL;
+    }
+
+    burst->num_frames ++;
+}
+
+static struct bench_event flushing_burst;
+
+static void pkt_burst_flush(struct pkt_burst *burst)
+{
+    unsigned const num_frames = burst->num_frames;
+    if (! num_frames) return;
+    burst->num_frames = 0;
+    burst->copies_len = 0;  // copies are still valid until next pkt_burst_add
+    if (want_exit) return;
+
+    uint64_t const start = bench_event_start();
+    struct pkt_source *pkt_source = burst->pkt_source;
+    SLOG(LOG_DEBUG, "Flushing a burst of %u frames from packet source %s", num_frames, pkt_source_name(pkt_source));
+
+    if (! pkt_source->is_file) shedding_report_latency(timeval_age(&burst->frames[num_frames-1].tv));
+
+    // Predecode, shed then dedup the whole burst first
+    uint64_t cap_bytes = 0, wire_bytes = 0;
+    unsigned num_shed = 0, num_dups = 0, num_kept = 0;
+    for (unsigned f = 0; f < num_frames; f++) {
+        struct frame *frame = burst->frames + f;
+        if (! frame->data) {
+            frame->data = burst->copies->data + burst->copy_offs[f];
+            frame->buf = burst->copies;
+        }
+    }
+    /* Descriptors are used for their flow hash (to shed or to dispatch to parsing workers)
+     * and to prefetch while parsing the burst ourself. If none of this happens, do not bother. */
+    bool const shed = ! pkt_source->is_file && shedding_ratio > 1;    // files are never shed
+    bool const predecode = shed || pkt_source->lane || prefetch_distance > 0;
+    if (predecode) frames_predecode(burst->descs, burst->frames, num_frames);
+    for (unsigned f = 0; f < num_frames; f++) {
+        struct frame *frame = burst->frames + f;
+        cap_bytes += frame->cap_len;
+        wire_bytes += frame->wire_len;
+        if (shed && ! shedding_keep_hash(burst->descs[f].flow_hash)) {
+            num_shed ++;
+            continue;
+        }
+        if (is_duplicate(pkt_source, frame->cap_len, frame->data, &frame->tv)) {
+            num_dups ++;
+            continue;
+        }
+        if (pkt_source->patch_ts) timeval_set_now(&frame->tv);
+        if (num_kept != f) {
+            burst->frames[num_kept] = *frame;
+            burst->descs[num_kept] = burst->descs[f];
+        }
+        num_kept ++;
+    }
+
+    pkt_source->num_packets += num_frames;
+    pkt_source->num_duplicates += num_dups;
+    pkt_source->num_cap_bytes += cap_bytes;
+    pkt_source->num_wire_bytes += wire_bytes;
+    if (num_dups) SLOG(LOG_DEBUG, "Drop %u duplicated packets", num_dups);
+    shedding_account(num_frames - num_shed, num_shed);
+
+    num_kept = consume_pkt_count(num_kept);
+
+    if (pkt_source->lane) {
+        for (unsigned f = 0; f < num_kept; f++) {
+            (void)parse_lane_push_hashed(pkt_source->lane, burst->frames + f, burst->descs[f].flow_hash);
+        }
+    } else if (num_kept > 0) {
+        parse_frames(burst->frames, predecode ? burst->descs : NULL, num_kept);
+    }
+
+    bench_event_stop_n(&flushing_burst, start, num_frames);
+}
+
+// A pcap_handler that adds the frame to the burst
+static void burst_packet(u_char *burst_, const struct pcap_pkthdr *header, const u_char *packet)
+{
+    struct pkt_burst *burst = (struct pkt_burst *)burst_;
+    if (pkt_burst_is_full(burst)) pkt_burst_flush(burst);
+    // libpcap may reuse its buffer for the next packet, so we must copy
+    pkt_burst_add(burst, header, packet, true);
 }
 
 static void pkt_source_del(struct pkt_source *);
+static void may_quit(void);
+static void install_new_filter(struct pkt_source *);
 
 static void rewind_file(struct pkt_source *pkt_source)
 {
@@ -186,13 +517,20 @@ static void rewind_file(struct pkt_source *pkt_source)
     }
 }
 
-// Callback is responsible for updating pkt_source stats.
-static void *sniffer(struct pkt_source *pkt_source, pcap_handler callback)
+// Frames are parsed by bursts (or one at a time if we cannot have a burst)
+static void *sniffer(struct pkt_source *pkt_source)
 {
     SLOG(LOG_INFO, "Dispatching packets from packet source %s", pkt_source_name(pkt_source));
+    struct pkt_burst *burst = pkt_burst_new(pkt_source);
+    if (! burst) SLOG(LOG_WARNING, "Cannot alloc a burst for packet source %s, parsing frames one at a time", pkt_source_name(pkt_source));
+
     do {
-        int num_packets = pcap_dispatch(pkt_source->pcap_handle, 100, callback, (u_char *)pkt_source);
+        int num_packets = burst ?
+            pcap_dispatch(pkt_source->pcap_handle, get_burst_size(), burst_packet, (u_char *)burst) :
+            pcap_dispatch(pkt_source->pcap_handle, 100, parse_packet, (u_char *)pkt_source);
         SLOG(LOG_DEBUG, "Got a batch of %d packets", num_packets);
+        if (burst) pkt_burst_flush(burst);
+        if (pkt_source->new_filter) install_new_filter(pkt_source);
         if (num_packets < 0) {
             if (num_packets != -2) {
                 SLOG(LOG_ALERT, "Cannot pcap_dispatch on pkt_source %s: %s", pkt_source_name(pkt_source), pcap_geterr(pkt_source->pcap_handle));
@@ -209,40 +547,163 @@ static void *sniffer(struct pkt_source *pkt_source, pcap_handler callback)
         }
     } while (! want_exit);
 
+    if (burst) pkt_burst_del(burst);
     SLOG(LOG_INFO, "Stop sniffing on packet source %s (%"PRIuLEAST64" packets received)", pkt_source_name(pkt_source), pkt_source->num_packets);
     pkt_source_del(pkt_source);
     return NULL;
 }
 
-// Beware that pkt is an in/out parameter
-static void sync_times(struct timeval const *file_start, struct timeval const *replay_start, struct timeval *pkt)
+/*
+ * Replay at capture rate
+ *
+ * Each frame is given a due time, relative to the start of the replay,
+ * according to either its capture time (accelerated by pkt_source->replay_speed)
+ * or to a target packet or bit rate. We sleep until shortly before that
+ * time then spin, and the frame timestamp is rewritten to the due time.
+ */
+
+struct replay {
+    double speed;                   ///< Speed factor to apply to frame capture times
+    unsigned pps;                   ///< Or, if not 0, the target packet rate
+    uint64_t bps;                   ///< Or, if not 0, the target bit rate
+    struct timeval file_start;      ///< Capture time of the first frame
+    uint64_t start_ns;              ///< When we started (or looped), in monotonic ns
+    struct timeval start_tv;        ///< Same, in wall clock time
+    uint64_t num_frames, num_bytes; ///< Frames replayed since start_ns
+    // For the final report
+    uint64_t first_ns;
+    uint64_t tot_frames, tot_bytes;
+    uint64_t tot_lag_ns, max_lag_ns;
+    unsigned num_protos;
+    struct proto_snapshot {
+        struct proto const *proto;
+        uint64_t num_frames;
+#       ifdef WITH_BENCH
+        uint64_t parse_count, parse_duration;
+#       endif
+    } *protos;                      ///< Protocol counters when we started
+};
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void replay_restart(struct replay *replay)
 {
-    int64_t const pkt_age = timeval_sub(pkt, file_start);
-    struct timeval tv = *replay_start;
-    timeval_add_usec(&tv, pkt_age);
-    // We must wait until tv
-    struct timeval now;
-    do {
-        timeval_set_now(&now);
-        int64_t wait_time = timeval_sub(&tv, &now);
-#       define MIN_SLEEP 10000 /* microseconds */
-#       define MAX_SLEEP 400000
-        // Don't sleep less than 10ms since the sleep + parse would likely last more than that
-        if (wait_time < MIN_SLEEP) break;
-        // Don't sleep more than 400ms straight so that we can check for want_exit flag from time to time
-        usleep(MIN(MIN_SLEEP, wait_time));
-    } while (! want_exit);
-    SLOG(LOG_DEBUG, "Patching packet TS from %s to %s", timeval_2_str(pkt), timeval_2_str(&tv));
-    *pkt = tv; // Set ideal 'now' time in pkt
+    replay->start_ns = monotonic_ns();
+    timeval_set_now(&replay->start_tv);
+    replay->num_frames = replay->num_bytes = 0;
 }
 
-// Same as above, but try to follow original capture packet rate
+static void replay_ctor(struct replay *replay, double speed)
+{
+    replay->speed = speed > 0. ? speed : 1.;
+    WITH_EXT_LOCK(replay_pps, replay->pps = replay_pps);
+    WITH_EXT_LOCK(replay_bps, replay->bps = replay_bps);
+    timeval_reset(&replay->file_start);
+    replay->tot_frames = replay->tot_bytes = 0;
+    replay->tot_lag_ns = replay->max_lag_ns = 0;
+
+    // Snapshot protocol counters so that we can report what we parsed
+    replay->num_protos = 0;
+    struct proto const *proto;
+    LIST_FOREACH(proto, &protos, entry) replay->num_protos ++;
+    replay->protos = objalloc(replay->num_protos * sizeof(*replay->protos), "replays");
+    if (replay->protos) {
+        unsigned p = 0;
+        LIST_FOREACH(proto, &protos, entry) {
+            struct proto_snapshot *snap = replay->protos + p++;
+            snap->proto = proto;
+            snap->num_frames = counter_read(&proto->num_frames);
+#           ifdef WITH_BENCH
+            snap->parse_count = proto->parsing.count.count;
+            snap->parse_duration = proto->parsing.tot_duration;
+#           endif
+        }
+    }
+
+    replay_restart(replay);
+    replay->first_ns = replay->start_ns;
+}
+
+static void replay_dtor(struct replay *replay, struct pkt_source *pkt_source)
+{
+    double const duration = (monotonic_ns() - replay->first_ns) / 1e9;
+    SLOG(LOG_NOTICE, "Replayed %"PRIu64" frames (%"PRIu64" bytes) from packet source %s in %.3fs: %.0f pps, %.0f bps, lagging %.1fus behind schedule on average (max %.1fus)",
+        replay->tot_frames, replay->tot_bytes, pkt_source_name(pkt_source), duration,
+        duration > 0. ? replay->tot_frames / duration : 0., duration > 0. ? replay->tot_bytes * 8 / duration : 0.,
+        replay->tot_frames > 0 ? replay->tot_lag_ns / 1e3 / replay->tot_frames : 0., replay->max_lag_ns / 1e3);
+
+    if (! replay->protos) return;
+    for (unsigned p = 0; p < replay->num_protos; p++) {
+        struct proto_snapshot const *snap = replay->protos + p;
+        uint64_t const num_frames = counter_read(&snap->proto->num_frames) - snap->num_frames;
+        if (! num_frames) continue;
+#       ifdef WITH_BENCH
+        uint64_t const count = snap->proto->parsing.count.count - snap->parse_count;
+        uint64_t const cycles = snap->proto->parsing.tot_duration - snap->parse_duration;
+        SLOG(LOG_NOTICE, "  %s: %"PRIu64" frames, %"PRIu64" cycles per frame", snap->proto->name, num_frames, count > 0 ? cycles / count : 0);
+#       else
+        SLOG(LOG_NOTICE, "  %s: %"PRIu64" frames", snap->proto->name, num_frames);
+#       endif
+    }
+    objfree(replay->protos);
+}
+
+// Returns when this frame is due, in ns since start
+static uint64_t replay_due(struct replay const *replay, struct pcap_pkthdr const *hdr)
+{
+    if (replay->pps) return replay->num_frames * 1000000000ULL / replay->pps;
+    if (replay->bps) return (replay->num_bytes * 8. * 1e9) / replay->bps;
+    int64_t const age = timeval_sub(&hdr->ts, &replay->file_start);
+    return age > 0 ? (age * 1e3) / replay->speed : 0;
+}
+
+// Wait until the frame is due, then patch its timestamp. Beware that hdr is an in/out parameter.
+static void replay_wait(struct replay *replay, struct pcap_pkthdr *hdr)
+{
+    if (! timeval_is_set(&replay->file_start)) replay->file_start = hdr->ts;
+    uint64_t const due = replay_due(replay, hdr);
+    uint64_t const deadline = replay->start_ns + due;
+
+#   define SPIN_NS 100000ULL        // Below that we'd rather spin than risk oversleeping
+#   define MAX_SLEEP_NS 100000000ULL // Don't sleep more than 100ms straight so that we can check for want_exit flag from time to time
+    uint64_t now;
+    while ((now = monotonic_ns()) < deadline && !want_exit) {
+        uint64_t const wait = deadline - now;
+        if (wait > SPIN_NS) {
+            uint64_t const sleep_ns = MIN(wait - SPIN_NS, MAX_SLEEP_NS);
+            struct timespec const ts = { .tv_sec = sleep_ns / 1000000000ULL, .tv_nsec = sleep_ns % 1000000000ULL };
+            (void)nanosleep(&ts, NULL);
+        }
+    }
+
+    if (now > deadline) {
+        uint64_t const lag = now - deadline;
+        replay->tot_lag_ns += lag;
+        if (lag > replay->max_lag_ns) replay->max_lag_ns = lag;
+    }
+
+    struct timeval tv = replay->start_tv;
+    timeval_add_usec(&tv, due / 1000);
+    SLOG(LOG_DEBUG, "Patching packet TS from %s to %s", timeval_2_str(&hdr->ts), timeval_2_str(&tv));
+    hdr->ts = tv;
+
+    replay->num_frames ++;
+    replay->num_bytes += hdr->len;
+    replay->tot_frames ++;
+    replay->tot_bytes += hdr->len;
+}
+
+// Same as sniffer, but try to follow original capture packet rate
 static void *sniffer_rt(struct pkt_source *pkt_source, pcap_handler callback)
 {
     SLOG(LOG_INFO, "Reading packets in realtime from packet source %s", pkt_source_name(pkt_source));
-    struct timeval file_start, replay_start;
-    timeval_reset(&file_start);
-    timeval_set_now(&replay_start);
+    struct replay replay;
+    replay_ctor(&replay, pkt_source->replay_speed);
 
     do {
         struct pcap_pkthdr *pkt_hdr;
@@ -253,7 +714,7 @@ static void *sniffer_rt(struct pkt_source *pkt_source, pcap_handler callback)
                 assert(pkt_source->is_file);
                 if (pkt_source->loop && !want_exit) {
                     rewind_file(pkt_source);
-                    timeval_set_now(&replay_start);
+                    replay_restart(&replay);
                     continue;
                 } else {
                     break;
@@ -265,12 +726,12 @@ static void *sniffer_rt(struct pkt_source *pkt_source, pcap_handler callback)
         }
         assert(res == 1);   // 0 should not happen
         if (pkt_hdr->ts.tv_sec == 0) continue;   // should not happen, but does occur sometime (same goes for all other pcap header fields)
-        if (! timeval_is_set(&file_start)) file_start = pkt_hdr->ts;
-        sync_times(&file_start, &replay_start, &pkt_hdr->ts);
+        replay_wait(&replay, pkt_hdr);
         if (want_exit) break;
         callback((void *)pkt_source, pkt_hdr, packet);
     } while (1);
 
+    replay_dtor(&replay, pkt_source);
     SLOG(LOG_INFO, "Stop sniffing on packet source %s (realtime) (%"PRIuLEAST64" packets received)", pkt_source_name(pkt_source), pkt_source->num_packets);
     pkt_source_del(pkt_source);
     return NULL;
@@ -280,14 +741,14 @@ static void *iface_sniffer(void *pkt_source_)
 {
     struct pkt_source *pkt_source = pkt_source_;
     set_thread_name(tempstr_printf("J-snif-%s[%u]", pkt_source->name, pkt_source->instance));
-    return sniffer(pkt_source, parse_packet);
+    return sniffer(pkt_source);
 }
 
 static void *file_sniffer(void *pkt_source_)
 {
     struct pkt_source *pkt_source = pkt_source_;
     set_thread_name(tempstr_printf("J-read-%s[%u]", pkt_source->name, pkt_source->instance));
-    return sniffer(pkt_source, parse_packet);
+    return sniffer(pkt_source);
 }
 
 static void *file_sniffer_rt(void *pkt_source_)
@@ -297,28 +758,422 @@ static void *file_sniffer_rt(void *pkt_source_)
     return sniffer_rt(pkt_source, parse_packet);
 }
 
+/*
+ * Memory mapped files
+ *
+ * Frames stay valid in the mapping for as long as the pkt_source lives, so
+ * we can burst them without copy, and looping is just a matter of resetting
+ * an offset.
+ *
+ * When the file is partitioned, each partition tells the merge of their
+ * outputs how far in the file it went once its frames are parsed.
+ */
+
+static void map_burst_flush(struct pkt_burst *burst, uint64_t next_rank)
+{
+    pkt_burst_flush(burst);
+    struct pkt_source *pkt_source = burst->pkt_source;
+    if (pkt_source->merge) cap_merge_advance(pkt_source->merge, pcap_map_partition(pkt_source->map), next_rank);
+}
+
+static void *map_sniffer(void *pkt_source_)
+{
+    struct pkt_source *pkt_source = pkt_source_;
+    set_thread_name(tempstr_printf("J-map-%s[%u]", pkt_source->name, pkt_source->instance));
+    SLOG(LOG_INFO, "Reading packets from mapped file %s", pkt_source_name(pkt_source));
+
+    struct pkt_burst *burst = pkt_burst_new(pkt_source);
+    if (! burst) {
+        SLOG(LOG_ERR, "Cannot alloc a burst for packet source %s", pkt_source_name(pkt_source));
+        goto quit;
+    }
+
+    while (! want_exit) {
+        struct pcap_pkthdr pkthdr;
+        uint8_t *data;
+        int const res = pcap_map_next(pkt_source->map, &pkthdr, &data);
+        if (res == 1) {
+            if (pkt_burst_is_full(burst)) map_burst_flush(burst, pcap_map_rank(pkt_source->map) - 1);
+            pkt_burst_add(burst, &pkthdr, data, false);
+            continue;
+        }
+        map_burst_flush(burst, pcap_map_rank(pkt_source->map));
+        if (res < 0 || ! pkt_source->loop) break;
+        pcap_map_rewind(pkt_source->map);
+    }
+
+    pkt_burst_flush(burst);
+    pkt_burst_del(burst);
+quit:
+    SLOG(LOG_INFO, "Stop sniffing on packet source %s (%"PRIuLEAST64" packets received)", pkt_source_name(pkt_source), pkt_source->num_packets);
+    pkt_source_del(pkt_source);
+    return NULL;
+}
+
+/*
+ * AF_PACKET rings
+ *
+ * Rather than a single libpcap handle per iface, we can open several packet
+ * sockets on the same iface, all members of the same fanout group so that the
+ * kernel spreads the frames amongst them according to a flow hash. Each
+ * socket comes with its own mmapped TPACKET_V3 ring and its own sniffer thread
+ * that parses the frames right from the ring blocks. Each member is a
+ * pkt_source of its own (with same name but distinct instance).
+ */
+
+#ifdef WITH_PKT_RING
+
+#define RING_BLOCK_SIZE (1U << 20)
+#define RING_FRAME_SIZE 2048U
+#define VLAN_TAG_LEN 4
+
+struct pkt_ring {
+    int fd;                     ///< The packet socket
+    uint8_t *map;               ///< The mmapped ring
+    size_t block_size;          ///< Size of each block of the ring
+    unsigned num_blocks;        ///< Number of blocks in the ring
+    unsigned next_block;        ///< The block we expect the kernel to hand over next (only used by the sniffer thread)
+    size_t snaplen;             ///< Max number of bytes we pass to the parsers
+    unsigned fanout_id;         ///< Fanout group shared by all sockets reading this iface
+    unsigned member;            ///< Rank of this socket in its fanout group
+    unsigned num_members;       ///< Number of sockets in the fanout group
+    volatile sig_atomic_t stop; ///< Set to ask the sniffer thread to stop
+    uint64_t num_blocks_read;   ///< Number of blocks handed over by the kernel so far
+    /// PACKET_STATISTICS are reset after each read, so we accumulate them here
+    uint64_t tot_recved, tot_dropped, tot_freezes;
+};
+
+// Frames are valid until the block is given back to the kernel, so we can burst them without copy
+static void ring_read_block(struct pkt_burst *burst, struct tpacket_block_desc *block)
+{
+    struct pkt_ring *ring = burst->pkt_source->ring;
+    uint8_t *frame = (uint8_t *)block + block->hdr.bh1.offset_to_first_pkt;
+
+    for (unsigned n = block->hdr.bh1.num_pkts; n > 0 && !want_exit; n--) {
+        struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)frame;
+        uint8_t *data = frame + hdr->tp_mac;
+        struct pcap_pkthdr pkthdr = {
+            .ts = { .tv_sec = hdr->tp_sec, .tv_usec = hdr->tp_nsec / 1000 },
+            .caplen = hdr->tp_snaplen,
+            .len = hdr->tp_len,
+        };
+
+        if ((hdr->tp_status & TP_STATUS_VLAN_VALID) && pkthdr.caplen >= 2*ETH_ALEN) {
+            // The kernel stripped the 802.1q tag. Put it back in the room we reserved in front of the frame.
+            uint16_t tpid = ETH_P_8021Q;
+#           ifdef TP_STATUS_VLAN_TPID_VALID
+            if (hdr->tp_status & TP_STATUS_VLAN_TPID_VALID) tpid = hdr->hv1.tp_vlan_tpid;
+#           endif
+            data -= VLAN_TAG_LEN;
+            memmove(data, data + VLAN_TAG_LEN, 2*ETH_ALEN);
+            uint16_t const tag[2] = { htons(tpid), htons(hdr->hv1.tp_vlan_tci) };
+            memcpy(data + 2*ETH_ALEN, tag, sizeof(tag));
+            pkthdr.caplen += VLAN_TAG_LEN;
+            pkthdr.len += VLAN_TAG_LEN;
+        }
+        pkthdr.caplen = MIN(pkthdr.caplen, ring->snaplen);
+
+        if (pkt_burst_is_full(burst)) pkt_burst_flush(burst);
+        pkt_burst_add(burst, &pkthdr, data, false);
+
+        frame += hdr->tp_next_offset;
+    }
+
+    pkt_burst_flush(burst);
+}
+
+static void *ring_sniffer(void *pkt_source_)
+{
+    struct pkt_source *pkt_source = pkt_source_;
+    struct pkt_ring *ring = pkt_source->ring;
+    set_thread_name(tempstr_printf("J-ring-%s[%u]", pkt_source->name, pkt_source->instance));
+    SLOG(LOG_INFO, "Reading packets from ring %u/%u of packet source %s", ring->member+1, ring->num_members, pkt_source_name(pkt_source));
+
+    struct pkt_burst *burst = pkt_burst_new(pkt_source);
+    if (! burst) {
+        SLOG(LOG_ERR, "Cannot alloc a burst for packet source %s", pkt_source_name(pkt_source));
+        goto quit;
+    }
+
+    struct pollfd pfd = { .fd = ring->fd, .events = POLLIN | POLLERR };
+
+    while (! want_exit && ! ring->stop) {
+        if (pkt_source->new_filter) install_new_filter(pkt_source);
+        struct tpacket_block_desc *block = (struct tpacket_block_desc *)(ring->map + ring->next_block * ring->block_size);
+        if (! (block->hdr.bh1.block_status & TP_STATUS_USER)) {
+            // Wait no more than 1s so that we can check for stop flags from time to time
+            if (0 > poll(&pfd, 1, 1000) && errno != EINTR) {
+                SLOG(LOG_ALERT, "Cannot poll ring of packet source %s: %s", pkt_source_name(pkt_source), strerror(errno));
+                break;
+            }
+            continue;
+        }
+
+        __sync_synchronize();   // do not read the block before its status
+        ring_read_block(burst, block);
+        __sync_synchronize();   // nor give it back before we are done with it
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+        ring->next_block = (ring->next_block + 1) % ring->num_blocks;
+        ring->num_blocks_read ++;
+    }
+
+    pkt_burst_del(burst);
+quit:
+    SLOG(LOG_INFO, "Stop sniffing on packet source %s (%"PRIuLEAST64" packets received)", pkt_source_name(pkt_source), pkt_source->num_packets);
+    pkt_source_del(pkt_source);
+    return NULL;
+}
+
+#endif  // WITH_PKT_RING
+
 /*
  * Ctor/Dtor of pkt_sources
  */
 
-static int set_filter(pcap_t *pcap_handle, char const *filter)
+// Unlike set_filter, an empty filter accepts every frame (and replaces any previous filter)
+static int install_filter(pcap_t *pcap_handle, char const *filter)
 {
     struct bpf_program fp;
 
-    if (filter[0] == '\0') return 0;
-
     if (0 != pcap_compile(pcap_handle, &fp, filter, 1, 0)) {
         SLOG(LOG_ERR, "Cannot parse filter %s: %s", filter, pcap_geterr(pcap_handle));
         return -1;
     }
     if (0 != pcap_setfilter(pcap_handle, &fp)) {
         SLOG(LOG_ERR, "Cannot install filter %s: %s", filter, pcap_geterr(pcap_handle));
+        pcap_freecode(&fp);
+        return -1;
+    }
+
+    pcap_freecode(&fp);
+    return 0;
+}
+
+static int set_filter(pcap_t *pcap_handle, char const *filter)
+{
+    if (filter[0] == '\0') return 0;
+    return install_filter(pcap_handle, filter);
+}
+
+#ifdef WITH_PKT_RING
+
+// Compile the filter with libpcap and attach it to the packet socket
+static int set_ring_filter(int fd, char const *filter, size_t snaplen)
+{
+    if (filter[0] == '\0') return 0;
+
+    pcap_t *dead = pcap_open_dead(DLT_EN10MB, snaplen);
+    if (! dead) {
+        SLOG(LOG_ERR, "Cannot compile filter %s: pcap_open_dead failed", filter);
         return -1;
     }
 
+    int ret = -1;
+    struct bpf_program fp;
+    if (0 != pcap_compile(dead, &fp, filter, 1, PCAP_NETMASK_UNKNOWN)) {
+        SLOG(LOG_ERR, "Cannot parse filter %s: %s", filter, pcap_geterr(dead));
+        goto err1;
+    }
+
+    struct sock_fprog prog = {
+        .len = fp.bf_len,
+        .filter = (struct sock_filter *)fp.bf_insns,
+    };
+    if (0 != setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))) {
+        SLOG(LOG_ERR, "Cannot install filter %s: %s", filter, strerror(errno));
+        goto err0;
+    }
+
+    ret = 0;
+err0:
+    pcap_freecode(&fp);
+err1:
+    pcap_close(dead);
+    return ret;
+}
+
+static void pkt_ring_del(struct pkt_ring *ring)
+{
+    if (ring->map) munmap(ring->map, ring->block_size * ring->num_blocks);
+    close(ring->fd);
+    objfree(ring);
+}
+
+static struct pkt_ring *pkt_ring_new(char const *ifname, bool promisc, char const *filter, size_t snaplen, size_t ring_size, unsigned fanout_id, unsigned member, unsigned num_members)
+{
+    unsigned const ifindex = if_nametoindex(ifname);
+    if (! ifindex) {
+        SLOG(LOG_ALERT, "Cannot find device '%s': %s", ifname, strerror(errno));
+        return NULL;
+    }
+
+    struct pkt_ring *ring = objalloc(sizeof(*ring), "pkt_rings");
+    if (! ring) return NULL;
+
+    ring->map = NULL;
+    ring->block_size = RING_BLOCK_SIZE;
+    ring->num_blocks = MAX(2, ring_size / RING_BLOCK_SIZE);
+    ring->next_block = 0;
+    ring->snaplen = snaplen;
+    ring->fanout_id = fanout_id;
+    ring->member = member;
+    ring->num_members = num_members;
+    ring->stop = 0;
+    ring->num_blocks_read = 0;
+    ring->tot_recved = ring->tot_dropped = ring->tot_freezes = 0;
+
+    ring->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (ring->fd < 0) {
+        SLOG(LOG_ALERT, "Cannot open packet socket for device '%s': %s", ifname, strerror(errno));
+        objfree(ring);
+        return NULL;
+    }
+
+    int const version = TPACKET_V3;
+    if (0 != setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+        SLOG(LOG_ALERT, "Cannot use TPACKET_V3 for device '%s': %s", ifname, strerror(errno));
+        goto err;
+    }
+
+    // Leave some room in front of each frame so that we can reinsert the vlan tags
+    unsigned const reserve = VLAN_TAG_LEN;
+    if (0 != setsockopt(ring->fd, SOL_PACKET, PACKET_RESERVE, &reserve, sizeof(reserve))) {
+        SLOG(LOG_ALERT, "Cannot reserve headroom in ring for device '%s': %s", ifname, strerror(errno));
+        goto err;
+    }
+
+    struct tpacket_req3 req = {
+        .tp_block_size = ring->block_size,
+        .tp_block_nr = ring->num_blocks,
+        .tp_frame_size = RING_FRAME_SIZE,
+        .tp_frame_nr = (ring->block_size / RING_FRAME_SIZE) * ring->num_blocks,
+        .tp_retire_blk_tov = 10,    // ms before the kernel hands us a block that's not full
+        .tp_sizeof_priv = 0,
+        .tp_feature_req_word = 0,
+    };
+    if (0 != setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+        SLOG(LOG_ALERT, "Cannot setup a ring of %u blocks for device '%s': %s", ring->num_blocks, ifname, strerror(errno));
+        goto err;
+    }
+
+    void *map = mmap(NULL, ring->block_size * ring->num_blocks, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, 0);
+    if (map == MAP_FAILED) {
+        SLOG(LOG_ALERT, "Cannot mmap ring for device '%s': %s", ifname, strerror(errno));
+        goto err;
+    }
+    ring->map = map;
+
+    struct sockaddr_ll addr = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+        .sll_ifindex = ifindex,
+    };
+    if (0 != bind(ring->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        SLOG(LOG_ALERT, "Cannot bind packet socket to device '%s': %s", ifname, strerror(errno));
+        goto err;
+    }
+
+    if (promisc) {
+        struct packet_mreq mreq = {
+            .mr_ifindex = ifindex,
+            .mr_type = PACKET_MR_PROMISC,
+        };
+        if (0 != setsockopt(ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq))) {
+            SLOG(LOG_ALERT, "Cannot set promiscuous mode for device '%s': %s", ifname, strerror(errno));
+            goto err;
+        }
+    }
+
+    if (filter && 0 != set_ring_filter(ring->fd, filter, snaplen)) goto err;
+
+    // Defrag so that all fragments of an IP packet end up in the same member
+    int const fanout = (fanout_id & 0xffff) | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+    if (0 != setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout))) {
+        SLOG(LOG_ALERT, "Cannot join fanout group %u for device '%s': %s", fanout_id, ifname, strerror(errno));
+        goto err;
+    }
+
+    return ring;
+err:
+    pkt_ring_del(ring);
+    return NULL;
+}
+
+static int pkt_ring_stats(struct pkt_ring *ring, struct pcap_stat *stats)
+{
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+    if (0 != getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len)) return -1;
+
+    // tp_packets already includes tp_drops
+    stats->ps_recv = __sync_add_and_fetch(&ring->tot_recved, st.tp_packets);
+    stats->ps_drop = __sync_add_and_fetch(&ring->tot_dropped, st.tp_drops);
+    stats->ps_ifdrop = 0;
+    (void)__sync_add_and_fetch(&ring->tot_freezes, st.tp_freeze_q_cnt);
+
     return 0;
 }
 
+#endif  // WITH_PKT_RING
+
+/* Filters are changed from the sniffer thread itself, since libpcap does not
+ * allow to change the filter of a handle while another thread reads from it. */
+static void install_new_filter(struct pkt_source *pkt_source)
+{
+    char *filter = __sync_lock_test_and_set(&pkt_source->new_filter, NULL);
+    if (! filter) return;
+
+    SLOG(LOG_INFO, "Installing filter '%s' on packet source %s", filter, pkt_source_name(pkt_source));
+#   ifdef WITH_PKT_RING
+    if (pkt_source->ring) {
+        if (filter[0] == '\0') {
+            if (0 != setsockopt(pkt_source->ring->fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0) && errno != ENOENT) {
+                SLOG(LOG_ERR, "Cannot remove filter from packet source %s: %s", pkt_source_name(pkt_source), strerror(errno));
+            }
+        } else {
+            (void)set_ring_filter(pkt_source->ring->fd, filter, pkt_source->ring->snaplen);
+        }
+    } else
+#   endif
+    if (pkt_source->pcap_handle) {
+        (void)install_filter(pkt_source->pcap_handle, filter);
+    }
+
+    objfree(filter);
+}
+
+// Called by auto_filter whenever the auto filter changes
+static void auto_filter_changed(void)
+{
+    mutex_lock(&pkt_sources_lock);
+    struct pkt_source *pkt_source;
+    LIST_FOREACH(pkt_source, &pkt_sources, entry) {
+        if (pkt_source->is_file) continue;
+        char const *filter = auto_filter_combine(pkt_source->filter);
+        char *new_filter = objalloc_strdup(filter ? filter : "");
+        char *prev = __sync_lock_test_and_set(&pkt_source->new_filter, new_filter);
+        if (prev) objfree(prev);
+    }
+    mutex_unlock(&pkt_sources_lock);
+}
+
+static bool pkt_source_stats(struct pkt_source *pkt_source, struct pcap_stat *stats)
+{
+#   ifdef WITH_PKT_RING
+    if (pkt_source->ring) return 0 == pkt_ring_stats(pkt_source->ring, stats);
+#   endif
+    if (pkt_source->map) return false;
+    return 0 == pcap_stats(pkt_source->pcap_handle, stats);
+}
+
+static char const *pkt_source_geterr(struct pkt_source *pkt_source)
+{
+    if (pkt_source->ring) return strerror(errno);
+    if (pkt_source->map) return "no statistics for mapped files";
+    return pcap_geterr(pkt_source->pcap_handle);
+}
+
 /* We start all sniffer thread in guile mode so that plugins that require guile mode are not
  * forced to enter guile mode packet by packet. */
 static void *start_guile_sniffer(void *pkt_source_)
@@ -327,8 +1182,16 @@ static void *start_guile_sniffer(void *pkt_source_)
     return scm_with_guile(pkt_source->sniffer_fun, pkt_source);
 }
 
+static void pkt_source_latency_dtor(struct pkt_source *pkt_source)
+{
+    for (unsigned b = 0; b < NB_LATENCY_BUCKETS; b++) {
+        counter_dtor(pkt_source->parse_latency+b);
+        counter_dtor(pkt_source->done_latency+b);
+    }
+}
+
 // TODO: add a parameter to enable/disable deduplication
-static int pkt_source_ctor(struct pkt_source *pkt_source, char const *name, pcap_t *pcap_handle, void *(*sniffer)(void *), bool is_file, bool patch_ts, uint8_t dev_id, char const *filter, bool loop)
+static int pkt_source_ctor(struct pkt_source *pkt_source, char const *name, pcap_t *pcap_handle, struct pkt_ring *ring, struct pcap_map *map, void *(*sniffer)(void *), bool is_file, bool patch_ts, uint8_t dev_id, char const *filter, bool loop, double replay_speed, struct cap_merge *merge)
 {
     SLOG(LOG_DEBUG, "Construct pkt_source@%p of name %s and dev_id %"PRIu8, pkt_source, name, dev_id);
     int ret = 0;
@@ -336,6 +1199,8 @@ static int pkt_source_ctor(struct pkt_source *pkt_source, char const *name, pcap
     snprintf(pkt_source->name, sizeof(pkt_source->name), "%s", name);
     pkt_source->instance = 0;
     pkt_source->pcap_handle = pcap_handle;
+    pkt_source->ring = ring;
+    pkt_source->map = map;
     pkt_source->num_packets = 0;
     pkt_source->num_duplicates = 0;
     pkt_source->num_cap_bytes = 0;
@@ -345,9 +1210,22 @@ static int pkt_source_ctor(struct pkt_source *pkt_source, char const *name, pcap
     pkt_source->is_file = is_file;
     pkt_source->patch_ts = patch_ts;
     pkt_source->loop = loop;
+    pkt_source->replay_speed = replay_speed;
     pkt_source->filter = filter ? objalloc_strdup(filter) : NULL;
+    pkt_source->new_filter = NULL;
+    // Timestamps of files are in the past, unless overwritten or paced
+    pkt_source->timed = !is_file || patch_ts || replay_speed > 0.;
+    for (unsigned b = 0; b < NB_LATENCY_BUCKETS; b++) {
+        counter_ctor(pkt_source->parse_latency+b);
+        counter_ctor(pkt_source->done_latency+b);
+    }
     pkt_source->sniffer_fun = sniffer;
     pkt_source->digests = digest_queue_get(dev_id); // if we can't have a deduplicator, let's go without one!
+    // Each partition of a file has a parser tree (and thus mux state) of its own
+    pkt_source->cap_parser = map && pcap_map_num_partitions(map) > 1 ? proto_cap->ops->parser_new(proto_cap) : NULL;
+    pkt_source->merge = merge ? cap_merge_ref(merge) : NULL;
+    // Partitions are already parsed in parallel, and their merge requires each frame to be parsed by its sniffer thread
+    pkt_source->lane = merge ? NULL : parse_lane_new(name);   // NULL if we are to parse in the sniffer thread
 
     mutex_lock(&pkt_sources_lock);
     if (want_exit) {
@@ -374,15 +1252,21 @@ static int pkt_source_ctor(struct pkt_source *pkt_source, char const *name, pcap
 
 unlock_quit:
     mutex_unlock(&pkt_sources_lock);
+    if (ret) {
+        parse_lane_del(&pkt_source->lane);
+        cap_merge_unref(&pkt_source->merge);
+        parser_unref(&pkt_source->cap_parser);
+        pkt_source_latency_dtor(pkt_source);
+    }
     return ret;
 }
 
-static struct pkt_source *pkt_source_new(char const *name, pcap_t *pcap_handle, void *(*sniffer)(void *), bool is_file, bool patch_ts, uint8_t dev_id, char const *filter, bool loop)
+static struct pkt_source *pkt_source_new(char const *name, pcap_t *pcap_handle, struct pkt_ring *ring, struct pcap_map *map, void *(*sniffer)(void *), bool is_file, bool patch_ts, uint8_t dev_id, char const *filter, bool loop, double replay_speed, struct cap_merge *merge)
 {
     struct pkt_source *pkt_source = objalloc(sizeof(*pkt_source), "pkt_sources");
     if (! pkt_source) return NULL;
 
-    if (0 != pkt_source_ctor(pkt_source, name, pcap_handle, sniffer, is_file, patch_ts, dev_id, filter, loop)) {
+    if (0 != pkt_source_ctor(pkt_source, name, pcap_handle, ring, map, sniffer, is_file, patch_ts, dev_id, filter, loop, replay_speed, merge)) {
         objfree(pkt_source);
         pkt_source = NULL;
     }
@@ -390,10 +1274,92 @@ static struct pkt_source *pkt_source_new(char const *name, pcap_t *pcap_handle,
     return pkt_source;
 }
 
-static struct pkt_source *pkt_source_new_file(char const *filename, char const *filter, bool rt, bool patch_ts, bool loop)
+static char const *file_basename(char const *filename)
+{
+    char const *basename = filename;
+    for (char const *c = filename; *c != '\0'; c++) {
+        if (*c == '/') basename = c+1;
+    }
+    return basename;
+}
+
+static struct pkt_source *pkt_source_new_mapped_file(char const *filename, char const *filter, bool patch_ts, bool loop)
+{
+    SLOG(LOG_DEBUG, "Mapping pcap file '%s' with filter %s", filename, filter ? filter:"NONE");
+
+    struct pcap_map *map = pcap_map_open(filename);
+    if (! map) {
+        SLOG(LOG_CRIT, "Cannot map pcap file '%s'", filename);
+        return NULL;
+    }
+
+    if (filter && 0 != pcap_map_set_filter(map, filter)) {
+        pcap_map_close(map);
+        return NULL;
+    }
+
+    struct pkt_source *pkt_source = pkt_source_new(file_basename(filename), NULL, NULL, map, map_sniffer, true, patch_ts, pcap_id_seq++, filter, loop, 0., NULL);
+    if (! pkt_source) {
+        pcap_map_close(map);
+    }
+
+    return pkt_source;
+}
+
+// Open num_parts mapped pkt_sources for the same file, each of them parsing only a partition of the flows
+static unsigned pkt_source_new_partitioned_file(char const *filename, unsigned num_parts, char const *filter, bool loop, struct pkt_source **parts)
 {
     if (! filter) filter = default_bpf_filter;
 
+    SLOG(LOG_INFO, "Splitting pcap file '%s' into %u partitions with filter %s", filename, num_parts, filter ? filter:"NONE");
+
+    // Do not quit if the first partitions are done before the last ones are opened
+    mutex_lock(&pkt_sources_lock);
+    num_opening ++;
+    mutex_unlock(&pkt_sources_lock);
+
+    // Outputs of the partitions are merged back into file order
+    struct cap_merge *merge = cap_merge_new(num_parts);
+    if (! merge) SLOG(LOG_WARNING, "Cannot merge outputs of the partitions of %s", filename);
+
+    unsigned p;
+    for (p = 0; p < num_parts; p++) {
+        struct pcap_map *map = pcap_map_open(filename);
+        if (! map) break;
+        pcap_map_set_partition(map, p, num_parts);
+        if (filter && 0 != pcap_map_set_filter(map, filter)) {
+            pcap_map_close(map);
+            break;
+        }
+        parts[p] = pkt_source_new(file_basename(filename), NULL, NULL, map, map_sniffer, true, false, pcap_id_seq++, filter, loop, 0., merge);
+        if (! parts[p]) {
+            pcap_map_close(map);
+            break;
+        }
+    }
+
+    if (merge) {
+        // Do not wait for the partitions that could not be opened
+        for (unsigned q = p; q < num_parts; q++) cap_merge_advance(merge, q, UINT64_MAX);
+        cap_merge_unref(&merge);
+    }
+
+    mutex_lock(&pkt_sources_lock);
+    num_opening --;
+    may_quit();
+    mutex_unlock(&pkt_sources_lock);
+
+    return p;
+}
+
+// A replay_speed of 0 means as fast as possible, otherwise the capture rate is followed (accelerated by this factor)
+static struct pkt_source *pkt_source_new_file(char const *filename, char const *filter, double replay_speed, bool patch_ts, bool loop, bool mapped)
+{
+    if (! filter) filter = default_bpf_filter;
+
+    // The mapped reader does not know how to follow the capture rate
+    if (mapped && replay_speed == 0.) return pkt_source_new_mapped_file(filename, filter, patch_ts, loop);
+
     char errbuf[PCAP_ERRBUF_SIZE] = "";
 
     SLOG(LOG_DEBUG, "Opening pcap file '%s' with filter %s", filename, filter ? filter:"NONE");
@@ -407,18 +1373,13 @@ static struct pkt_source *pkt_source_new_file(char const *filename, char const *
         SLOG(LOG_WARNING, "While opening pcap file '%s': %s", filename, errbuf);
     }
 
-    char const *basename = filename;
-    for (char const *c = filename; *c != '\0'; c++) {
-        if (*c == '/') basename = c+1;
-    }
-
     if (filter && 0 != set_filter(handle, filter)) {
         pcap_close(handle);
         return NULL;
     }
 
-    void *(*sniff)(void *) = rt ? file_sniffer_rt : file_sniffer;
-    struct pkt_source *pkt_source = pkt_source_new(basename, handle, sniff, true, patch_ts, pcap_id_seq++, filter, loop);
+    void *(*sniff)(void *) = replay_speed > 0. ? file_sniffer_rt : file_sniffer;
+    struct pkt_source *pkt_source = pkt_source_new(file_basename(filename), handle, NULL, NULL, sniff, true, patch_ts, pcap_id_seq++, filter, loop, replay_speed, NULL);
     if (! pkt_source) {
         pcap_close(handle);
     }
@@ -435,7 +1396,7 @@ static void may_quit(void)
 
     if (want_exit) {
         do_exit = true;
-    } else if (LIST_EMPTY(&pkt_sources)) {
+    } else if (LIST_EMPTY(&pkt_sources) && num_opening == 0) {
         WITH_EXT_LOCK(quit_when_done, do_exit = quit_when_done);
     }
 
@@ -497,13 +1458,14 @@ static struct pkt_source *pkt_source_new_if(char const *ifname, bool promisc, ch
         goto err1;
     }
 
-    if (filter && 0 != set_filter(handle, filter)) {
+    char const *kernel_filter = auto_filter_combine(filter);
+    if (kernel_filter && 0 != set_filter(handle, kernel_filter)) {
         pcap_close(handle);
         return NULL;
     }
 
     uint8_t dev_id = dev_id_of_ifname(ifname);
-    struct pkt_source *pkt_source = pkt_source_new(ifname, handle, iface_sniffer, false, false, dev_id, filter, false);
+    struct pkt_source *pkt_source = pkt_source_new(ifname, handle, NULL, NULL, iface_sniffer, false, false, dev_id, filter, false, 0., NULL);
     if (! pkt_source) goto err1;
 
     return pkt_source;
@@ -516,6 +1478,45 @@ err2:
     return NULL;
 }
 
+#ifdef WITH_PKT_RING
+// A sequence to give distinct fanout group ids to the ifaces we open (protected with pkt_sources_lock)
+static unsigned fanout_id_seq;
+
+// Returns the number of members successfully opened (stored in members)
+static unsigned pkt_source_new_ring(char const *ifname, unsigned num_members, bool promisc, char const *filter, size_t snaplen, size_t ring_size, struct pkt_source **members)
+{
+    if (! filter) filter = default_bpf_filter;
+    if (! snaplen) snaplen = 65535;
+
+    SLOG(LOG_INFO, "Opening %u rings of %zu bytes on device '%s'%s with filter %s", num_members, ring_size, ifname, promisc ? " in promiscuous mode":"", filter ? filter:"NONE");
+
+    mutex_lock(&pkt_sources_lock);
+    // Fanout group ids are shared by all processes, so add some entropy
+    unsigned const fanout_id = (getpid() + fanout_id_seq++) & 0xffff;
+    mutex_unlock(&pkt_sources_lock);
+
+    uint8_t const dev_id = dev_id_of_ifname(ifname);
+    unsigned m;
+    for (m = 0; m < num_members; m++) {
+        struct pkt_ring *ring = pkt_ring_new(ifname, promisc, auto_filter_combine(filter), snaplen, ring_size, fanout_id, m, num_members);
+        if (! ring) break;
+        members[m] = pkt_source_new(ifname, NULL, ring, NULL, ring_sniffer, false, false, dev_id, filter, false, 0., NULL);
+        if (! members[m]) {
+            pkt_ring_del(ring);
+            break;
+        }
+    }
+
+    if (m == 0) {
+        mutex_lock(&pkt_sources_lock);
+        may_quit();
+        mutex_unlock(&pkt_sources_lock);
+    }
+
+    return m;
+}
+#endif
+
 // Caller must own pkt_sources_lock
 static void pkt_source_dtor(struct pkt_source *pkt_source)
 {
@@ -527,11 +1528,31 @@ static void pkt_source_dtor(struct pkt_source *pkt_source)
         pcap_close(pkt_source->pcap_handle);
         pkt_source->pcap_handle = NULL;
     }
+#   ifdef WITH_PKT_RING
+    if (pkt_source->ring) {
+        pkt_ring_del(pkt_source->ring);
+        pkt_source->ring = NULL;
+    }
+#   endif
+    if (pkt_source->merge) {
+        cap_merge_advance(pkt_source->merge, pcap_map_partition(pkt_source->map), UINT64_MAX);
+        cap_merge_unref(&pkt_source->merge);
+    }
+    if (pkt_source->map) {
+        pcap_map_close(pkt_source->map);
+        pkt_source->map = NULL;
+    }
     if (pkt_source->filter) {
         objfree(pkt_source->filter);
         pkt_source->filter = NULL;
     }
+    if (pkt_source->new_filter) {
+        objfree(pkt_source->new_filter);
+        pkt_source->new_filter = NULL;
+    }
     digest_queue_unref(&pkt_source->digests);
+    parser_unref(&pkt_source->cap_parser);
+    pkt_source_latency_dtor(pkt_source);
 }
 
 static uint64_t tot_dropped, tot_recved;
@@ -540,9 +1561,9 @@ static void pkt_source_del(struct pkt_source *pkt_source)
 {
     // Dump some stats
     struct pcap_stat stats;
-    bool const have_stats = 0 == pcap_stats(pkt_source->pcap_handle, &stats);
+    bool const have_stats = pkt_source_stats(pkt_source, &stats);
     if (! have_stats) {
-        SLOG(pkt_source->is_file ? LOG_DEBUG:LOG_WARNING, "Cannot read stats for packet source %s: %s", pkt_source_name(pkt_source), pcap_geterr(pkt_source->pcap_handle));
+        SLOG(pkt_source->is_file ? LOG_DEBUG:LOG_WARNING, "Cannot read stats for packet source %s: %s", pkt_source_name(pkt_source), pkt_source_geterr(pkt_source));
     } else if (stats.ps_recv > 0) {
         tot_recved += stats.ps_recv;
         tot_dropped += stats.ps_drop;
@@ -550,6 +1571,9 @@ static void pkt_source_del(struct pkt_source *pkt_source)
             stats.ps_recv, stats.ps_drop, (stats.ps_drop * 100.)/stats.ps_recv);
     }
 
+    // Frames still queued for the parsing workers refer to this pkt_source
+    parse_lane_del(&pkt_source->lane);
+
     mutex_lock(&pkt_sources_lock);
     pkt_source_dtor(pkt_source);
     objfree(pkt_source);
@@ -562,6 +1586,16 @@ static void pkt_source_terminate(struct pkt_source *pkt_source)
 {
     SLOG(LOG_DEBUG, "Terminating packet source '%s' after %"PRIu64" packets (%"PRIu64" dups)", pkt_source_name(pkt_source), pkt_source->num_packets, pkt_source->num_duplicates);
     pkt_source->loop = false;
+#   ifdef WITH_PKT_RING
+    if (pkt_source->ring) {
+        pkt_source->ring->stop = 1;
+        return;
+    }
+#   endif
+    if (pkt_source->map) {
+        pcap_map_stop(pkt_source->map);
+        return;
+    }
     pcap_breakloop(pkt_source->pcap_handle);
 }
 
@@ -627,19 +1661,86 @@ static SCM g_open_iface(SCM ifname_, SCM promisc_, SCM filter_, SCM snaplen_, SC
     return pkt_source ? scm_from_latin1_string(pkt_source_guile_name(pkt_source)) : SCM_UNSPECIFIED;
 }
 
+static struct ext_function sg_open_iface_ring;
+static SCM g_open_iface_ring(SCM ifname_, SCM num_members_, SCM promisc_, SCM filter_, SCM snaplen_, SCM ring_size_)
+{
+    char *ifname = scm_to_tempstr(ifname_);
+    unsigned const num_members = SCM_UNBNDP(num_members_) ? 4 : scm_to_uint(num_members_);
+    bool const promisc = SCM_UNBNDP(promisc_) || scm_to_bool(promisc_);
+    char const *filter = SCM_UNBNDP(filter_) ? NULL : scm_to_tempstr(filter_);
+    size_t const snaplen = SCM_UNBNDP(snaplen_) ? 0 : scm_to_size_t(snaplen_);
+    size_t const ring_size = SCM_UNBNDP(ring_size_) ? 64U << 20 : scm_to_size_t(ring_size_);
+
+#   ifdef WITH_PKT_RING
+    if (num_members == 0 || num_members > CPU_MAX) {
+        SLOG(LOG_ERR, "Cannot open %u rings on device '%s' (must be between 1 and %u)", num_members, ifname, CPU_MAX);
+        return SCM_BOOL_F;
+    }
+
+    struct pkt_source *members[CPU_MAX];
+    unsigned const num_opened = pkt_source_new_ring(ifname, num_members, promisc, filter, snaplen, ring_size, members);
+    if (! num_opened) return SCM_BOOL_F;
+
+    SCM ret = SCM_EOL;
+    for (unsigned m = num_opened; m > 0; m--) {
+        ret = scm_cons(scm_from_latin1_string(pkt_source_guile_name(members[m-1])), ret);
+    }
+    return ret;
+#   else
+    (void)promisc; (void)snaplen; (void)ring_size;
+    SLOG(LOG_ERR, "Cannot open %u rings on device '%s' with filter %s: AF_PACKET rings are not supported on this system", num_members, ifname, filter ? filter:"NONE");
+    return SCM_BOOL_F;
+#   endif
+}
+
 static struct ext_function sg_open_pcap;
-static SCM g_open_pcap(SCM filename_, SCM rt_, SCM filter_, SCM patch_ts_, SCM loop_)
+static SCM g_open_pcap(SCM filename_, SCM rt_, SCM filter_, SCM patch_ts_, SCM loop_, SCM mapped_)
 {
     char const *filename = scm_to_tempstr(filename_);
     char const *filter = SCM_UNBNDP(filter_) ? NULL : scm_to_tempstr(filter_);
-    bool const rt = SCM_UNBNDP(rt_) ? false : scm_to_bool(rt_);
+    // rt can be a boolean or a speed factor
+    double const replay_speed =
+        SCM_UNBNDP(rt_) ? 0. :
+        scm_is_number(rt_) ? scm_to_double(rt_) :
+        scm_to_bool(rt_) ? 1. : 0.;
     bool const patch_ts = SCM_UNBNDP(patch_ts_) ? false : scm_to_bool(patch_ts_);
     bool const loop = SCM_UNBNDP(loop_) ? false : scm_to_bool(loop_);
+    bool const mapped = SCM_UNBNDP(mapped_) ? false : scm_to_bool(mapped_);
 
-    struct pkt_source *pkt_source = pkt_source_new_file(filename, filter, rt, patch_ts, loop);
+    struct pkt_source *pkt_source = pkt_source_new_file(filename, filter, replay_speed, patch_ts, loop, mapped);
     return pkt_source ? SCM_BOOL_T : SCM_BOOL_F;
 }
 
+static struct ext_function sg_open_pcap_partitioned;
+static SCM g_open_pcap_partitioned(SCM filename_, SCM num_parts_, SCM filter_, SCM loop_)
+{
+    char const *filename = scm_to_tempstr(filename_);
+    unsigned const num_parts = SCM_UNBNDP(num_parts_) ? 4 : scm_to_uint(num_parts_);
+    char const *filter = SCM_UNBNDP(filter_) ? NULL : scm_to_tempstr(filter_);
+    bool const loop = SCM_UNBNDP(loop_) ? false : scm_to_bool(loop_);
+
+    if (num_parts == 0 || num_parts > CPU_MAX) {
+        SLOG(LOG_ERR, "Cannot split '%s' into %u partitions (must be between 1 and %u)", filename, num_parts, CPU_MAX);
+        return SCM_BOOL_F;
+    }
+
+    struct pkt_source *parts[CPU_MAX];
+    unsigned const num_opened = pkt_source_new_partitioned_file(filename, num_parts, filter, loop, parts);
+    if (num_opened < num_parts) {
+        // Partial results would be misleading
+        mutex_lock(&pkt_sources_lock);
+        for (unsigned p = 0; p < num_opened; p++) pkt_source_terminate(parts[p]);
+        mutex_unlock(&pkt_sources_lock);
+        return SCM_BOOL_F;
+    }
+
+    SCM ret = SCM_EOL;
+    for (unsigned p = num_opened; p > 0; p--) {
+        ret = scm_cons(scm_from_latin1_string(pkt_source_guile_name(parts[p-1])), ret);
+    }
+    return ret;
+}
+
 static struct ext_function sg_close_iface;
 static SCM g_close_iface(SCM ifname_)
 {
@@ -683,23 +1784,28 @@ static SCM num_cap_bytes_sym;
 static SCM num_wire_bytes_sym;
 static SCM filep_sym;
 static SCM filter_sym;
+static SCM fanout_group_sym;
+static SCM fanout_member_sym;
+static SCM ring_blocks_sym;
+static SCM ring_freezes_sym;
+static SCM timed_sym;
+static SCM parse_latency_sym;
+static SCM done_latency_sym;
+static SCM parse_p50_sym;
+static SCM parse_p99_sym;
+static SCM done_p50_sym;
+static SCM done_p99_sym;
 
-static struct ext_function sg_iface_stats;
-static SCM g_iface_stats(SCM ifname_)
+// Caller must own pkt_sources_lock
+static SCM pkt_source_stats_alist(struct pkt_source *pkt_source)
 {
-    mutex_lock(&pkt_sources_lock);
-    struct pkt_source *pkt_source = pkt_source_of_scm(ifname_);
-    SCM ret = SCM_UNSPECIFIED;
-
-    if (! pkt_source) goto err;
-
     struct pcap_stat stats;
-    bool const have_stats = 0 == pcap_stats(pkt_source->pcap_handle, &stats);
+    bool const have_stats = pkt_source_stats(pkt_source, &stats);
     if (! have_stats) {
-        SLOG(LOG_WARNING, "Cannot read stats for packet source %s: %s", pkt_source_name(pkt_source), pcap_geterr(pkt_source->pcap_handle));
+        SLOG(LOG_WARNING, "Cannot read stats for packet source %s: %s", pkt_source_name(pkt_source), pkt_source_geterr(pkt_source));
     }
 
-    ret = scm_list_n(
+    SCM ret = scm_list_n(
         scm_cons(id_sym,            scm_from_uint8(pkt_source->dev_id)),
         scm_cons(num_packets_sym,    scm_from_uint64(pkt_source->num_packets)),
         scm_cons(num_duplicates_sym, scm_from_uint64(pkt_source->num_duplicates)),
@@ -715,11 +1821,108 @@ static SCM g_iface_stats(SCM ifname_)
             SCM_UNDEFINED,
         SCM_UNDEFINED);
 
-    pkt_source->num_acked_recvs = stats.ps_recv;
-    pkt_source->num_acked_drops = stats.ps_drop;
+#   ifdef WITH_PKT_RING
+    struct pkt_ring const *ring = pkt_source->ring;
+    if (ring) {
+        ret = scm_cons(scm_cons(fanout_group_sym,  scm_from_uint(ring->fanout_id)),
+              scm_cons(scm_cons(fanout_member_sym, scm_from_uint(ring->member)),
+              scm_cons(scm_cons(ring_blocks_sym,   scm_from_uint64(ring->num_blocks_read)),
+              scm_cons(scm_cons(ring_freezes_sym,  scm_from_uint64(ring->tot_freezes)),
+              ret))));
+    }
+#   endif
 
-err:
+    if (have_stats) {
+        pkt_source->num_acked_recvs = stats.ps_recv;
+        pkt_source->num_acked_drops = stats.ps_drop;
+    }
+
+    return ret;
+}
+
+static struct ext_function sg_iface_stats;
+static SCM g_iface_stats(SCM ifname_)
+{
+    mutex_lock(&pkt_sources_lock);
+    struct pkt_source *pkt_source = pkt_source_of_scm(ifname_);
+    SCM ret = pkt_source ? pkt_source_stats_alist(pkt_source) : SCM_UNSPECIFIED;
+    mutex_unlock(&pkt_sources_lock);
+    return ret;
+}
+
+// Returns the upper bound (in microseconds) of the bucket where this percentile of the latencies lies
+static uint64_t latency_percentile(uint64_t const *histo, unsigned percent)
+{
+    uint64_t tot = 0;
+    for (unsigned b = 0; b < NB_LATENCY_BUCKETS; b++) tot += histo[b];
+    if (! tot) return 0;
+
+    uint64_t const target = (tot * percent + 99) / 100;
+    uint64_t sum = 0;
+    unsigned b;
+    for (b = 0; b < NB_LATENCY_BUCKETS-1; b++) {
+        sum += histo[b];
+        if (sum >= target) break;
+    }
+    return UINT64_C(1) << b;
+}
+
+// Non empty buckets, as an alist of upper bound (in microseconds) to number of frames
+static SCM latency_histo_alist(uint64_t const *histo)
+{
+    SCM ret = SCM_EOL;
+    for (unsigned b = NB_LATENCY_BUCKETS; b-- > 0; ) {
+        if (! histo[b]) continue;
+        ret = scm_cons(scm_cons(scm_from_uint64(UINT64_C(1) << b), scm_from_uint64(histo[b])), ret);
+    }
+    return ret;
+}
+
+static struct ext_function sg_iface_latency;
+static SCM g_iface_latency(SCM ifname_)
+{
+    mutex_lock(&pkt_sources_lock);
+    struct pkt_source *pkt_source = pkt_source_of_scm(ifname_);
+    if (! pkt_source) {
+        mutex_unlock(&pkt_sources_lock);
+        return SCM_UNSPECIFIED;
+    }
+
+    uint64_t parse[NB_LATENCY_BUCKETS], done[NB_LATENCY_BUCKETS];
+    for (unsigned b = 0; b < NB_LATENCY_BUCKETS; b++) {
+        parse[b] = counter_read(pkt_source->parse_latency+b);
+        done[b] = counter_read(pkt_source->done_latency+b);
+    }
+    bool const timed = pkt_source->timed;
+    mutex_unlock(&pkt_sources_lock);
+
+    return scm_list_n(
+        scm_cons(timed_sym,         scm_from_bool(timed)),
+        scm_cons(parse_p50_sym,     scm_from_uint64(latency_percentile(parse, 50))),
+        scm_cons(parse_p99_sym,     scm_from_uint64(latency_percentile(parse, 99))),
+        scm_cons(done_p50_sym,      scm_from_uint64(latency_percentile(done, 50))),
+        scm_cons(done_p99_sym,      scm_from_uint64(latency_percentile(done, 99))),
+        scm_cons(parse_latency_sym, latency_histo_alist(parse)),
+        scm_cons(done_latency_sym,  latency_histo_alist(done)),
+        SCM_UNDEFINED);
+}
+
+static struct ext_function sg_fanout_stats;
+static SCM g_fanout_stats(SCM ifname_)
+{
+    char *ifname = scm_to_tempstr(ifname_);
+    SCM ret = SCM_EOL;
+
+    mutex_lock(&pkt_sources_lock);
+    struct pkt_source *pkt_source;
+    LIST_FOREACH(pkt_source, &pkt_sources, entry) {
+        if (! pkt_source->ring || 0 != strcmp(ifname, pkt_source->name)) continue;
+        ret = scm_cons(
+            scm_cons(scm_from_latin1_string(pkt_source_guile_name(pkt_source)), pkt_source_stats_alist(pkt_source)),
+            ret);
+    }
     mutex_unlock(&pkt_sources_lock);
+
     return ret;
 }
 
@@ -727,6 +1930,22 @@ err:
  * Init
  */
 
+// Sum the kernel counters of all live packet sources (for the shedder)
+static void get_live_stats(uint64_t *recved, uint64_t *dropped)
+{
+    *recved = *dropped = 0;
+    mutex_lock(&pkt_sources_lock);
+    struct pkt_source *pkt_source;
+    LIST_FOREACH(pkt_source, &pkt_sources, entry) {
+        if (pkt_source->is_file) continue;
+        struct pcap_stat stats;
+        if (! pkt_source_stats(pkt_source, &stats)) continue;
+        *recved += stats.ps_recv;
+        *dropped += stats.ps_drop;
+    }
+    mutex_unlock(&pkt_sources_lock);
+}
+
 static struct timeval sniffing_start;
 
 static unsigned inited;
@@ -739,9 +1958,15 @@ void pkt_source_init(void)
     ref_init();
     digest_init();
     bench_init();
+    counter_init();
+    parse_pool_init(parse_frame);
+    pcap_map_init();
+    shedding_init(get_live_stats);
 
     timeval_set_now(&sniffing_start);
     bench_event_ctor(&waiting_for_multi, "parser waiting for multi region");
+    bench_event_ctor(&parsing_frames, "parsing a frame");
+    bench_event_ctor(&flushing_burst, "flushing a burst (per frame)");
 
 #   define IFACE_ALL 255
     global_digests = digest_queue_get(IFACE_ALL);
@@ -751,6 +1976,7 @@ void pkt_source_init(void)
 #   endif
 
     mutex_ctor(&pkt_sources_lock, "pkt_sources");
+    auto_filter_init(auto_filter_changed);
 
     id_sym                = scm_permanent_object(scm_from_latin1_symbol("id"));
     num_packets_sym        = scm_permanent_object(scm_from_latin1_symbol("num-packets"));
@@ -763,8 +1989,23 @@ void pkt_source_init(void)
     num_wire_bytes_sym     = scm_permanent_object(scm_from_latin1_symbol("num-wire-bytes"));
     filep_sym             = scm_permanent_object(scm_from_latin1_symbol("file?"));
     filter_sym            = scm_permanent_object(scm_from_latin1_symbol("filter"));
+    fanout_group_sym      = scm_permanent_object(scm_from_latin1_symbol("fanout-group"));
+    fanout_member_sym     = scm_permanent_object(scm_from_latin1_symbol("fanout-member"));
+    ring_blocks_sym       = scm_permanent_object(scm_from_latin1_symbol("ring-blocks"));
+    ring_freezes_sym      = scm_permanent_object(scm_from_latin1_symbol("ring-freezes"));
+    timed_sym             = scm_permanent_object(scm_from_latin1_symbol("timed"));
+    parse_latency_sym     = scm_permanent_object(scm_from_latin1_symbol("parse-latency"));
+    done_latency_sym      = scm_permanent_object(scm_from_latin1_symbol("done-latency"));
+    parse_p50_sym         = scm_permanent_object(scm_from_latin1_symbol("parse-p50"));
+    parse_p99_sym         = scm_permanent_object(scm_from_latin1_symbol("parse-p99"));
+    done_p50_sym          = scm_permanent_object(scm_from_latin1_symbol("done-p50"));
+    done_p99_sym          = scm_permanent_object(scm_from_latin1_symbol("done-p99"));
 
     ext_param_quit_when_done_init();
+    ext_param_burst_size_init();
+    ext_param_prefetch_distance_init();
+    ext_param_replay_pps_init();
+    ext_param_replay_bps_init();
     ext_param_default_bpf_filter_init();
     log_category_pkt_sources_init();
 
@@ -792,21 +2033,48 @@ void pkt_source_init(void)
         "See also (? 'list-ifaces) to have a list of all openable ifaces,\n"
         "    and (? 'close-iface) to close a given iface\n");
 
+    ext_function_ctor(&sg_open_iface_ring,
+        "open-iface-ring", 1, 5, 0, g_open_iface_ring,
+        "(open-iface-ring \"iface-name\"): open the given iface with 4 AF_PACKET rings (TPACKET_V3), each\n"
+        "    read by its own sniffer thread. The kernel spreads the traffic amongst the rings\n"
+        "    according to a flow hash (PACKET_FANOUT_HASH).\n"
+        "(open-iface-ring \"iface-name\" 8): same as above, with 8 rings and threads.\n"
+        "(open-iface-ring \"iface-name\" 8 #f \"filter\" 90 (* 128 1024 1024)): same as above, without\n"
+        "    setting the iface in promiscuous mode, with the given packet filter, capturing only the\n"
+        "    first 90 bytes of each packet (0 for all bytes) and using rings of 128Mb each (instead of 64Mb).\n"
+        "Each ring is a distinct packet source with the same name (but distinct instance number).\n"
+        "Will return the list of opened packet sources or #f on failure.\n"
+        "See also (? 'open-iface) and (? 'fanout-stats).\n");
+
     ext_function_ctor(&sg_close_iface,
         "close-iface", 1, 0, 0, g_close_iface,
         "(close-iface \"iface-name\"): stop sniffing a previously opened iface.\n"
         "See also (? 'open-iface).\n");
 
     ext_function_ctor(&sg_open_pcap,
-        "open-pcap", 1, 4, 0, g_open_pcap,
+        "open-pcap", 1, 5, 0, g_open_pcap,
         "(open-pcap \"pcap-file\"): read the content of this pcap file, full speed.\n"
         "(open-pcap \"pcap-file\" #t): read this pcap file using its packet rate rather than full speed.\n"
+        "(open-pcap \"pcap-file\" 4): same as above, but 4 times faster (see also (? 'replay-pps) and (? 'replay-bps)).\n"
         "(open-pcap \"pcap-file\" #f \"filter\"): same as above, applying given filter.\n"
         "(open-pcap \"pcap-file\" #f \"filter\" #t): same as above, patching current localtime on every packets.\n"
         "(open-pcap \"pcap-file\" #f \"filter\" #t #t): same as above, looping the pcap.\n"
+        "(open-pcap \"pcap-file\" #f \"filter\" #f #f #t): read this pcap or pcapng file with junkie's own mmapped reader (faster, but not in realtime).\n"
         "Will return #t or #f according to the status of the operation.\n"
         "See also (? 'open-iface)\n");
 
+    ext_function_ctor(&sg_open_pcap_partitioned,
+        "open-pcap-partitioned", 1, 3, 0, g_open_pcap_partitioned,
+        "(open-pcap-partitioned \"pcap-file\"): read this pcap or pcapng file with 4 threads, each of them\n"
+        "    parsing only the flows which hash falls into its partition with a parser tree of its own.\n"
+        "(open-pcap-partitioned \"pcap-file\" 8): same as above, with 8 partitions.\n"
+        "(open-pcap-partitioned \"pcap-file\" 8 \"filter\"): same as above, applying given filter.\n"
+        "(open-pcap-partitioned \"pcap-file\" 8 \"filter\" #t): same as above, looping the pcap.\n"
+        "Returns the list of the opened packet source names, or #f.\n"
+        "Notice that all frames of a flow are parsed in order, but frames from distinct\n"
+        "    partitions are delivered to the plugins concurrently.\n"
+        "See also (? 'open-pcap)\n");
+
     ext_function_ctor(&sg_iface_names,
         "iface-names", 0, 0, 0, g_iface_names,
         "(iface-names): returns the list of currently opened interfaces.\n"
@@ -817,12 +2085,32 @@ void pkt_source_init(void)
         "(iface-stats \"iface-name\"): return detailed statistics about that packet source.\n"
         "Note: all counters are reset after each read.\n"
         "See also (? 'get-ifaces).\n");
+
+    ext_function_ctor(&sg_iface_latency,
+        "iface-latency", 1, 0, 0, g_iface_latency,
+        "(iface-latency \"iface-name\"): return how far behind real time frames from that packet source are processed:\n"
+        "    parse-latency is the histogram of the time between capture and parse start, and done-latency\n"
+        "    of the time between capture and the last subscriber being done with the frame,\n"
+        "    both as an alist of upper bound (in microseconds, powers of 2) to number of frames.\n"
+        "    parse-p50, parse-p99, done-p50 and done-p99 are the corresponding percentiles (bucket upper bounds).\n"
+        "Latencies are measured only for packet sources which timestamps are meaningful (see timed):\n"
+        "    ifaces, and files whose timestamps are patched or that are replayed at their capture rate.\n"
+        "See also (? 'iface-stats).\n");
+
+    ext_function_ctor(&sg_fanout_stats,
+        "fanout-stats", 1, 0, 0, g_fanout_stats,
+        "(fanout-stats \"iface-name\"): return the statistics of all the rings opened on that iface,\n"
+        "    as an alist of packet source names to their iface-stats.\n"
+        "See also (? 'open-iface-ring) and (? 'iface-stats).\n");
 }
 
 void pkt_source_fini(void)
 {
     if (--inited) return;
 
+    auto_filter_fini();
+    shedding_fini();
+
 #   ifdef DELETE_ALL_AT_EXIT
     mutex_lock(&pkt_sources_lock);
     terminating = want_exit = 1;
@@ -858,12 +2146,21 @@ void pkt_source_fini(void)
     digest_queue_unref(&global_digests);
 #   endif   // DELETE_ALL_AT_EXIT
 
+    pcap_map_fini();
+    parse_pool_fini();
+    bench_event_dtor(&flushing_burst);
+    bench_event_dtor(&parsing_frames);
     bench_event_dtor(&waiting_for_multi);
 
     log_category_pkt_sources_fini();
     ext_param_quit_when_done_fini();
+    ext_param_prefetch_distance_fini();
+    ext_param_burst_size_fini();
+    ext_param_replay_pps_fini();
+    ext_param_replay_bps_fini();
     ext_param_default_bpf_filter_fini();
 
+    counter_fini();
     bench_fini();
     digest_fini();
     ref_fini();
@@ -10,8 +10,12 @@
 #include <pthread.h>
 #include "junkie/tools/queue.h"
 #include "junkie/tools/mutex.h"
+#include "junkie/tools/counter.h"
 #include "junkie/proto/proto.h"
 
+/// Latencies are counted in buckets of powers of 2 microseconds: bucket b counts latencies in [2^(b-1), 2^b[
+#define NB_LATENCY_BUCKETS 24
+
 /** A Packet Source is something that gives us packets (with libpcap).
  * So basically it can be either a real interface or a file.
  */
@@ -19,7 +23,9 @@ struct pkt_source {
     LIST_ENTRY(pkt_source) entry;   ///< Entry in the list of all packet sources
     char name[PATH_MAX];            ///< The name to identify this source
     unsigned instance;              ///< If several pkt_source uses the same name (as is frequent), distinguish them with this
-    pcap_t *pcap_handle;            ///< The handle for libpcap
+    pcap_t *pcap_handle;            ///< The handle for libpcap (NULL if ring or map is set)
+    struct pkt_ring *ring;          ///< If set, packets are read from this AF_PACKET ring instead of libpcap
+    struct pcap_map *map;           ///< If set, packets are read from this mmapped file instead of libpcap
     pthread_t sniffer_pth;          ///< The thread sniffing this device or file
     void *(*sniffer_fun)(void *);   ///< The function that's sniffing packet (stored here for convenience)
     uint64_t num_packets;            ///< Number of packets received from PCAP
@@ -31,11 +37,19 @@ struct pkt_source {
     bool is_file;                   ///< A flag to distinguish between files and ifaces
     bool patch_ts;                  ///< If set, all frame timestamps will be overwritten with current time (only valid when is_file)
     bool loop;                      ///< If set, the pcap will be read in a loop (only valid when is_file)
+    double replay_speed;            ///< If not 0, the pcap is replayed following its capture rate accelerated by this factor (only valid when is_file)
     /** A numerical id used to distinguish various interfaces during parsing
         (same underlying interface will have same dev_id, while same pcap files will have distinct dev_id). */
     uint8_t dev_id;
     char *filter;                   ///< Packet filter expression in use for this device (for reference only)
+    char *volatile new_filter;      ///< If set, the sniffer thread will install this filter (then free it)
     struct digest_queue *digests;   ///< Digests queue used for deduplication on this pkt_source
+    struct parser *cap_parser;      ///< If set, frames are parsed by this parser tree of our own rather than by the shared one
+    struct parse_lane *lane;        ///< If set, frames are parsed by the parsing workers instead of the sniffer thread
+    struct cap_merge *merge;        ///< If set, this is a partition of a file (see map) which outputs are merged with the other partitions ones
+    bool timed;                     ///< If set, frame timestamps are comparable to current time and latencies are measured
+    struct counter parse_latency[NB_LATENCY_BUCKETS];  ///< Histogram of the time between capture and parse start
+    struct counter done_latency[NB_LATENCY_BUCKETS];   ///< Histogram of the time between capture and the last subscriber being done
 };
 
 /** Now the frame structure that will be given to the cap parser, since
@@ -45,7 +59,9 @@ struct frame {
     size_t cap_len;     ///< number of bytes captured
     size_t wire_len;    ///< number of bytes on the wire
     struct pkt_source const *pkt_source;  ///< the pkt_source this packet was read from
-    uint8_t /*const*/ *data;    ///< the packet itself (FIXME: fix digest_frame then restore const)
+    uint8_t const *data;    ///< the packet itself
+    struct cap_buf *buf;    ///< the buffer data lies in, if it can be retained past the parse (not a ref)
+    uint64_t rank;          ///< position of the frame in the file (only set if pkt_source->merge)
 };
 
 // Call every interested parties
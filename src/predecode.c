@@ -0,0 +1,261 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2018, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include "junkie/cpp.h"
+#include "junkie/tools/hash.h"
+#include "junkie/tools/miscmacs.h"
+#include "junkie/proto/proto.h"
+#include "pkt_source.h"
+#include "predecode.h"
+
+/*
+ * Decoding
+ */
+
+#define MAX_TUNNEL_DEPTH 2
+
+static uint32_t eth_decode(struct frame_desc *desc, uint8_t const *frame, uint8_t const *packet, size_t cap_len, unsigned depth);
+static uint32_t ip_decode(struct frame_desc *desc, uint8_t const *frame, uint8_t const *packet, size_t cap_len, unsigned depth);
+
+static uint32_t endpoint_hash(uint8_t const *addr, size_t addr_len, uint16_t port)
+{
+    return hashfun(addr, addr_len) + port * 0x9e3779b1U;
+}
+
+static uint32_t gre_decode(struct frame_desc *desc, uint8_t const *frame, uint8_t const *packet, size_t cap_len, unsigned depth)
+{
+    if (cap_len < 4) return 0;
+    uint16_t const flags = READ_U16N(packet);
+    if (flags & 0x7) return 0;  // only GRE version 0
+    size_t head_len = 4;
+    if (flags & 0x8000) head_len += 4;  // checksum
+    if (flags & 0x2000) head_len += 4;  // key
+    if (flags & 0x1000) head_len += 4;  // sequence number
+    if (cap_len < head_len) return 0;
+
+    switch (READ_U16N(packet + 2)) {
+        case 0x0800:
+        case 0x86dd:
+            return ip_decode(desc, frame, packet + head_len, cap_len - head_len, depth);
+        case 0x6558:    // transparent ethernet bridging
+            return eth_decode(desc, frame, packet + head_len, cap_len - head_len, depth);
+    }
+    return 0;
+}
+
+static uint32_t gtp_decode(struct frame_desc *desc, uint8_t const *frame, uint8_t const *packet, size_t cap_len, unsigned depth)
+{
+    if (cap_len < 8) return 0;
+    uint8_t const flags = packet[0];
+    if ((flags >> 5) != 1 || packet[1] != 0xff) return 0;   // only GTPv1 G-PDUs
+    size_t head_len = 8;
+    if (flags & 0x07) {
+        if (cap_len < 12) return 0;
+        if ((flags & 0x04) && packet[11] != 0) return 0;    // we do not bother with extension headers
+        head_len += 4;
+    }
+    return ip_decode(desc, frame, packet + head_len, cap_len - head_len, depth);
+}
+
+static void ip_desc(struct frame_desc *desc, uint8_t const *frame, uint8_t const *packet, uint8_t const *l4, unsigned version, unsigned proto, unsigned depth)
+{
+    desc->l3_offset = packet - frame;
+    desc->l4_offset = l4 ? l4 - frame : 0;
+    desc->ip_version = version;
+    desc->ip_proto = proto;
+    desc->depth = depth;
+    desc->fragment = ! l4;
+}
+
+/* Fills desc only if the IP header is valid, so that when a tunnel payload
+ * cannot be decoded the descriptor of the tunnel itself is kept. */
+static uint32_t ip_decode(struct frame_desc *desc, uint8_t const *frame, uint8_t const *packet, size_t cap_len, unsigned depth)
+{
+    if (cap_len < 1) return 0;
+
+    uint8_t const *src, *dst;
+    size_t addr_len, head_len;
+    unsigned const version = packet[0] >> 4;
+    unsigned proto;
+    bool fragment;
+
+    switch (version) {
+        case 4:
+            if (cap_len < 20) return 0;
+            head_len = (packet[0] & 0xf) * 4;
+            if (head_len < 20 || cap_len < head_len) return 0;
+            proto = packet[9];
+            fragment = READ_U16N(packet + 6) & 0x3fff;  // MF or offset
+            src = packet + 12;
+            dst = packet + 16;
+            addr_len = 4;
+            break;
+        case 6:
+            if (cap_len < 40) return 0;
+            head_len = 40;
+            proto = packet[6];
+            fragment = proto == 44;
+            src = packet + 8;
+            dst = packet + 24;
+            addr_len = 16;
+            break;
+        default:
+            return 0;
+    }
+
+    // All fragments of a packet must have the same hash, so we can't use the ports
+    if (fragment) {
+        ip_desc(desc, frame, packet, NULL, version, proto, depth);
+        return endpoint_hash(src, addr_len, 0) + endpoint_hash(dst, addr_len, 0) + proto;
+    }
+
+    uint8_t const *const l4 = packet + head_len;
+    cap_len -= head_len;
+    uint16_t sport = 0, dport = 0;
+
+    switch (proto) {
+        case 47:    // GRE
+            if (depth < MAX_TUNNEL_DEPTH) {
+                uint32_t const h = gre_decode(desc, frame, l4, cap_len, depth+1);
+                if (h) return h;
+            }
+            break;
+        case 17:    // UDP
+            if (cap_len >= 8 && depth < MAX_TUNNEL_DEPTH) {
+                uint16_t const port_src = READ_U16N(l4), port_dst = READ_U16N(l4 + 2);
+                uint32_t h = 0;
+                if (port_dst == 4789 && cap_len >= 16) {   // VXLAN
+                    h = eth_decode(desc, frame, l4 + 16, cap_len - 16, depth+1);
+                } else if (port_dst == 2152 || port_src == 2152) {  // GTP-U
+                    h = gtp_decode(desc, frame, l4 + 8, cap_len - 8, depth+1);
+                }
+                if (h) return h;
+            }
+            // fall through
+        case 6:     // TCP
+        case 132:   // SCTP
+            if (cap_len >= 4) {
+                sport = READ_U16N(l4);
+                dport = READ_U16N(l4 + 2);
+            }
+            break;
+    }
+
+    ip_desc(desc, frame, packet, l4, version, proto, depth);
+
+    return endpoint_hash(src, addr_len, sport) + endpoint_hash(dst, addr_len, dport) + proto;
+}
+
+static uint32_t eth_decode(struct frame_desc *desc, uint8_t const *frame, uint8_t const *packet, size_t cap_len, unsigned depth)
+{
+    if (cap_len < 14) return 0;
+    size_t head_len = 14;
+    uint16_t type = READ_U16N(packet + 12);
+    for (unsigned v = 0; v < 2 && (type == 0x8100 || type == 0x88a8); v++) { // skip VLAN tags
+        if (cap_len < head_len + 4) return 0;
+        type = READ_U16N(packet + head_len + 2);
+        head_len += 4;
+    }
+
+    if (type != 0x0800 && type != 0x86dd) return 0;
+    return ip_decode(desc, frame, packet + head_len, cap_len - head_len, depth);
+}
+
+struct frame_desc *frame_predecode(struct frame_desc *desc, uint8_t const *packet, size_t cap_len)
+{
+    desc->l3_offset = desc->l4_offset = 0;
+    desc->ip_version = desc->ip_proto = desc->depth = 0;
+    desc->fragment = false;
+
+    uint32_t h = eth_decode(desc, packet, packet, cap_len, 0);
+    // Final mix, since we will use the low bits only
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    desc->flow_hash = h;
+
+    return desc;
+}
+
+void frames_predecode(struct frame_desc *descs, struct frame const *frames, unsigned num_frames)
+{
+    for (unsigned f = 0; f < num_frames; f++) {
+        (void)frame_predecode(descs + f, frames[f].data, frames[f].cap_len);
+    }
+}
+
+uint32_t frame_flow_hash(uint8_t const *packet, size_t cap_len)
+{
+    struct frame_desc desc;
+    return frame_predecode(&desc, packet, cap_len)->flow_hash;
+}
+
+/*
+ * Prefetching
+ *
+ * Each parsing thread remembers, for the flows it parsed recently, the
+ * location of the deepest subparser (and parser) the last frame of that flow
+ * was handed to. These are mere hints that are never dereferenced after the
+ * protected region they were recorded in, since prefetching an address that
+ * was freed since is harmless.
+ */
+
+#define NB_FLOW_MEMOS 256   // per thread (must be a power of 2)
+
+static __thread struct flow_memo {
+    uint32_t flow_hash;
+    void const *subparser;
+    void const *parser;
+} flow_memos[NB_FLOW_MEMOS];
+
+static void prefetch(void const unused_ *addr)
+{
+#   ifdef __GNUC__
+    __builtin_prefetch(addr);
+#   endif
+}
+
+void frame_prefetch(struct frame const *frame, struct frame_desc const *desc)
+{
+    prefetch(frame->data);
+    if (desc->l4_offset) prefetch(frame->data + desc->l4_offset);
+
+    if (! desc->flow_hash) return;
+    struct flow_memo const *memo = flow_memos + (desc->flow_hash & (NB_FLOW_MEMOS - 1));
+    if (memo->flow_hash != desc->flow_hash) return;
+    prefetch(memo->subparser);
+    prefetch(memo->parser);
+}
+
+void frame_parsed(struct frame_desc const *desc)
+{
+    struct mux_subparser const *subparser = mux_subparser_last;
+    if (! subparser) return;
+    mux_subparser_last = NULL;  // so that we do not record it for a frame that does not use it
+    if (! desc->flow_hash) return;
+
+    struct flow_memo *memo = flow_memos + (desc->flow_hash & (NB_FLOW_MEMOS - 1));
+    memo->flow_hash = desc->flow_hash;
+    memo->subparser = subparser;
+    memo->parser = subparser->parser;
+}
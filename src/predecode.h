@@ -0,0 +1,54 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef PREDECODE_H_261018
+#define PREDECODE_H_261018
+#include <stdint.h>
+#include <stddef.h>
+
+/** @file
+ * @brief Decode the L2-L4 headers of frames before they are parsed.
+ *
+ * Before a burst of frames is parsed, each frame Ethernet, IP and transport
+ * headers (looking into GRE, VXLAN and GTP tunnels) are quickly validated and
+ * summarized into a small descriptor, once for all the users of this
+ * information: load shedding and the dispatch of frames to parsing workers
+ * use the flow hash, while the parsing loop uses the descriptors of the
+ * frames to come to prefetch their headers and the state their flow used
+ * last time, so that the parsers do not wait for them.
+ *
+ * Descriptors are only hints: the parsers still decode and validate every
+ * header they are given.
+ */
+
+struct frame;
+
+struct frame_desc {
+    uint32_t flow_hash;     ///< Symmetric hash of the innermost flow, 0 if not IP (see frame_flow_hash())
+    uint16_t l3_offset;     ///< Offset of the innermost IP header in the frame (if ip_version)
+    uint16_t l4_offset;     ///< Offset of the innermost transport header in the frame (0 if none or not in this fragment)
+    uint8_t ip_version;     ///< 4 or 6, or 0 if no IP header was found
+    uint8_t ip_proto;       ///< The innermost IP protocol (if ip_version)
+    uint8_t depth;          ///< How many tunnels were looked through
+    uint8_t fragment:1;     ///< The innermost IP packet is a fragment (so the flow hash does not use the ports)
+};
+
+/// Decode that frame.
+/** @returns desc */
+struct frame_desc *frame_predecode(struct frame_desc *desc, uint8_t const *packet, size_t cap_len);
+
+/// Decode all these frames into descs.
+void frames_predecode(struct frame_desc *descs, struct frame const *frames, unsigned num_frames);
+
+/// Symmetric hash of the flow this frame belongs to (the innermost one for tunneled traffic).
+/** Both directions of a flow (and all fragments of an IP packet) have the same hash.
+ * Non IP frames all hash to 0. */
+uint32_t frame_flow_hash(uint8_t const *packet, size_t cap_len);
+
+/// Prefetch the headers of this frame and whatever its flow used last time it was parsed by this thread.
+void frame_prefetch(struct frame const *, struct frame_desc const *);
+
+/// Remember what this frame used while it was parsed, for frame_prefetch().
+/** Must be called by the thread that just parsed it, in the same protected region. */
+void frame_parsed(struct frame_desc const *);
+
+#endif
@@ -30,6 +30,10 @@
 #include "junkie/proto/eth.h"
 #include "junkie/proto/cap.h"
 #include "junkie/tools/ext.h"
+#include "junkie/tools/mallocer.h"
+#include "junkie/tools/objalloc.h"
+#include "junkie/tools/mutex.h"
+#include "junkie/tools/queue.h"
 #include "pkt_source.h"
 
 #undef LOG_CAT
@@ -41,6 +45,283 @@ bool collapse_ifaces = true;
 EXT_PARAM_RW(collapse_ifaces, "collapse-ifaces", bool, "Set to true if packets from distinct ifaces share the same address range");
 static const uint8_t iface_unset = IFACE_UNSET; // When collapsing devices we use this fake device id
 
+/*
+ * Frame buffers
+ */
+
+size_t cap_buf_tot_size;
+EXT_PARAM_RO(cap_buf_tot_size, "cap-buf-tot-size", size_t, "Total size of the buffers holding captured frames (including those retained by waiting lists)");
+size_t cap_buf_pinned_size;
+EXT_PARAM_RO(cap_buf_pinned_size, "cap-buf-pinned-size", size_t, "Total size of the buffers of captured frames that are kept alive only because waiting lists retained some of their frames (included in cap-buf-tot-size)");
+static size_t cap_buf_max_size = 64 * 1024 * 1024;
+EXT_PARAM_RW(cap_buf_max_size, "cap-buf-max-size", size_t, "Past this total size of frame buffers, waiting lists copy the frames they keep instead of retaining their buffers.");
+
+struct cap_buf *cap_buf_new(size_t size)
+{
+    struct cap_buf *buf = malloc(sizeof(*buf) + size);
+    if (! buf) {
+        SLOG(LOG_ERR, "Cannot alloc a frame buffer of %zu bytes", size);
+        return NULL;
+    }
+    buf->refs = 1;
+    buf->left = false;
+    buf->size = size;
+    (void)__sync_add_and_fetch(&cap_buf_tot_size, size);
+    return buf;
+}
+
+bool cap_buf_resize(struct cap_buf **buf_, size_t size)
+{
+    struct cap_buf *buf = *buf_;
+    assert(buf->refs == 1);
+    buf = realloc(buf, sizeof(*buf) + size);
+    if (! buf) {
+        SLOG(LOG_ERR, "Cannot realloc a frame buffer to %zu bytes", size);
+        return false;
+    }
+    (void)__sync_add_and_fetch(&cap_buf_tot_size, size - buf->size);   // wraps around if we shrink, which is as intended
+    buf->size = size;
+    *buf_ = buf;
+    return true;
+}
+
+struct cap_buf *cap_buf_ref(struct cap_buf *buf)
+{
+    (void)__sync_add_and_fetch(&buf->refs, 1);
+    return buf;
+}
+
+void cap_buf_unref(struct cap_buf **buf_)
+{
+    struct cap_buf *const buf = *buf_;
+    if (! buf) return;
+    *buf_ = NULL;
+    if (0 != __sync_sub_and_fetch(&buf->refs, 1)) return;
+    (void)__sync_sub_and_fetch(&cap_buf_tot_size, buf->size);
+    if (buf->left) (void)__sync_sub_and_fetch(&cap_buf_pinned_size, buf->size);
+    free(buf);
+}
+
+void cap_buf_leave(struct cap_buf **buf_)
+{
+    struct cap_buf *const buf = *buf_;
+    if (! buf) return;
+    // Flag it before we unref, so that whoever frees it last also unaccounts it
+    buf->left = true;
+    (void)__sync_add_and_fetch(&cap_buf_pinned_size, buf->size);
+    cap_buf_unref(buf_);
+}
+
+struct cap_buf *cap_buf_retain(struct proto_info const *info, uint8_t const *packet, size_t len, size_t *pinned)
+{
+    if (! info || overweight || cap_buf_tot_size > cap_buf_max_size) return NULL;
+
+    while (info->parent) info = info->parent;
+    if (info->parser->proto != proto_cap) return NULL;
+    struct cap_proto_info const *cap = DOWNCAST(info, info, cap_proto_info);
+    struct cap_buf *const buf = cap->buf;
+    if (! buf || packet < buf->data || packet + len > buf->data + buf->size) return NULL;
+
+    // We are the first to pin it if the capture layer was its only holder
+    *pinned = 1 == __sync_fetch_and_add(&buf->refs, 1) && ! buf->left ? buf->size : 0;
+    return buf;
+}
+
+/*
+ * Merging partitions outputs
+ */
+
+struct cap_merge_rec {
+    TAILQ_ENTRY(cap_merge_rec) entry;
+    uint64_t rank;              ///< Rank of the frame that was being parsed when this output was deferred
+    cap_merge_emit_fn *emit;
+    void *ctx;
+    struct timeval now;
+    size_t len;
+    uint8_t data[];
+};
+
+struct cap_merge {
+    LIST_ENTRY(cap_merge) entry;    ///< Entry in the list of all merges
+    unsigned refs;
+    struct mutex mutex;             ///< Protects the partitions and pending
+    struct condvar drained;         ///< Signaled when some pending outputs are emitted
+    size_t pending;                 ///< Total size of the pending outputs
+    unsigned num_parts;
+    struct cap_merge_part {
+        TAILQ_HEAD(cap_merge_recs, cap_merge_rec) recs; ///< In rank order, since a partition parses its frames in order
+        uint64_t next_rank;         ///< All frames of lower ranks were parsed
+    } parts[];
+};
+
+static LIST_HEAD(cap_merges, cap_merge) cap_merges = LIST_HEAD_INITIALIZER(cap_merges);
+static struct mutex cap_merges_lock;    ///< Protects cap_merges. Taken before any merge mutex.
+
+static size_t cap_merge_max_pending = 16 * 1024 * 1024;
+EXT_PARAM_RW(cap_merge_max_pending, "cap-merge-max-pending", size_t, "Past this total size of outputs waiting for the slowest partition of a file, the other partitions wait for it to catch up (see open-pcap-partitioned).");
+
+static __thread struct cap_merge *cur_merge;
+static __thread unsigned cur_part;
+static __thread uint64_t cur_rank;
+
+struct cap_merge *cap_merge_new(unsigned num_parts)
+{
+    struct cap_merge *merge = objalloc(sizeof(*merge) + num_parts * sizeof(merge->parts[0]), "cap_merges");
+    if (! merge) return NULL;
+
+    merge->refs = 1;
+    mutex_ctor(&merge->mutex, "cap_merge");
+    condvar_ctor(&merge->drained, "cap_merge drained");
+    merge->pending = 0;
+    merge->num_parts = num_parts;
+    for (unsigned p = 0; p < num_parts; p++) {
+        TAILQ_INIT(&merge->parts[p].recs);
+        merge->parts[p].next_rank = 0;
+    }
+
+    mutex_lock(&cap_merges_lock);
+    LIST_INSERT_HEAD(&cap_merges, merge, entry);
+    mutex_unlock(&cap_merges_lock);
+
+    return merge;
+}
+
+// Emit, in rank order, the pending outputs of ranks below limit (and only those for ctx if it's set). Caller must own merge->mutex.
+static void cap_merge_emit(struct cap_merge *merge, uint64_t limit, void *ctx)
+{
+    size_t const pending = merge->pending;
+    while (1) {
+        struct cap_merge_rec *first = NULL, *rec;
+        unsigned first_part = 0;
+        for (unsigned p = 0; p < merge->num_parts; p++) {
+            TAILQ_FOREACH(rec, &merge->parts[p].recs, entry) {
+                if (! ctx || rec->ctx == ctx) break;
+            }
+            if (! rec || rec->rank >= limit) continue;
+            if (! first || rec->rank < first->rank) {
+                first = rec;
+                first_part = p;
+            }
+        }
+        if (! first) break;
+
+        TAILQ_REMOVE(&merge->parts[first_part].recs, first, entry);
+        first->emit(first->ctx, &first->now, first->data, first->len);
+        assert(merge->pending >= first->len);
+        merge->pending -= first->len;
+        objfree(first);
+    }
+    if (merge->pending < pending) condvar_broadcast(&merge->drained);
+}
+
+// All frames below this rank were parsed by all partitions. Caller must own merge->mutex.
+static uint64_t cap_merge_limit(struct cap_merge const *merge)
+{
+    uint64_t limit = UINT64_MAX;
+    for (unsigned p = 0; p < merge->num_parts; p++) limit = MIN(limit, merge->parts[p].next_rank);
+    return limit;
+}
+
+struct cap_merge *cap_merge_ref(struct cap_merge *merge)
+{
+    (void)__sync_add_and_fetch(&merge->refs, 1);
+    return merge;
+}
+
+void cap_merge_unref(struct cap_merge **merge_)
+{
+    struct cap_merge *const merge = *merge_;
+    if (! merge) return;
+    *merge_ = NULL;
+    if (0 != __sync_sub_and_fetch(&merge->refs, 1)) return;
+
+    mutex_lock(&cap_merges_lock);
+    LIST_REMOVE(merge, entry);
+    mutex_lock(&merge->mutex);
+    cap_merge_emit(merge, UINT64_MAX, NULL);
+    mutex_unlock(&merge->mutex);
+    mutex_unlock(&cap_merges_lock);
+
+    condvar_dtor(&merge->drained);
+    mutex_dtor(&merge->mutex);
+    objfree(merge);
+}
+
+void cap_merge_enter(struct cap_merge *merge, unsigned part, uint64_t rank)
+{
+    assert(part < merge->num_parts);
+    cur_merge = merge;
+    cur_part = part;
+    cur_rank = rank;
+}
+
+void cap_merge_leave(void)
+{
+    cur_merge = NULL;
+}
+
+bool cap_merge_defer(cap_merge_emit_fn *emit, void *ctx, struct timeval const *now, struct iovec const *iov, unsigned iovcnt)
+{
+    struct cap_merge *const merge = cur_merge;
+    if (! merge) return false;
+
+    size_t len = 0;
+    for (unsigned i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+
+    struct cap_merge_rec *rec = objalloc(sizeof(*rec) + len, "cap_merge_recs");
+    if (! rec) return false;    // better out of order than lost
+    rec->rank = cur_rank;
+    rec->emit = emit;
+    rec->ctx = ctx;
+    rec->now = *now;
+    rec->len = 0;
+    for (unsigned i = 0; i < iovcnt; i++) {
+        memcpy(rec->data + rec->len, iov[i].iov_base, iov[i].iov_len);
+        rec->len += iov[i].iov_len;
+    }
+
+    mutex_lock(&merge->mutex);
+    TAILQ_INSERT_TAIL(&merge->parts[cur_part].recs, rec, entry);
+    merge->pending += rec->len;
+    mutex_unlock(&merge->mutex);
+
+    return true;
+}
+
+void cap_merge_advance(struct cap_merge *merge, unsigned part, uint64_t next_rank)
+{
+    assert(part < merge->num_parts);
+
+    mutex_lock(&merge->mutex);
+    merge->parts[part].next_rank = next_rank;
+    cap_merge_emit(merge, cap_merge_limit(merge), NULL);
+    /* Pending outputs all wait for the slowest partition. Rather than piling
+     * up more of them, the leading partitions wait for it to catch up (it
+     * never waits itself, so it does). Finished partitions have nothing more
+     * to pile up. */
+    size_t const max_pending = cap_merge_max_pending;   // No need to lock, any value is as good
+    while (
+        merge->pending > max_pending &&
+        next_rank != UINT64_MAX &&
+        next_rank > cap_merge_limit(merge)
+    ) {
+        condvar_wait(&merge->drained, &merge->mutex);
+    }
+    mutex_unlock(&merge->mutex);
+}
+
+void cap_merge_forget(void *ctx)
+{
+    mutex_lock(&cap_merges_lock);
+    struct cap_merge *merge;
+    LIST_FOREACH(merge, &cap_merges, entry) {
+        mutex_lock(&merge->mutex);
+        cap_merge_emit(merge, UINT64_MAX, ctx);
+        mutex_unlock(&merge->mutex);
+    }
+    mutex_unlock(&cap_merges_lock);
+}
+
 /*
  * Proto Infos
  */
@@ -69,6 +350,7 @@ static void cap_proto_info_ctor(struct cap_proto_info *info, struct parser *pars
 
     info->dev_id = collapse_ifaces ? iface_unset : frame->pkt_source->dev_id;
     info->tv = frame->tv;
+    info->buf = frame->buf;
 }
 
 /*
@@ -117,6 +399,11 @@ void cap_init(void)
 {
     log_category_proto_capture_init();
     ext_param_collapse_ifaces_init();
+    ext_param_cap_buf_tot_size_init();
+    ext_param_cap_buf_pinned_size_init();
+    ext_param_cap_buf_max_size_init();
+    ext_param_cap_merge_max_pending_init();
+    mutex_ctor(&cap_merges_lock, "cap_merges");
 
     static struct proto_ops const ops = {
         .parse       = cap_parse,
@@ -133,6 +420,11 @@ void cap_fini(void)
 #   ifdef DELETE_ALL_AT_EXIT
     mux_proto_dtor(&mux_proto_cap);
 #   endif
+    mutex_dtor(&cap_merges_lock);
+    ext_param_cap_merge_max_pending_fini();
+    ext_param_cap_buf_max_size_fini();
+    ext_param_cap_buf_pinned_size_fini();
+    ext_param_cap_buf_tot_size_fini();
     ext_param_collapse_ifaces_fini();
     log_category_proto_capture_fini();
 }
@@ -141,6 +141,7 @@ static void capfile_dtor(struct capfile *capfile)
 
 static void capfile_del(struct capfile *capfile)
 {
+    cap_merge_forget(capfile);
     capfile_dtor(capfile);
     objfree(capfile);
 }
@@ -195,6 +196,39 @@ static void capfile_may_rotate(struct capfile *capfile, struct timeval const *no
     mutex_unlock(&capfile->lock);
 }
 
+// Append a record to the file
+static int capfile_commit(struct capfile *capfile, struct timeval const *now, struct iovec *iov, unsigned iovcnt)
+{
+    int err = -1;
+    mutex_lock(&capfile->lock);
+
+    if (capfile->fd < 0) goto err;
+    if (0 != file_writev(capfile->fd, iov, iovcnt)) goto err;
+
+    capfile->num_pkts++;
+    for (unsigned i = 0; i < iovcnt; i++) capfile->file_size += iov[i].iov_len;
+
+    capfile_may_rotate(capfile, now);
+
+    err = 0;
+err:
+    mutex_unlock(&capfile->lock);
+    return err;
+}
+
+static void capfile_emit(void *capfile, struct timeval const *now, void const *data, size_t len)
+{
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    (void)capfile_commit(capfile, now, &iov, 1);
+}
+
+// Append a record now, unless we are parsing a partition of a file in which case it will be appended in file order.
+static int capfile_write(struct capfile *capfile, struct timeval const *now, struct iovec *iov, unsigned iovcnt)
+{
+    if (cap_merge_defer(capfile_emit, capfile, now, iov, iovcnt)) return 0;
+    return capfile_commit(capfile, now, iov, iovcnt);
+}
+
 /*
  * PCAP files
  * Note: we do not use libpcap because it requires an activated pcap_t for cap_len, which does not suit our case
@@ -237,12 +271,9 @@ static int write_pcap(struct capfile *capfile, struct proto_info const *info, si
 {
     if (capfile->fd < 0) return -1;
 
-    int err = -1;
     SLOG(LOG_DEBUG, "Add a packet of size %zu into capfile %s", cap_len_, capfile->path);
     ASSIGN_INFO_CHK(cap, info, -1);
 
-    mutex_lock(&capfile->lock);
-
     size_t cap_len = capfile->cap_len ? MIN(cap_len_, capfile->cap_len) : cap_len_;
 
     struct pcap_sf_pkthdr {
@@ -260,17 +291,7 @@ static int write_pcap(struct capfile *capfile, struct proto_info const *info, si
         { .iov_base = &pkthdr,     .iov_len = sizeof(pkthdr), },
         { .iov_base = (void *)pkt, .iov_len = cap_len, },
     };
-    if (0 != file_writev(capfile->fd, iov, NB_ELEMS(iov))) goto err;
-
-    capfile->num_pkts++;
-    capfile->file_size += sizeof(pkthdr) + cap_len;
-
-    capfile_may_rotate(capfile, now);
-
-    err = 0;
-err:
-    mutex_unlock(&capfile->lock);
-    return err;
+    return capfile_write(capfile, now, iov, NB_ELEMS(iov));
 }
 
 struct capfile *capfile_new_pcap(char const *path, unsigned max_pkts, size_t max_size, unsigned max_secs, size_t cap_len, unsigned rotation, struct timeval const *now)
@@ -311,29 +332,17 @@ static int write_csv(struct capfile *capfile, struct proto_info const *info, siz
 {
     if (capfile->fd < 0) return -1;
 
-    int err = -1;
     SLOG(LOG_DEBUG, "Add a packet of size %zu into capfile %s", cap_len_, capfile->path);
     ASSIGN_INFO_CHK(cap, info, -1);
 
-    mutex_lock(&capfile->lock);
-
     char *str = capfile_csv_from_info(info);
     size_t len = strlen(str);
     if (len >= TEMPSTR_SIZE -1) len = TEMPSTR_SIZE -1;
     str[len++] = '\n';
     str[len] = '\0';
 
-    if (0 != file_write(capfile->fd, str, len)) goto err;
-
-    capfile->num_pkts++;
-    capfile->file_size += len;
-
-    capfile_may_rotate(capfile, now);
-
-    err = 0;
-err:
-    mutex_unlock(&capfile->lock);
-    return err;
+    struct iovec iov = { .iov_base = str, .iov_len = len };
+    return capfile_write(capfile, now, &iov, 1);
 }
 
 struct capfile *capfile_new_csv(char const *path, unsigned max_pkts, size_t max_size, unsigned max_secs, size_t cap_len, unsigned rotation, struct timeval const *now)
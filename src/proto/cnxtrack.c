@@ -8,6 +8,7 @@
 #include <junkie/tools/mutex.h>
 #include <junkie/tools/ext.h>
 #include <junkie/tools/log.h>
+#include <junkie/tools/timer_wheel.h>
 #include "junkie/tools/objalloc.h"
 
 #undef LOG_CAT
@@ -15,17 +16,18 @@
 
 LOG_CATEGORY_DEF(cnxtrack);
 
-static TAILQ_HEAD(cnxtrack_ips, cnxtrack_ip) cnxtrack_ips;   // all cnxtrack_ips ordered most recently used first
+static struct timer_wheel cnxtrack_ips_wheel;   // the timers of all cnxtrack_ips
 static HASH_TABLE(cnxtrack_ips_h, cnxtrack_ip) cnxtrack_ips_h;  // the hash of all defined cnxtrack_ips
 
 static int64_t cnxtrack_timeout = 1000000; /* microseconds */
 EXT_PARAM_RW(cnxtrack_timeout, "connection-tracking-timeout", int64, "After how many microseconds an unused tracked connection must be forgotten");
 
 struct ip_addr cnxtrack_ip_addr_unknown;
-struct mutex cnxtracker_lock;   // protects cnxtrack_ips list and hash
+struct mutex cnxtracker_lock;   // protects cnxtrack_ips wheel and hash
+static struct timeval last_seen; // the most recent time a lookup was done at (protected by cnxtracker_lock)
 
 struct cnxtrack_ip {
-    TAILQ_ENTRY(cnxtrack_ip) used_entry; // in the list of cnxtrack_ip ordered by last_used
+    struct timer timer;                 // fires when it may have timeouted
     HASH_ENTRY(cnxtrack_ip) h_entry;    // in the hash list of collisions
     struct cnxtrack_ip_key {
         struct ip_key ip;
@@ -37,6 +39,13 @@ struct cnxtrack_ip {
     struct timeval last_used;
 };
 
+// Caller must own cnxtracker_lock
+static void cnxtrack_ip_arm(struct cnxtrack_ip *ct, time_t now)
+{
+    time_t const expiry = ct->last_used.tv_sec + (MAX(cnxtrack_timeout, 0) + 999999) / 1000000 + 1;
+    timer_arm(&cnxtrack_ips_wheel, &ct->timer, MAX(expiry, now + 1));
+}
+
 static int cnxtrack_ip_ctor(struct cnxtrack_ip *ct, unsigned ip_proto, struct ip_addr const *ip_a, uint16_t port_a, struct ip_addr const *ip_b, uint16_t port_b, bool reuse, struct proto *proto, struct timeval const *now, struct proto *requestor)
 {
     SLOG(LOG_DEBUG, "Construct cnxtrack_ip@%p for proto %u, %s:%"PRIu16"->%s:%"PRIu16" for %s",
@@ -51,9 +60,10 @@ static int cnxtrack_ip_ctor(struct cnxtrack_ip *ct, unsigned ip_proto, struct ip
     ct->requestor = requestor;
     ct->reuse = reuse;
     ct->last_used = *now;
+    timer_ctor(&ct->timer);
 
     mutex_lock(&cnxtracker_lock);
-    TAILQ_INSERT_HEAD(&cnxtrack_ips, ct, used_entry);
+    cnxtrack_ip_arm(ct, now->tv_sec);
     HASH_INSERT(&cnxtrack_ips_h, ct, &ct->key, h_entry);
     mutex_unlock(&cnxtracker_lock);
 
@@ -77,7 +87,7 @@ static void cnxtrack_ip_dtor(struct cnxtrack_ip *ct)
     SLOG(LOG_DEBUG, "Destruct cnxtrack_ip@%p", ct);
 
     HASH_REMOVE(&cnxtrack_ips_h, ct, h_entry);
-    TAILQ_REMOVE(&cnxtrack_ips, ct, used_entry);
+    timer_cancel(&cnxtrack_ips_wheel, &ct->timer);
 }
 
 static void cnxtrack_ip_del_locked(struct cnxtrack_ip *ct)
@@ -98,18 +108,25 @@ void cnxtrack_ip_del(struct cnxtrack_ip *ct)
  */
 
 // Caller must own cnxtracker_lock
-static void cnxtrack_ip_timeout(struct timeval const *now)
+static bool cnxtrack_ip_timeouted(struct cnxtrack_ip const *ct, struct timeval const *now)
 {
-    struct cnxtrack_ip *ct;
-    while (NULL != (ct = TAILQ_LAST(&cnxtrack_ips, cnxtrack_ips))) {
-        if (timeval_sub(now, &ct->last_used) <= cnxtrack_timeout) break;
+    return timeval_sub(now, &ct->last_used) > cnxtrack_timeout;
+}
+
+// Called with cnxtracker_lock locked
+static void cnxtrack_ip_timeout(struct timer_wheel unused_ *wheel, struct timer *timer, time_t now)
+{
+    struct cnxtrack_ip *ct = DOWNCAST(timer, timer, cnxtrack_ip);
+    if (cnxtrack_ip_timeouted(ct, &last_seen)) {
         SLOG(LOG_DEBUG, "Timeouting cnxtrack_ip@%p", ct);
         cnxtrack_ip_del_locked(ct);
+    } else {    // used since
+        cnxtrack_ip_arm(ct, now);
     }
 }
 
 // caller must own cnxtracker_lock
-static struct cnxtrack_ip *ll_lookup(unsigned ip_proto, struct ip_addr const *ip_a, uint16_t port_a, struct ip_addr const *ip_b, uint16_t port_b)
+static struct cnxtrack_ip *ll_lookup(unsigned ip_proto, struct ip_addr const *ip_a, uint16_t port_a, struct ip_addr const *ip_b, uint16_t port_b, struct timeval const *now)
 {
     struct cnxtrack_ip_key key = {
         .ip = {
@@ -122,6 +139,12 @@ static struct cnxtrack_ip *ll_lookup(unsigned ip_proto, struct ip_addr const *ip
     };
     struct cnxtrack_ip *ct;
     HASH_LOOKUP(ct, &cnxtrack_ips_h, &key, key, h_entry);
+    // Its timer may not have fired yet
+    if (ct && cnxtrack_ip_timeouted(ct, now)) {
+        SLOG(LOG_DEBUG, "Timeouting cnxtrack_ip@%p", ct);
+        cnxtrack_ip_del_locked(ct);
+        ct = NULL;
+    }
     return ct;
 }
 
@@ -141,32 +164,31 @@ struct proto *cnxtrack_ip_lookup(unsigned ip_proto, struct ip_addr const *ip_a,
         HASH_TRY_REHASH(&cnxtrack_ips_h, key, h_entry);
     }
 
-    // Clean
-    cnxtrack_ip_timeout(now);
+    timeval_set_max(&last_seen, now);
 
     // Ok, look for an exact match first
     struct cnxtrack_ip *ct;
-    ct = ll_lookup(ip_proto, ip_a, port_a, ip_b, port_b);
+    ct = ll_lookup(ip_proto, ip_a, port_a, ip_b, port_b, now);
     if (ct) goto done;
-    ct = ll_lookup(ip_proto, ip_b, port_b, ip_a, port_a);
+    ct = ll_lookup(ip_proto, ip_b, port_b, ip_a, port_a, now);
     if (ct) goto done;
 
     // Maybe we lacked one IP address?
-    ct = ll_lookup(ip_proto, ip_a, port_a, &cnxtrack_ip_addr_unknown, port_b);
+    ct = ll_lookup(ip_proto, ip_a, port_a, &cnxtrack_ip_addr_unknown, port_b, now);
     if (ct) goto done;
-    ct = ll_lookup(ip_proto, ip_b, port_b, &cnxtrack_ip_addr_unknown, port_a);
+    ct = ll_lookup(ip_proto, ip_b, port_b, &cnxtrack_ip_addr_unknown, port_a, now);
     if (ct) goto done;
 
     // Maybe we lacked one port then?
-    ct = ll_lookup(ip_proto, ip_a, port_a, ip_b, PORT_UNKNOWN);
+    ct = ll_lookup(ip_proto, ip_a, port_a, ip_b, PORT_UNKNOWN, now);
     if (ct) goto done;
-    ct = ll_lookup(ip_proto, ip_b, port_b, ip_a, PORT_UNKNOWN);
+    ct = ll_lookup(ip_proto, ip_b, port_b, ip_a, PORT_UNKNOWN, now);
     if (ct) goto done;
 
     // It's becoming problematic. Maybe we had only one peer then?
-    ct = ll_lookup(ip_proto, ip_a, port_a, &cnxtrack_ip_addr_unknown, PORT_UNKNOWN);
+    ct = ll_lookup(ip_proto, ip_a, port_a, &cnxtrack_ip_addr_unknown, PORT_UNKNOWN, now);
     if (ct) goto done;
-    ct = ll_lookup(ip_proto, ip_b, port_b, &cnxtrack_ip_addr_unknown, PORT_UNKNOWN);
+    ct = ll_lookup(ip_proto, ip_b, port_b, &cnxtrack_ip_addr_unknown, PORT_UNKNOWN, now);
     if (ct) goto done;
 
     // I'm afraid we don't know this stream. so many hash searches for nothing...
@@ -176,10 +198,7 @@ done:
         proto = ct->proto;
         if (requestor) *requestor = ct->requestor;
         if (ct->reuse) {
-            // promote at head of used list
-            TAILQ_REMOVE(&cnxtrack_ips, ct, used_entry);
-            TAILQ_INSERT_HEAD(&cnxtrack_ips, ct, used_entry);
-            // and touch
+            // touch (its timer will be rearmed when it fires)
             ct->last_used = *now;
         } else {
             // delete him
@@ -191,6 +210,19 @@ done:
     return proto;
 }
 
+/*
+ * Timeouter
+ */
+
+static struct timer_ticker cnxtrack_ticker;
+
+static void cnxtrack_tick(struct timer_ticker unused_ *ticker)
+{
+    WITH_LOCK(&cnxtracker_lock) {
+        if (timeval_is_set(&last_seen)) (void)timer_wheel_advance(&cnxtrack_ips_wheel, last_seen.tv_sec);
+    }
+}
+
 /*
  * Init
  */
@@ -204,26 +236,32 @@ void cnxtrack_init(void)
     mutex_init();
     hash_init();
     objalloc_init();
+    timer_wheel_init();
 
     log_category_cnxtrack_init();
     ext_param_cnxtrack_timeout_init();
 
     mutex_ctor(&cnxtracker_lock, "cnxtracker");
     memset(&cnxtrack_ip_addr_unknown, 0, sizeof(cnxtrack_ip_addr_unknown));
-    TAILQ_INIT(&cnxtrack_ips);
+    timeval_reset(&last_seen);
+    timer_wheel_ctor(&cnxtrack_ips_wheel, cnxtrack_ip_timeout);
     HASH_INIT(&cnxtrack_ips_h, 1000 /* initial value of how many cnx we expect to track at a given time */, "Connection Tracking for IP");
+    timer_ticker_ctor(&cnxtrack_ticker, "timeout tracked connections", cnxtrack_tick);
 }
 
 void cnxtrack_fini(void)
 {
     if (--inited) return;
 
+    timer_ticker_dtor(&cnxtrack_ticker);
+
 #   ifdef DELETE_ALL_AT_EXIT
-    struct cnxtrack_ip *ct;
+    struct timer *timer;
     mutex_lock(&cnxtracker_lock);
-    while (NULL != (ct = TAILQ_FIRST(&cnxtrack_ips))) {
-        cnxtrack_ip_del_locked(ct);
+    while (NULL != (timer = timer_wheel_first(&cnxtrack_ips_wheel))) {
+        cnxtrack_ip_del_locked(DOWNCAST(timer, timer, cnxtrack_ip));
     }
+    timer_wheel_dtor(&cnxtrack_ips_wheel);
     mutex_unlock(&cnxtracker_lock);
 
     HASH_DEINIT(&cnxtrack_ips_h);
@@ -234,6 +272,7 @@ void cnxtrack_fini(void)
     ext_param_cnxtrack_timeout_fini();
     log_category_cnxtrack_fini();
 
+    timer_wheel_fini();
     objalloc_fini();
     hash_fini();
     mutex_fini();
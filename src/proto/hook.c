@@ -19,31 +19,88 @@
  */
 #include "junkie/tools/log.h"
 #include "junkie/tools/mutex.h"
+#include "junkie/tools/objalloc.h"
+#include "junkie/tools/ref.h"
 #include "junkie/proto/proto.h"
 
+/*
+ * Published subscribers
+ */
+
+static void hook_subscribers_del(struct hook_subscribers *subs)
+{
+    ref_dtor(&subs->ref);
+    objfree(subs);
+}
+
+static void hook_subscribers_del_by_ref(struct ref *ref)
+{
+    struct hook_subscribers *subs = DOWNCAST(ref, ref, hook_subscribers);
+    hook_subscribers_del(subs);
+}
+
+// Caller must own hook->mutex
+static void hook_publish(struct hook *hook)
+{
+    unsigned num = 0;
+    struct proto_subscriber *sub;
+    LIST_FOREACH(sub, &hook->list, entry) num ++;
+
+    struct hook_subscribers *subs = NULL;
+    if (num > 0) {
+        subs = objalloc(sizeof(*subs) + num * sizeof(subs->subs[0]), "hook subscribers");
+        if (! subs) {
+            SLOG(LOG_ERR, "Cannot allocate the %u subscribers of hook %s, keeping the previous ones", num, hook->name);
+            return;
+        }
+        ref_ctor(&subs->ref, hook_subscribers_del_by_ref);
+        subs->num = 0;
+        LIST_FOREACH(sub, &hook->list, entry) subs->subs[subs->num++] = sub;
+    }
+
+    // Readers must not see the pointer before the content
+#   ifdef __GNUC__
+    __sync_synchronize();
+#   endif
+    struct hook_subscribers *prev = hook->subscribers;
+    hook->subscribers = subs;
+    // Deleted by the doomer once no one can be using it any more
+    if (prev) unref(&prev->ref);
+}
+
+/*
+ * Hooks
+ */
+
 void hook_ctor(struct hook *hook, char const *name)
 {
     SLOG(LOG_DEBUG, "Constructing hook %s", name);
     hook->name = name;
-    LIST_INIT(&hook->subscribers);
-    rwlock_ctor(&hook->lock, name);
+    hook->subscribers = NULL;
+    LIST_INIT(&hook->list);
+    mutex_ctor(&hook->mutex, name);
 }
 
 void hook_dtor(struct hook *hook)
 {
     SLOG(LOG_DEBUG, "Destructing hook %s", hook->name);
-    if (! LIST_EMPTY(&hook->subscribers)) {
+    if (! LIST_EMPTY(&hook->list)) {
         SLOG(LOG_NOTICE, "Some subscribers of hook %s are still registered", hook->name);
     }
-    rwlock_dtor(&hook->lock);
+    if (hook->subscribers) {
+        unref(&hook->subscribers->ref);
+        hook->subscribers = NULL;
+    }
+    mutex_dtor(&hook->mutex);
 }
 
 int hook_subscriber_ctor(struct hook *hook, struct proto_subscriber *sub, proto_cb_t *cb)
 {
     SLOG(LOG_DEBUG, "Construct a new subscriber for %s @%p", hook->name, sub);
     sub->cb = cb;
-    WITH_WRITE_LOCK(&hook->lock) {
-        LIST_INSERT_HEAD(&hook->subscribers, sub, entry);
+    WITH_LOCK(&hook->mutex) {
+        LIST_INSERT_HEAD(&hook->list, sub, entry);
+        hook_publish(hook);
     }
     return 0;
 }
@@ -51,18 +108,25 @@ int hook_subscriber_ctor(struct hook *hook, struct proto_subscriber *sub, proto_
 void hook_subscriber_dtor(struct hook *hook, struct proto_subscriber *sub)
 {
     SLOG(LOG_DEBUG, "Destruct subscriber of %s @%p", hook->name, sub);
-    WITH_WRITE_LOCK(&hook->lock) {
+    WITH_LOCK(&hook->mutex) {
         LIST_REMOVE(sub, entry);
+        hook_publish(hook);
     }
+
+    /* Wait for the threads that may still be calling sub with the former subscribers,
+     * so that the caller can free it once we return. We would wait for ourself if we
+     * were in a protected region, so callbacks must not unsubscribe. */
+    assert(! in_protected_region());
+    enter_mono_region();
+    leave_protected_region();
 }
 
 void hook_subscribers_call(struct hook *hook, struct proto_info *info, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now)
 {
-    WITH_READ_LOCK(&hook->lock) {
-        struct proto_subscriber *sub;
-        LIST_FOREACH(sub, &hook->subscribers, entry) {
-            sub->cb(sub, info, tot_cap_len, tot_packet, now);
-        }
+    struct hook_subscribers const *subs = hook->subscribers;
+    if (! subs) return;
+
+    for (unsigned s = 0; s < subs->num; s++) {
+        subs->subs[s]->cb(subs->subs[s], info, tot_cap_len, tot_packet, now);
     }
 }
-
@@ -248,14 +248,14 @@ struct ip_subparser {
     /* Also, as an additional rule, we must not send fragments to the subparser before the packet is fully
      * reassembled, otherwise the subparser could receive the first fragment of id X then the first fragment
      * of id Y, which make no sense. */
+    /* Since most IP subparsers never see a fragment, the reassemblies are allocated
+     * at their first fragment and freed once reassembled. */
     struct ip_reassembly {
-        uint16_t in_use:1;
-        uint16_t constructed:1;     // always 1 when in_use
         uint16_t got_last:1;        // set when we received the fragment without more_fragments flag
-        uint16_t id;                // only valid when in_use flag is set
+        uint16_t id;
         unsigned end_offset;        // only valid when got_last flag is set
-        struct pkt_wait_list wl;    // only constructed when constructed flag is set
-    } reassembly[4];
+        struct pkt_wait_list wl;
+    } *reassembly[4];               // NULL when unused
     struct mutex *mutex;            // To protect the reassembly machinery
     struct mux_subparser mux_subparser;
 };
@@ -266,9 +266,7 @@ static int ip_subparser_ctor(struct ip_subparser *ip_subparser, struct mux_parse
     CHECK_LAST_FIELD(ip_subparser, mux_subparser, struct mux_subparser);
 
     for (unsigned r = 0; r < NB_ELEMS(ip_subparser->reassembly); r++) {
-        ip_subparser->reassembly[r].in_use = 0;
-        ip_subparser->reassembly[r].constructed = 0;
-        ip_subparser->reassembly[r].got_last = 0;
+        ip_subparser->reassembly[r] = NULL;
     }
 
     ip_subparser->mutex = mutex_pool_anyone(&ip_locks);
@@ -294,14 +292,16 @@ static struct mux_subparser *ip_subparser_new(struct mux_parser *mux_parser, str
     return &ip_subparser->mux_subparser;
 }
 
-static void ip_reassembly_dtor(struct ip_reassembly *reassembly)
+// Destruct and free the reassembly in this slot, if any
+static void ip_reassembly_del(struct ip_subparser *ip_subparser, struct ip_reassembly **reassembly)
 {
-    SLOG(LOG_DEBUG, "Destructing ip_reassembly@%p", reassembly);
-    if (reassembly->constructed) {
-        pkt_wait_list_dtor(&reassembly->wl);
-        reassembly->constructed = 0;
-        reassembly->in_use = 0;
-    }
+    if (! *reassembly) return;
+
+    SLOG(LOG_DEBUG, "Destructing ip_reassembly@%p", *reassembly);
+    pkt_wait_list_dtor(&(*reassembly)->wl);
+    mux_subparser_account(&ip_subparser->mux_subparser, -(ssize_t)sizeof(**reassembly));
+    objfree(*reassembly);
+    *reassembly = NULL;
 }
 
 static void ip_subparser_dtor(struct ip_subparser *ip_subparser)
@@ -309,7 +309,7 @@ static void ip_subparser_dtor(struct ip_subparser *ip_subparser)
     SLOG(LOG_DEBUG, "Destruct an IP mux_subparser @%p", ip_subparser);
 
     for (unsigned r = 0; r < NB_ELEMS(ip_subparser->reassembly); r++) {
-        ip_reassembly_dtor(ip_subparser->reassembly+r);
+        ip_reassembly_del(ip_subparser, ip_subparser->reassembly+r);
     }
     mux_subparser_dtor(&ip_subparser->mux_subparser);
 }
@@ -323,35 +323,35 @@ static void ip_subparser_del(struct mux_subparser *mux_subparser)
 
 static struct pkt_wl_config ip_reassembly_config;
 
-// Really construct the waiting list
-static int ip_reassembly_ctor(struct ip_reassembly *reassembly, struct parser *parser, uint16_t id)
+static struct ip_reassembly *ip_reassembly_new(struct ip_subparser *ip_subparser, struct parser *parser, uint16_t id)
 {
+    struct ip_reassembly *reassembly = objalloc_nice(sizeof(*reassembly), "IP reassemblies");
+    if (! reassembly) return NULL;
     SLOG(LOG_DEBUG, "Constructing ip_reassembly@%p for parser %s", reassembly, parser_name(parser));
-    assert(! reassembly->constructed);
 
-    if (0 != pkt_wait_list_ctor(&reassembly->wl, 0, &ip_reassembly_config, parser, NULL)) return -1;
+    if (0 != pkt_wait_list_ctor(&reassembly->wl, 0, &ip_reassembly_config, parser, NULL)) {
+        objfree(reassembly);
+        return NULL;
+    }
     reassembly->id = id;
     reassembly->got_last = 0;
-    reassembly->constructed = 1;
-    reassembly->in_use = 1;
+    mux_subparser_account(&ip_subparser->mux_subparser, sizeof(*reassembly));
 
-    return 0;
+    return reassembly;
 }
 
-static struct ip_reassembly *ip_reassembly_lookup(struct ip_subparser *ip_subparser, uint16_t id, struct parser *parser)
+// @returns the slot of the reassembly for this id (creating it if needed), or NULL
+static struct ip_reassembly **ip_reassembly_lookup(struct ip_subparser *ip_subparser, uint16_t id, struct parser *parser)
 {
     SLOG(LOG_DEBUG, "Looking for ip_reassembly for id=%"PRIu16" for subparser %s", id, parser_name(parser));
 
     int last_unused = -1;
     for (unsigned r = 0; r < NB_ELEMS(ip_subparser->reassembly); r++) {
-        struct ip_reassembly *const reassembly = ip_subparser->reassembly + r;
-        if (reassembly->in_use) {
+        struct ip_reassembly *const reassembly = ip_subparser->reassembly[r];
+        if (reassembly) {
             if (reassembly->id != id) continue;
             SLOG(LOG_DEBUG, "Found id at index %u in ip_reassembly@%p", r, reassembly);
-            if (! reassembly->constructed) {
-                if (0 != ip_reassembly_ctor(reassembly, parser, id)) return NULL;
-            }
-            return reassembly;
+            return ip_subparser->reassembly + r;
         } else {
             last_unused = r;
         }
@@ -360,13 +360,13 @@ static struct ip_reassembly *ip_reassembly_lookup(struct ip_subparser *ip_subpar
     if (last_unused == -1) {
         last_unused = 0;    // a "random" value would be better
         SLOG(LOG_DEBUG, "No slot left on ip_reassembly, reusing slot at index %u", last_unused);
-        ip_reassembly_dtor(ip_subparser->reassembly + last_unused);
+        ip_reassembly_del(ip_subparser, ip_subparser->reassembly + last_unused);
     }
 
-    struct ip_reassembly *const reassembly = ip_subparser->reassembly + last_unused;
-    assert(! reassembly->in_use);
-    if (0 != ip_reassembly_ctor(reassembly, parser, id)) return NULL;
-    return reassembly;
+    struct ip_reassembly **const slot = ip_subparser->reassembly + last_unused;
+    assert(! *slot);
+    *slot = ip_reassembly_new(ip_subparser, parser, id);
+    return *slot ? slot : NULL;
 }
 
 unsigned ip_key_ctor(struct ip_key *k, unsigned protocol, struct ip_addr const *src, struct ip_addr const *dst)
@@ -396,8 +396,9 @@ struct mux_subparser *ip_subparser_lookup(struct parser *parser, struct proto *p
  * But we also want to acknoledge the several IP fragments that were received (but the
  * first one that count for the whole payload), so we also must call subscribers for
  * each IP info. The pkt_wait_list_dtor will do this for us. */
-static enum proto_parse_status reassemble(struct ip_reassembly *reassembly)
+static enum proto_parse_status reassemble(struct ip_subparser *ip_subparser, struct ip_reassembly **slot)
 {
+    struct ip_reassembly *const reassembly = *slot;
     SLOG(LOG_DEBUG, "Reassembling ip_reassembly@%p", reassembly);
 
     /* FIXME: reassembled packet does not lie inside tot_packet, which is a problem if we use another pkt_wait_list in the subparser.
@@ -406,7 +407,7 @@ static enum proto_parse_status reassemble(struct ip_reassembly *reassembly)
     uint8_t *payload = pkt_wait_list_reassemble(&reassembly->wl, 0, reassembly->end_offset);
     enum proto_parse_status status = pkt_wait_list_flush(&reassembly->wl, payload, reassembly->end_offset, reassembly->end_offset);
     if (payload) objfree(payload);
-    ip_reassembly_dtor(reassembly);
+    ip_reassembly_del(ip_subparser, slot);
     return status;
 }
 
@@ -479,9 +480,9 @@ enum proto_parse_status ip_parse(struct parser *parser, struct proto_info *paren
         unsigned const offset = fragment_offset(iphdr);
         uint16_t id = READ_U16N(&iphdr->id);
         SLOG(LOG_DEBUG, "IP packet is a fragment of id %"PRIu16", offset=%u", id, offset);
-        struct ip_reassembly *reassembly = ip_reassembly_lookup(ip_subparser, id, subparser->parser);
-        if (! reassembly) goto unlock_fallback;
-        assert(reassembly->in_use && reassembly->constructed);
+        struct ip_reassembly **const slot = ip_reassembly_lookup(ip_subparser, id, subparser->parser);
+        if (! slot) goto unlock_fallback;
+        struct ip_reassembly *const reassembly = *slot;
         if (! (READ_U8(&iphdr->flags) & IP_MORE_FRAGS_MASK)) {
             reassembly->got_last = 1;
             reassembly->end_offset = offset + payload;
@@ -491,7 +492,7 @@ enum proto_parse_status ip_parse(struct parser *parser, struct proto_info *paren
             goto unlock_fallback;  // should not happen
         }
         if (reassembly->got_last && pkt_wait_list_is_complete(&reassembly->wl, 0, reassembly->end_offset)) {
-            status = reassemble(reassembly);
+            status = reassemble(ip_subparser, slot);
         } else {
             status = PROTO_OK;  // for now
         }
@@ -26,6 +26,7 @@
 #include "junkie/tools/mallocer.h"  // for overweight
 #include "junkie/tools/bench.h"
 #include "junkie/proto/pkt_wait_list.h"
+#include "junkie/proto/cap.h"
 
 #undef LOG_CAT
 #define LOG_CAT pkt_wait_list_log_category
@@ -91,6 +92,8 @@ static void pkt_wait_dtor(struct pkt_wait *pkt, struct pkt_wait_list *pkt_wl)
         proto_info_del_rec(pkt->parent);
         pkt->parent = NULL;
     }
+
+    cap_buf_unref(&pkt->buf);
 }
 
 // caller must own list->mutex
@@ -174,10 +177,11 @@ static enum proto_parse_status pkt_wait_finalize(struct pkt_wait *pkt, struct pk
  */
 
 // Construct it but does not insert it into the pkt_wait list yet
-static int pkt_wait_ctor(struct pkt_wait *pkt, unsigned offset, unsigned next_offset, bool sync, unsigned sync_offset, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now)
+// If buf is set then tot_packet lies within it and we steal this ref, otherwise we copy tot_packet.
+static int pkt_wait_ctor(struct pkt_wait *pkt, unsigned offset, unsigned next_offset, bool sync, unsigned sync_offset, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now, struct cap_buf *buf)
 {
     SLOG(LOG_DEBUG, "Construct pkt@%p", pkt);
-    CHECK_LAST_FIELD(pkt_wait, packet, uint8_t);
+    CHECK_LAST_FIELD(pkt_wait, copy, uint8_t);
 
     pkt->offset = offset;
     pkt->next_offset = next_offset;
@@ -188,6 +192,8 @@ static int pkt_wait_ctor(struct pkt_wait *pkt, unsigned offset, unsigned next_of
     pkt->way = way;
     pkt->tot_cap_len = tot_cap_len;
     pkt->cap_tv = *now;
+    pkt->buf = buf;
+    pkt->parent = NULL;
     if (packet < tot_packet || packet + cap_len > tot_packet + tot_cap_len) {
         // FIXME: May happen since packet does not always lies within tot_packet (see pkt_wait_list_reassemble)
         return -1;
@@ -198,28 +204,46 @@ static int pkt_wait_ctor(struct pkt_wait *pkt, unsigned offset, unsigned next_of
     assert(pkt->wire_len >= pkt->cap_len);
 
     // We save the original packet, assuming packet points within it.
-    memcpy(pkt->packet, tot_packet, tot_cap_len);
+    if (buf) {
+        pkt->packet = tot_packet;
+    } else {
+        memcpy(pkt->copy, tot_packet, tot_cap_len);
+        pkt->packet = pkt->copy;
+    }
 
     if (parent) {
         pkt->parent = copy_info_rec(parent);
         if (! pkt->parent) return -1;
-    } else {
-        pkt->parent = NULL;
+        /* The capture info of our copy must not point to a buffer we do not hold,
+         * since this info will be parsed again (maybe by another thread, or after the frame buffer was reused) */
+        struct proto_info *root = pkt->parent;
+        while (root->parent) root = root->parent;
+        if (root->parser->proto == proto_cap) DOWNCAST(root, info, cap_proto_info)->buf = buf;
     }
 
     return 0;
 }
 
-static struct pkt_wait *pkt_wait_new(unsigned offset, unsigned next_offset, bool sync, unsigned sync_offset, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now)
+static struct pkt_wait *pkt_wait_new(struct pkt_wl_config *config, unsigned offset, unsigned next_offset, bool sync, unsigned sync_offset, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now)
 {
-    struct pkt_wait *pkt = objalloc(sizeof(*pkt) + tot_cap_len, "pkt_waits");
-    if (! pkt) return NULL;
+    // Rather than copying the packet, retain the buffer it's in if we can
+    size_t pinned = 0;
+    struct cap_buf *buf = cap_buf_retain(parent, tot_packet, tot_cap_len, &pinned);
+
+    struct pkt_wait *pkt = objalloc(sizeof(*pkt) + (buf ? 0 : tot_cap_len), "pkt_waits");
+    if (! pkt) {
+        cap_buf_unref(&buf);
+        return NULL;
+    }
 
-    if (0 != pkt_wait_ctor(pkt, offset, next_offset, sync, sync_offset, parent, way, packet, cap_len, wire_len, tot_cap_len, tot_packet, now)) {
+    if (0 != pkt_wait_ctor(pkt, offset, next_offset, sync, sync_offset, parent, way, packet, cap_len, wire_len, tot_cap_len, tot_packet, now, buf)) {
+        cap_buf_unref(&pkt->buf);
         objfree(pkt);
         return NULL;
     }
 
+    counter_add(buf ? &config->bytes_referenced : &config->bytes_copied, tot_cap_len);
+    if (pinned) counter_add(&config->bytes_pinned, pinned);
     return pkt;
 }
 
@@ -230,45 +254,54 @@ static struct pkt_wait *pkt_wait_new(unsigned offset, unsigned next_offset, bool
 static SLIST_HEAD(pkt_wl_configs, pkt_wl_config) pkt_wl_configs = SLIST_HEAD_INITIALIZER(pkt_wls_configs);
 static struct mutex pkt_wl_configs_mutex;
 
-static struct bench_event timeouting_wl;
+static struct timer_ticker wl_ticker;
 
-// Timeouter thread (one per wl_config)
-static void *pkt_wl_config_timeouter_thread_(void *config_)
+static void pkt_wait_list_arm(struct pkt_wait_list *pkt_wl, time_t since, time_t now)
 {
-    struct pkt_wl_config *config = config_;
+    time_t const expiry = since + pkt_wl->config->timeout + 1;
+    timer_arm(&pkt_wl->list->wheel, &pkt_wl->timer, MAX(expiry, now + 1));
+}
 
-    set_thread_name(tempstr_printf("J-TO-%s", config->name));
-    disable_cancel();
+// Called with list->mutex locked, when the oldest pending packet of this WL may have timeouted
+static void pkt_wait_list_timeout(struct timer_wheel *wheel, struct timer *timer, time_t now)
+{
+    struct pkt_wl_config_list *list = DOWNCAST(wheel, wheel, pkt_wl_config_list);
+    struct pkt_wait_list *wl = DOWNCAST(timer, timer, pkt_wait_list);
 
-    while (1) {
-        enter_mono_region();
-        uint64_t start = bench_event_start();
-        for (unsigned h = 0; h < NB_ELEMS(config->lists); h++) {
-            struct pkt_wl_config_list *list = config->lists + h;
-            if (! timeval_is_set(&list->last_used)) break;
-            if (0 == supermutex_lock(&list->mutex)) {
-                struct pkt_wait_list *wl;
-                // Timeout only next_to
-                LIST_FOREACH(wl, &list->list[config->next_to], entry) {
-                    enum proto_parse_status status;
-                    (void)pkt_wait_list_try_both(wl, &status, &list->last_used, overweight);
+    enum proto_parse_status status;
+    (void)pkt_wait_list_try_both(wl, &status, &list->last_used, overweight);
+
+    // Wait for the next one to timeout, if any
+    struct pkt_wait *const pkt = LIST_FIRST(&wl->pkts);
+    if (pkt && wl->config->timeout > 0) pkt_wait_list_arm(wl, pkt->cap_tv.tv_sec, now);
+}
+
+// Advance the wheels of all configs to the last time they were used
+static void pkt_wait_list_tick(struct timer_ticker unused_ *ticker)
+{
+    WITH_LOCK(&pkt_wl_configs_mutex) {
+        struct pkt_wl_config *config;
+        SLIST_FOREACH(config, &pkt_wl_configs, entry) {
+            if (! config->timeout) continue;
+            /* Timeouting parses the pending packets, which (like any parse) must be done from
+             * within a protected region, but the list mutex is enough to keep the parsers off
+             * these lists meanwhile, so we do not need to stop them. */
+            enter_multi_region();
+            for (unsigned h = 0; h < NB_ELEMS(config->lists); h++) {
+                struct pkt_wl_config_list *list = config->lists + h;
+                if (! timeval_is_set(&list->last_used)) break;  // lists are used in order
+                if (0 == supermutex_lock(&list->mutex)) {
+                    if (overweight) {
+                        (void)timer_wheel_flush(&list->wheel, list->last_used.tv_sec);
+                    } else {
+                        (void)timer_wheel_advance(&list->wheel, list->last_used.tv_sec);
+                    }
+                    supermutex_unlock(&list->mutex);
                 }
-                supermutex_unlock(&list->mutex);
             }
+            leave_protected_region();
         }
-        config->next_to = (config->next_to + 1) % NB_ELEMS(config->lists[0].list);
-        bench_event_stop(&timeouting_wl, start);
-        leave_protected_region();
-
-        // Wait
-        cancellable_sleep(1);
     }
-    return NULL;
-}
-
-static void *pkt_wl_config_timeouter_thread(void *config_)
-{
-    return scm_with_guile(pkt_wl_config_timeouter_thread_, config_);
 }
 
 // caller must own list->mutex
@@ -328,9 +361,7 @@ int pkt_wait_list_ctor(struct pkt_wait_list *pkt_wl, unsigned next_offset, struc
     pkt_wl->sync_with = sync_with;
     pkt_wl->list = config->lists + (config->list_seqnum % NB_ELEMS(config->lists));
     config->list_seqnum ++; // No need for atomicity for this usage
-    if (0 != supermutex_lock(&pkt_wl->list->mutex)) return -1;
-    LIST_INSERT_HEAD(&pkt_wl->list->list[config->next_to], pkt_wl, entry); // construct on the next to timeout list
-    supermutex_unlock(&pkt_wl->list->mutex);
+    timer_ctor(&pkt_wl->timer); // armed when a packet is enqueued
 
     return 0;
 }
@@ -351,7 +382,7 @@ void pkt_wait_list_dtor(struct pkt_wait_list *pkt_wl)
     // In case there's something left we couldn't parse (for instance if the parser returned PROTO_PARSE_ERR) then call the callback for each pending packet
     pkt_wait_list_empty(pkt_wl);
 
-    LIST_REMOVE(pkt_wl, entry);
+    timer_cancel(&pkt_wl->list->wheel, &pkt_wl->timer);
     pkt_wl->list = NULL;
     supermutex_unlock(mutex);
 }
@@ -365,27 +396,17 @@ void pkt_wl_config_ctor(struct pkt_wl_config *config, char const *name, unsigned
     config->timeout = timeout;
     config->allow_partial = allow_partial;
     config->list_seqnum = 0;
+    counter_ctor(&config->bytes_copied);
+    counter_ctor(&config->bytes_referenced);
+    counter_ctor(&config->bytes_pinned);
 #   ifndef __GNUC__
     mutex_ctor(&config->atomic, "pkt_wl_config");
 #   endif
 
     for (unsigned l = 0; l < NB_ELEMS(config->lists); l++) {
-        for (unsigned i = 0; i < NB_ELEMS(config->lists[0].list); i++) {
-            LIST_INIT(&config->lists[l].list[i]);
-        }
+        timer_wheel_ctor(&config->lists[l].wheel, pkt_wait_list_timeout);
         supermutex_ctor(&config->lists[l].mutex, "pkt wl config");
     }
-    config->next_to = 0;
-
-    config->has_timeouter = false;
-    if (config->timeout > 0) {
-        int err = pthread_create(&config->timeouter_pth, NULL, pkt_wl_config_timeouter_thread, config);
-        if (! err) {
-            config->has_timeouter = true;
-        } else {
-            SLOG(LOG_ERR, "Cannot pthread_create(): %s", strerror(err));
-        }
-    }
 
     mutex_lock(&pkt_wl_configs_mutex);
     SLIST_INSERT_HEAD(&pkt_wl_configs, config, entry);
@@ -398,26 +419,21 @@ void pkt_wl_config_dtor(struct pkt_wl_config *config)
     SLIST_REMOVE(&pkt_wl_configs, config, pkt_wl_config, entry);
     mutex_unlock(&pkt_wl_configs_mutex);
 
-    // Kill timeouter thread
-    if (config->has_timeouter) {
-        SLOG(LOG_DEBUG, "Terminating timeouter thread for %s waiting lists...", config->name);
-        (void)pthread_cancel(config->timeouter_pth);
-        (void)pthread_join(config->timeouter_pth, NULL);
-    }
-
     for (unsigned l = 0; l < NB_ELEMS(config->lists); l++) {
-        for (unsigned i = 0; i < NB_ELEMS(config->lists[l].list); i++) {
-            if (! LIST_EMPTY(&config->lists[l].list[i])) {
-                /* We cannot destruct the pkt_wait_lists since this may trigger the deletion of the parser
-                 * still owning it, which would then certainly also destruct the list.
-                 * Emptying the list would have the same result, ie deleting this list (and
-                 * probably others as well) while we are scanning the list. So be it. */
-                SLOG(LOG_INFO, "Packet waiting list config@%p is not empty!", config);
-            }
+        if (config->lists[l].wheel.num_timers > 0) {
+            /* We cannot destruct the pkt_wait_lists since this may trigger the deletion of the parser
+             * still owning it, which would then certainly also destruct the list.
+             * Firing their timers would have the same result, ie deleting this list (and
+             * probably others as well) while we are scanning the wheel. So be it. */
+            SLOG(LOG_INFO, "Packet waiting list config@%p is not empty!", config);
         }
+        timer_wheel_dtor(&config->lists[l].wheel);
         supermutex_dtor(&config->lists[l].mutex);
     }
 
+    counter_dtor(&config->bytes_pinned);
+    counter_dtor(&config->bytes_referenced);
+    counter_dtor(&config->bytes_copied);
 #   ifndef __GNUC__
     mutex_dtor(&config->atomic);
 #   endif
@@ -527,7 +543,7 @@ enum proto_parse_status pkt_wait_list_add(struct pkt_wait_list *pkt_wl, unsigned
     }
 
     // In all other more complex cases, insert the packet
-    struct pkt_wait *pkt = pkt_wait_new(offset, next_offset, sync, sync_offset, parent, way, packet, cap_len, wire_len, tot_cap_len, tot_packet, now);
+    struct pkt_wait *pkt = pkt_wait_new(pkt_wl->config, offset, next_offset, sync, sync_offset, parent, way, packet, cap_len, wire_len, tot_cap_len, tot_packet, now);
     if (! pkt) {
         ret = proto_parse_or_die(NULL, parent, way, NULL, 0, 0, now, tot_cap_len, tot_packet); // silently discard
         goto quit;
@@ -538,6 +554,9 @@ enum proto_parse_status pkt_wait_list_add(struct pkt_wait_list *pkt_wl, unsigned
     } else {
         LIST_INSERT_HEAD(&pkt_wl->pkts, pkt, entry);
     }
+    if (pkt_wl->config->timeout > 0 && ! timer_is_armed(&pkt_wl->timer)) {
+        pkt_wait_list_arm(pkt_wl, pkt->cap_tv.tv_sec, pkt_wl->list->wheel.now);
+    }
     pkt_wl->num_pkts ++;
     pkt_wl->tot_payload += pkt->cap_len;
 
@@ -707,6 +726,9 @@ static SCM timeout_sym;
 static SCM max_payload_sym;
 static SCM max_packets_sym;
 static SCM acceptable_gap_sym;
+static SCM bytes_copied_sym;
+static SCM bytes_referenced_sym;
+static SCM bytes_pinned_sym;
 
 static struct ext_function sg_wait_list_stats;
 static SCM g_wait_list_stats(SCM name_)
@@ -714,11 +736,15 @@ static SCM g_wait_list_stats(SCM name_)
     struct pkt_wl_config *config = pkt_wl_config_of_scm_name(name_);
     if (! config) return SCM_UNSPECIFIED;
 
-    return scm_list_4(
-        scm_cons(timeout_sym,        scm_from_uint(config->timeout)),
-        scm_cons(max_payload_sym,    scm_from_size_t(config->payload_max)),
-        scm_cons(max_packets_sym,    scm_from_uint(config->num_pkts_max)),
-        scm_cons(acceptable_gap_sym, scm_from_uint(config->acceptable_gap)));
+    return scm_list_n(
+        scm_cons(timeout_sym,          scm_from_uint(config->timeout)),
+        scm_cons(max_payload_sym,      scm_from_size_t(config->payload_max)),
+        scm_cons(max_packets_sym,      scm_from_uint(config->num_pkts_max)),
+        scm_cons(acceptable_gap_sym,   scm_from_uint(config->acceptable_gap)),
+        scm_cons(bytes_copied_sym,     scm_from_uint64(counter_read(&config->bytes_copied))),
+        scm_cons(bytes_referenced_sym, scm_from_uint64(counter_read(&config->bytes_referenced))),
+        scm_cons(bytes_pinned_sym,     scm_from_uint64(counter_read(&config->bytes_pinned))),
+        SCM_UNDEFINED);
 }
 
 static struct ext_function sg_wait_list_set_max_payload;
@@ -760,15 +786,19 @@ static SCM g_wait_list_set_timeout(SCM name_, SCM timeout_)
 void pkt_wait_list_init(void)
 {
     bench_init();
+    timer_wheel_init();
 
     log_category_pkt_wait_list_init();
     mutex_ctor(&pkt_wl_configs_mutex, "pkt_wls_list");
-    bench_event_ctor(&timeouting_wl, "timeout waiting lists");
+    timer_ticker_ctor(&wl_ticker, "timeout waiting lists", pkt_wait_list_tick);
 
     timeout_sym        = scm_permanent_object(scm_from_latin1_symbol("timeout"));
     max_payload_sym    = scm_permanent_object(scm_from_latin1_symbol("max-payload"));
     max_packets_sym    = scm_permanent_object(scm_from_latin1_symbol("max-packets"));
     acceptable_gap_sym = scm_permanent_object(scm_from_latin1_symbol("acceptable-gap"));
+    bytes_copied_sym   = scm_permanent_object(scm_from_latin1_symbol("bytes-copied"));
+    bytes_referenced_sym = scm_permanent_object(scm_from_latin1_symbol("bytes-referenced"));
+    bytes_pinned_sym   = scm_permanent_object(scm_from_latin1_symbol("bytes-pinned"));
 
     ext_function_ctor(&sg_wait_list_names,
         "wait-list-names", 0, 0, 0, g_wait_list_names,
@@ -801,10 +831,11 @@ void pkt_wait_list_init(void)
 
 void pkt_wait_list_fini(void)
 {
-    bench_event_dtor(&timeouting_wl);
+    timer_ticker_dtor(&wl_ticker);
     log_category_pkt_wait_list_fini();
 #   ifdef DELETE_ALL_AT_EXIT
     mutex_dtor(&pkt_wl_configs_mutex);
 #   endif
+    timer_wheel_fini();
     bench_fini();
 }
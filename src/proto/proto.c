@@ -17,6 +17,7 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <stdlib.h>
 #include <stdio.h>
 #include <inttypes.h>
 #include <assert.h>
@@ -41,6 +42,15 @@ EXT_PARAM_RW(mux_timeout, "mux-timeout", uint, "After how many seconds an unused
 static unsigned denied_parsers;
 EXT_PARAM_RW(denied_parsers, "denied-parsers", uint, "How many parsers couldn't be created because we were overweight.");
 
+static unsigned mux_grow_collisions = 100;
+EXT_PARAM_RW(mux_grow_collisions, "mux-grow-collisions", uint, "Multiplexer hashes grow when their lookups meet more than this many collisions per hundred lookups (0 to never grow).")
+
+static unsigned mux_max_hash_size = 1U << 20;
+EXT_PARAM_RW(mux_max_hash_size, "mux-max-hash-size", uint, "Multiplexer hashes do not grow beyond this many buckets.")
+
+static bool mux_flow_cache = true;
+EXT_PARAM_RW(mux_flow_cache, "mux-flow-cache", bool, "Should each parsing thread remember the subparsers of the flows it met recently, so that it does not look them up in every multiplexer hash for every packet.")
+
 #undef LOG_CAT
 #define LOG_CAT proto_log_category
 
@@ -65,8 +75,8 @@ void proto_ctor(struct proto *proto, struct proto_ops const *ops, char const *na
     proto->name = name;
     proto->enabled = true;
     proto->code = code;
-    proto->num_frames = 0;
-    proto->num_bytes = 0;
+    counter_ctor(&proto->num_frames);
+    counter_ctor(&proto->num_bytes);
     proto->fuzzed_times = 0;
     proto->num_parsers = 0;
     hook_ctor(&proto->hook, name);
@@ -114,6 +124,8 @@ void proto_dtor(struct proto *proto)
     }
 
     bench_event_dtor(&proto->parsing);
+    counter_dtor(&proto->num_bytes);
+    counter_dtor(&proto->num_frames);
 
     LIST_REMOVE(proto, entry);
     mutex_dtor(&proto->lock);
@@ -162,18 +174,11 @@ enum proto_parse_status proto_parse(struct parser *parser, struct proto_info *pa
 
     if (! go_deeper) return PROTO_OK;
 
-#   ifdef __GNUC__
-    (void)__sync_add_and_fetch(&parser->proto->num_frames, 1);
-    (void)__sync_add_and_fetch(&parser->proto->num_bytes, wire_len);
-#   else
-    mutex_lock(&parser->proto->lock);
-    parser->proto->num_frames ++;
-    parser->proto->num_bytes += wire_len;
-    mutex_unlock(&parser->proto->lock);
-#   endif
+    counter_inc(&parser->proto->num_frames);
+    counter_add(&parser->proto->num_bytes, wire_len);
 
-    SLOG(LOG_DEBUG, "Parse packet @%p, size %zu (%zu captured), #%"PRIu64" for %s",
-        packet, wire_len, cap_len, parser->proto->num_frames, parser_name(parser));
+    SLOG(LOG_DEBUG, "Parse packet @%p, size %zu (%zu captured) for %s",
+        packet, wire_len, cap_len, parser_name(parser));
 
     if (unlikely_(num_fuzzed_bits > 0)) fuzz(parser, packet, cap_len, num_fuzzed_bits);
 
@@ -209,12 +214,15 @@ void proto_subscribers_call(struct proto *proto, struct proto_info *info, size_t
     }
     info->proto_sbc_called = true;
 
+    if (! hook_has_subscribers(&proto->hook)) return;  // most protos have none
     hook_subscribers_call(&proto->hook, info, tot_cap_len, tot_packet, now);
 }
 
 // same as normal hook_subscribers_call but ensure we call it no more than once per packet
 void full_pkt_subscribers_call(struct proto_info *info, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now)
 {
+    if (! hook_has_subscribers(&pkt_hook)) return;
+
     // look for last proto_info with pkt_sbc_called, flaging all proto_infos along the way so that next lookups will be faster
     struct proto_info *info_ = info;
     while (info_->parent && !info_->pkt_sbc_called) {
@@ -389,7 +397,16 @@ char const *mux_subparser_name(struct mux_subparser const *subparser)
 
 static struct subparsers *h_list_of_h_idx(struct mux_parser *mux_parser, unsigned h_idx)
 {
-    return mux_parser->subparsers + h_idx;
+    if (h_idx < mux_parser->hash_size) return mux_parser->subparsers + h_idx;
+
+    // Segment s holds the buckets from hash_size << s to hash_size << (s+1)
+    unsigned s = 0, seg_start = mux_parser->hash_size;
+    while (h_idx - seg_start >= seg_start) {
+        seg_start <<= 1;
+        s ++;
+    }
+    assert(s < NB_MUX_SEGMENTS && mux_parser->segments && mux_parser->segments[s]);
+    return mux_parser->segments[s] + (h_idx - seg_start);
 }
 static struct subparsers *h_list_of_subparser_(struct mux_subparser *subparser, unsigned h_idx)
 {
@@ -433,10 +450,277 @@ static struct mutex *mutex_of_subparser(struct mux_subparser *subparser)
 // List of all mux_protos used to configure them from Guile
 static LIST_HEAD(mux_protos, mux_proto) mux_protos = LIST_HEAD_INITIALIZER(mux_protos);
 
+/*
+ * Lock-free index
+ *
+ * When mux_proto->lockfree is set, new mux_parsers also index their subparsers
+ * in an open addressing table that lookups probe without taking any mutex.
+ * The hash lists and timers are still maintained (under the mutexes)
+ * since timeouts and infanticides rely on them, so this table is merely a
+ * shortcut to the subparsers: a lookup that misses in it falls back to the
+ * locked path, and the subparsers that do not fit in it are only reachable
+ * that way.
+ *
+ * Slots are grouped by 8, with one tag byte per slot so that a whole group
+ * can be matched against the tag of the key in a few arithmetic operations.
+ * Each group has a sequence counter (odd while a writer is at work on it).
+ * Since a miss sends the reader to the locked path anyway, readers only have
+ * to check that the group where they found a subparser was not modified in
+ * the meantime (or give up).
+ * Subparsers pointed to by the table cannot be freed under our feet as long
+ * as we are in the multi region (see ref.h), but their count may reach 0,
+ * in which case we must not ref them.
+ */
+
+#define INDEX_GROUP_SIZE 8      // must match the number of bytes in the tags word
+#define INDEX_MAX_PROBES 4      // how many groups to probe before giving up
+#define TAG_EMPTY 0             // never used
+#define TAG_DELETED 1           // used once, may be reused
+#define TAG_ONES 0x0101010101010101ULL
+#define TAG_HIGHS 0x8080808080808080ULL
+
+struct mux_index {
+    unsigned num_groups;        ///< Always a power of 2
+    struct mutex mutex;         ///< Serializes writers (taken after the subparsers mutex)
+    struct index_group {
+        unsigned volatile seq;  ///< Odd while a writer is modifying this group
+        uint64_t volatile tags; ///< One byte per slot
+        struct mux_subparser *volatile subparsers[INDEX_GROUP_SIZE];
+    } groups[];
+};
+
+static uint8_t index_tag(uint_least32_t h)
+{
+    // Use other bits than the ones selecting the group
+    return 2 + ((h * 2654435761U) >> 24) % 254;
+}
+
+static uint8_t get_tag(uint64_t tags, unsigned i)
+{
+    return tags >> (8 * i);
+}
+
+// @returns a word with the high bit set in every byte equal to tag (and maybe in some bytes above an actual match)
+static uint64_t match_tag(uint64_t tags, uint8_t tag)
+{
+    uint64_t const x = tags ^ (TAG_ONES * tag);
+    return (x - TAG_ONES) & ~x & TAG_HIGHS;
+}
+
+static struct mux_index *mux_index_new(unsigned num_slots)
+{
+    unsigned num_groups = 1;
+    while (num_groups * INDEX_GROUP_SIZE < num_slots && num_groups < (1U << 24)) num_groups <<= 1;
+
+    struct mux_index *index = objalloc_nice(sizeof(*index) + num_groups * sizeof(index->groups[0]), "mux_indexes");
+    if (unlikely_(! index)) return NULL;
+
+    index->num_groups = num_groups;
+    mutex_ctor(&index->mutex, "mux_index");
+    memset(index->groups, 0, num_groups * sizeof(index->groups[0]));
+
+    return index;
+}
+
+static void mux_index_del(struct mux_index *index)
+{
+    mutex_dtor(&index->mutex);
+    objfree(index);
+}
+
+// Caller must own index->mutex
+static void index_set_slot(struct index_group *group, unsigned i, uint8_t tag, struct mux_subparser *subparser)
+{
+    group->seq ++;
+    __sync_synchronize();
+    group->subparsers[i] = subparser;
+    group->tags = (group->tags & ~(0xffULL << (8 * i))) | ((uint64_t)tag << (8 * i));
+    __sync_synchronize();
+    group->seq ++;
+}
+
+// Caller must own the subparsers mutex. @returns false if there were no room left.
+static bool mux_index_insert(struct mux_index *index, uint_least32_t h, struct mux_subparser *subparser)
+{
+    uint8_t const tag = index_tag(h);
+    bool ok = false;
+
+    mutex_lock(&index->mutex);
+    unsigned g = h & (index->num_groups - 1);
+    for (unsigned p = 0; p < INDEX_MAX_PROBES && p < index->num_groups && !ok; p++, g = (g + 1) & (index->num_groups - 1)) {
+        struct index_group *const group = index->groups + g;
+        for (unsigned i = 0; i < INDEX_GROUP_SIZE; i++) {
+            if (get_tag(group->tags, i) > TAG_DELETED) continue;
+            index_set_slot(group, i, tag, subparser);
+            ok = true;
+            break;
+        }
+    }
+    mutex_unlock(&index->mutex);
+
+    return ok;
+}
+
+// Caller must own the subparsers mutex
+static void mux_index_remove(struct mux_index *index, uint_least32_t h, struct mux_subparser *subparser)
+{
+    mutex_lock(&index->mutex);
+    unsigned g = h & (index->num_groups - 1);
+    for (unsigned p = 0; p < INDEX_MAX_PROBES && p < index->num_groups; p++, g = (g + 1) & (index->num_groups - 1)) {
+        struct index_group *const group = index->groups + g;
+        for (unsigned i = 0; i < INDEX_GROUP_SIZE; i++) {
+            if (group->subparsers[i] != subparser) continue;
+            index_set_slot(group, i, TAG_DELETED, NULL);
+            goto quit;
+        }
+        if (match_tag(group->tags, TAG_EMPTY)) break;  // it was not indexed
+    }
+quit:
+    mutex_unlock(&index->mutex);
+}
+
+// Like ref() but fails if the subparser is already unreachable
+static bool mux_subparser_try_ref(struct mux_subparser *subparser)
+{
+    unsigned c = subparser->ref.count;
+    while (c > 0) {
+        unsigned const prev = __sync_val_compare_and_swap(&subparser->ref.count, c, c + 1);
+        if (prev == c) return true;
+        c = prev;
+    }
+    return false;
+}
+
+/* Look for the subparser without taking any lock.
+ * Caller must be in the multi region.
+ * @returns a new ref to the subparser, or NULL if not found (which does not mean it's not there). */
+static struct mux_subparser *mux_index_lookup(struct mux_index *index, uint_least32_t h, struct proto *create_proto, void const *key, size_t key_size, unsigned *num_colls)
+{
+    uint8_t const tag = index_tag(h);
+    unsigned g = h & (index->num_groups - 1);
+
+    for (unsigned p = 0; p < INDEX_MAX_PROBES && p < index->num_groups; p++, g = (g + 1) & (index->num_groups - 1)) {
+        struct index_group *const group = index->groups + g;
+        unsigned const seq = group->seq;
+        if (seq & 1) return NULL;   // a writer is at work
+        __sync_synchronize();
+        uint64_t const tags = group->tags;
+        uint64_t matches = match_tag(tags, tag);
+        while (matches) {
+            unsigned const i = __builtin_ctzll(matches) / 8;
+            matches &= matches - 1;
+            struct mux_subparser *subparser = group->subparsers[i];
+            if (
+                ! subparser ||
+                (create_proto && subparser->parser->proto != create_proto) ||  // see mux_subparser_lookup()
+                0 != memcmp(subparser->key, key, key_size)
+            ) {
+                (*num_colls) ++;
+                continue;
+            }
+            if (! mux_subparser_try_ref(subparser)) return NULL;
+            __sync_synchronize();
+            if (seq == group->seq) return subparser;
+            unref(&subparser->ref);
+            return NULL;
+        }
+        if (match_tag(tags, TAG_EMPTY)) break;
+    }
+
+    return NULL;
+}
+
+/*
+ * Flow classes
+ *
+ * When a mux_parser limits its number of children it also lists them by class
+ * (see enum mux_flow_class), so that the child to sacrifice for a newcomer can
+ * be chosen amongst all of its children rather than amongst those of the
+ * newcomer bucket only, which under a flood of new flows (SYN floods, scans...)
+ * would be as likely to kill a valuable flow than one of the flood.
+ * These lists are protected by the mux_parser flows_mutex, which is always
+ * taken last.
+ */
+
+// Caller must own the subparser bucket mutex
+static void mux_subparser_list_flow(struct mux_subparser *subparser)
+{
+    struct mux_parser *const mux_parser = subparser->mux_parser;
+    if (! mux_parser->num_max_children) return;
+
+    mutex_lock(mux_parser->flows_mutex);
+    TAILQ_INSERT_HEAD(&mux_parser->flows[subparser->flow_class], subparser, c_entry);
+    subparser->flow_listed = 1;
+    mutex_unlock(mux_parser->flows_mutex);
+}
+
+// Caller must own the subparser bucket mutex
+static void mux_subparser_unlist_flow(struct mux_subparser *subparser)
+{
+    struct mux_parser *const mux_parser = subparser->mux_parser;
+    if (! mux_parser->num_max_children) return;
+
+    mutex_lock(mux_parser->flows_mutex);
+    if (subparser->flow_listed) {
+        TAILQ_REMOVE(&mux_parser->flows[subparser->flow_class], subparser, c_entry);
+        subparser->flow_listed = 0;
+    }
+    mutex_unlock(mux_parser->flows_mutex);
+}
+
+void mux_subparser_promote(struct mux_subparser *subparser, enum mux_flow_class flow_class)
+{
+    assert(flow_class < MUX_NB_FLOW_CLASSES);
+    if (likely_(flow_class <= subparser->flow_class)) return;
+
+    struct mux_parser *const mux_parser = subparser->mux_parser;
+    if (! mux_parser->num_max_children) {
+        subparser->flow_class = flow_class;
+        return;
+    }
+
+    mutex_lock(mux_parser->flows_mutex);
+    if (flow_class > subparser->flow_class) {   // check again now that we own the lock
+        if (subparser->flow_listed) {
+            TAILQ_REMOVE(&mux_parser->flows[subparser->flow_class], subparser, c_entry);
+            TAILQ_INSERT_HEAD(&mux_parser->flows[flow_class], subparser, c_entry);
+        }
+        subparser->flow_class = flow_class;
+    }
+    mutex_unlock(mux_parser->flows_mutex);
+}
+
+// How many of the oldest children of a class we consider before sacrificing one
+#define MUX_EVICT_SAMPLE 8
+
+/* Pick the least recently used amongst the oldest children of the lowest class.
+ * @returns a new ref to it, or NULL if there is none but the newcomer. */
+static struct mux_subparser *mux_parser_pick_victim(struct mux_parser *mux_parser, struct mux_subparser const *newcomer)
+{
+    struct mux_subparser *victim = NULL;
+
+    mutex_lock(mux_parser->flows_mutex);
+    for (unsigned c = 0; c < NB_ELEMS(mux_parser->flows) && !victim; c++) {
+        unsigned n = 0;
+        struct mux_subparser *s;
+        TAILQ_FOREACH_REVERSE(s, &mux_parser->flows[c], mux_flows, c_entry) {
+            if (s == newcomer) continue;
+            if (! victim || s->last_used < victim->last_used) victim = s;
+            if (++n >= MUX_EVICT_SAMPLE) break;
+        }
+    }
+    // Since it's still listed it's still indexed, thus referenced
+    if (victim) mux_subparser_ref(victim);
+    mutex_unlock(mux_parser->flows_mutex);
+
+    return victim;
+}
+
+static unsigned volatile deindexed_seq; // incremented whenever a subparser is deindexed (see flow caches)
+
 // Caller must own list->mutex
 static void mux_subparser_deindex_locked(struct mux_subparser *subparser)
 {
-    struct subparsers *const h_list = h_list_of_subparser(subparser);
     struct per_mutex *const to_list = to_list_of_subparser(subparser);
 #   ifdef __GNUC__
     unsigned const unused_ n = __sync_fetch_and_sub(&subparser->mux_parser->num_children, 1);
@@ -446,20 +730,25 @@ static void mux_subparser_deindex_locked(struct mux_subparser *subparser)
     subparser->mux_parser->num_children --;
     mutex_unlock(&subparser->mux_proto->proto.lock);
 #   endif
-    STAILQ_REMOVE(&h_list->list, subparser, mux_subparser, h_entry);
-    TAILQ_REMOVE(&to_list->timeout_queue, subparser, to_entry);
+    LIST_REMOVE(subparser, h_entry);
+    mux_subparser_unlist_flow(subparser);
+    timer_cancel(&to_list->wheel, &subparser->timer);
+    struct mux_index *const index = subparser->mux_parser->index;
+    if (index) mux_index_remove(index, key_hash(subparser->key, subparser->mux_proto->key_size), subparser);
     subparser->h_idx = NOT_HASHED;
+    (void)__sync_add_and_fetch(&deindexed_seq, 1);  // so that flow caches evict it
     unref(&subparser->ref);
 }
 
-void mux_subparser_deindex(struct mux_subparser *subparser)
+// @returns false if it was not indexed (anymore)
+static bool mux_subparser_deindex_(struct mux_subparser *subparser)
 {
     unsigned h_idx;
     struct mutex *mutex;
 
     do {
         h_idx = subparser->h_idx;
-        if (h_idx == NOT_HASHED) return;
+        if (h_idx == NOT_HASHED) return false;
         mutex = mutex_of_subparser_(subparser, h_idx);
 
         mutex_lock(mutex);
@@ -472,16 +761,37 @@ void mux_subparser_deindex(struct mux_subparser *subparser)
     mux_subparser_deindex_locked(subparser);
 
     mutex_unlock(mutex);
+    return true;
+}
+
+void mux_subparser_deindex(struct mux_subparser *subparser)
+{
+    (void)mux_subparser_deindex_(subparser);
+}
+
+// How long to wait before checking again a subparser when timeouting is disabled
+#define MUX_TIMEOUT_RECHECK 64
+
+// When to timeout this subparser if it's not used in between
+static time_t mux_subparser_expiry(struct mux_subparser const *subparser, unsigned timeout_s)
+{
+    if (! timeout_s) return subparser->last_used + MUX_TIMEOUT_RECHECK;
+    return subparser->last_used + timeout_s + 1;
 }
 
 // Caller must own subparsers mutex
 static void mux_subparser_index(struct mux_subparser *subparser)
 {
-    // Insert the subparser into its mux_parser hash and into the timeout_queue
+    // Insert the subparser into its mux_parser hash and arm its timer
     struct subparsers *const h_list = h_list_of_subparser(subparser);
     struct per_mutex *const to_list = to_list_of_subparser(subparser);
-    STAILQ_INSERT_HEAD(&h_list->list, subparser, h_entry); // most used first
-    TAILQ_INSERT_TAIL(&to_list->timeout_queue, subparser, to_entry); // most used last
+    LIST_INSERT_HEAD(&h_list->list, subparser, h_entry);
+    mux_subparser_list_flow(subparser);
+    timer_arm(&to_list->wheel, &subparser->timer, mux_subparser_expiry(subparser, mux_timeout));
+    struct mux_index *const index = subparser->mux_parser->index;
+    if (index && ! mux_index_insert(index, key_hash(subparser->key, subparser->mux_proto->key_size), subparser)) {
+        counter_inc(&subparser->mux_proto->num_unindexed);
+    }
     // inc num_children
 #   if __GNUC__
     (void)__sync_fetch_and_add(&subparser->mux_parser->num_children, 1);
@@ -517,63 +827,212 @@ static bool too_many_children(struct mux_parser *mux_parser)
         mux_parser->num_children > mux_parser->num_max_children;
 }
 
-// Caller must own list->mutex
-static void try_sacrifice_child(struct mux_proto *mux_proto, struct subparsers *h_list)
+/* Caller must not own any subparsers mutex, since the victim may be in any bucket.
+ * See mux_parser_pick_victim(). */
+static void try_sacrifice_child(struct mux_parser *mux_parser, struct mux_subparser const *newcomer)
 {
-    struct mux_subparser *subparser = STAILQ_LAST(&h_list->list, mux_subparser, h_entry);    // killing the least recently used child
-    if (! subparser) return;    // empty
+    struct mux_subparser *subparser = mux_parser_pick_victim(mux_parser, newcomer);
+    if (! subparser) return;
 
     SLOG(LOG_DEBUG, "Too many children, killing %s", mux_subparser_name(subparser));
 
-    mux_subparser_deindex_locked(subparser);
+    enum mux_flow_class const flow_class = subparser->flow_class;
+    if (mux_subparser_deindex_(subparser)) {    // or someone else killed it already
+        counter_inc(&subparser->mux_proto->num_infanticide);
+        counter_inc(&subparser->mux_proto->num_evictions[flow_class]);
+    }
+    mux_subparser_unref(&subparser);
+}
 
-#   ifdef __GNUC__
-    (void)__sync_add_and_fetch(&mux_proto->num_infanticide, 1);
-#   else
-    mutex_lock(&mux_proto->proto.lock);
-    mux_proto->num_infanticide ++
-    mutex_unlock(&mux_proto->proto.lock);
-#   endif
+/*
+ * Growing the hash
+ *
+ * The hash of a mux_parser grows by linear hashing: buckets are split one at
+ * a time, in order, each split moving roughly half of the subparsers of a
+ * bucket into a new one appended at the end. So the cost of growing is spread
+ * over many lookups and no lookup ever has to wait for the whole hash to be
+ * rehashed. Splitting a bucket only requires the mutexes of these two buckets.
+ */
+
+// @returns the bucket for this hash value (since num_buckets is read only once, always a valid one)
+static unsigned bucket_of_hash(struct mux_parser *mux_parser, uint_least32_t h)
+{
+    unsigned const num_buckets = mux_parser->num_buckets;
+    unsigned level_size = mux_parser->hash_size;    // number of buckets when the current round of splits started
+    while (num_buckets - level_size >= level_size) level_size <<= 1;
+
+    unsigned const b = h % (2 * level_size);
+    return b < num_buckets ? b : b - level_size;
 }
 
-static unsigned hash_key(void const *key, size_t key_sz, unsigned hash_size)
+// Lock the bucket this hash value belongs to, and returns it
+static unsigned lock_bucket_of_hash(struct mux_parser *mux_parser, uint_least32_t h)
 {
-    return hashfun(key, key_sz) % hash_size;
+    do {
+        unsigned const b = bucket_of_hash(mux_parser, h);
+        struct mutex *const mutex = mutex_of_h_idx(mux_parser, b);
+        mutex_lock(mutex);
+        // by the time the lock is acquired maybe another thread split this bucket?
+        if (b == bucket_of_hash(mux_parser, h)) return b;
+        mutex_unlock(mutex);
+    } while (1);
 }
 
-// Caller must own list->mutex
-static unsigned mux_subparsers_timeout(struct mux_proto *mux_proto, struct per_mutex *to_list, unsigned const timeout_s, time_t const last_used)
+// Make sure the bucket num_buckets can be used. Caller must own mux_parser->splitting.
+static int mux_parser_alloc_bucket(struct mux_parser *mux_parser)
 {
-    if (0 == timeout_s) return 0;
+    unsigned const b = mux_parser->num_buckets;
+    unsigned s = 0, seg_start = mux_parser->hash_size;
+    while (b - seg_start >= seg_start) {
+        seg_start <<= 1;
+        s ++;
+    }
+    if (b != seg_start) return 0;   // not the first bucket of a segment, so already allocated
+    if (s >= NB_MUX_SEGMENTS) return -1;
 
-    // Beware that deletion of a subparser can lead to the creation of new parsers !
-    struct mux_subparser *subparser;
-    unsigned count = 0;
-    while (NULL != (subparser = TAILQ_FIRST(&to_list->timeout_queue))) {
-        // As parsers are sorted by last_used time (least recently used first in the timeout_queue),
-        // we can stop scanning as soon as we met a survivor.
-        if (likely_(!overweight) && likely_(last_used - subparser->last_used.tv_sec <= timeout_s)) break;
+    if (! mux_parser->segments) {
+        mux_parser->segments = objalloc_nice(NB_MUX_SEGMENTS * sizeof(*mux_parser->segments), "mux_segments");
+        if (! mux_parser->segments) return -1;
+        memset(mux_parser->segments, 0, NB_MUX_SEGMENTS * sizeof(*mux_parser->segments));
+    }
+
+    struct subparsers *segment = objalloc_nice(seg_start * sizeof(*segment), "mux_segments");
+    if (! segment) return -1;
+    for (unsigned i = 0; i < seg_start; i++) LIST_INIT(&segment[i].list);
+    mux_parser->segments[s] = segment;
+    __sync_synchronize();   // before anyone can see the new bucket
 
-        SLOG(LOG_DEBUG, "Timeouting subparser %s", mux_subparser_name(subparser));
-        mux_subparser_deindex_locked(subparser);
+    return 0;
+}
 
-        count ++;
+// Tells whether the hash can have one more bucket
+static bool mux_parser_may_grow(struct mux_parser const *mux_parser)
+{
+    return
+        mux_parser->num_buckets < mux_max_hash_size &&
+        mux_parser->num_buckets < (uint64_t)mux_parser->hash_size << NB_MUX_SEGMENTS;
+}
+
+static void mux_parser_split_bucket(struct mux_parser *mux_parser)
+{
+    if (! __sync_bool_compare_and_swap(&mux_parser->splitting, 0, 1)) return;   // someone else is at it
+
+    if (
+        mux_parser->num_to_split == 0 ||
+        ! mux_parser_may_grow(mux_parser) ||
+        0 != mux_parser_alloc_bucket(mux_parser)
+    ) {
+        mux_parser->num_to_split = 0;
+        goto quit;
     }
 
-#   ifdef __GNUC__
-    (void)__sync_add_and_fetch(&mux_proto->num_timeouts, count);
-#   else    // well, don't put to much trust in this then
-    mux_proto->num_timeouts += count;
-#   endif
+    struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
+    unsigned const dst = mux_parser->num_buckets;
+    unsigned level_size = mux_parser->hash_size;
+    while (dst - level_size >= level_size) level_size <<= 1;
+    unsigned const src = dst - level_size;
+    struct mutex *const src_mutex = mutex_of_h_idx(mux_parser, src);
+    struct mutex *const dst_mutex = mutex_of_h_idx(mux_parser, dst);
+    struct subparsers *const src_list = h_list_of_h_idx(mux_parser, src);
+    struct subparsers *const dst_list = h_list_of_h_idx(mux_parser, dst);
+    struct per_mutex *const src_to_list = to_list_of_h_idx(mux_parser, src);
+    struct per_mutex *const dst_to_list = to_list_of_h_idx(mux_parser, dst);
+
+    mutex_lock2(src_mutex, dst_mutex);
+    unsigned num_moved = 0;
+    struct mux_subparser *subparser, *tmp;
+    LIST_FOREACH_SAFE(subparser, &src_list->list, h_entry, tmp) {
+        if (key_hash(subparser->key, mux_proto->key_size) % (2 * level_size) != dst) continue;
+        LIST_REMOVE(subparser, h_entry);
+        LIST_INSERT_HEAD(&dst_list->list, subparser, h_entry);
+        if (src_to_list != dst_to_list) {
+            time_t const expiry = subparser->timer.expiry;
+            timer_cancel(&src_to_list->wheel, &subparser->timer);
+            timer_arm(&dst_to_list->wheel, &subparser->timer, expiry);
+        }
+        subparser->h_idx = dst;
+        num_moved ++;
+    }
+    __sync_synchronize();
+    mux_parser->num_buckets = dst + 1;
+    mutex_unlock2(src_mutex, dst_mutex);
+
+    mux_parser->num_to_split --;
+    SLOG(LOG_DEBUG, "Split bucket %u of %s into bucket %u (%u subparsers moved)", src, parser_name(&mux_parser->parser), dst, num_moved);
 
-    return count;
+quit:
+    __sync_synchronize();
+    mux_parser->splitting = 0;
+}
+
+#define GROW_PERIOD 1024    // how many lookups between two evaluations of the collision rate
+
+// Called after each lookup, without any lock
+static void mux_parser_count_lookup(struct mux_parser *mux_parser, unsigned num_colls)
+{
+    // No need to be exact
+    mux_parser->num_collisions += num_colls;
+    if (++ mux_parser->num_lookups >= GROW_PERIOD) {
+        unsigned const num_lookups = mux_parser->num_lookups, num_collisions = mux_parser->num_collisions;
+        mux_parser->num_lookups = mux_parser->num_collisions = 0;
+        unsigned const max_collisions = mux_grow_collisions;
+        if (
+            max_collisions > 0 && mux_parser->num_to_split == 0 &&
+            (uint64_t)num_collisions * 100 > (uint64_t)num_lookups * max_collisions &&
+            mux_parser_may_grow(mux_parser)
+        ) {
+            // Double the number of buckets, one bucket per lookup
+            SLOG(LOG_INFO, "%u collisions for %u lookups in %s with %u buckets, growing", num_collisions, num_lookups, parser_name(&mux_parser->parser), mux_parser->num_buckets);
+            mux_parser->num_to_split = mux_parser->num_buckets;
+        }
+    }
+
+    if (unlikely_(mux_parser->num_to_split > 0)) mux_parser_split_bucket(mux_parser);
+}
+
+static void mux_proto_count_lookup(struct mux_proto *mux_proto, unsigned num_colls)
+{
+    counter_inc(&mux_proto->num_lookups);
+    if (num_colls) counter_add(&mux_proto->num_collisions, num_colls);
+}
+
+/* Fired by the wheel of a per_mutex, which mutex is owned by the caller.
+ * Since lookups do not rearm the timer but merely set last_used, the subparser
+ * may have been used since its timer was armed, in which case we rearm it. */
+static void mux_subparser_timeout(struct timer_wheel *wheel, struct timer *timer, time_t now)
+{
+    struct mux_subparser *subparser = DOWNCAST(timer, timer, mux_subparser);
+    unsigned const timeout_s = mux_timeout;
+
+    if (likely_(! overweight)) {
+        if (0 == timeout_s) {
+            timer_arm(wheel, timer, now + MUX_TIMEOUT_RECHECK);
+            return;
+        }
+        if (now - subparser->last_used <= timeout_s) {
+            timer_arm(wheel, timer, mux_subparser_expiry(subparser, timeout_s));
+            return;
+        }
+    }
+
+    SLOG(LOG_DEBUG, "Timeouting subparser %s", mux_subparser_name(subparser));
+    // Beware that deletion of a subparser can lead to the creation of new parsers !
+    mux_subparser_deindex_locked(subparser);
+    counter_inc(&subparser->mux_proto->num_timeouts);
 }
 
 static void mux_subparser_del_as_ref(struct ref *ref)
 {
     struct mux_subparser *subparser = DOWNCAST(ref, ref, mux_subparser);
     // Beware that subparser->mux_parser might have been deleted already, so we need a backlink to mux_proto
-    subparser->mux_proto->ops.subparser_del(subparser);
+    struct mux_proto *mux_proto = subparser->mux_proto;
+    mux_proto->ops.subparser_del(subparser);
+    counter_add(&mux_proto->num_subparsers, -1);
+}
+
+void mux_subparser_account(struct mux_subparser *subparser, ssize_t bytes)
+{
+    counter_add(&subparser->mux_proto->extra_bytes, bytes);
 }
 
 int mux_subparser_ctor(struct mux_subparser *subparser, struct mux_parser *mux_parser, struct parser *child, struct proto *requestor, void const *key, struct timeval const *now)
@@ -585,30 +1044,31 @@ int mux_subparser_ctor(struct mux_subparser *subparser, struct mux_parser *mux_p
     subparser->requestor = requestor;
     subparser->mux_parser = mux_parser; // backlink
     subparser->mux_proto = mux_proto;   // another backlink, see mux_subparser_del_as_ref().
-    subparser->last_used = *now;
+    subparser->last_used = now->tv_sec;
+    subparser->flow_class = MUX_FLOW_EMBRYONIC;
+    subparser->flow_listed = 0;
     memcpy(subparser->key, key, mux_proto->key_size);
     ref_ctor(&subparser->ref, mux_subparser_del_as_ref);
+    timer_ctor(&subparser->timer);
+    counter_inc(&mux_proto->num_subparsers);
 
-    subparser->h_idx = hash_key(key, mux_proto->key_size, mux_parser->hash_size);
+    subparser->h_idx = lock_bucket_of_hash(mux_parser, key_hash(key, mux_proto->key_size));
     struct mutex *mutex = mutex_of_subparser(subparser);
-    struct subparsers *list = h_list_of_subparser(subparser);
-
-    mutex_lock(mutex);
-
-    if (too_many_children(mux_parser)) {
-        try_sacrifice_child(mux_proto, list);
-    }
 
+    bool const sacrifice = too_many_children(mux_parser);
     mux_subparser_index(subparser);
 
     mutex_unlock(mutex);
 
+    if (sacrifice) try_sacrifice_child(mux_parser, subparser);
+
     return 0;
 }
 
 void *mux_subparser_alloc(struct mux_parser *mux_parser, size_t size_without_key)
 {
     struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
+    mux_proto->subparser_size = size_without_key + mux_proto->key_size;
     void *subparser = objalloc_nice(size_without_key + mux_proto->key_size, "subparsers");
     if (unlikely_(! subparser)) __sync_fetch_and_add(&denied_parsers, 1);
     return subparser;
@@ -653,18 +1113,202 @@ struct mux_subparser *mux_subparser_and_parser_new(struct mux_parser *mux_parser
     return subparser;
 }
 
-struct mux_subparser *mux_subparser_lookup(struct mux_parser *mux_parser, struct proto *create_proto, struct proto *requestor, void const *key, struct timeval const *now)
+/*
+ * Flow cache
+ *
+ * Each thread remembers, for each (mux_parser, key) it looked up recently,
+ * the subparser it found, so that the packets of established flows find their
+ * subparser at every layer (including the inner layers of tunnels) without
+ * taking any lock nor walking any hash. An entry owns a ref on its subparser,
+ * and is checked against the subparser current state on each hit so that a
+ * subparser which was deindexed since (timeouted, sacrificed, rekeyed, or which
+ * mux_parser was deleted) is never returned but instead evicted.
+ * So that a cache does not keep for long the subparsers that were deindexed
+ * (with their parser state), each thread evicts them from its own cache when it
+ * leaves a burst of frames, if any subparser was deindexed since it last did.
+ * A thread owns the lock of its cache while it parses a burst, so that the
+ * timeouter, which also evicts deindexed entries, only does so from the caches
+ * of threads that stopped parsing (an idle interface, or a parsing worker with
+ * nothing to do).
+ */
+
+#define FLOW_CACHE_SIZE 1024    // entries per thread (must be a power of 2)
+
+struct flow_cache {
+    LIST_ENTRY(flow_cache) entry;   // in the list of all caches
+    struct mutex lock;          // owned by the thread using it (see mux_flow_cache_enter)
+    unsigned depth;             // how many times its thread entered (and not left) it (only used by that thread)
+    unsigned evicted_seq;       // the deindexed_seq when the deindexed entries were last evicted
+    unsigned sweep;             // next entry to check for eviction
+    struct flow_cache_entry {
+        struct mux_parser *mux_parser;
+        struct mux_subparser *subparser;    // we own a ref on it
+    } entries[FLOW_CACHE_SIZE];
+};
+
+static __thread struct flow_cache *flow_cache;
+static pthread_key_t flow_cache_key;    // to be notified of threads termination
+static LIST_HEAD(flow_caches, flow_cache) flow_caches = LIST_HEAD_INITIALIZER(flow_caches);
+static struct mutex flow_caches_lock;   // protects flow_caches
+
+// Called at thread termination
+static void flow_cache_del(void *cache_)
 {
-    struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
-    unsigned h = hash_key(key, mux_proto->key_size, mux_parser->hash_size);
-    struct mutex *mutex = mutex_of_h_idx(mux_parser, h);
-    struct subparsers *h_list = h_list_of_h_idx(mux_parser, h);
+    struct flow_cache *cache = cache_;
+    WITH_LOCK(&flow_caches_lock) {
+        LIST_REMOVE(cache, entry);
+    }
+    for (unsigned e = 0; e < NB_ELEMS(cache->entries); e++) {
+        mux_subparser_unref(&cache->entries[e].subparser);
+    }
+    mutex_dtor(&cache->lock);
+    if (flow_cache == cache) flow_cache = NULL;
+    free(cache);
+}
+
+static struct flow_cache *flow_cache_get(void)
+{
+    if (likely_(flow_cache)) return flow_cache;
+
+    flow_cache = calloc(1, sizeof(*flow_cache));
+    if (! flow_cache) return NULL;  // too bad, we will use the hashes
+    mutex_ctor(&flow_cache->lock, "flow cache");
+    flow_cache->evicted_seq = deindexed_seq;
+    WITH_LOCK(&flow_caches_lock) {
+        LIST_INSERT_HEAD(&flow_caches, flow_cache, entry);
+    }
+    (void)pthread_setspecific(flow_cache_key, flow_cache);
+    return flow_cache;
+}
+
+static struct flow_cache_entry *flow_cache_entry(struct flow_cache *cache, struct mux_parser const *mux_parser, uint_least32_t h)
+{
+    return cache->entries + ((h ^ ((uintptr_t)mux_parser >> 4)) & (FLOW_CACHE_SIZE - 1));
+}
+
+static void flow_cache_evict(struct flow_cache_entry *entry)
+{
+    mux_subparser_unref(&entry->subparser);
+    entry->mux_parser = NULL;
+}
+
+// @returns a new ref on the cached subparser for that key, or NULL
+static struct mux_subparser *flow_cache_lookup(struct flow_cache *cache, struct flow_cache_entry *entry, struct mux_parser *mux_parser, struct proto *create_proto, void const *key, size_t key_size)
+{
+    // Evict the next deindexed entry, if any
+    struct flow_cache_entry *const swept = cache->entries + (cache->sweep++ & (FLOW_CACHE_SIZE - 1));
+    if (swept->subparser && swept->subparser->h_idx == NOT_HASHED) flow_cache_evict(swept);
+
+    struct mux_subparser *const subparser = entry->subparser;
+    if (! subparser || entry->mux_parser != mux_parser) return NULL;
+
+    if (subparser->h_idx == NOT_HASHED) {
+        flow_cache_evict(entry);
+        return NULL;
+    }
+
+    if (
+        (create_proto && subparser->parser->proto != create_proto) ||  // see mux_subparser_lookup()
+        0 != memcmp(subparser->key, key, key_size)
+    ) return NULL;
+
+    return mux_subparser_ref(subparser);
+}
+
+// Evict the deindexed subparsers from this cache, if some were deindexed since last time. Caller must own cache->lock.
+static unsigned flow_cache_evict_deindexed(struct flow_cache *cache)
+{
+    unsigned const seq = deindexed_seq;
+    if (seq == cache->evicted_seq) return 0;
+    cache->evicted_seq = seq;
+
+    unsigned num_evicted = 0;
+    for (unsigned e = 0; e < NB_ELEMS(cache->entries); e++) {
+        struct flow_cache_entry *const entry = cache->entries + e;
+        if (! entry->subparser || entry->subparser->h_idx != NOT_HASHED) continue;
+        flow_cache_evict(entry);
+        num_evicted ++;
+    }
+    return num_evicted;
+}
 
-    mutex_lock(mutex);
+// Evict the deindexed subparsers from the caches of the threads that are not parsing
+static void flow_caches_evict_deindexed(void)
+{
+    unsigned num_evicted = 0;
+    WITH_LOCK(&flow_caches_lock) {
+        struct flow_cache *cache;
+        LIST_FOREACH(cache, &flow_caches, entry) {
+            if (cache->evicted_seq == deindexed_seq) continue;
+            if (! mutex_trylock(&cache->lock)) continue;    // busy, will evict itself when leaving its burst
+            num_evicted += flow_cache_evict_deindexed(cache);
+            mutex_unlock(&cache->lock);
+        }
+    }
+    SLOG(LOG_DEBUG, "Evicted %u deindexed subparsers from idle flow caches", num_evicted);
+}
 
+void mux_flow_cache_enter(void)
+{
+    if (! mux_flow_cache) return;
+    struct flow_cache *const cache = flow_cache_get();
+    if (cache && cache->depth++ == 0) mutex_lock(&cache->lock);
+}
+
+void mux_flow_cache_leave(void)
+{
+    struct flow_cache *const cache = flow_cache;
+    if (! cache || cache->depth == 0) return;   // mux-flow-cache was set meanwhile
+    if (--cache->depth > 0) return;
+    (void)flow_cache_evict_deindexed(cache);
+    mutex_unlock(&cache->lock);
+}
+
+static void flow_cache_set(struct flow_cache_entry *entry, struct mux_parser *mux_parser, struct mux_subparser *subparser)
+{
+    if (entry->subparser == subparser) return;
+    mux_subparser_unref(&entry->subparser);
+    entry->subparser = mux_subparser_ref(subparser);
+    entry->mux_parser = mux_parser;
+}
+
+/*
+ * Lookup
+ */
+
+/* Record that this subparser was just used (its timer will be rearmed when it fires),
+ * and give time to the timers thread.
+ * No need to lock as long as writing a time_t is atomic, and we write only
+ * when the second changes so that the lookup of a busy flow does not dirty
+ * these cache lines. */
+static void mux_subparser_touch(struct mux_subparser *subparser, struct mux_proto *mux_proto, time_t now)
+{
+    if (subparser && subparser->last_used != now) subparser->last_used = now;
+    if (mux_proto->last_used != now) mux_proto->last_used = now;
+}
+
+static struct mux_subparser *mux_subparser_lookup_(struct mux_parser *mux_parser, struct proto *create_proto, struct proto *requestor, void const *key, uint_least32_t const h_full, struct timeval const *now)
+{
+    struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
     unsigned num_colls = 0;
     struct mux_subparser *subparser;
-    STAILQ_FOREACH(subparser, &h_list->list, h_entry) {
+
+    if (mux_parser->index) {
+        subparser = mux_index_lookup(mux_parser->index, h_full, create_proto, key, mux_proto->key_size, &num_colls);
+        if (subparser) {
+            mux_subparser_touch(subparser, mux_proto, now->tv_sec);
+            mux_proto_count_lookup(mux_proto, num_colls);
+            mux_parser_count_lookup(mux_parser, 0);    // the hash was not even used
+            return subparser;
+        }
+        num_colls = 0;
+    }
+
+    unsigned const h = lock_bucket_of_hash(mux_parser, h_full);
+    struct mutex *mutex = mutex_of_h_idx(mux_parser, h);
+    struct subparsers *h_list = h_list_of_h_idx(mux_parser, h);
+
+    LIST_FOREACH(subparser, &h_list->list, h_entry) {
         if (
             // Various kind of subparsers might have the same key so we should include proto in any case,
             // whether or not we intend to create the child if not found (ie. use another flag for that).
@@ -678,24 +1322,15 @@ struct mux_subparser *mux_subparser_lookup(struct mux_parser *mux_parser, struct
         num_colls ++;
     }
 
-    if (subparser) {
-        /* Promote this children both to the head of the h_list (for performance)
-         * and the tail of the timeout_queue (since it is used). */
-        subparser->last_used = *now;
-        struct per_mutex *const to_list = to_list_of_subparser(subparser);
-        TAILQ_REMOVE(&to_list->timeout_queue, subparser, to_entry);
-        TAILQ_INSERT_TAIL(&to_list->timeout_queue, subparser, to_entry);
-        STAILQ_REMOVE(&h_list->list, subparser, mux_subparser, h_entry);
-        STAILQ_INSERT_HEAD(&h_list->list, subparser, h_entry);
-    }
+    mux_subparser_touch(subparser, mux_proto, now->tv_sec);
 
     if (num_colls > 8) {
         SLOG(num_colls > 100 ? LOG_INFO : LOG_DEBUG, "%u collisions while looking for subparser of %s", num_colls, mux_parser->parser.proto->name);
 #       ifndef NDEBUG
         if (unlikely_(num_colls > 100)) {
             SLOG(LOG_NOTICE, "Dump of first keys for h = %u :", h);
-            SLOG_HEX(LOG_NOTICE, STAILQ_FIRST(&h_list->list)->key, mux_proto->key_size);
-            SLOG_HEX(LOG_NOTICE, STAILQ_FIRST(&h_list->list)->h_entry.stqe_next->key, mux_proto->key_size);
+            SLOG_HEX(LOG_NOTICE, LIST_FIRST(&h_list->list)->key, mux_proto->key_size);
+            SLOG_HEX(LOG_NOTICE, LIST_NEXT(LIST_FIRST(&h_list->list), h_entry)->key, mux_proto->key_size);
         }
 #       endif
     }
@@ -705,17 +1340,8 @@ struct mux_subparser *mux_subparser_lookup(struct mux_parser *mux_parser, struct
 
     mutex_unlock(mutex);
 
-    mux_proto->last_used = now->tv_sec;  // give time to timeouter thread (no need to lock as long as writing a time_t is atomic)
-
-#   ifdef __GNUC__
-    (void)__sync_add_and_fetch(&mux_proto->num_lookups, 1);
-    (void)__sync_add_and_fetch(&mux_proto->num_collisions, num_colls);
-#   else
-    mutex_lock(&mux_proto->proto.lock);
-    mux_proto->num_lookups ++;
-    mux_proto->num_collisions += num_colls;
-    mutex_unlock(&mux_proto->proto.lock);
-#   endif
+    mux_proto_count_lookup(mux_proto, num_colls);
+    mux_parser_count_lookup(mux_parser, num_colls);
 
     if (subparser || ! create_proto) return subparser;
 
@@ -723,19 +1349,50 @@ struct mux_subparser *mux_subparser_lookup(struct mux_parser *mux_parser, struct
     return mux_subparser_and_parser_new(mux_parser, create_proto, requestor, key, now);
 }
 
+__thread struct mux_subparser *mux_subparser_last;
+
+struct mux_subparser *mux_subparser_lookup(struct mux_parser *mux_parser, struct proto *create_proto, struct proto *requestor, void const *key, struct timeval const *now)
+{
+    struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
+    uint_least32_t const h_full = key_hash(key, mux_proto->key_size);
+
+    struct flow_cache *const cache = mux_flow_cache ? flow_cache_get() : NULL;
+    if (! cache) return mux_subparser_last = mux_subparser_lookup_(mux_parser, create_proto, requestor, key, h_full, now);
+
+    // Lookups from outside of a burst (for instance when timeouting waiting lists) must lock the cache themselves
+    bool const outside = cache->depth == 0;
+    if (outside) mutex_lock(&cache->lock);
+
+    struct flow_cache_entry *const entry = flow_cache_entry(cache, mux_parser, h_full);
+    struct mux_subparser *subparser = flow_cache_lookup(cache, entry, mux_parser, create_proto, key, mux_proto->key_size);
+    if (subparser) {
+        mux_subparser_touch(subparser, mux_proto, now->tv_sec);
+        counter_inc(&mux_proto->num_lookups);
+        counter_inc(&mux_proto->num_cache_hits);
+    } else {
+        subparser = mux_subparser_lookup_(mux_parser, create_proto, requestor, key, h_full, now);
+        if (subparser) flow_cache_set(entry, mux_parser, subparser);
+    }
+
+    if (outside) mutex_unlock(&cache->lock);
+    return mux_subparser_last = subparser;
+}
+
 void mux_subparser_change_key(struct mux_subparser *subparser, struct mux_parser *mux_parser, void const *key)
 {
     SLOG(LOG_DEBUG, "Changing key for subparser @%p", subparser);
 
     struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
-    unsigned new_h = hash_key(key, mux_proto->key_size, mux_parser->hash_size);
-    struct subparsers *new_list = h_list_of_h_idx(mux_parser, new_h);
-    struct mutex *new_mutex = mutex_of_h_idx(mux_parser, new_h);
-    struct subparsers *cur_list;
-    struct mutex *cur_mutex;
+    uint_least32_t const new_hash = key_hash(key, mux_proto->key_size);
+    unsigned new_h;
+    struct subparsers *new_list, *cur_list;
+    struct mutex *new_mutex, *cur_mutex;
 
     // Loop until we grab the two required locks (former list and new list)
     do {
+        new_h = bucket_of_hash(mux_parser, new_hash);
+        new_list = h_list_of_h_idx(mux_parser, new_h);
+        new_mutex = mutex_of_h_idx(mux_parser, new_h);
         unsigned const h_idx = subparser->h_idx;
         if (h_idx == NOT_HASHED) return;
         cur_list = h_list_of_subparser_(subparser, h_idx);
@@ -743,8 +1400,8 @@ void mux_subparser_change_key(struct mux_subparser *subparser, struct mux_parser
         cur_mutex = mutex_of_subparser_(subparser, h_idx);
 
         mutex_lock2(cur_mutex, new_mutex);
-        // by the time the locks are acquired maybe another thread changed subparser->h_idx?
-        if (h_idx == (unsigned volatile)subparser->h_idx) break;
+        // by the time the locks are acquired maybe another thread changed subparser->h_idx, or split the new bucket?
+        if (h_idx == (unsigned volatile)subparser->h_idx && new_h == bucket_of_hash(mux_parser, new_hash)) break;
         SLOG(LOG_INFO, "Subparser list changed while waiting for list mutex");
         mutex_unlock2(cur_mutex, new_mutex);
     } while (1);
@@ -768,10 +1425,25 @@ int mux_parser_ctor(struct mux_parser *mux_parser, struct mux_proto *mux_proto,
     mux_parser->hash_size = hash_size;
     mux_parser->num_max_children = num_max_children;
     mux_parser->num_children = 0;
+    mux_parser->index = NULL;
+    mux_parser->num_buckets = hash_size;
+    mux_parser->num_to_split = 0;
+    mux_parser->num_lookups = mux_parser->num_collisions = 0;
+    mux_parser->splitting = 0;
+    mux_parser->segments = NULL;
+    static unsigned flows_mutex_idx;    // no need to be exact
+    mux_parser->flows_mutex = mux_proto->flows_mutexes + (flows_mutex_idx++ % NB_ELEMS(mux_proto->flows_mutexes));
+    for (unsigned c = 0; c < NB_ELEMS(mux_parser->flows); c++) TAILQ_INIT(&mux_parser->flows[c]);
 
     for (unsigned h = 0; h < mux_parser->hash_size; h++) {
         struct subparsers *const h_list = mux_parser->subparsers + h;
-        STAILQ_INIT(&h_list->list);
+        LIST_INIT(&h_list->list);
+    }
+
+    if (mux_proto->lockfree) {
+        // Room for twice as many subparsers as expected, so that probes are short
+        mux_parser->index = mux_index_new(2 * MAX(hash_size, num_max_children));
+        if (! mux_parser->index) SLOG(LOG_WARNING, "Cannot alloc lock-free index for %s, will use locks", parser_name(&mux_parser->parser));
     }
 
     return 0;
@@ -816,19 +1488,33 @@ void mux_parser_dtor(struct mux_parser *mux_parser)
      * Also, even if subparsers cannot reach us they can reach the hash list they are on!
      * Hopefully since we are not reachable no new subparser will end up in our hash (addition
      * or change key require a ref on us). */
-    for (unsigned h = 0; h < mux_parser->hash_size; h++) {
+    for (unsigned h = 0; h < mux_parser->num_buckets; h++) {
         struct subparsers *const h_list = h_list_of_h_idx(mux_parser, h);
         struct mutex *const mutex = mutex_of_h_idx(mux_parser, h);
 
         mutex_lock(mutex);
         struct mux_subparser *subparser;
-        while (NULL != (subparser = STAILQ_FIRST(&h_list->list))) {
-            assert(subparser->h_idx % mux_parser->hash_size == h);
+        while (NULL != (subparser = LIST_FIRST(&h_list->list))) {
+            assert(subparser->h_idx == h);
             mux_subparser_deindex_locked(subparser);
         }
         mutex_unlock(mutex);
     }
     assert(mux_parser->num_children == 0);
+    for (unsigned c = 0; c < NB_ELEMS(mux_parser->flows); c++) assert(TAILQ_EMPTY(&mux_parser->flows[c]));
+
+    if (mux_parser->segments) {
+        for (unsigned s = 0; s < NB_MUX_SEGMENTS; s++) {
+            if (mux_parser->segments[s]) objfree(mux_parser->segments[s]);
+        }
+        objfree(mux_parser->segments);
+        mux_parser->segments = NULL;
+    }
+
+    if (mux_parser->index) {
+        mux_index_del(mux_parser->index);
+        mux_parser->index = NULL;
+    }
 
     // Then ancestor parser
     parser_dtor(&mux_parser->parser);
@@ -848,14 +1534,23 @@ void mux_proto_ctor(struct mux_proto *mux_proto, struct proto_ops const *ops, st
     mux_proto->hash_size = hash_size;
     mux_proto->key_size = key_size;
     mux_proto->num_max_children = 0;
-    mux_proto->num_infanticide = 0;
-    mux_proto->num_collisions = 0;
-    mux_proto->num_lookups = 0;
-    mux_proto->num_timeouts = 0;
+    mux_proto->lockfree = false;
+    counter_ctor(&mux_proto->num_infanticide);
+    for (unsigned c = 0; c < NB_ELEMS(mux_proto->num_evictions); c++) counter_ctor(&mux_proto->num_evictions[c]);
+    counter_ctor(&mux_proto->num_denied);
+    counter_ctor(&mux_proto->num_subparsers);
+    counter_ctor(&mux_proto->extra_bytes);
+    mux_proto->subparser_size = 0;
+    counter_ctor(&mux_proto->num_collisions);
+    counter_ctor(&mux_proto->num_lookups);
+    counter_ctor(&mux_proto->num_timeouts);
+    counter_ctor(&mux_proto->num_unindexed);
+    counter_ctor(&mux_proto->num_cache_hits);
     mux_proto->last_used = 0;
     for (unsigned m = 0; m < NB_ELEMS(mux_proto->mutexes); m++) {
         mutex_ctor_recursive(&mux_proto->mutexes[m].mutex, "subparsers");
-        TAILQ_INIT(&mux_proto->mutexes[m].timeout_queue);
+        timer_wheel_ctor(&mux_proto->mutexes[m].wheel, mux_subparser_timeout);
+        mutex_ctor(&mux_proto->flows_mutexes[m], "mux flows");
     }
     LIST_INSERT_HEAD(&mux_protos, mux_proto, entry);
 }
@@ -865,10 +1560,22 @@ void mux_proto_dtor(struct mux_proto *mux_proto)
     LIST_REMOVE(mux_proto, entry);
     for (unsigned m = 0; m < NB_ELEMS(mux_proto->mutexes); m++) {
         mutex_dtor(&mux_proto->mutexes[m].mutex);
-        if (! TAILQ_EMPTY(&mux_proto->mutexes[m].timeout_queue)) {
-            SLOG(LOG_NOTICE, "While destructing proto %s, timeout_queue %u not empty", mux_proto->proto.name, m);
+        if (mux_proto->mutexes[m].wheel.num_timers > 0) {
+            SLOG(LOG_NOTICE, "While destructing proto %s, timer wheel %u not empty", mux_proto->proto.name, m);
         }
+        timer_wheel_dtor(&mux_proto->mutexes[m].wheel);
+        mutex_dtor(&mux_proto->flows_mutexes[m]);
     }
+    counter_dtor(&mux_proto->num_cache_hits);
+    counter_dtor(&mux_proto->num_unindexed);
+    counter_dtor(&mux_proto->num_timeouts);
+    counter_dtor(&mux_proto->num_lookups);
+    counter_dtor(&mux_proto->num_collisions);
+    counter_dtor(&mux_proto->extra_bytes);
+    counter_dtor(&mux_proto->num_subparsers);
+    counter_dtor(&mux_proto->num_denied);
+    for (unsigned c = 0; c < NB_ELEMS(mux_proto->num_evictions); c++) counter_dtor(&mux_proto->num_evictions[c]);
+    counter_dtor(&mux_proto->num_infanticide);
     proto_dtor(&mux_proto->proto);
 }
 
@@ -877,37 +1584,46 @@ struct mux_proto_ops mux_proto_ops = {
     .subparser_del = mux_subparser_del,
 };
 
-static pthread_t timeouter_pth;
+static struct timer_ticker mux_ticker;
+static unsigned armed_timeout;  // the mux_timeout the subparsers timers were armed with (only used by the timers thread)
 
-static void mux_proto_timeout(struct mux_proto *mux_proto)
+static void mux_proto_timeout(struct mux_proto *mux_proto, bool check_all)
 {
-    unsigned count = 0;
+    uint64_t const num_timeouts = counter_read(&mux_proto->num_timeouts);
+    time_t const now = mux_proto->last_used;    // safe here
 
     for (unsigned m = 0; m < NB_ELEMS(mux_proto->mutexes); m++) {
+        struct per_mutex *const to_list = mux_proto->mutexes + m;
         enter_mono_region();
-        mutex_lock(&mux_proto->mutexes[m].mutex);
-        count += mux_subparsers_timeout(mux_proto, mux_proto->mutexes+m, mux_timeout, mux_proto->last_used /* safe here */);
-        mutex_unlock(&mux_proto->mutexes[m].mutex);
+        mutex_lock(&to_list->mutex);
+        if (check_all) {
+            (void)timer_wheel_flush(&to_list->wheel, now);
+        } else {
+            (void)timer_wheel_advance(&to_list->wheel, now);
+        }
+        mutex_unlock(&to_list->mutex);
         leave_protected_region();
     }
 
-    SLOG(count > 0 ? LOG_INFO:LOG_DEBUG, "Timeouted %u subparsers of proto %s", count, mux_proto->proto.name);
+    uint64_t const count = counter_read(&mux_proto->num_timeouts) - num_timeouts;
+    SLOG(count > 0 ? LOG_INFO:LOG_DEBUG, "Timeouted %"PRIu64" subparsers of proto %s", count, mux_proto->proto.name);
 }
 
-static void *timeouter_thread(void unused_ *dummy)
+static void mux_tick(struct timer_ticker unused_ *ticker)
 {
-    set_thread_name("J-timeouter");
-    disable_cancel();
+    /* Timers armed before mux_timeout was shortened (or enabled) would fire
+     * too late, so then (and when we are overweight) check them all at once. */
+    unsigned const timeout_s = mux_timeout;
+    bool const check_all = overweight || (timeout_s && (! armed_timeout || timeout_s < armed_timeout));
+    armed_timeout = timeout_s;
 
-    while (1) {
-        struct mux_proto *mux_proto;
-        LIST_FOREACH(mux_proto, &mux_protos, entry) {
-            mux_proto_timeout(mux_proto);
-        }
-
-        cancellable_sleep(1);
+    struct mux_proto *mux_proto;
+    LIST_FOREACH(mux_proto, &mux_protos, entry) {
+        mux_proto_timeout(mux_proto, check_all);
     }
-    return NULL;
+
+    // So that the caches of threads that stopped parsing do not keep the subparsers we just timeouted
+    flow_caches_evict_deindexed();
 }
 
 /*
@@ -989,6 +1705,15 @@ static SCM num_infanticide_sym;
 static SCM num_collisions_sym;
 static SCM num_lookups_sym;
 static SCM num_timeouts_sym;
+static SCM lockfree_sym;
+static SCM num_cache_hits_sym;
+static SCM num_unindexed_sym;
+static SCM num_denied_sym;
+static SCM num_subparsers_sym;
+static SCM subparser_size_sym;
+static SCM extra_bytes_sym;
+static SCM bytes_per_flow_sym;
+static SCM num_evicted_sym[MUX_NB_FLOW_CLASSES];
 
 static struct ext_function sg_mux_proto_stats;
 static SCM g_mux_proto_stats(SCM name_)
@@ -996,13 +1721,30 @@ static SCM g_mux_proto_stats(SCM name_)
     struct mux_proto *mux_proto = mux_proto_of_scm_name(name_);
     if (! mux_proto) return SCM_UNSPECIFIED;
 
+    // Memory footprint of the flows (reading num_subparsers and extra_bytes as signed since they can be off a bit)
+    int64_t const num_subparsers = counter_read(&mux_proto->num_subparsers);
+    int64_t const extra_bytes = counter_read(&mux_proto->extra_bytes);
+    size_t const subparser_size = mux_proto->subparser_size;
+    uint64_t const bytes_per_flow = subparser_size + (num_subparsers > 0 && extra_bytes > 0 ? extra_bytes / num_subparsers : 0);
+
     SCM alist = scm_list_n(
         scm_cons(hash_size_sym,       scm_from_uint(mux_proto->hash_size)),
         scm_cons(num_max_children_sym, scm_from_uint(mux_proto->num_max_children)),
-        scm_cons(num_infanticide_sym,  scm_from_uint64(mux_proto->num_infanticide)),
-        scm_cons(num_collisions_sym,   scm_from_uint64(mux_proto->num_collisions)),
-        scm_cons(num_lookups_sym,      scm_from_uint64(mux_proto->num_lookups)),
-        scm_cons(num_timeouts_sym,     scm_from_uint64(mux_proto->num_timeouts)),
+        scm_cons(num_infanticide_sym,  scm_from_uint64(counter_read(&mux_proto->num_infanticide))),
+        scm_cons(num_collisions_sym,   scm_from_uint64(counter_read(&mux_proto->num_collisions))),
+        scm_cons(num_lookups_sym,      scm_from_uint64(counter_read(&mux_proto->num_lookups))),
+        scm_cons(num_timeouts_sym,     scm_from_uint64(counter_read(&mux_proto->num_timeouts))),
+        scm_cons(lockfree_sym,         scm_from_bool(mux_proto->lockfree)),
+        scm_cons(num_unindexed_sym,    scm_from_uint64(counter_read(&mux_proto->num_unindexed))),
+        scm_cons(num_cache_hits_sym,   scm_from_uint64(counter_read(&mux_proto->num_cache_hits))),
+        scm_cons(num_denied_sym,       scm_from_uint64(counter_read(&mux_proto->num_denied))),
+        scm_cons(num_evicted_sym[MUX_FLOW_EMBRYONIC],   scm_from_uint64(counter_read(&mux_proto->num_evictions[MUX_FLOW_EMBRYONIC]))),
+        scm_cons(num_evicted_sym[MUX_FLOW_ESTABLISHED], scm_from_uint64(counter_read(&mux_proto->num_evictions[MUX_FLOW_ESTABLISHED]))),
+        scm_cons(num_evicted_sym[MUX_FLOW_ACTIVE],      scm_from_uint64(counter_read(&mux_proto->num_evictions[MUX_FLOW_ACTIVE]))),
+        scm_cons(num_subparsers_sym,   scm_from_int64(num_subparsers)),
+        scm_cons(subparser_size_sym,   scm_from_size_t(subparser_size)),
+        scm_cons(extra_bytes_sym,      scm_from_int64(extra_bytes)),
+        scm_cons(bytes_per_flow_sym,   scm_from_uint64(bytes_per_flow)),
         SCM_UNDEFINED);
     return alist;
 }
@@ -1021,8 +1763,8 @@ static SCM g_proto_stats(SCM name_)
 
     return scm_list_5(
         scm_cons(enabled_sym,    scm_from_bool(proto->enabled)),
-        scm_cons(num_frames_sym,  scm_from_int64(proto->num_frames)),
-        scm_cons(num_bytes_sym,   scm_from_int64(proto->num_bytes)),
+        scm_cons(num_frames_sym,  scm_from_int64(counter_read(&proto->num_frames))),
+        scm_cons(num_bytes_sym,   scm_from_int64(counter_read(&proto->num_bytes))),
         scm_cons(num_parsers_sym, scm_from_uint(proto->num_parsers)),
         scm_cons(num_fuzzed_sym,  scm_from_uint(proto->fuzzed_times)));
 }
@@ -1050,8 +1792,22 @@ static SCM g_mux_proto_set_hash_size(SCM name_, SCM hash_size_)
     unsigned const hash_size = scm_to_uint(hash_size_);
     mutex_lock(&mux_proto->proto.lock);
     mux_proto->hash_size = hash_size;
-    mux_proto->num_collisions = 0;
-    mux_proto->num_lookups = 0;
+    counter_reset(&mux_proto->num_collisions);
+    counter_reset(&mux_proto->num_lookups);
+    mutex_unlock(&mux_proto->proto.lock);
+
+    return SCM_BOOL_T;
+}
+
+static struct ext_function sg_mux_proto_set_lockfree;
+static SCM g_mux_proto_set_lockfree(SCM name_, SCM lockfree_)
+{
+    struct mux_proto *mux_proto = mux_proto_of_scm_name(name_);
+    if (! mux_proto) return SCM_UNSPECIFIED;
+
+    bool const lockfree = scm_to_bool(lockfree_);
+    mutex_lock(&mux_proto->proto.lock);
+    mux_proto->lockfree = lockfree;
     mutex_unlock(&mux_proto->proto.lock);
 
     return SCM_BOOL_T;
@@ -1074,17 +1830,25 @@ void proto_init(void)
     bench_init();
     log_category_proto_init();
     mutex_init();
+    counter_init();
+    timer_wheel_init();
     ext_param_num_fuzzed_bits_init();
     ext_param_mux_timeout_init();
     ext_param_denied_parsers_init();
+    ext_param_mux_grow_collisions_init();
+    ext_param_mux_max_hash_size_init();
+    ext_param_mux_flow_cache_init();
+    mutex_ctor(&flow_caches_lock, "flow caches");
+    int err = pthread_key_create(&flow_cache_key, flow_cache_del);
+    if (err) {
+        SLOG(LOG_ERR, "Cannot pthread_key_create(): %s", strerror(err));
+    }
 
     hook_ctor(&pkt_hook, "pkt hook");
 
-    // A thread to timeout all mux_subparsers
-    int err = pthread_create(&timeouter_pth, NULL, timeouter_thread, NULL);
-    if (err) {
-        SLOG(LOG_ERR, "Cannot pthread_create(): %s", strerror(err));
-    }
+    // Timeout all mux_subparsers
+    armed_timeout = mux_timeout;
+    timer_ticker_ctor(&mux_ticker, "timeout subparsers", mux_tick);
 
     hash_size_sym       = scm_permanent_object(scm_from_latin1_symbol("hash-size"));
     num_max_children_sym = scm_permanent_object(scm_from_latin1_symbol("num-max-children"));
@@ -1092,6 +1856,17 @@ void proto_init(void)
     num_collisions_sym   = scm_permanent_object(scm_from_latin1_symbol("num-collisions"));
     num_lookups_sym      = scm_permanent_object(scm_from_latin1_symbol("num-lookups"));
     num_timeouts_sym     = scm_permanent_object(scm_from_latin1_symbol("num-timeouts"));
+    lockfree_sym         = scm_permanent_object(scm_from_latin1_symbol("lockfree"));
+    num_unindexed_sym    = scm_permanent_object(scm_from_latin1_symbol("num-unindexed"));
+    num_cache_hits_sym   = scm_permanent_object(scm_from_latin1_symbol("num-cache-hits"));
+    num_denied_sym       = scm_permanent_object(scm_from_latin1_symbol("num-denied"));
+    num_subparsers_sym   = scm_permanent_object(scm_from_latin1_symbol("num-subparsers"));
+    subparser_size_sym   = scm_permanent_object(scm_from_latin1_symbol("subparser-size"));
+    extra_bytes_sym      = scm_permanent_object(scm_from_latin1_symbol("extra-bytes"));
+    bytes_per_flow_sym   = scm_permanent_object(scm_from_latin1_symbol("bytes-per-flow"));
+    num_evicted_sym[MUX_FLOW_EMBRYONIC]   = scm_permanent_object(scm_from_latin1_symbol("num-evicted-embryonic"));
+    num_evicted_sym[MUX_FLOW_ESTABLISHED] = scm_permanent_object(scm_from_latin1_symbol("num-evicted-established"));
+    num_evicted_sym[MUX_FLOW_ACTIVE]      = scm_permanent_object(scm_from_latin1_symbol("num-evicted-active"));
     enabled_sym         = scm_permanent_object(scm_from_latin1_symbol("enabled"));
     num_frames_sym       = scm_permanent_object(scm_from_latin1_symbol("num-frames"));
     num_bytes_sym        = scm_permanent_object(scm_from_latin1_symbol("num-bytes"));
@@ -1116,22 +1891,33 @@ void proto_init(void)
         "(mux-stats \"proto-name\"): returns various stats about this multiplexer.\n"
         "BEWARE that currently alive multiplexers may have different settings!\n"
         "See also (? 'mux-names) for a list of protocol names that are multiplexers.\n"
-        "         (? 'set-max-children) and (? 'set-mux-hash-size) for altering a multiplexer.\n");
+        "         (? 'set-max-children), (? 'set-mux-hash-size) and (? 'set-mux-lockfree) for altering a multiplexer.\n");
 
     ext_function_ctor(&sg_mux_proto_set_max_children,
         "set-max-children", 2, 0, 0, g_mux_proto_set_max_children,
         "(set-max-children \"proto-name\" n): limits the number of children of each parser of this protocol to n.\n"
-        "Once n is reached, a child is killed at random.\n"
+        "Once n is reached, a child is killed for each new one: the least recently used of the oldest\n"
+        "children of the lowest class (embryonic, then established, then active).\n"
+        "Only parsers created afterward are limited.\n"
         "If n is 0, then there is no such limit.\n"
         "See also (? 'mux-names) for a list of protocol names that are multiplexers.\n");
 
     ext_function_ctor(&sg_mux_proto_set_hash_size,
         "set-mux-hash-size", 2, 0, 0, g_mux_proto_set_hash_size,
-        "(set-mux-hash-size \"proto-name\" n): sets the hash size for newly created parsers of this protocol.\n"
+        "(set-mux-hash-size \"proto-name\" n): sets the initial hash size for newly created parsers of this protocol.\n"
+        "Hashes then grow by themselves when lookups meet too many collisions (see (? 'mux-grow-collisions)).\n"
         "Beware of max allowed childrens whenever you change this value.\n"
         "See also (? 'set-max-children) for setting the max number of allowed child for newly created parsers of a protocol.\n"
         "         (? 'mux-names) for a list of protocol names that are multiplexers.\n");
 
+    ext_function_ctor(&sg_mux_proto_set_lockfree,
+        "set-mux-lockfree", 2, 0, 0, g_mux_proto_set_lockfree,
+        "(set-mux-lockfree \"proto-name\" #t): newly created parsers of this protocol will also index their children\n"
+        "in a table that can be looked up without locks, which scales better with the number of parsing threads.\n"
+        "This table has room for twice the hash size (or max children, if greater); children that do not fit\n"
+        "are still found, but with locks (see num-unindexed in (? 'mux-stats)).\n"
+        "See also (? 'mux-names) for a list of protocol names that are multiplexers.\n");
+
     ext_function_ctor(&sg_set_proto_enabled,
         "set-proto-enabled", 2, 0, 0, g_set_proto_enabled,
         "(set-proto-enabled \"TCP\" #f): disable TCP protocol.\n"
@@ -1143,19 +1929,26 @@ void proto_init(void)
 
 void proto_fini(void)
 {
-    SLOG(LOG_DEBUG, "Terminating timeouter thread...");
-    (void)pthread_cancel(timeouter_pth);
-    (void)pthread_join(timeouter_pth, NULL);
+    timer_ticker_dtor(&mux_ticker);
+
+    if (flow_cache) flow_cache_del(flow_cache);  // other threads' ones were deleted when they terminated
+    (void)pthread_key_delete(flow_cache_key);
+    mutex_dtor(&flow_caches_lock);
 
 #   ifdef DELETE_ALL_AT_EXIT
     hook_dtor(&pkt_hook);
 #   endif
 
     dummy_fini();
+    ext_param_mux_flow_cache_fini();
+    ext_param_mux_max_hash_size_fini();
+    ext_param_mux_grow_collisions_fini();
     ext_param_denied_parsers_fini();
     ext_param_mux_timeout_fini();
     ext_param_num_fuzzed_bits_fini();
     log_category_proto_fini();
+    timer_wheel_fini();
+    counter_fini();
     mutex_fini();
     bench_fini();
 }
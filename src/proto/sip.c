@@ -31,6 +31,7 @@
 #include "junkie/tools/tempstr.h"
 #include "junkie/tools/hash.h"
 #include "junkie/tools/mutex.h"
+#include "junkie/tools/timer_wheel.h"
 #include "junkie/proto/ip.h"
 #include "junkie/proto/tcp.h"
 #include "junkie/proto/udp.h"
@@ -53,7 +54,7 @@ LOG_CATEGORY_DEF(proto_sip);
 
 struct callid_2_sdp {
     HASH_ENTRY(callid_2_sdp) entry;     // entry in the hash
-    TAILQ_ENTRY(callid_2_sdp) used_entry;   // entry in the used list
+    struct timer timer;                 // fires when it may have timeouted
     char call_id[SIP_CALLID_LEN+1];
     struct parser *sdp_parser;
     struct timeval last_used;
@@ -61,16 +62,18 @@ struct callid_2_sdp {
 
 // The hash itself
 static HASH_TABLE(callids_2_sdps, callid_2_sdp) callids_2_sdps;
-// A list of all entries, in LRU order
-static TAILQ_HEAD(callids_2_sdps_tq, callid_2_sdp) callids_2_sdps_used = TAILQ_HEAD_INITIALIZER(callids_2_sdps_used);
-// A mutex to protect both the hash and the tailqueue
+// The timers of all entries
+static struct timer_wheel callids_2_sdps_wheel;
+// The last time we saw a SIP message with SDP
+static time_t callids_2_sdps_last;
+// A mutex to protect the hash, the wheel and the above time
 static struct mutex callids_2_sdps_mutex;
 
 static void callid_2_sdp_dtor(struct callid_2_sdp *c2s)
 {
     SLOG(LOG_DEBUG, "Destruct callid_2_sdp@%p for callid '%s'", c2s, c2s->call_id);
     HASH_REMOVE(&callids_2_sdps, c2s, entry);
-    TAILQ_REMOVE(&callids_2_sdps_used, c2s, used_entry);
+    timer_cancel(&callids_2_sdps_wheel, &c2s->timer);
     parser_unref(&c2s->sdp_parser);
 }
 
@@ -80,18 +83,25 @@ static void callid_2_sdp_del(struct callid_2_sdp *c2s)
     objfree(c2s);
 }
 
-static void callids_2_sdps_timeout(struct timeval const *now)
+static void callid_2_sdp_arm(struct callid_2_sdp *c2s, time_t now)
 {
-    PTHREAD_ASSERT_LOCK(&callids_2_sdps_mutex.mutex);
-    struct callid_2_sdp *c2s;
-    while (NULL != (c2s = TAILQ_FIRST(&callids_2_sdps_used))) {
-        if (likely_(timeval_sub(now, &c2s->last_used) <= CALLID_TIMEOUT * 1000000LL)) break;
+    time_t const expiry = c2s->last_used.tv_sec + CALLID_TIMEOUT + 1;
+    timer_arm(&callids_2_sdps_wheel, &c2s->timer, MAX(expiry, now + 1));
+}
 
+// Called with callids_2_sdps_mutex locked
+static void callid_2_sdp_timeout(struct timer_wheel unused_ *wheel, struct timer *timer, time_t now)
+{
+    struct callid_2_sdp *c2s = DOWNCAST(timer, timer, callid_2_sdp);
+    if (c2s->last_used.tv_sec + CALLID_TIMEOUT < now) {
         SLOG(LOG_DEBUG, "Timeouting callid_2_sdp@%p for callid '%s'", c2s, c2s->call_id);
         callid_2_sdp_del(c2s);
+    } else {    // used since
+        callid_2_sdp_arm(c2s, now);
     }
 }
 
+// Caller must own callids_2_sdps_mutex
 static int callid_2_sdp_ctor(struct callid_2_sdp *c2s, char const *call_id, struct timeval const *now)
 {
     SLOG(LOG_DEBUG, "Construct callid_2_sdp@%p for callid '%s'", c2s, call_id);
@@ -100,14 +110,13 @@ static int callid_2_sdp_ctor(struct callid_2_sdp *c2s, char const *call_id, stru
     memset(c2s->call_id, 0, sizeof c2s->call_id); // because it's used as a hash key
     snprintf(c2s->call_id, sizeof(c2s->call_id), "%s", call_id);
     c2s->last_used = *now;
-    mutex_lock(&callids_2_sdps_mutex);
-    callids_2_sdps_timeout(now);
+    timer_ctor(&c2s->timer);
+    callid_2_sdp_arm(c2s, now->tv_sec);
     HASH_INSERT(&callids_2_sdps, c2s, &c2s->call_id, entry);
-    TAILQ_INSERT_TAIL(&callids_2_sdps_used, c2s, used_entry);
-    mutex_unlock(&callids_2_sdps_mutex);
     return 0;
 }
 
+// Caller must own callids_2_sdps_mutex
 static struct callid_2_sdp *callid_2_sdp_new(char const *call_id, struct timeval const *now)
 {
     struct callid_2_sdp *c2s = objalloc_nice(sizeof(*c2s), "SIP->SDP");
@@ -119,13 +128,19 @@ static struct callid_2_sdp *callid_2_sdp_new(char const *call_id, struct timeval
     return c2s;
 }
 
+// Caller must own callids_2_sdps_mutex
 static void callid_2_sdp_touch(struct callid_2_sdp *c2s, struct timeval const *now)
 {
-    mutex_lock(&callids_2_sdps_mutex);
-    c2s->last_used = *now;
-    TAILQ_REMOVE(&callids_2_sdps_used, c2s, used_entry);
-    TAILQ_INSERT_TAIL(&callids_2_sdps_used, c2s, used_entry);
-    mutex_unlock(&callids_2_sdps_mutex);
+    c2s->last_used = *now;  // its timer will be rearmed when it fires
+}
+
+static struct timer_ticker callids_2_sdps_ticker;
+
+static void callids_2_sdps_tick(struct timer_ticker unused_ *ticker)
+{
+    WITH_LOCK(&callids_2_sdps_mutex) {
+        if (callids_2_sdps_last) (void)timer_wheel_advance(&callids_2_sdps_wheel, callids_2_sdps_last);
+    }
 }
 
 /*
@@ -434,29 +449,31 @@ static enum proto_parse_status sip_parse(struct parser *parser, struct proto_inf
     ) {
         mutex_lock(&callids_2_sdps_mutex);
         // Maybe rehash the hash?
-        static time_t last_rehash = 0; // timestamp (seconds) of the last rehash
-        if (now->tv_sec > last_rehash) {
-            last_rehash = now->tv_sec;
+        if (now->tv_sec > callids_2_sdps_last) {
+            callids_2_sdps_last = now->tv_sec;
             HASH_TRY_REHASH(&callids_2_sdps, call_id, entry);
         }
         // Retrieve the global SDP for this call-id
         struct callid_2_sdp *c2s;
         SLOG(LOG_DEBUG, "Look for a callid_2_sdp for callid '%s'", info.call_id);
         HASH_LOOKUP(c2s, &callids_2_sdps, &info.call_id, call_id, entry);
-        mutex_unlock(&callids_2_sdps_mutex);
         if (c2s) {
             SLOG(LOG_DEBUG, "Found a previous callid_2_sdp@%p", c2s);
             callid_2_sdp_touch(c2s, now);
         } else {
             c2s = callid_2_sdp_new(info.call_id, now);
         }
-        if (c2s) subparser = c2s->sdp_parser;
+        // Keep a ref to the parser since c2s may timeout as soon as we unlock
+        if (c2s) subparser = parser_ref(c2s->sdp_parser);
+        mutex_unlock(&callids_2_sdps_mutex);
     }
 #   undef MIME_SDP
 
     if (! subparser) goto fallback;
 
-    if (0 != proto_parse(subparser, &info.info, way, packet + siphdr_len, cap_len - siphdr_len, wire_len - siphdr_len, now, tot_cap_len, tot_packet)) goto fallback;
+    status = proto_parse(subparser, &info.info, way, packet + siphdr_len, cap_len - siphdr_len, wire_len - siphdr_len, now, tot_cap_len, tot_packet);
+    parser_unref(&subparser);
+    if (status != PROTO_OK) goto fallback;
     return PROTO_OK;
 
 fallback:
@@ -476,8 +493,11 @@ void sip_init(void)
 {
     log_category_proto_sip_init();
     hash_init();
+    timer_wheel_init();
     mutex_ctor(&callids_2_sdps_mutex, "callids_2_sdps");
     HASH_INIT(&callids_2_sdps, 67, "SIP->SDP");
+    timer_wheel_ctor(&callids_2_sdps_wheel, callid_2_sdp_timeout);
+    timer_ticker_ctor(&callids_2_sdps_ticker, "timeout SIP callids", callids_2_sdps_tick);
     httper_ctor(&httper, NB_ELEMS(httper_commands), httper_commands, NB_ELEMS(httper_fields), httper_fields);
 
     static struct proto_ops const ops = {
@@ -494,14 +514,23 @@ void sip_init(void)
 
 void sip_fini(void)
 {
+    timer_ticker_dtor(&callids_2_sdps_ticker);
 #   ifdef DELETE_ALL_AT_EXIT
     port_muxer_dtor(&tcp_port_muxer, &tcp_port_muxers);
     port_muxer_dtor(&udp_port_muxer, &udp_port_muxers);
     uniq_proto_dtor(&uniq_proto_sip);
     httper_dtor(&httper);
+    WITH_LOCK(&callids_2_sdps_mutex) {
+        struct timer *timer;
+        while (NULL != (timer = timer_wheel_first(&callids_2_sdps_wheel))) {
+            callid_2_sdp_del(DOWNCAST(timer, timer, callid_2_sdp));
+        }
+    }
+    timer_wheel_dtor(&callids_2_sdps_wheel);
     HASH_DEINIT(&callids_2_sdps);
     mutex_dtor(&callids_2_sdps_mutex);
 #   endif
     log_category_proto_sip_fini();
+    timer_wheel_fini();
     hash_fini();
 }
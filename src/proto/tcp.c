@@ -42,6 +42,9 @@ LOG_CATEGORY_DEF(proto_tcp);
 
 #define TCP_HASH_SIZE 67
 
+static bool lazy_flows = false;
+EXT_PARAM_RW(lazy_flows, "tcp-lazy-flows", bool, "Do not give a subparser to a TCP connection before a SYN-ACK or some payload is seen (so that SYN floods and scans do not fill the TCP multiplexers).")
+
 /*
  * Proto Infos
  */
@@ -210,13 +213,18 @@ static struct pkt_wl_config tcp_wl_config;
 
 static struct mutex_pool tcp_locks;
 
-// We overload the mux_subparser in order to store a waiting list.
+/* We overload the mux_subparser in order to store a waiting list per way.
+ * But most connections never see a single segment out of order, so these are
+ * only allocated at the first one that cannot be parsed at once. */
 struct tcp_subparser {
     uint32_t fin_seqnum[2];     // indice = way
     uint32_t max_acknum[2];
     uint32_t isn[2];            // if syn, used to compute relative seqnum.
     uint32_t wl_origin[2];      // if origin, the origin for our waiting list (ideally, wl_origin == isn).
-    struct pkt_wait_list wl[2]; // for packets reordering. offsets will be relative to wl_origin
+    uint32_t next_offset[2];    // while we have no reorder, the offset (relative to wl_origin) of the next segment we expect
+    struct tcp_reorder {
+        struct pkt_wait_list wl[2]; // for packets reordering. offsets will be relative to wl_origin
+    } *reorder;                 // NULL until some segment must wait
     struct mutex *mutex;        // protects this structure
 #   define SET_FOR_WAY(way, field) (field |= (1U<<way))
 #   define RESET_FOR_WAY(way, field) (field &= ~(1U<<way))
@@ -261,25 +269,36 @@ static int tcp_subparser_ctor(struct tcp_subparser *tcp_sub, struct mux_parser *
     tcp_sub->syn = 0;
     tcp_sub->origin = 0;
     tcp_sub->srv_set = 0;   // will be set later
+    tcp_sub->next_offset[0] = tcp_sub->next_offset[1] = 0;  // relative to the ISN
+    tcp_sub->reorder = NULL;
+    tcp_sub->mutex = mutex_pool_anyone(&tcp_locks);
 
-    if (0 != pkt_wait_list_ctor(tcp_sub->wl+0, 0 /* relative to the ISN */, &tcp_wl_config, child, tcp_sub->wl+1)) {
-        return -1;
-    }
+    // Now that everything is ready, make this subparser public
+    return mux_subparser_ctor(&tcp_sub->mux_subparser, mux_parser, child, requestor, key, now);
+}
 
-    if (0 != pkt_wait_list_ctor(tcp_sub->wl+1, 0 /* relative to the ISN */, &tcp_wl_config, child, tcp_sub->wl+0)) {
-        pkt_wait_list_dtor(tcp_sub->wl+0);
+// Caller must own tcp_sub->mutex
+static int tcp_subparser_reorder(struct tcp_subparser *tcp_sub)
+{
+    struct tcp_reorder *reorder = objalloc_nice(sizeof(*reorder), "TCP reorders");
+    if (! reorder) return -1;
+    SLOG(LOG_DEBUG, "TCP subparser@%p needs to reorder", tcp_sub);
+
+    // The waiting lists take over from where we are
+    struct parser *child = tcp_sub->mux_subparser.parser;
+    if (0 != pkt_wait_list_ctor(reorder->wl+0, tcp_sub->next_offset[0], &tcp_wl_config, child, reorder->wl+1)) {
+        objfree(reorder);
         return -1;
     }
 
-    tcp_sub->mutex = mutex_pool_anyone(&tcp_locks);
-
-    // Now that everything is ready, make this subparser public
-    if (0 != mux_subparser_ctor(&tcp_sub->mux_subparser, mux_parser, child, requestor, key, now)) {
-        pkt_wait_list_dtor(tcp_sub->wl+0);
-        pkt_wait_list_dtor(tcp_sub->wl+1);
+    if (0 != pkt_wait_list_ctor(reorder->wl+1, tcp_sub->next_offset[1], &tcp_wl_config, child, reorder->wl+0)) {
+        pkt_wait_list_dtor(reorder->wl+0);
+        objfree(reorder);
         return -1;
     }
 
+    mux_subparser_account(&tcp_sub->mux_subparser, sizeof(*reorder));
+    tcp_sub->reorder = reorder;
     return 0;
 }
 
@@ -309,8 +328,13 @@ static void tcp_subparser_dtor(struct tcp_subparser *tcp_subparser)
 {
     SLOG(LOG_DEBUG, "Destructing TCP subparser @%p", tcp_subparser);
 
-    pkt_wait_list_dtor(tcp_subparser->wl+0);
-    pkt_wait_list_dtor(tcp_subparser->wl+1);
+    if (tcp_subparser->reorder) {
+        pkt_wait_list_dtor(tcp_subparser->reorder->wl+0);
+        pkt_wait_list_dtor(tcp_subparser->reorder->wl+1);
+        mux_subparser_account(&tcp_subparser->mux_subparser, -(ssize_t)sizeof(*tcp_subparser->reorder));
+        objfree(tcp_subparser->reorder);
+        tcp_subparser->reorder = NULL;
+    }
 
     mux_subparser_dtor(&tcp_subparser->mux_subparser);
 }
@@ -393,6 +417,13 @@ enum proto_parse_status tcp_parse(struct parser *parser, struct proto_info *pare
     struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &key, now);
     if (subparser) SLOG(LOG_DEBUG, "Found subparser@%p for this cnx, for proto %s", subparser->parser, subparser->parser->proto->name);
 
+    if (! subparser && lazy_flows && !(info.syn && info.ack) && info.info.payload == 0) {
+        // A lone SYN, or what remains of a connection: not worth a subparser yet
+        struct mux_proto *mux_proto = DOWNCAST(parser->proto, proto, mux_proto);
+        counter_inc(&mux_proto->num_denied);
+        goto fallback;
+    }
+
     if (! subparser) {
         struct proto *requestor = NULL;
         struct proto *sub_proto = NULL;
@@ -431,6 +462,14 @@ enum proto_parse_status tcp_parse(struct parser *parser, struct proto_info *pare
         SET_FOR_WAY(way, tcp_sub->syn);
         tcp_sub->isn[way] = info.seq_num;
     }
+    if (
+        lazy_flows && info.syn && info.ack &&
+        !IS_SET_FOR_WAY(!way, tcp_sub->syn) && !IS_SET_FOR_WAY(!way, tcp_sub->origin)
+    ) {
+        // The SYN we did not keep track of is acknowledged by this SYN-ACK
+        SET_FOR_WAY(!way, tcp_sub->syn);
+        tcp_sub->isn[!way] = info.ack_num - 1;
+    }
     if (!IS_SET_FOR_WAY(way, tcp_sub->origin)) {
         SET_FOR_WAY(way, tcp_sub->origin);
         tcp_sub->wl_origin[way] = info.seq_num;
@@ -480,15 +519,30 @@ enum proto_parse_status tcp_parse(struct parser *parser, struct proto_info *pare
     // FIXME: Here the parser is chosen before we actually parse anything. If later the parser fails we cannot try another one.
     //        Choice of parser should be delayed until we start actual parse.
     bool const do_sync = info.ack && IS_SET_FOR_WAY(!way, tcp_sub->origin);
-    err = pkt_wait_list_add(tcp_sub->wl+way, offset, next_offset, do_sync, sync_offset, true, &info.info, way, packet + tcphdr_len, cap_len - tcphdr_len, packet_len, now, tot_cap_len, tot_packet);
-    SLOG(LOG_DEBUG, "Waiting list returned %s", proto_parse_status_2_str(err));
-
-    if (err == PROTO_OK) {
-        // Try advancing each WL until we are stuck or met an error
-        pkt_wait_list_try_both(tcp_sub->wl+!way, &err, now, false);
+    if (
+        ! tcp_sub->reorder &&
+        offset == tcp_sub->next_offset[way] &&
+        (! do_sync || tcp_sub->next_offset[!way] >= sync_offset)
+    ) {
+        // What the waiting list would do at once, if we had one
+        err = proto_parse(subparser->parser, &info.info, way, packet + tcphdr_len, cap_len - tcphdr_len, packet_len, now, tot_cap_len, tot_packet);
+        tcp_sub->next_offset[way] = next_offset;
+    } else if (! tcp_sub->reorder && 0 != tcp_subparser_reorder(tcp_sub)) {
+        err = proto_parse(NULL, &info.info, way, packet + tcphdr_len, cap_len - tcphdr_len, packet_len, now, tot_cap_len, tot_packet);  // silently discard
+    } else {
+        err = pkt_wait_list_add(tcp_sub->reorder->wl+way, offset, next_offset, do_sync, sync_offset, true, &info.info, way, packet + tcphdr_len, cap_len - tcphdr_len, packet_len, now, tot_cap_len, tot_packet);
+        SLOG(LOG_DEBUG, "Waiting list returned %s", proto_parse_status_2_str(err));
+
+        if (err == PROTO_OK) {
+            // Try advancing each WL until we are stuck or met an error
+            pkt_wait_list_try_both(tcp_sub->reorder->wl+!way, &err, now, false);
+        }
     }
 
     bool const term = tcp_subparser_term(tcp_sub);
+    enum mux_flow_class const flow_class =
+        subparser->parser && packet_len > 0 ? MUX_FLOW_ACTIVE :
+        tcp_sub->ack == 3 ? MUX_FLOW_ESTABLISHED : MUX_FLOW_EMBRYONIC;
     mutex_unlock(tcp_sub->mutex);
 
     if (term || err == PROTO_PARSE_ERR) {
@@ -498,6 +552,8 @@ enum proto_parse_status tcp_parse(struct parser *parser, struct proto_info *pare
             SLOG(LOG_DEBUG, "No suitable subparser for this payload");
         }
         mux_subparser_deindex(subparser);
+    } else {
+        mux_subparser_promote(subparser, flow_class);
     }
     mux_subparser_unref(&subparser);
 
@@ -520,6 +576,7 @@ void tcp_init(void)
 {
     mutex_pool_ctor(&tcp_locks, "TCP subparsers");
     log_category_proto_tcp_init();
+    ext_param_lazy_flows_init();
     pkt_wl_config_ctor(&tcp_wl_config, "TCP-reordering", 100000, 20, 100000, 3 /* REORDERING TIMEOUT (second) */, true);
 
     static struct proto_ops const ops = {
@@ -564,6 +621,7 @@ void tcp_fini(void)
     pkt_wl_config_dtor(&tcp_wl_config);
     mutex_pool_dtor(&tcp_locks);
 #   endif
+    ext_param_lazy_flows_fini();
 
     log_category_proto_tcp_fini();
 }
@@ -0,0 +1,293 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2018, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <libguile.h>
+#include "junkie/tools/log.h"
+#include "junkie/tools/ext.h"
+#include "junkie/tools/mutex.h"
+#include "junkie/tools/mallocer.h"  // for overweight
+#include "junkie/tools/miscmacs.h"
+#include "shedding.h"
+
+LOG_CATEGORY_DEF(shedding);
+#undef LOG_CAT
+#define LOG_CAT shedding_log_category
+
+unsigned shedding_ratio = 1;
+EXT_PARAM_RO(shedding_ratio, "shedding-ratio", uint, "We currently parse only one flow out of this many (see (? 'set-shedding-policy)).")
+
+static unsigned shedding_max_ratio = 64;
+EXT_PARAM_RW(shedding_max_ratio, "shedding-max-ratio", uint, "When shedding load automatically, never keep less than one flow out of this many.")
+
+static unsigned shedding_max_drop_rate = 1;
+EXT_PARAM_RW(shedding_max_drop_rate, "shedding-max-drop-rate", uint, "Percentage of frames dropped by the kernel above which we consider ourselves overloaded.")
+
+static unsigned shedding_max_latency = 500000;
+EXT_PARAM_RW(shedding_max_latency, "shedding-max-latency", uint, "Number of microseconds a live frame can wait before being parsed above which we consider ourselves overloaded.")
+
+#define CALM_PERIODS 5  // number of consecutive calm seconds before we halve the ratio
+
+static enum shedding_policy { SHEDDING_OFF, SHEDDING_AUTO, SHEDDING_FIXED } policy = SHEDDING_OFF;
+static unsigned fixed_ratio;
+static struct mutex policy_lock;    // protects policy and fixed_ratio
+
+static uint64_t num_kept, num_shed;
+static int64_t volatile max_latency;    // max latency reported since last adjustment
+
+void shedding_account(unsigned kept, unsigned shed)
+{
+#   ifdef __GNUC__
+    if (kept) (void)__sync_add_and_fetch(&num_kept, kept);
+    if (shed) (void)__sync_add_and_fetch(&num_shed, shed);
+#   else
+    num_kept += kept;
+    num_shed += shed;
+#   endif
+}
+
+void shedding_report_latency(int64_t latency)
+{
+    // No need to be exact
+    if (latency > max_latency) max_latency = latency;
+}
+
+static unsigned round_to_pow2(unsigned n)
+{
+    unsigned r = 1;
+    while (r < n && r < (1U << 31)) r <<= 1;
+    return r;
+}
+
+/*
+ * Controller
+ */
+
+static void (*get_stats)(uint64_t *, uint64_t *);
+static uint64_t last_recved, last_dropped;
+static unsigned num_calm;
+
+static void set_ratio(unsigned ratio, char const *why)
+{
+    if (ratio == shedding_ratio) return;
+    SLOG(LOG_NOTICE, "Now keeping 1 flow out of %u (was %u) %s", ratio, shedding_ratio, why);
+    shedding_ratio = ratio;
+}
+
+static void shedding_adjust(void)
+{
+    uint64_t recved = 0, dropped = 0;
+    if (get_stats) get_stats(&recved, &dropped);
+    // Counters may go backward when a packet source is closed
+    uint64_t const d_recved = recved >= last_recved ? recved - last_recved : 0;
+    uint64_t const d_dropped = dropped >= last_dropped ? dropped - last_dropped : 0;
+    last_recved = recved;
+    last_dropped = dropped;
+
+    int64_t const latency = max_latency;
+    max_latency = 0;
+
+    enum shedding_policy pol;
+    unsigned ratio;
+    mutex_lock(&policy_lock);
+    pol = policy;
+    ratio = fixed_ratio;
+    mutex_unlock(&policy_lock);
+
+    switch (pol) {
+        case SHEDDING_OFF:
+            set_ratio(1, "since load shedding is off");
+            return;
+        case SHEDDING_FIXED:
+            set_ratio(ratio, "as requested");
+            return;
+        case SHEDDING_AUTO:
+            break;
+    }
+
+    unsigned max_ratio, max_drop_rate, max_lat;
+    WITH_EXT_LOCK(shedding_max_ratio, max_ratio = shedding_max_ratio);
+    WITH_EXT_LOCK(shedding_max_drop_rate, max_drop_rate = shedding_max_drop_rate);
+    WITH_EXT_LOCK(shedding_max_latency, max_lat = shedding_max_latency);
+    max_ratio = round_to_pow2(MAX(max_ratio, 1U));
+
+    bool const too_many_drops = d_recved > 0 && d_dropped * 100 > d_recved * max_drop_rate;
+    bool const too_slow = latency > max_lat;
+
+    if (overweight || too_many_drops || too_slow) {
+        SLOG(LOG_INFO, "Overloaded: %"PRIu64"/%"PRIu64" frames dropped, latency up to %"PRId64"us%s", d_dropped, d_recved, latency, overweight ? ", overweight":"");
+        num_calm = 0;
+        if (shedding_ratio < max_ratio) {
+            set_ratio(shedding_ratio * 2,
+                too_many_drops ? "because the kernel drops frames" :
+                too_slow ? "because frames wait too long before being parsed" :
+                "because we are overweight");
+        }
+    } else if (shedding_ratio > max_ratio) {
+        set_ratio(max_ratio, "since shedding-max-ratio was lowered");
+    } else if (shedding_ratio > 1 && d_dropped == 0 && latency < max_lat/2) {
+        if (++num_calm >= CALM_PERIODS) {
+            num_calm = 0;
+            set_ratio(shedding_ratio / 2, "since load went down");
+        }
+    } else {
+        num_calm = 0;
+    }
+}
+
+static pthread_t shedder_pth;
+
+static void *shedder_thread(void unused_ *dummy)
+{
+    set_thread_name("J-shedder");
+    disable_cancel();
+
+    while (1) {
+        shedding_adjust();
+        cancellable_sleep(1);
+    }
+    return NULL;
+}
+
+/*
+ * Extensions
+ */
+
+static SCM auto_sym;
+static SCM off_sym;
+static SCM policy_sym;
+static SCM ratio_sym;
+static SCM num_kept_sym;
+static SCM num_shed_sym;
+
+static struct ext_function sg_set_shedding_policy;
+static SCM g_set_shedding_policy(SCM policy_)
+{
+    enum shedding_policy pol;
+    unsigned ratio = 1;
+
+    if (scm_is_eq(policy_, auto_sym)) {
+        pol = SHEDDING_AUTO;
+    } else if (scm_is_eq(policy_, off_sym)) {
+        pol = SHEDDING_OFF;
+    } else {
+        ratio = round_to_pow2(scm_to_uint(policy_));
+        pol = ratio > 1 ? SHEDDING_FIXED : SHEDDING_OFF;
+    }
+
+    mutex_lock(&policy_lock);
+    policy = pol;
+    fixed_ratio = ratio;
+    mutex_unlock(&policy_lock);
+
+    // Apply now rather than within a second
+    if (pol != SHEDDING_AUTO) set_ratio(ratio, "as requested");
+
+    return SCM_UNSPECIFIED;
+}
+
+static struct ext_function sg_shedding_stats;
+static SCM g_shedding_stats(void)
+{
+    mutex_lock(&policy_lock);
+    SCM pol =
+        policy == SHEDDING_AUTO ? auto_sym :
+        policy == SHEDDING_OFF ? off_sym :
+        scm_from_uint(fixed_ratio);
+    mutex_unlock(&policy_lock);
+
+    return scm_list_4(
+        scm_cons(policy_sym,   pol),
+        scm_cons(ratio_sym,    scm_from_uint(shedding_ratio)),
+        scm_cons(num_kept_sym, scm_from_uint64(num_kept)),
+        scm_cons(num_shed_sym, scm_from_uint64(num_shed)));
+}
+
+/*
+ * Init
+ */
+
+static unsigned inited;
+void shedding_init(void (*get_stats_)(uint64_t *, uint64_t *))
+{
+    if (inited++) return;
+    mutex_init();
+    ext_init();
+    mallocer_init();
+
+    get_stats = get_stats_;
+    mutex_ctor(&policy_lock, "shedding policy");
+    log_category_shedding_init();
+    ext_param_shedding_ratio_init();
+    ext_param_shedding_max_ratio_init();
+    ext_param_shedding_max_drop_rate_init();
+    ext_param_shedding_max_latency_init();
+
+    auto_sym     = scm_permanent_object(scm_from_latin1_symbol("auto"));
+    off_sym      = scm_permanent_object(scm_from_latin1_symbol("off"));
+    policy_sym   = scm_permanent_object(scm_from_latin1_symbol("policy"));
+    ratio_sym    = scm_permanent_object(scm_from_latin1_symbol("ratio"));
+    num_kept_sym = scm_permanent_object(scm_from_latin1_symbol("num-kept"));
+    num_shed_sym = scm_permanent_object(scm_from_latin1_symbol("num-shed"));
+
+    ext_function_ctor(&sg_set_shedding_policy,
+        "set-shedding-policy", 1, 0, 0, g_set_shedding_policy,
+        "(set-shedding-policy 'auto): when overloaded, parse only a sample of the flows.\n"
+        "(set-shedding-policy 'off): parse every flow, whatever the load (the default).\n"
+        "(set-shedding-policy 8): parse only one flow out of 8 (rounded up to a power of 2).\n"
+        "Sampled flows are chosen by their hash, so that both directions of the kept flows are parsed entirely.\n"
+        "Frames read from files are never shed.\n"
+        "See also (? 'shedding-stats), (? 'shedding-max-ratio), (? 'shedding-max-drop-rate)\n"
+        "    and (? 'shedding-max-latency).\n");
+
+    ext_function_ctor(&sg_shedding_stats,
+        "shedding-stats", 0, 0, 0, g_shedding_stats,
+        "(shedding-stats): returns the current shedding policy and ratio, and how many frames were kept or shed.\n"
+        "See also (? 'set-shedding-policy).\n");
+
+    int err = pthread_create(&shedder_pth, NULL, shedder_thread, NULL);
+    if (err) {
+        SLOG(LOG_ERR, "Cannot pthread_create(): %s", strerror(err));
+    }
+}
+
+void shedding_fini(void)
+{
+    if (--inited) return;
+
+    SLOG(LOG_DEBUG, "Terminating shedder thread...");
+    (void)pthread_cancel(shedder_pth);
+    (void)pthread_join(shedder_pth, NULL);
+
+    ext_param_shedding_max_latency_fini();
+    ext_param_shedding_max_drop_rate_fini();
+    ext_param_shedding_max_ratio_fini();
+    ext_param_shedding_ratio_fini();
+    log_category_shedding_fini();
+#   ifdef DELETE_ALL_AT_EXIT
+    mutex_dtor(&policy_lock);
+#   endif
+
+    mallocer_fini();
+    ext_fini();
+    mutex_fini();
+}
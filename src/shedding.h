@@ -0,0 +1,51 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef SHEDDING_H_261018
+#define SHEDDING_H_261018
+#include <stdbool.h>
+#include <stdint.h>
+#include "predecode.h"
+
+/** @file
+ * @brief Load shedding by consistent flow sampling.
+ *
+ * When we are overloaded (the kernel drops frames, frames wait too long
+ * before being parsed, or we are overweight) we'd rather parse fewer flows
+ * entirely than every flow partially. So we then keep only the flows which
+ * symmetric hash is a multiple of shedding_ratio (always a power of 2, so
+ * that the flows kept at a given ratio are also kept at any lower ratio).
+ *
+ * This is off unless asked for, and only ever applies to live sources: a file
+ * is parsed at our own pace so there is no reason to lose any of its frames.
+ */
+
+/// We keep 1 flow out of shedding_ratio. Counters computed from parsed frames should be scaled accordingly.
+extern unsigned shedding_ratio;
+
+/// @returns true if the frames of the flow with this hash (see frame_flow_hash()) are to be parsed.
+static inline bool shedding_keep_hash(uint32_t flow_hash)
+{
+    unsigned const ratio = shedding_ratio;
+    if (ratio <= 1) return true;
+    // Use the high bits, since the low ones are used to dispatch flows to parsing workers
+    return ((flow_hash >> 16) & (ratio - 1)) == 0;
+}
+
+/// @returns true if this frame is to be parsed.
+static inline bool shedding_keep(uint8_t const *packet, size_t cap_len)
+{
+    if (shedding_ratio <= 1) return true;
+    return shedding_keep_hash(frame_flow_hash(packet, cap_len));
+}
+
+/// Account for n frames that were kept and m that were shed.
+void shedding_account(unsigned num_kept, unsigned num_shed);
+
+/// Report how long a frame waited between capture and parsing (in microseconds).
+void shedding_report_latency(int64_t latency);
+
+/// @param get_stats is called periodically to learn how many frames were received and dropped by the kernel so far
+void shedding_init(void (*get_stats)(uint64_t *recved, uint64_t *dropped));
+void shedding_fini(void);
+
+#endif
@@ -0,0 +1,209 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2018, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include "junkie/tools/miscmacs.h"
+#include "junkie/tools/log.h"
+#include "junkie/tools/mutex.h"
+#include "junkie/tools/counter.h"
+
+LOG_CATEGORY_DEF(counter)
+#undef LOG_CAT
+#define LOG_CAT counter_log_category
+
+#define COUNTER_MAX (COUNTER_BLOCK_SIZE * COUNTER_MAX_BLOCKS)
+
+/* Protects the list of threads copies, the copies of terminated threads and
+ * the allocation of counter indexes. Never taken by counter_add() except
+ * the first time a thread uses a block. */
+static struct mutex counters_mutex;
+
+__thread struct counter_thread *counter_thread;
+static struct counter_thread *counter_threads;  // all registered threads copies
+static struct counter_thread retired;           // what terminated threads added
+static pthread_key_t counter_thread_key;        // to be notified of threads termination
+
+// Index 0 is never allocated, so that it can be shared by the counters we could not allocate
+static uint64_t used_idxs[COUNTER_MAX / 64] = { 1 };
+
+/*
+ * Per thread copies
+ */
+
+static uint64_t *block_new(void)
+{
+    uint64_t *copies = calloc(COUNTER_BLOCK_SIZE, sizeof(*copies));
+    if (! copies) {
+        SLOG(LOG_CRIT, "Cannot allocate a block of counters! I'm sorry there's no alternative!");
+        abort();
+    }
+    return copies;
+}
+
+uint64_t *counter_block_new(unsigned block)
+{
+    assert(block < COUNTER_MAX_BLOCKS);
+
+    if (! counter_thread) {
+        counter_thread = calloc(1, sizeof(*counter_thread));  // we do not use objalloc to avoid circular dependancy here
+        if (! counter_thread) {
+            SLOG(LOG_CRIT, "Cannot allocate a counter_thread! I'm sorry there's no alternative!");
+            abort();
+        }
+        WITH_LOCK(&counters_mutex) {
+            counter_thread->next = counter_threads;
+            counter_threads = counter_thread;
+        }
+        (void)pthread_setspecific(counter_thread_key, counter_thread);
+        SLOG(LOG_DEBUG, "New counter_thread@%p for thread %s", counter_thread, get_thread_name());
+    }
+
+    uint64_t *copies = block_new();
+    // Readers may read the block as soon as they see it
+#   ifdef __GNUC__
+    __sync_synchronize();
+#   endif
+    counter_thread->blocks[block] = copies;
+    return copies;
+}
+
+// Called at thread termination
+static void counter_thread_del(void *counter_thread_)
+{
+    struct counter_thread *const ct = counter_thread_;
+    SLOG(LOG_DEBUG, "Retiring counter_thread@%p", ct);
+
+    WITH_LOCK(&counters_mutex) {
+        for (struct counter_thread **prev = &counter_threads; *prev; prev = &(*prev)->next) {
+            if (*prev != ct) continue;
+            *prev = ct->next;
+            break;
+        }
+        for (unsigned b = 0; b < NB_ELEMS(ct->blocks); b++) {
+            if (! ct->blocks[b]) continue;
+            if (! retired.blocks[b]) retired.blocks[b] = block_new();
+            for (unsigned c = 0; c < COUNTER_BLOCK_SIZE; c++) retired.blocks[b][c] += ct->blocks[b][c];
+            free(ct->blocks[b]);
+        }
+    }
+
+    if (counter_thread == ct) counter_thread = NULL;
+    free(ct);
+}
+
+/*
+ * Counters
+ */
+
+// Caller must own counters_mutex
+static uint64_t counter_sum(unsigned idx)
+{
+    unsigned const block = idx / COUNTER_BLOCK_SIZE, c = idx % COUNTER_BLOCK_SIZE;
+    uint64_t sum = retired.blocks[block] ? retired.blocks[block][c] : 0;
+    for (struct counter_thread const *ct = counter_threads; ct; ct = ct->next) {
+        uint64_t const volatile *copies = ct->blocks[block];
+        if (copies) sum += copies[c];
+    }
+    return sum;
+}
+
+uint64_t counter_read(struct counter const *counter)
+{
+    uint64_t sum;
+    WITH_LOCK(&counters_mutex) {
+        sum = counter_sum(counter->idx);
+    }
+    return sum - counter->base;
+}
+
+void counter_reset(struct counter *counter)
+{
+    WITH_LOCK(&counters_mutex) {
+        counter->base = counter_sum(counter->idx);
+    }
+}
+
+void counter_ctor(struct counter *counter)
+{
+    unsigned idx = 0;
+    WITH_LOCK(&counters_mutex) {
+        for (unsigned w = 0; w < NB_ELEMS(used_idxs); w++) {
+            if (used_idxs[w] == ~(uint64_t)0) continue;
+            unsigned const bit = __builtin_ctzll(~used_idxs[w]);
+            used_idxs[w] |= (uint64_t)1 << bit;
+            idx = w * 64 + bit;
+            break;
+        }
+        counter->idx = idx;
+        // Copies of a previous counter with the same idx are not zeroed, but accounted in our base
+        counter->base = counter_sum(idx);
+    }
+
+    if (idx == 0) {
+        SLOG(LOG_ERR, "No more counters available, values of counter@%p will be meaningless", counter);
+    }
+}
+
+void counter_dtor(struct counter *counter)
+{
+    if (counter->idx == 0) return;
+    WITH_LOCK(&counters_mutex) {
+        used_idxs[counter->idx / 64] &= ~((uint64_t)1 << (counter->idx % 64));
+    }
+}
+
+/*
+ * Init
+ */
+
+static unsigned inited;
+void counter_init(void)
+{
+    if (inited++) return;
+    mutex_init();
+    log_init();
+
+    log_category_counter_init();
+    mutex_ctor(&counters_mutex, "counters");
+    int err = pthread_key_create(&counter_thread_key, counter_thread_del);
+    if (err) {
+        SLOG(LOG_ERR, "Cannot pthread_key_create(): %s", strerror(err));
+    }
+}
+
+void counter_fini(void)
+{
+    if (--inited) return;
+
+    (void)pthread_key_delete(counter_thread_key);
+#   ifdef DELETE_ALL_AT_EXIT
+    for (unsigned b = 0; b < NB_ELEMS(retired.blocks); b++) {
+        free(retired.blocks[b]);
+        retired.blocks[b] = NULL;
+    }
+#   endif
+    mutex_dtor(&counters_mutex);
+
+    log_category_counter_fini();
+    log_fini();
+    mutex_fini();
+}
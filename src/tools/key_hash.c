@@ -0,0 +1,34 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2018, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "junkie/tools/key_hash.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__SSE4_2__)
+
+bool key_hash_has_crc32c;
+
+/* Hashes are kept in memory, so the implementation must not change once
+ * a single key was hashed: we choose it before main() is even called. */
+static void __attribute__((constructor)) key_hash_detect(void)
+{
+    __builtin_cpu_init();
+    key_hash_has_crc32c = __builtin_cpu_supports("sse4.2");
+}
+
+#endif
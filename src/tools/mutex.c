@@ -74,6 +74,18 @@ void mutex_lock(struct mutex *mutex)
     }
 }
 
+bool mutex_trylock(struct mutex *mutex)
+{
+    assert(mutex->name);
+    int const err = pthread_mutex_trylock(&mutex->mutex);
+    if (! err) {
+        SLOG(LOG_DEBUG, "Locked %s", mutex_name(mutex));
+        return true;
+    }
+    if (err != EBUSY) SLOG(LOG_ERR, "Cannot trylock %s: %s", mutex_name(mutex), strerror(err));
+    return false;
+}
+
 void mutex_unlock(struct mutex *mutex)
 {
     assert(mutex->name);
@@ -164,6 +176,52 @@ void mutex_dtor(struct mutex *mutex)
     mutex->name = NULL;
 }
 
+/*
+ * Condition variables
+ */
+
+static char const *condvar_name(struct condvar const *condvar)
+{
+    return tempstr_printf("%s@%p", condvar->name, condvar);
+}
+
+void condvar_ctor(struct condvar *condvar, char const *name)
+{
+    assert(name);
+    condvar->name = name;
+    SLOG(LOG_DEBUG, "Construct condvar %s", condvar_name(condvar));
+    int const err = pthread_cond_init(&condvar->cond, NULL);
+    if (err) SLOG(LOG_ERR, "Cannot create condvar %s: %s", condvar_name(condvar), strerror(err));
+}
+
+void condvar_dtor(struct condvar *condvar)
+{
+    SLOG(LOG_DEBUG, "Destruct condvar %s", condvar_name(condvar));
+    assert(condvar->name);
+    (void)pthread_cond_destroy(&condvar->cond);
+    condvar->name = NULL;
+}
+
+void condvar_wait(struct condvar *condvar, struct mutex *mutex)
+{
+    assert(condvar->name);
+    SLOG(LOG_DEBUG, "Waiting for %s, releasing %s", condvar_name(condvar), mutex_name(mutex));
+    int const err = pthread_cond_wait(&condvar->cond, &mutex->mutex);
+    if (err) SLOG(LOG_ERR, "Cannot wait for %s: %s", condvar_name(condvar), strerror(err));
+}
+
+void condvar_signal(struct condvar *condvar)
+{
+    int const err = pthread_cond_signal(&condvar->cond);
+    if (err) SLOG(LOG_ERR, "Cannot signal %s: %s", condvar_name(condvar), strerror(err));
+}
+
+void condvar_broadcast(struct condvar *condvar)
+{
+    int const err = pthread_cond_broadcast(&condvar->cond);
+    if (err) SLOG(LOG_ERR, "Cannot broadcast %s: %s", condvar_name(condvar), strerror(err));
+}
+
 /*
  * Supermutexes
  */
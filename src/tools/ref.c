@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sched.h>
 #include <libguile.h>
 #include "junkie/tools/log.h"
 #include "junkie/tools/ref.h"
@@ -31,57 +32,268 @@ LOG_CATEGORY_DEF(ref)
 #define LOG_CAT ref_log_category
 
 /* We proceed as follow :
- * There is a RW lock that all threads try to take for read, and the doomer
- * thread that takes it for write from time to time.
+ * Each thread has a record where it writes the global epoch when it enters a
+ * protected region, and clears it when it leaves. The doomer thread advances
+ * the global epoch when all threads in a protected region have seen the
+ * current one, so that when it has been advanced twice, all threads that were
+ * in a protected region when it was first advanced have left it.
+ * Objects which count drops to 0 are queued by the thread that dropped it in
+ * its own list of doomed objects, which the doomer collects into the limbo of
+ * the current epoch. A limbo is emptied (its objects deleted or rescued) two
+ * epochs later.
+ * The mono region, on the other hand, is still a stop-the-world affair: a
+ * thread that wants it raises a flag that prevents other threads to enter a
+ * protected region, then waits for the ones already in to leave.
  */
 
-static struct rwlock rwlock;
+SLIST_HEAD(refs, ref);
+
+struct ref_thread {
+    uint64_t volatile state;        // (epoch << 1) | 1 while in a protected region, 0 otherwise
+    struct ref *volatile doomed;    // objects doomed by this thread and not collected yet (linked with their entry)
+    struct ref_thread *next;        // in the list of all ref_threads (protected by ref_threads_mutex)
+};
+
+static __thread struct ref_thread *my_ref_thread;
+static __thread unsigned region_depth;  // how many times we entered (and not left) a protected region
+static __thread bool in_mono;           // the outermost protected region we are in is the mono one
+
+static struct ref_thread *ref_threads;
+static struct refs orphans;             // objects doomed by terminated threads (protected by ref_threads_mutex)
+static struct mutex ref_threads_mutex;
+static pthread_key_t ref_thread_key;    // to be notified of threads termination
+
+static uint64_t volatile epoch = 1;
+static bool volatile mono;              // set while a thread is in (or waiting for) the mono region
+static struct mutex mono_mutex;         // owned by the thread in the mono region
+
+static struct ref_thread *ref_thread_get(void)
+{
+    if (likely_(my_ref_thread)) return my_ref_thread;
+
+    struct ref_thread *t = malloc(sizeof(*t)); // we do not use objalloc to avoid circular dependancy here
+    if (! t) {
+        SLOG(LOG_CRIT, "Cannot allocate for a ref_thread! I'm sorry there's no alternative!");
+        abort();
+    }
+    t->state = 0;
+    t->doomed = NULL;
+    WITH_LOCK(&ref_threads_mutex) {
+        t->next = ref_threads;
+        ref_threads = t;
+    }
+    (void)pthread_setspecific(ref_thread_key, t);
+    return my_ref_thread = t;
+}
+
+// Called at thread termination
+static void ref_thread_del(void *t_)
+{
+    struct ref_thread *const t = t_;
+
+    WITH_LOCK(&ref_threads_mutex) {
+        for (struct ref_thread **prev = &ref_threads; *prev; prev = &(*prev)->next) {
+            if (*prev != t) continue;
+            *prev = t->next;
+            break;
+        }
+        // What we doomed is left to the doomer
+        struct ref *r = __sync_lock_test_and_set(&t->doomed, NULL);
+        while (r) {
+            struct ref *const next = r->entry.sle_next;
+            SLIST_INSERT_HEAD(&orphans, r, entry);
+            r = next;
+        }
+    }
+
+    if (my_ref_thread == t) my_ref_thread = NULL;
+    free(t);
+}
+
+/*
+ * Protected regions
+ */
 
 void enter_multi_region(void)
 {
-    rwlock_acquire(&rwlock, false);
+    if (region_depth++ > 0) return;
+
+    struct ref_thread *const t = ref_thread_get();
+    while (1) {
+        t->state = (epoch << 1) | 1;
+        __sync_synchronize();   // our state must be visible before we read mono (see enter_mono_region)
+        if (likely_(! mono)) break;
+        // Someone wants to be alone, wait until it's done
+        t->state = 0;
+        mutex_lock(&mono_mutex);
+        mutex_unlock(&mono_mutex);
+    }
+}
+
+static bool others_in_region(void)
+{
+    bool ret = false;
+    WITH_LOCK(&ref_threads_mutex) {
+        for (struct ref_thread const *t = ref_threads; t; t = t->next) {
+            if (t != my_ref_thread && (t->state & 1)) {
+                ret = true;
+                break;
+            }
+        }
+    }
+    return ret;
 }
 
 void enter_mono_region(void)
 {
-    rwlock_acquire(&rwlock, true);
+    assert(region_depth == 0);  // or we would wait for ourself
+
+    mutex_lock(&mono_mutex);
+    mono = true;
+    __sync_synchronize();   // mono must be visible before we read others state (see enter_multi_region)
+    while (others_in_region()) sched_yield();
+
+    region_depth = 1;
+    in_mono = true;
 }
 
 void leave_protected_region(void)
 {
-    rwlock_release(&rwlock);
+    assert(region_depth > 0);
+    if (--region_depth > 0) return;
+
+    if (in_mono) {
+        in_mono = false;
+        mono = false;
+        mutex_unlock(&mono_mutex);
+        return;
+    }
+
+    __sync_synchronize();   // we must be done with protected objects before we appear out of the region
+    my_ref_thread->state = 0;
 }
 
+bool in_protected_region(void)
+{
+    return region_depth > 0;
+}
+
+/*
+ * Dooming
+ */
+
+void ref_doom(struct ref *ref)
+{
+    /* If it's still in a limbo (rescued, then unrefed again before the
+     * doomer noticed) then the doomer will see its count is 0. */
+    if (! __sync_bool_compare_and_swap(&ref->entry.sle_next, (struct ref *)NOT_IN_DEATH_ROW, NULL)) return;
+
+    struct ref_thread *const t = ref_thread_get();
+    struct ref *head;
+    do {
+        head = t->doomed;
+        ref->entry.sle_next = head;
+    } while (! __sync_bool_compare_and_swap(&t->doomed, head, ref));
+}
+
+/*
+ * Doomer
+ */
+
 static pthread_t doomer_pth;
+static struct mutex doomer_mutex;   // protects limbos and serializes doomer runs
 
-struct refs death_row;
-struct mutex death_row_mutex;
+/* Objects doomed during epoch e are in limbos[e % NB_LIMBOS], until
+ * the epoch reaches e+2. */
+#define NB_LIMBOS 3
+static struct refs limbos[NB_LIMBOS];
 
 static struct bench_event dooming;
 
-void doomer_run(void)
+// Caller must own doomer_mutex
+static void collect_doomed(void)
 {
-    enter_mono_region();
+    struct refs *const limbo = limbos + epoch % NB_LIMBOS;
 
+    WITH_LOCK(&ref_threads_mutex) {
+        for (struct ref_thread *t = ref_threads; t; t = t->next) {
+            if (! t->doomed) continue;
+            struct ref *r = __sync_lock_test_and_set(&t->doomed, NULL);
+            while (r) {
+                struct ref *const next = r->entry.sle_next;
+                SLIST_INSERT_HEAD(limbo, r, entry);
+                r = next;
+            }
+        }
+        struct ref *r;
+        while (NULL != (r = SLIST_FIRST(&orphans))) {
+            SLIST_REMOVE_HEAD(&orphans, entry);
+            SLIST_INSERT_HEAD(limbo, r, entry);
+        }
+    }
+}
+
+// Caller must own doomer_mutex. @returns true if the epoch was advanced.
+static bool try_advance_epoch(void)
+{
+    uint64_t const current = (epoch << 1) | 1;
+    bool late = false;
+    WITH_LOCK(&ref_threads_mutex) {
+        for (struct ref_thread const *t = ref_threads; t; t = t->next) {
+            uint64_t const state = t->state;
+            if ((state & 1) && state != current) {
+                late = true;
+                break;
+            }
+        }
+    }
+    if (late) return false;
+
+    epoch ++;
+    return true;
+}
+
+// Caller must own doomer_mutex. Moves the objects of the limbo of 2 epochs ago into to_kill, or rescue them.
+static void empty_limbo(struct refs *to_kill, unsigned *num_dels, unsigned *num_rescued)
+{
+    struct refs *const limbo = limbos + (epoch - 2) % NB_LIMBOS;
+    struct ref *r;
+    while (NULL != (r = SLIST_FIRST(limbo))) {
+        SLIST_REMOVE_HEAD(limbo, entry);
+        if (r->count == 0) {
+            SLIST_INSERT_HEAD(to_kill, r, entry);
+            (*num_dels) ++;
+            continue;
+        }
+        // Rescued, so it can be doomed again
+        r->entry.sle_next = NOT_IN_DEATH_ROW;
+        __sync_synchronize();
+        if (r->count == 0 && __sync_bool_compare_and_swap(&r->entry.sle_next, (struct ref *)NOT_IN_DEATH_ROW, NULL)) {
+            // It was unrefed in between, and that thread gave up dooming it. Start over.
+            SLIST_INSERT_HEAD(limbos + epoch % NB_LIMBOS, r, entry);
+        } else {
+            (*num_rescued) ++;
+        }
+    }
+}
+
+void doomer_run(void)
+{
     SLOG(LOG_DEBUG, "Deleting doomed objects...");
     unsigned num_dels = 0, num_rescued = 0;
 
-    // Bench time spent scanning death_row
+    // Bench time spent scanning death_row (no other thread is blocked meanwhile)
     uint64_t start = bench_event_start();
 
-    // Rescue from death_row the objects which ref count is > 0,
-    // and queue into kill_list the one no longer accessible (they can not even reach each others)
     struct refs to_kill;
     SLIST_INIT(&to_kill);
-    struct ref *r;
-    while (NULL != (r = SLIST_FIRST(&death_row))) {
-        SLIST_REMOVE_HEAD(&death_row, entry);
-        if (r->count == 0) {
-            SLIST_INSERT_HEAD(&to_kill, r, entry);
-            num_dels ++;
-        } else {
-            r->entry.sle_next = NOT_IN_DEATH_ROW;
-            num_rescued ++;
+    WITH_LOCK(&doomer_mutex) {
+        /* Objects doomed before we were called can be deleted once the epoch is advanced twice, so try a few times
+         * (this will not succeed if some thread stays in its protected region, in which case next run will do) */
+        for (unsigned pass = 0; pass < NB_LIMBOS; pass++) {
+            collect_doomed();
+            if (! try_advance_epoch()) break;
+            empty_limbo(&to_kill, &num_dels, &num_rescued);
         }
     }
 
@@ -89,15 +301,13 @@ void doomer_run(void)
 
     bench_event_stop(&dooming, start);
 
-    // No need to block parsing any more since the selected objects are not accessible
-    leave_protected_region();
-
-    enter_multi_region();   // should not compete with mono_region anyway.
+    enter_multi_region();
 
     // Delete all selected objects
+    struct ref *r;
     while (NULL != (r = SLIST_FIRST(&to_kill))) {
         assert(r->count == 0);
-        // Beware that r->del() may doom further objects, which will be added in the death_row for next run
+        // Beware that r->del() may doom further objects, which will be collected by next run
         SLOG(LOG_DEBUG, "Delete next object on kill list: %p", r);
         SLIST_REMOVE_HEAD(&to_kill, entry);
         r->entry.sle_next = NULL;   // the deletor must not care about the ref (since the decision to del the object was already taken)
@@ -148,12 +358,18 @@ void ref_init(void)
     bench_init();
 
     bench_event_ctor(&dooming, "del doomed objs");
-    mutex_ctor(&death_row_mutex, "death row");
-    SLIST_INIT(&death_row);
     log_category_ref_init();
-    rwlock_ctor(&rwlock, "doomer");
+    mutex_ctor(&ref_threads_mutex, "ref threads");
+    mutex_ctor(&mono_mutex, "mono region");
+    mutex_ctor(&doomer_mutex, "doomer");
+    SLIST_INIT(&orphans);
+    for (unsigned l = 0; l < NB_LIMBOS; l++) SLIST_INIT(limbos+l);
+    int err = pthread_key_create(&ref_thread_key, ref_thread_del);
+    if (err) {
+        SLOG(LOG_ERR, "Cannot pthread_key_create(): %s", strerror(err));
+    }
 
-    int err = pthread_create(&doomer_pth, NULL, doomer_thread, NULL);
+    err = pthread_create(&doomer_pth, NULL, doomer_thread, NULL);
 
     if (err) {
         SLOG(LOG_ERR, "Cannot pthread_create(): %s", strerror(err));
@@ -165,8 +381,10 @@ void ref_fini(void)
     if (--inited) return;
 
 #   ifdef DELETE_ALL_AT_EXIT
-    rwlock_dtor(&rwlock);
-    mutex_dtor(&death_row_mutex);
+    (void)pthread_key_delete(ref_thread_key);
+    mutex_dtor(&doomer_mutex);
+    mutex_dtor(&mono_mutex);
+    mutex_dtor(&ref_threads_mutex);
 #   endif
     log_category_ref_fini();
     bench_event_dtor(&dooming);
@@ -35,6 +35,29 @@ LOG_CATEGORY_DEF(timebound)
  * No need to be very accurate here. */
 static time_t volatile last_used;
 
+/// When the timeout is disabled, timers are nonetheless rechecked every so often
+#define TIMEBOUND_RECHECK 64
+
+static time_t timebound_expiry(struct timebound const *t, unsigned timeout)
+{
+    return t->last_used + (timeout ? timeout : TIMEBOUND_RECHECK);
+}
+
+// Called with the bucket mutex locked
+static void timebound_timeout(struct timer_wheel *wheel, struct timer *timer, time_t now)
+{
+    struct timebound_bucket *const bucket = DOWNCAST(wheel, wheel, timebound_bucket);
+    struct timebound *const t = DOWNCAST(timer, timer, timebound);
+    unsigned const timeout = *bucket->pool->timeout;
+
+    if (timeout && t->last_used + (time_t)timeout <= now) {
+        SLOG(LOG_DEBUG, "Timeouting timebound object@%p", t);
+        bucket->pool->del(t);
+    } else {    // touched since
+        timer_arm(wheel, timer, timebound_expiry(t, timeout));
+    }
+}
+
 /*
  * Timebound Pools
  */
@@ -54,8 +77,10 @@ void timebound_pool_ctor(struct timebound_pool *pool, char const *name, unsigned
     for (unsigned p = 0; p < NB_ELEMS(pool->buckets); p++) {
         struct timebound_bucket *const bucket = pool->buckets + p;
         mutex_ctor_recursive(&bucket->mutex, "timebound_pool bucket");
-        TAILQ_INIT(&bucket->list);
+        timer_wheel_ctor(&bucket->wheel, timebound_timeout);
+        bucket->pool = pool;
     }
+    pool->armed_timeout = *timeout;
     WITH_LOCK(&timebound_pools_mutex) {
         LIST_INSERT_HEAD(&timebound_pools, pool, entry);
     }
@@ -71,10 +96,11 @@ void timebound_pool_dtor(struct timebound_pool *pool)
 
     for (unsigned p = 0; p < NB_ELEMS(pool->buckets); p++) {
         struct timebound_bucket *const bucket = pool->buckets + p;
-        struct timebound *t;
-        while (NULL != (t = TAILQ_LAST(&bucket->list, timebounds))) {
-            pool->del(t);
+        struct timer *timer;
+        while (NULL != (timer = timer_wheel_first(&bucket->wheel))) {
+            pool->del(DOWNCAST(timer, timer, timebound));
         }
+        timer_wheel_dtor(&bucket->wheel);
         mutex_dtor(&bucket->mutex);
     }
 }
@@ -89,8 +115,9 @@ void timebound_ctor(struct timebound *t, struct timebound_pool *pool, struct tim
     t->monitored = true;
     SLOG(LOG_DEBUG, "...bucket=%p", bucket);
     t->last_used = now->tv_sec;
+    timer_ctor(&t->timer);
     WITH_LOCK(&bucket->mutex) {
-        TAILQ_INSERT_HEAD(&bucket->list, t, entry);
+        timer_arm(&bucket->wheel, &t->timer, timebound_expiry(t, *pool->timeout));
     }
 }
 
@@ -102,7 +129,7 @@ void timebound_dtor(struct timebound *t)
     WITH_LOCK(mutex) {
         assert(t->monitored);
         t->monitored = false;
-        TAILQ_REMOVE(&t->bucket->list, t, entry);
+        timer_cancel(&t->bucket->wheel, &t->timer);
     }
 }
 
@@ -110,64 +137,41 @@ void timebound_touch(struct timebound *t, struct timeval const *now)
 {
     SLOG(LOG_DEBUG, "Touching timebound object @%p", t);
 
-    WITH_LOCK(&t->bucket->mutex) {
-        if (t->monitored) {
-            TAILQ_REMOVE(&t->bucket->list, t, entry);
-            TAILQ_INSERT_HEAD(&t->bucket->list, t, entry);
-        }
-    }
+    // Its timer will be rearmed when it fires
     last_used = t->last_used = now->tv_sec;
 }
 
 /*
- * Timeouter Thread
+ * Timeouter
  */
 
-static pthread_t timebounder_pth;
-static struct bench_event timebounding;
+static struct timer_ticker timebound_ticker;
 
-static void *timebounder_thread_(void unused_ *dummy)
+static void timebound_tick(struct timer_ticker unused_ *ticker)
 {
-    set_thread_name("J-timebounder");
-    disable_cancel();
-
-    while (1) {
-        uint64_t start = bench_event_start();
-        WITH_LOCK(&timebound_pools_mutex) {
-            struct timebound_pool *pool;
-            LIST_FOREACH(pool, &timebound_pools, entry) {
-                unsigned const timeout = *pool->timeout;
-                if (! timeout) continue;
-                time_t max_last_used = last_used - timeout;
-
-                SLOG(LOG_DEBUG, "Timeouting timebound_pool@%p (%s), which timeout=%u", pool, pool->name, timeout);
-                for (unsigned p = 0; p < NB_ELEMS(pool->buckets); p++) {
-                    struct timebound_bucket *const bucket = pool->buckets + p;
-                    WITH_LOCK(&bucket->mutex) {
-                        // from last to first
-                        struct timebound *t, *tmp;
-                        TAILQ_FOREACH_REVERSE_SAFE(t, &bucket->list, timebounds, entry, tmp) {
-                            if (t->last_used > max_last_used) break;
-
-                            SLOG(LOG_DEBUG, "Timeouting timebound object@%p", t);
-                            pool->del(t);
-                        }
+    time_t const now = last_used;
+
+    WITH_LOCK(&timebound_pools_mutex) {
+        struct timebound_pool *pool;
+        LIST_FOREACH(pool, &timebound_pools, entry) {
+            unsigned const timeout = *pool->timeout;
+            // If the timeout was shortened (or enabled) then timers may be armed too far away
+            bool const check_all = timeout && (! pool->armed_timeout || timeout < pool->armed_timeout);
+            pool->armed_timeout = timeout;
+
+            SLOG(LOG_DEBUG, "Timeouting timebound_pool@%p (%s), which timeout=%u", pool, pool->name, timeout);
+            for (unsigned p = 0; p < NB_ELEMS(pool->buckets); p++) {
+                struct timebound_bucket *const bucket = pool->buckets + p;
+                WITH_LOCK(&bucket->mutex) {
+                    if (check_all) {
+                        (void)timer_wheel_flush(&bucket->wheel, now);
+                    } else {
+                        (void)timer_wheel_advance(&bucket->wheel, now);
                     }
                 }
             }
         }
-        bench_event_stop(&timebounding, start);
-
-        // Wait
-        cancellable_sleep(1);
     }
-
-    return NULL;
-}
-
-static void *timebounder_thread(void *dummy)
-{
-    return scm_with_guile(timebounder_thread_, dummy);
 }
 
 /*
@@ -179,29 +183,19 @@ void timebound_init(void)
 {
     if (inited++) return;
     mutex_init();
+    timer_wheel_init();
 
     mutex_ctor(&timebound_pools_mutex, "timebound pools");
     LIST_INIT(&timebound_pools);
     log_category_timebound_init();
-    bench_event_ctor(&timebounding, "timeout timebound objects");
-
-    int err = pthread_create(&timebounder_pth, NULL, timebounder_thread, NULL);
-
-    if (err) {
-        SLOG(LOG_ERR, "Cannot pthread_create(): %s", strerror(err));
-    }
+    timer_ticker_ctor(&timebound_ticker, "timeout timebound objects", timebound_tick);
 }
 
 void timebound_fini(void)
 {
     if (--inited) return;
 
-    // Kill timebounder thread
-    SLOG(LOG_DEBUG, "Terminating timebounder thread...");
-    (void)pthread_cancel(timebounder_pth);
-    (void)pthread_join(timebounder_pth, NULL);
-
-    bench_event_dtor(&timebounding);
+    timer_ticker_dtor(&timebound_ticker);
 
 #   ifdef DELETE_ALL_AT_EXIT
     // timebound_pools?
@@ -209,5 +203,6 @@ void timebound_fini(void)
 #   endif
     log_category_timebound_fini();
 
+    timer_wheel_fini();
     mutex_fini();
 }
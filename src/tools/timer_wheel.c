@@ -0,0 +1,370 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2018, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <libguile.h>
+#include <assert.h>
+#include "junkie/tools/miscmacs.h"
+#include "junkie/tools/log.h"
+#include "junkie/tools/mutex.h"
+#include "junkie/tools/bench.h"
+#include "junkie/tools/timer_wheel.h"
+
+LOG_CATEGORY_DEF(timer_wheel)
+#undef LOG_CAT
+#define LOG_CAT timer_wheel_log_category
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(l) (TIMER_WHEEL_BITS * (l))
+#define SLOTS_BITS ((1ULL << TIMER_WHEEL_SLOTS) - 1)
+// A timer that far away in the future is first stored in the last slot of the upper level
+#define WHEEL_SPAN ((time_t)1 << LEVEL_SHIFT(TIMER_WHEEL_LEVELS))
+
+/*
+ * Timers
+ */
+
+void timer_ctor(struct timer *timer)
+{
+    timer->where = TIMER_UNARMED;
+}
+
+// Store an armed timer in the slot of its expiry
+static void timer_insert(struct timer_wheel *wheel, struct timer *timer)
+{
+    time_t expiry = MAX(timer->expiry, wheel->now);
+    time_t const delta = expiry - wheel->now;
+    unsigned level = 0;
+    if (delta >= WHEEL_SPAN) {
+        expiry = wheel->now + WHEEL_SPAN - 1;
+        level = TIMER_WHEEL_LEVELS - 1;
+    } else {
+        while (delta >> LEVEL_SHIFT(level + 1)) level ++;
+    }
+
+    unsigned const slot = (expiry >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    timer->where = level * TIMER_WHEEL_SLOTS + slot;
+    LIST_INSERT_HEAD(&wheel->slots[timer->where], timer, entry);
+    wheel->used[level] |= 1U << slot;
+}
+
+// Remove an armed timer from its slot (or from the expired list)
+static void timer_remove(struct timer_wheel *wheel, struct timer *timer)
+{
+    LIST_REMOVE(timer, entry);
+    if (timer->where != TIMER_EXPIRED && LIST_EMPTY(&wheel->slots[timer->where])) {
+        wheel->used[timer->where / TIMER_WHEEL_SLOTS] &= ~(1U << (timer->where % TIMER_WHEEL_SLOTS));
+    }
+    timer->where = TIMER_UNARMED;
+}
+
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, time_t expiry)
+{
+    /* A wheel that was never advanced does not know what time it is (it starts at 0).
+     * Rather than clamping this first timer into the last slot, move now as close to
+     * its expiry as we can without risking to fire a later armed timer late (assuming
+     * timeouts are shorter than the wheel span). */
+    if (wheel->now == 0 && wheel->num_timers == 0 && expiry >= WHEEL_SPAN) wheel->now = expiry - WHEEL_SPAN + 1;
+
+    if (timer_is_armed(timer)) {
+        timer_remove(wheel, timer);
+    } else {
+        wheel->num_timers ++;
+    }
+    timer->expiry = expiry;
+    timer_insert(wheel, timer);
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+    if (! timer_is_armed(timer)) return;
+    timer_remove(wheel, timer);
+    assert(wheel->num_timers > 0);
+    wheel->num_timers --;
+}
+
+/*
+ * Wheels
+ */
+
+void timer_wheel_ctor(struct timer_wheel *wheel, void (*fire)(struct timer_wheel *, struct timer *, time_t))
+{
+    wheel->fire = fire;
+    wheel->now = 0;
+    wheel->num_timers = 0;
+    for (unsigned l = 0; l < NB_ELEMS(wheel->used); l++) wheel->used[l] = 0;
+    for (unsigned s = 0; s < NB_ELEMS(wheel->slots); s++) LIST_INIT(&wheel->slots[s]);
+}
+
+void timer_wheel_dtor(struct timer_wheel *wheel)
+{
+    if (wheel->num_timers > 0) {
+        SLOG(LOG_DEBUG, "Destructing timer_wheel@%p with %u timers still armed", wheel, wheel->num_timers);
+    }
+}
+
+// Set *next to the first second (not before now) when something must be done at this level
+// @returns false if this level is empty
+static bool level_next_event(struct timer_wheel const *wheel, unsigned level, time_t *next)
+{
+    uint32_t const used = wheel->used[level];
+    if (! used) return false;
+
+    // First slot start not before now, and the slots in use from there
+    time_t const slot_len = (time_t)1 << LEVEL_SHIFT(level);
+    time_t const first = (wheel->now + slot_len - 1) >> LEVEL_SHIFT(level);
+    unsigned const idx = first & SLOT_MASK;
+    uint32_t const rotated = ((used >> idx) | (used << (TIMER_WHEEL_SLOTS - idx))) & SLOTS_BITS;
+    assert(rotated);
+    *next = (first + __builtin_ctz(rotated)) << LEVEL_SHIFT(level);
+    return true;
+}
+
+// @returns false if the wheel is empty
+static bool next_event(struct timer_wheel const *wheel, time_t *next)
+{
+    bool found = false;
+    for (unsigned l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        time_t n;
+        if (! level_next_event(wheel, l, &n)) continue;
+        if (! found || n < *next) *next = n;
+        found = true;
+    }
+    return found;
+}
+
+// Move all timers of this slot into the expired list
+static void collect_slot(struct timer_wheel *wheel, unsigned level, unsigned slot, struct timers *expired)
+{
+    struct timers *const list = wheel->slots + level * TIMER_WHEEL_SLOTS + slot;
+    struct timer *timer;
+    while (NULL != (timer = LIST_FIRST(list))) {
+        LIST_REMOVE(timer, entry);
+        timer->where = TIMER_EXPIRED;
+        LIST_INSERT_HEAD(expired, timer, entry);
+    }
+    wheel->used[level] &= ~(1U << slot);
+}
+
+// Redistribute the timers of this slot into lower levels
+static void cascade_slot(struct timer_wheel *wheel, unsigned level, unsigned slot)
+{
+    struct timers moved;
+    LIST_INIT(&moved);
+    collect_slot(wheel, level, slot, &moved);
+    struct timer *timer;
+    while (NULL != (timer = LIST_FIRST(&moved))) {
+        LIST_REMOVE(timer, entry);
+        timer_insert(wheel, timer);
+    }
+}
+
+static unsigned fire_expired(struct timer_wheel *wheel, struct timers *expired, time_t now)
+{
+    unsigned count = 0;
+    struct timer *timer;
+    // Beware that firing a timer may cancel others from the expired list
+    while (NULL != (timer = LIST_FIRST(expired))) {
+        timer_cancel(wheel, timer);
+        wheel->fire(wheel, timer, now);
+        count ++;
+    }
+    return count;
+}
+
+// Redistribute all timers for this new current time, collecting those that are due
+static void rebase(struct timer_wheel *wheel, time_t now, struct timers *expired)
+{
+    struct timers moved;
+    LIST_INIT(&moved);
+    for (unsigned l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        while (wheel->used[l]) {
+            collect_slot(wheel, l, __builtin_ctz(wheel->used[l]), &moved);
+        }
+    }
+
+    wheel->now = now + 1;
+    struct timer *timer;
+    while (NULL != (timer = LIST_FIRST(&moved))) {
+        LIST_REMOVE(timer, entry);
+        if (timer->expiry <= now) {
+            LIST_INSERT_HEAD(expired, timer, entry);    // still TIMER_EXPIRED
+        } else {
+            timer_insert(wheel, timer);
+        }
+    }
+}
+
+unsigned timer_wheel_advance(struct timer_wheel *wheel, time_t now)
+{
+    struct timers expired;
+    LIST_INIT(&expired);
+
+    /* When time jumps further than the wheel span (such as the first advance of a wheel which
+     * timers were armed before it knew what time it is) we would cascade the timers of the upper
+     * level once per slot of that level all the way: rather redistribute them all at once. */
+    if (now - wheel->now >= WHEEL_SPAN) rebase(wheel, now, &expired);
+
+    while (wheel->now <= now) {
+        // Jump to the next second when there is something to do
+        time_t next;
+        if (! next_event(wheel, &next) || next > now) {
+            wheel->now = now + 1;
+            break;
+        }
+        wheel->now = next;
+
+        // Upper levels first, since they may have timers for this very second
+        for (unsigned l = TIMER_WHEEL_LEVELS - 1; l > 0; l--) {
+            if (wheel->now & (((time_t)1 << LEVEL_SHIFT(l)) - 1)) continue;
+            cascade_slot(wheel, l, (wheel->now >> LEVEL_SHIFT(l)) & SLOT_MASK);
+        }
+        collect_slot(wheel, 0, wheel->now & SLOT_MASK, &expired);
+        wheel->now ++;
+    }
+
+    return fire_expired(wheel, &expired, now);
+}
+
+unsigned timer_wheel_flush(struct timer_wheel *wheel, time_t now)
+{
+    struct timers expired;
+    LIST_INIT(&expired);
+
+    for (unsigned l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        while (wheel->used[l]) {
+            collect_slot(wheel, l, __builtin_ctz(wheel->used[l]), &expired);
+        }
+    }
+
+    return fire_expired(wheel, &expired, now);
+}
+
+struct timer *timer_wheel_first(struct timer_wheel const *wheel)
+{
+    for (unsigned l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        if (! wheel->used[l]) continue;
+        return LIST_FIRST(&wheel->slots[l * TIMER_WHEEL_SLOTS + __builtin_ctz(wheel->used[l])]);
+    }
+    return NULL;
+}
+
+/*
+ * Tickers
+ */
+
+static struct mutex tickers_mutex;  // protects tickers
+static LIST_HEAD(timer_tickers, timer_ticker) tickers;
+
+void timer_ticker_ctor(struct timer_ticker *ticker, char const *name, void (*tick)(struct timer_ticker *))
+{
+    SLOG(LOG_DEBUG, "Construct timer_ticker@%p for %s", ticker, name);
+
+    ticker->name = name;
+    ticker->tick = tick;
+    bench_event_ctor(&ticker->ticking, name);
+    WITH_LOCK(&tickers_mutex) {
+        LIST_INSERT_HEAD(&tickers, ticker, entry);
+    }
+}
+
+void timer_ticker_dtor(struct timer_ticker *ticker)
+{
+    SLOG(LOG_DEBUG, "Destruct timer_ticker@%p (%s)", ticker, ticker->name);
+
+    WITH_LOCK(&tickers_mutex) {
+        LIST_REMOVE(ticker, entry);
+    }
+    bench_event_dtor(&ticker->ticking);
+}
+
+/*
+ * The Timers Thread
+ */
+
+static pthread_t timers_pth;
+
+static void *timers_thread_(void unused_ *dummy)
+{
+    set_thread_name("J-timers");
+    disable_cancel();
+
+    while (1) {
+        WITH_LOCK(&tickers_mutex) {
+            struct timer_ticker *ticker;
+            LIST_FOREACH(ticker, &tickers, entry) {
+                uint64_t const start = bench_event_start();
+                ticker->tick(ticker);
+                bench_event_stop(&ticker->ticking, start);
+            }
+        }
+
+        cancellable_sleep(1);
+    }
+
+    return NULL;
+}
+
+static void *timers_thread(void *dummy)
+{
+    return scm_with_guile(timers_thread_, dummy);
+}
+
+/*
+ * Init
+ */
+
+static unsigned inited;
+void timer_wheel_init(void)
+{
+    if (inited++) return;
+    mutex_init();
+    log_init();
+    bench_init();
+
+    log_category_timer_wheel_init();
+    mutex_ctor(&tickers_mutex, "timer tickers");
+    LIST_INIT(&tickers);
+
+    int err = pthread_create(&timers_pth, NULL, timers_thread, NULL);
+    if (err) {
+        SLOG(LOG_ERR, "Cannot pthread_create(): %s", strerror(err));
+    }
+}
+
+void timer_wheel_fini(void)
+{
+    if (--inited) return;
+
+    SLOG(LOG_DEBUG, "Terminating timers thread...");
+    (void)pthread_cancel(timers_pth);
+    (void)pthread_join(timers_pth, NULL);
+
+    if (! LIST_EMPTY(&tickers)) {
+        SLOG(LOG_NOTICE, "Some timer tickers are still registered");
+    }
+    mutex_dtor(&tickers_mutex);
+    log_category_timer_wheel_fini();
+
+    bench_fini();
+    log_fini();
+    mutex_fini();
+}
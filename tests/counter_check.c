@@ -0,0 +1,97 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#undef NDEBUG
+#include <assert.h>
+#include <pthread.h>
+#include <junkie/tools/miscmacs.h>
+#include <junkie/tools/log.h>
+#include <junkie/tools/mutex.h>
+#include <junkie/tools/counter.h>
+
+#define NB_THREADS 8
+#define NB_ADDS 100000
+
+static struct counter counters[2 * COUNTER_BLOCK_SIZE];  // so that we use several blocks
+static pthread_barrier_t added, read_done;
+
+static void *adder(void unused_ *dummy)
+{
+    for (unsigned a = 0; a < NB_ADDS; a++) {
+        counter_inc(counters + a % NB_ELEMS(counters));
+    }
+    counter_add(counters + 0, 1000);
+
+    // Stay alive until the main thread has read our copies
+    pthread_barrier_wait(&added);
+    pthread_barrier_wait(&read_done);
+    return NULL;
+}
+
+static uint64_t expected(unsigned c)
+{
+    uint64_t const per_thread = NB_ADDS / NB_ELEMS(counters) + (c < NB_ADDS % NB_ELEMS(counters) ? 1 : 0) + (c == 0 ? 1000 : 0);
+    return NB_THREADS * per_thread;
+}
+
+static void sum_check(void)
+{
+    for (unsigned c = 0; c < NB_ELEMS(counters); c++) counter_ctor(counters + c);
+
+    assert(0 == pthread_barrier_init(&added, NULL, NB_THREADS + 1));
+    assert(0 == pthread_barrier_init(&read_done, NULL, NB_THREADS + 1));
+    pthread_t pth[NB_THREADS];
+    for (unsigned t = 0; t < NB_ELEMS(pth); t++) {
+        assert(0 == pthread_create(pth+t, NULL, adder, NULL));
+    }
+
+    // Read while the adders are alive
+    pthread_barrier_wait(&added);
+    for (unsigned c = 0; c < NB_ELEMS(counters); c++) assert(counter_read(counters + c) == expected(c));
+    pthread_barrier_wait(&read_done);
+
+    // And once they are gone
+    for (unsigned t = 0; t < NB_ELEMS(pth); t++) {
+        assert(0 == pthread_join(pth[t], NULL));
+    }
+    for (unsigned c = 0; c < NB_ELEMS(counters); c++) assert(counter_read(counters + c) == expected(c));
+    pthread_barrier_destroy(&added);
+    pthread_barrier_destroy(&read_done);
+
+    // Reset
+    counter_reset(counters + 0);
+    assert(counter_read(counters + 0) == 0);
+    counter_add(counters + 0, 42);
+    assert(counter_read(counters + 0) == 42);
+
+    // A new counter starts from 0 even if it reuses the copies of a former one
+    counter_dtor(counters + 1);
+    struct counter fresh;
+    counter_ctor(&fresh);
+    assert(fresh.idx == counters[1].idx);
+    assert(counter_read(&fresh) == 0);
+    counter_inc(&fresh);
+    assert(counter_read(&fresh) == 1);
+    counter_dtor(&fresh);
+
+    for (unsigned c = 0; c < NB_ELEMS(counters); c++) {
+        if (c != 1) counter_dtor(counters + c);
+    }
+}
+
+int main(void)
+{
+    log_init();
+    mutex_init();
+    counter_init();
+    log_set_level(LOG_DEBUG, NULL);
+    log_set_file("counter_check.log");
+
+    sum_check();
+
+    counter_fini();
+    mutex_fini();
+    log_fini();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,70 @@
+#!../src/junkie -c
+; vim:syntax=scheme filetype=scheme expandtab
+!#
+
+(display "Testing deduplication across devices\n")
+
+(false-if-exception (delete-file "dedup_pairs.log"))
+(set-log-file "dedup_pairs.log")
+(set-log-level 7)
+(set-log-level 3 "mutex")
+
+(set-quit-when-done #f)
+
+(define (wait-completion)
+  (while (not (null? (iface-names)))
+         (usleep 100)))
+
+; Two frames, the second one being a dup of the first (but for its vlan, TTL and
+; padding) received 132us later
+(define pcap (string-append (getenv "srcdir") "/pcap/eth/dups_with_various_padding.pcap"))
+
+; Every pcap file is given its own dev_id, but with collapse-ifaces they are all
+; deduplicated in the window of device 255
+(define (play)
+  (open-pcap pcap)
+  (wait-completion))
+
+(define (stat name) (assq-ref (deduplication-stats 255) name))
+
+(define (pair-with pred)
+  (let ((pairs (filter (lambda (p) (pred (assq-ref p 'original) (assq-ref p 'duplicate)))
+                       (deduplication-pairs 255))))
+    (assert (eqv? 1 (length pairs)))
+    (car pairs)))
+
+(set-collapse-ifaces #t)
+(play)
+(assert (eqv? 1 (stat 'nodup-found)))
+(assert (eqv? 1 (stat 'dup-found)))
+(assert (eqv? 1 (stat 'intra-iface)))
+(assert (eqv? 0 (stat 'cross-iface)))
+(let ((intra (pair-with =)))
+  (assert (eqv? 1 (assq-ref intra 'count)))
+  (assert (equal? '((256 . 1)) (assq-ref intra 'dt))))
+
+; The same frames from another device are dups of the first ones, at the same time
+(play)
+(assert (eqv? 1 (stat 'nodup-found)))
+(assert (eqv? 3 (stat 'dup-found)))
+(assert (eqv? 1 (stat 'intra-iface)))
+(assert (eqv? 2 (stat 'cross-iface)))
+(assert (eqv? 1 (assq-ref (pair-with =) 'count)))
+(let ((cross (pair-with (lambda (o d) (not (= o d))))))
+  (assert (= (assq-ref cross 'original) (assq-ref (pair-with =) 'original)))
+  (assert (eqv? 2 (assq-ref cross 'count)))
+  (assert (equal? '((1 . 1) (256 . 1)) (assq-ref cross 'dt))))
+
+; Without collapse-ifaces each device has its own window, so device 255 sees nothing
+(set-collapse-ifaces #f)
+(play)
+(assert (eqv? 1 (stat 'nodup-found)))
+(assert (eqv? 3 (stat 'dup-found)))
+(assert (eqv? 2 (length (deduplication-pairs 255))))
+
+(reset-deduplication-stats)
+(assert (eqv? 0 (stat 'dup-found)))
+(assert (null? (deduplication-pairs 255)))
+
+;; good enough!
+(exit 0)
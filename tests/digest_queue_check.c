@@ -5,38 +5,58 @@
 #include <assert.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
+#include "junkie/tools/ref.h"
 #include "digest_queue.c"
 
-static void check_hash(uint8_t *data, size_t size, size_t eth_extra_bytes)
+static void check_hash_with(unsigned engine, uint8_t *data, size_t size, size_t eth_extra_bytes)
 {
-    uint8_t hash1[BUFSIZE_TO_HASH] = "";
-    uint8_t hash2[BUFSIZE_TO_HASH] = "";
+    dedup_digest = engine;
+
+    struct frame_digest fd1, fd2;
+    uint8_t copy[BUFSIZE_TO_HASH];
+    assert(size <= sizeof(copy));
+    memcpy(copy, data, size);
 
-    digest_frame(hash1, size, data);
+    digest_frame(&fd1, size, data);
     size_t iphdr_offset = ETHER_HEADER_SIZE + eth_extra_bytes;
 
+    /* the frame must be left untouched */
+    assert(0 == memcmp(copy, data, size));
+
     /* we modify a mac address, the hash shouldn't change */
     data[0] = 0xff;
-    digest_frame(hash2, size, data);
-    assert(0 == memcmp(hash1, hash2, sizeof hash1));
+    digest_frame(&fd2, size, data);
+    assert(0 == memcmp(fd1.digest, fd2.digest, sizeof fd1.digest));
+    assert(fd1.check == fd2.check);
 
     /* We change the TOS, the hash shouldn't change */
     data[iphdr_offset + IPV4_TOS_OFFSET] =
         !data[iphdr_offset + IPV4_TOS_OFFSET];
-    digest_frame(hash2, size, data);
-    assert(0 == memcmp(hash1, hash2, sizeof hash1));
+    digest_frame(&fd2, size, data);
+    assert(0 == memcmp(fd1.digest, fd2.digest, sizeof fd1.digest));
 
     /* We change the IP Hdr checksum, the hash shouldn't change */
     data[iphdr_offset + IPV4_CHECKSUM_OFFSET] =
         !data[iphdr_offset + IPV4_CHECKSUM_OFFSET];
-    digest_frame(hash2, size, data);
-    assert(0 == memcmp(hash1, hash2, sizeof hash1));
+    digest_frame(&fd2, size, data);
+    assert(0 == memcmp(fd1.digest, fd2.digest, sizeof fd1.digest));
 
     /* But if we change another value, the hash MUST change! */
     data[iphdr_offset + IPV4_SRC_HOST_OFFSET] =
         !data[iphdr_offset + IPV4_SRC_HOST_OFFSET];
-    digest_frame(hash2, size, data);
-    assert(0 != memcmp(hash1, hash2, sizeof hash1));
+    digest_frame(&fd2, size, data);
+    assert(0 != memcmp(fd1.digest, fd2.digest, sizeof fd1.digest));
+    assert(fd1.check != fd2.check);
+
+    memcpy(data, copy, size);
+}
+
+static void check_hash(uint8_t *data, size_t size, size_t eth_extra_bytes)
+{
+    for (unsigned e = 0; e < NB_ELEMS(digest_engines); e++) {
+        check_hash_with(e, data, size, eth_extra_bytes);
+    }
 }
 
 static void test_digest_frame_standard(void)
@@ -147,9 +167,309 @@ static void test_digest_frame_lcc_and_vlanid(void)
     check_hash(raw, sizeof raw, 6);
 }
 
+/*
+ * Lookups
+ */
+
+#define DELAY 100000
+#define T0 (INT64_C(1500000000) * 1000000)  // the start of a slice
+
+// A digest which key is key (so that we choose where it's stored), distinct for each n
+static struct frame_digest make_digest(uint64_t key, uint32_t n)
+{
+    struct frame_digest fd;
+    memset(&fd, 0, sizeof(fd));
+    memcpy(fd.digest, &key, sizeof(key));
+    memcpy(fd.digest + sizeof(key), &n, sizeof(n));
+    fd.check = n;
+    return fd;
+}
+
+// Look for that frame as received from dev_id
+static bool find_from(struct digest_queue *dq, uint8_t dev_id, uint64_t key, uint32_t n, int64_t ts)
+{
+    struct frame_digest const fd = make_digest(key, n);
+    struct timeval const tv = { .tv_sec = ts / 1000000, .tv_usec = ts % 1000000 };
+    return digest_queue_find(dq, &fd, dev_id, 0, NULL, &tv);
+}
+
+static bool find(struct digest_queue *dq, uint64_t key, uint32_t n, int64_t ts)
+{
+    return find_from(dq, dq->dev_id, key, n, ts);
+}
+
+static void dup_within_delay_check(void)
+{
+    struct digest_queue *dq = digest_queue_get(1);
+    assert(dq);
+
+    assert(! find(dq, 1, 1, T0 + 10));
+    assert(find(dq, 1, 1, T0 + 20));
+    assert(find(dq, 1, 1, T0 + 10 + DELAY));    // still a dup at exactly max_dup_delay
+    assert(! find(dq, 1, 2, T0 + 30));          // same key, distinct frame
+
+    assert(counter_read(&dq->num_dup_found) == 2);
+    assert(counter_read(&dq->num_nodup_found) == 2);
+    assert(counter_read(&dq->num_collisions) == 0);
+
+    digest_queue_unref(&dq);
+}
+
+static void retransmission_check(void)
+{
+    struct digest_queue *dq = digest_queue_get(2);
+    assert(dq);
+
+    assert(! find(dq, 2, 2, T0 + 100));
+    // After max_dup_delay this is a retransmission, which is stored in turn
+    assert(! find(dq, 2, 2, T0 + 100 + DELAY + 1));
+    assert(find(dq, 2, 2, T0 + 100 + DELAY + 2));
+
+    assert(counter_read(&dq->num_dup_found) == 1);
+    assert(counter_read(&dq->num_nodup_found) == 2);
+
+    digest_queue_unref(&dq);
+}
+
+static void slice_boundary_check(void)
+{
+    struct digest_queue *dq = digest_queue_get(3);
+    assert(dq);
+
+    // Stored at the end of a slice, found from the next one
+    assert(! find(dq, 3, 3, T0 + DELAY - 5));
+    assert(find(dq, 3, 3, T0 + DELAY + 5));
+    assert(find(dq, 3, 3, T0 + 2*DELAY - 5));
+    // But not from the one after
+    assert(! find(dq, 3, 3, T0 + 2*DELAY + 5));
+
+    assert(counter_read(&dq->num_dup_found) == 2);
+    assert(counter_read(&dq->num_nodup_found) == 2);
+
+    digest_queue_unref(&dq);
+}
+
+static void slice_reuse_check(void)
+{
+    dedup_window_size = PROBE_LEN;
+    struct digest_queue *dq = digest_queue_get(4);
+    assert(dq);
+    assert(dq->size == PROBE_LEN);
+
+    // Fill the whole table of a slice
+    for (unsigned i = 0; i < PROBE_LEN; i++) {
+        assert(! find(dq, i, 100 + i, T0 + i));
+    }
+    // Two slices later, the same table is reused, so the old entries are free
+    for (unsigned i = 0; i < PROBE_LEN; i++) {
+        assert(! find(dq, i, 200 + i, T0 + 2*DELAY + i));
+    }
+    assert(counter_read(&dq->num_overflows) == 0);
+    assert(find(dq, 3, 203, T0 + 2*DELAY + 10));
+    assert(! find(dq, 3, 103, T0 + 2*DELAY + 10));  // dropped with its slice, and no room left
+    assert(counter_read(&dq->num_overflows) == 1);
+
+    digest_queue_unref(&dq);
+    dedup_window_size = 16384;
+}
+
+static void overflow_check(void)
+{
+    dedup_window_size = PROBE_LEN;
+    struct digest_queue *dq = digest_queue_get(5);
+    assert(dq);
+
+    // All these keys probe the same entries
+    for (unsigned i = 0; i < PROBE_LEN; i++) {
+        assert(! find(dq, i * PROBE_LEN, 300 + i, T0 + i));
+    }
+    assert(counter_read(&dq->num_overflows) == 0);
+    assert(dq->overflows_checked == INT64_MIN);
+
+    assert(! find(dq, PROBE_LEN * PROBE_LEN, 300 + PROBE_LEN, T0 + 10));
+    assert(counter_read(&dq->num_overflows) == 1);
+    assert(dq->overflows_checked == T0 / 1000000);
+    // Not stored, so its dups go unnoticed
+    assert(! find(dq, PROBE_LEN * PROBE_LEN, 300 + PROBE_LEN, T0 + 11));
+    assert(counter_read(&dq->num_overflows) == 2);
+    // While the stored ones are still found
+    assert(find(dq, 0, 300, T0 + 12));
+
+    // Overflows are checked again a second later (then warned about)
+    for (unsigned i = 0; i <= PROBE_LEN; i++) {
+        assert(! find(dq, i * PROBE_LEN, 400 + i, T0 + 1000000 + i));
+    }
+    assert(counter_read(&dq->num_overflows) == 3);
+    assert(dq->overflows_checked == T0 / 1000000 + 1);
+    assert(dq->overflows_at_check == 3);
+    assert(dq->nodups_at_check == 2*PROBE_LEN + 3);
+
+    digest_queue_unref(&dq);
+    dedup_window_size = 16384;
+}
+
+/*
+ * Dups per pair of devices
+ */
+
+static struct dedup_pair const *find_pair(struct digest_queue const *dq, uint8_t original, uint8_t duplicate)
+{
+    for (unsigned p = 0; p < NB_ELEMS(dq->pairs); p++) {
+        struct dedup_pair const *pair = dq->pairs + p;
+        if (pair->key && pair_original(pair) == original && pair_duplicate(pair) == duplicate) return pair;
+    }
+    return NULL;
+}
+
+static void dt_bucket_check(void)
+{
+    assert(dt_bucket(0) == 0);
+    assert(dt_bucket(1) == 1);
+    assert(dt_bucket(3) == 2);
+    assert(dt_bucket(4) == 3);
+    assert(dt_bucket(1000) == 10);
+    assert(dt_bucket(UINT64_MAX) == NB_DEDUP_DT_BUCKETS-1);
+}
+
+static void pairs_check(void)
+{
+    // As with collapse-ifaces, all devices share this window
+    struct digest_queue *dq = digest_queue_get(7);
+    assert(dq);
+
+    assert(! find_from(dq, 1, 7, 7, T0));
+    assert(find_from(dq, 1, 7, 7, T0));         // intra iface, same time
+    assert(find_from(dq, 2, 7, 7, T0 + 3));     // cross iface
+    assert(find_from(dq, 2, 7, 7, T0 + 1000));  // cross iface, later
+    assert(! find_from(dq, 2, 7, 8, T0 + 1000));
+    assert(find_from(dq, 1, 7, 8, T0 + 1001));  // cross iface, the other way around
+
+    struct dedup_pair const *pair = find_pair(dq, 1, 1);
+    assert(pair);
+    assert(pair_count(pair) == 1);
+    assert(pair->dt[0] == 1);
+
+    pair = find_pair(dq, 1, 2);
+    assert(pair);
+    assert(pair_count(pair) == 2);
+    assert(pair->dt[2] == 1);
+    assert(pair->dt[10] == 1);
+
+    pair = find_pair(dq, 2, 1);
+    assert(pair);
+    assert(pair_count(pair) == 1);
+    assert(pair->dt[1] == 1);
+
+    assert(! find_pair(dq, 2, 2));
+
+    uint64_t intra, cross;
+    count_iface_dups(dq, &intra, &cross);
+    assert(intra == 1);
+    assert(cross == 3);
+    assert(intra + cross == counter_read(&dq->num_dup_found));
+
+    reset_dedup_stats();
+    assert(! find_pair(dq, 1, 2));
+    count_iface_dups(dq, &intra, &cross);
+    assert(intra == 0 && cross == 0);
+
+    digest_queue_unref(&dq);
+}
+
+static void pairs_full_check(void)
+{
+    struct digest_queue *dq = digest_queue_get(8);
+    assert(dq);
+
+    // One more pair of devices than we have room for
+    for (unsigned d = 0; d <= NB_DEDUP_PAIRS; d++) {
+        assert(! find_from(dq, 200, d, d, T0 + d));
+        assert(find_from(dq, d, d, d, T0 + d + 1));
+    }
+
+    // All dups are counted, but the last pair is not accounted for
+    assert(counter_read(&dq->num_dup_found) == NB_DEDUP_PAIRS + 1);
+    for (unsigned d = 0; d < NB_DEDUP_PAIRS; d++) {
+        struct dedup_pair const *pair = find_pair(dq, 200, d);
+        assert(pair);
+        assert(pair_count(pair) == 1);
+        assert(pair->dt[1] == 1);
+    }
+    assert(! find_pair(dq, 200, NB_DEDUP_PAIRS));
+
+    uint64_t intra, cross;
+    count_iface_dups(dq, &intra, &cross);
+    assert(intra == 0);
+    assert(cross == NB_DEDUP_PAIRS);
+
+    digest_queue_unref(&dq);
+}
+
+/* A writer stores distinct frames while a reader looks for those already
+ * stored, which must always be found. */
+
+#define NB_CONCURRENT 4096  // all within max_dup_delay
+static struct digest_queue *concurrent_dq;
+static unsigned volatile nb_inserted;
+
+static uint64_t concurrent_key(unsigned i)
+{
+    return i * UINT64_C(7919);  // spread over the table
+}
+
+static void *writer_thread(void *dummy)
+{
+    (void)dummy;
+    for (unsigned i = 0; i < NB_CONCURRENT; i++) {
+        assert(! find(concurrent_dq, concurrent_key(i), i, T0 + i));
+        __sync_synchronize();
+        nb_inserted = i + 1;
+    }
+    return NULL;
+}
+
+static void *reader_thread(void *dummy)
+{
+    (void)dummy;
+    unsigned next = 0;
+    while (next < NB_CONCURRENT) {
+        unsigned const n = nb_inserted;
+        __sync_synchronize();
+        for (; next < n; next++) {
+            assert(find(concurrent_dq, concurrent_key(next), next, T0 + NB_CONCURRENT + next));
+            unsigned const other = (next * 31) % n;
+            assert(find(concurrent_dq, concurrent_key(other), other, T0 + NB_CONCURRENT + next));
+        }
+    }
+    return NULL;
+}
+
+static void concurrent_check(void)
+{
+    concurrent_dq = digest_queue_get(6);
+    assert(concurrent_dq);
+    nb_inserted = 0;
+
+    pthread_t writer, reader;
+    assert(0 == pthread_create(&reader, NULL, reader_thread, NULL));
+    assert(0 == pthread_create(&writer, NULL, writer_thread, NULL));
+    assert(0 == pthread_join(writer, NULL));
+    assert(0 == pthread_join(reader, NULL));
+
+    assert(counter_read(&concurrent_dq->num_nodup_found) == NB_CONCURRENT);
+    assert(counter_read(&concurrent_dq->num_dup_found) == 2*NB_CONCURRENT);
+    assert(counter_read(&concurrent_dq->num_overflows) == 0);
+
+    digest_queue_unref(&concurrent_dq);
+}
+
 int main(void)
 {
     log_init();
+    ext_init();
+    objalloc_init();
+    ref_init();
+    digest_init();
     log_set_level(LOG_DEBUG, NULL);
     log_set_file("digest_queue_check.log");
 
@@ -159,6 +479,22 @@ int main(void)
     test_digest_frame_lcc();
     test_digest_frame_lcc_and_vlanid();
 
+    max_dup_delay = DELAY;
+    dup_within_delay_check();
+    retransmission_check();
+    slice_boundary_check();
+    slice_reuse_check();
+    overflow_check();
+    concurrent_check();
+    dt_bucket_check();
+    pairs_check();
+    pairs_full_check();
+
+    doomer_stop();
+    digest_fini();
+    ref_fini();
+    objalloc_fini();
+    ext_fini();
     log_fini();
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,231 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <ftw.h>
+#include <junkie/cpp.h>
+#include <junkie/tools/miscmacs.h>
+#include <junkie/tools/hash.h>
+#include <junkie/tools/key_hash.h>
+
+/*
+ * Check that the specialized versions are the same as the generic one
+ */
+
+static void specialized_check(void)
+{
+    uint8_t key[64];
+    for (unsigned t = 0; t < 1000; t++) {
+        for (unsigned i = 0; i < sizeof(key); i++) key[i] = rand();
+        for (size_t len = 0; len <= sizeof(key); len++) {
+            assert(key_hash(key, len) == key_hash_bytes(key, len));
+        }
+    }
+
+    // Any change in the key must change the hash (not strictly required, but we'd better have it)
+    memset(key, 0, sizeof(key));
+    uint_least32_t const h = key_hash(key, 36);
+    for (unsigned i = 0; i < 36; i++) {
+        key[i] = 1;
+        assert(key_hash(key, 36) != h);
+        key[i] = 0;
+    }
+    assert(key_hash(key, 8) != key_hash(key, 16));  // length matters
+}
+
+/*
+ * Collect flow keys from the test pcaps
+ */
+
+#define MAX_KEYS 100000
+
+static struct keys {
+    char const *name;
+    size_t len;
+    unsigned num;
+    uint8_t (*keys)[44];
+} keys[] = {
+    { "ports",      4,  0, NULL },
+    { "ip4 pairs",  8,  0, NULL },
+    { "ip6 addrs",  16, 0, NULL },
+    { "ip6 keys",   36, 0, NULL },
+    { "ip keys",    44, 0, NULL },
+};
+
+static void add_key(struct keys *k, void const *key)
+{
+    if (k->num >= MAX_KEYS) return;
+    for (unsigned i = 0; i < k->num; i++) {
+        if (0 == memcmp(k->keys[i], key, k->len)) return;   // we want distinct keys
+    }
+    memcpy(k->keys[k->num++], key, k->len);
+}
+
+static void add_ip_frame(uint8_t const *ip, size_t len)
+{
+    if (len < 1) return;
+    unsigned const version = ip[0] >> 4;
+    uint8_t ip_key[44];
+    memset(ip_key, 0, sizeof(ip_key));
+    uint8_t const *l4;
+    unsigned proto;
+
+    if (version == 4 && len >= 20) {
+        add_key(keys+1, ip + 12);
+        memcpy(ip_key + 4, ip + 12, 4);     // as in struct ip_key, after the family (and padding)
+        memcpy(ip_key + 24, ip + 16, 4);
+        proto = ip[9];
+        size_t const hlen = (ip[0] & 0xf) * 4;
+        if (hlen > len) return;
+        l4 = ip + hlen;
+        len -= hlen;
+    } else if (version == 6 && len >= 40) {
+        add_key(keys+2, ip + 8);
+        add_key(keys+2, ip + 24);
+        uint8_t ip6_key[36];
+        memcpy(ip6_key, ip + 8, 32);
+        memcpy(ip6_key + 32, ip + 6, 1);
+        memset(ip6_key + 33, 0, 3);
+        add_key(keys+3, ip6_key);
+        memcpy(ip_key + 4, ip + 8, 16);
+        memcpy(ip_key + 24, ip + 24, 16);
+        proto = ip[6];
+        l4 = ip + 40;
+        len -= 40;
+    } else {
+        return;
+    }
+
+    memcpy(ip_key + 40, &proto, 4);
+    add_key(keys+4, ip_key);
+    if ((proto == 6 || proto == 17) && len >= 4) add_key(keys+0, l4);
+}
+
+static uint32_t read_u32(uint8_t const *p, bool swap)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static int add_pcap(char const *path, struct stat const unused_ *sb, int type, struct FTW unused_ *ftw)
+{
+    size_t const path_len = strlen(path);
+    if (type != FTW_F || path_len < 5 || 0 != strcmp(path + path_len - 5, ".pcap")) return 0;
+
+    FILE *f = fopen(path, "r");
+    if (! f) return 0;
+    uint8_t hdr[24];
+    if (1 != fread(hdr, sizeof(hdr), 1, f)) goto quit;
+    uint32_t const magic = read_u32(hdr, false);
+    bool const swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    if (! swap && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) goto quit;
+    uint32_t const linktype = read_u32(hdr + 20, swap);
+
+    static uint8_t frame[65536];
+    uint8_t rec[16];
+    while (1 == fread(rec, sizeof(rec), 1, f)) {
+        uint32_t const caplen = read_u32(rec + 8, swap);
+        if (caplen > sizeof(frame) || 1 != fread(frame, caplen, 1, f)) break;
+        size_t off;
+        if (linktype == 1) {    // Ethernet
+            off = 12;
+            while (off + 4 <= caplen && frame[off] == 0x81 && frame[off+1] == 0x00) off += 4;   // VLANs
+            off += 2;
+        } else if (linktype == 113) {   // Linux cooked
+            off = 16;
+        } else {
+            break;
+        }
+        if (off <= caplen) add_ip_frame(frame + off, caplen - off);
+    }
+quit:
+    fclose(f);
+    return 0;
+}
+
+/*
+ * Bench
+ */
+
+static uint64_t cycles(void)
+{
+#   if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#   else
+    return 0;
+#   endif
+}
+
+// @returns the sum of squared bucket lengths, relative to what a random hash would give (so 1 is perfect)
+static double distribution(struct keys const *k, unsigned num_buckets, uint_least32_t (*hash)(void const *, size_t))
+{
+    unsigned *counts = calloc(num_buckets, sizeof(*counts));
+    assert(counts);
+    for (unsigned i = 0; i < k->num; i++) counts[hash(k->keys[i], k->len) % num_buckets] ++;
+    double sum = 0.;
+    for (unsigned b = 0; b < num_buckets; b++) sum += (double)counts[b] * counts[b];
+    free(counts);
+    double const n = k->num;
+    return sum / (n + n * (n - 1.) / num_buckets);
+}
+
+static uint_least32_t djb2(void const *key, size_t len)
+{
+    return hashfun(key, len);
+}
+
+static uint_least32_t key_hash_(void const *key, size_t len)
+{
+    return key_hash(key, len);
+}
+
+static uint_least32_t volatile sink;   // so that hashes are not optimized away
+
+static void bench(struct keys const *k)
+{
+    if (k->num == 0) return;
+
+#   define NB_ROUNDS 100
+    uint64_t start = cycles();
+    for (unsigned r = 0; r < NB_ROUNDS; r++) {
+        for (unsigned i = 0; i < k->num; i++) sink += hashfun(k->keys[i], k->len);
+    }
+    uint64_t const djb2_cycles = cycles() - start;
+    start = cycles();
+    for (unsigned r = 0; r < NB_ROUNDS; r++) {
+        for (unsigned i = 0; i < k->num; i++) sink += key_hash(k->keys[i], k->len);
+    }
+    uint64_t const key_hash_cycles = cycles() - start;
+    double const nb_hashes = (double)NB_ROUNDS * k->num;
+
+    printf("%-10s (%2zu bytes, %6u keys): djb2 %6.1f cycles/hash, dist %.2f/%.2f ; key_hash %6.1f cycles/hash, dist %.2f/%.2f\n",
+        k->name, k->len, k->num,
+        djb2_cycles / nb_hashes, distribution(k, 1024, djb2), distribution(k, 67, djb2),
+        key_hash_cycles / nb_hashes, distribution(k, 1024, key_hash_), distribution(k, 67, key_hash_));
+}
+
+int main(void)
+{
+    srand(time(NULL));
+    specialized_check();
+
+    for (unsigned k = 0; k < NB_ELEMS(keys); k++) {
+        keys[k].keys = malloc(MAX_KEYS * sizeof(*keys[k].keys));
+        assert(keys[k].keys);
+    }
+    (void)nftw(STRIZE(SRCDIR) "/pcap", add_pcap, 10, 0);
+
+    printf("key_hash implementation: %s\n", KEY_HASH_IMPL);
+    printf("(dist is the sum of squared bucket lengths relative to a random hash, with 1024 and 67 buckets)\n");
+    for (unsigned k = 0; k < NB_ELEMS(keys); k++) {
+        bench(keys + k);
+        free(keys[k].keys);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -50,6 +50,44 @@ static void supermutex_check(void)
     supermutex_dtor(&super1);
 }
 
+static struct mutex cond_lock;
+static struct condvar cond;
+static unsigned cond_value;
+
+static void *cond_waiter(void *dummy)
+{
+    (void)dummy;
+
+    mutex_lock(&cond_lock);
+    while (cond_value < 1) condvar_wait(&cond, &cond_lock);
+    cond_value = 2;
+    condvar_broadcast(&cond);
+    mutex_unlock(&cond_lock);
+
+    return NULL;
+}
+
+static void condvar_check(void)
+{
+    mutex_ctor(&cond_lock, "cond lock");
+    condvar_ctor(&cond, "cond");
+
+    pthread_t other_thread;
+    pthread_create(&other_thread, NULL, cond_waiter, NULL);
+
+    // Wake it up, then wait for its answer
+    mutex_lock(&cond_lock);
+    cond_value = 1;
+    condvar_signal(&cond);
+    while (cond_value < 2) condvar_wait(&cond, &cond_lock);
+    mutex_unlock(&cond_lock);
+
+    pthread_join(other_thread, NULL);
+
+    condvar_dtor(&cond);
+    mutex_dtor(&cond_lock);
+}
+
 int main(void)
 {
     log_init();
@@ -58,6 +96,7 @@ int main(void)
     mutex_init();
 
     supermutex_check();
+    condvar_check();
 
     mutex_fini();
     log_fini();
@@ -0,0 +1,362 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <junkie/tools/miscmacs.h>
+#include <junkie/tools/ext.h>
+#include <junkie/tools/objalloc.h>
+#include <junkie/tools/timeval.h>
+#include <junkie/tools/counter.h>
+#include <junkie/proto/proto.h>
+#include <junkie/proto/pkt_wait_list.h>
+
+#undef LOG_CAT
+#define LOG_CAT global_log_category
+
+/*
+ * A multiplexer which children are dummy parsers identified by a mere integer
+ */
+
+#define NB_CHILDREN 5000
+
+static struct mux_proto mux_proto_test;
+static struct timeval now;
+
+static enum proto_parse_status test_parse(struct parser unused_ *parser, struct proto_info unused_ *parent, unsigned unused_ way, uint8_t const unused_ *packet, size_t unused_ cap_len, size_t unused_ wire_len, struct timeval const unused_ *now, size_t unused_ tot_cap_len, uint8_t const unused_ *tot_packet)
+{
+    return PROTO_OK;
+}
+
+static void test_proto_ctor(void)
+{
+    static struct proto_ops const ops = {
+        .parse      = test_parse,
+        .parser_new = mux_parser_new,
+        .parser_del = mux_parser_del,
+        .info_2_str = proto_info_2_str,
+        .info_addr  = proto_info_addr,
+    };
+    mux_proto_ctor(&mux_proto_test, &ops, &mux_proto_ops, "Test", PROTO_CODE_DUMMY, sizeof(uint32_t), 1024);
+}
+
+static struct mux_parser *populate(bool lockfree)
+{
+    mux_proto_test.lockfree = lockfree;
+    struct parser *parser = mux_proto_test.proto.ops->parser_new(&mux_proto_test.proto);
+    assert(parser);
+    struct mux_parser *mux_parser = DOWNCAST(parser, parser, mux_parser);
+    assert(!mux_parser->index == !lockfree);
+
+    for (uint32_t k = 0; k < NB_CHILDREN; k++) {
+        struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, proto_dummy, NULL, &k, &now);
+        assert(subparser);
+        mux_subparser_unref(&subparser);
+    }
+    assert(mux_parser->num_children == NB_CHILDREN);
+    assert((int64_t)counter_read(&mux_proto_test.num_subparsers) >= NB_CHILDREN);
+    assert(mux_proto_test.subparser_size == sizeof(struct mux_subparser) + sizeof(uint32_t));
+
+    return mux_parser;
+}
+
+/*
+ * Check that we find what we indexed, and only that
+ */
+
+static void lookup_check(bool lockfree)
+{
+    struct mux_parser *mux_parser = populate(lockfree);
+
+    for (uint32_t k = 0; k < NB_CHILDREN; k++) {
+        struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &k, &now);
+        assert(subparser);
+        assert(0 == memcmp(subparser->key, &k, sizeof(k)));
+        if (k & 1) mux_subparser_deindex(subparser);
+        mux_subparser_unref(&subparser);
+    }
+    assert(mux_parser->num_children == NB_CHILDREN/2);
+
+    for (uint32_t k = 0; k < NB_CHILDREN; k++) {
+        struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &k, &now);
+        assert(!subparser == !!(k & 1));
+        if (! subparser) continue;
+        // Move the even ones to the odd keys
+        uint32_t const new_k = k + 1;
+        mux_subparser_change_key(subparser, mux_parser, &new_k);
+        mux_subparser_unref(&subparser);
+    }
+
+    for (uint32_t k = 0; k < NB_CHILDREN; k++) {
+        struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &k, &now);
+        assert(!subparser == !(k & 1));
+        mux_subparser_unref(&subparser);
+    }
+
+    struct parser *parser = &mux_parser->parser;
+    parser_unref(&parser);
+    doomer_run();
+}
+
+/*
+ * Check that an undersized hash grows while we use it
+ */
+
+static void grow_check(void)
+{
+    unsigned const hash_size = mux_proto_test.hash_size;
+    mux_proto_test.hash_size = 7;
+    struct mux_parser *mux_parser = populate(false);
+    mux_proto_test.hash_size = hash_size;
+
+    for (unsigned l = 0; l < 10 * NB_CHILDREN; l++) {
+        uint32_t const k = l % NB_CHILDREN;
+        struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &k, &now);
+        assert(subparser);
+        assert(0 == memcmp(subparser->key, &k, sizeof(k)));
+        assert(subparser->h_idx < mux_parser->num_buckets);
+        mux_subparser_unref(&subparser);
+    }
+    SLOG(LOG_INFO, "Hash grew from %u to %u buckets", mux_parser->hash_size, mux_parser->num_buckets);
+    assert(mux_parser->num_buckets > 16 * mux_parser->hash_size);
+    assert(mux_parser->num_children == NB_CHILDREN);
+
+    struct parser *parser = &mux_parser->parser;
+    parser_unref(&parser);
+    doomer_run();
+}
+
+/*
+ * Check that the flow cache answers established flows but never returns a deindexed subparser
+ */
+
+static void flow_cache_check(void)
+{
+    struct mux_parser *mux_parser = populate(false);
+    uint32_t const k = 42, other_k = NB_CHILDREN + 1;
+
+    struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &k, &now);
+    assert(subparser);
+    uint64_t const hits = counter_read(&mux_proto_test.num_cache_hits);
+    struct mux_subparser *again = mux_subparser_lookup(mux_parser, NULL, NULL, &k, &now);
+    assert(again == subparser);
+    assert(counter_read(&mux_proto_test.num_cache_hits) == hits + 1);
+    mux_subparser_unref(&again);
+
+    // Once rekeyed, it must not be found under its former key, but under the new one
+    mux_subparser_change_key(subparser, mux_parser, &other_k);
+    assert(! mux_subparser_lookup(mux_parser, NULL, NULL, &k, &now));
+    again = mux_subparser_lookup(mux_parser, NULL, NULL, &other_k, &now);
+    assert(again == subparser);
+    mux_subparser_unref(&again);
+
+    // Once deindexed, it must not be found at all
+    mux_subparser_deindex(subparser);
+    assert(! mux_subparser_lookup(mux_parser, NULL, NULL, &other_k, &now));
+    mux_subparser_unref(&subparser);
+
+    // Nor once its parser is gone, even if a new one is allocated at the same address
+    struct parser *parser = &mux_parser->parser;
+    parser_unref(&parser);
+    doomer_run();
+    mux_parser = populate(false);
+    subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &k, &now);
+    assert(subparser && subparser->mux_parser == mux_parser);
+    mux_subparser_unref(&subparser);
+
+    parser = &mux_parser->parser;
+    parser_unref(&parser);
+    doomer_run();
+}
+
+/*
+ * Check that when there are too many children the least recently used one is sacrificed
+ */
+
+static void infanticide_check(void)
+{
+    unsigned const hash_size = mux_proto_test.hash_size;
+    mux_proto_test.hash_size = 1;   // so that all children are in the same bucket
+    mux_proto_test.num_max_children = 10;
+    struct parser *parser = mux_proto_test.proto.ops->parser_new(&mux_proto_test.proto);
+    mux_proto_test.hash_size = hash_size;
+    mux_proto_test.num_max_children = 0;
+    assert(parser);
+    struct mux_parser *mux_parser = DOWNCAST(parser, parser, mux_parser);
+
+    struct timeval t = now;
+    for (uint32_t k = 0; k <= 10; k++) {
+        struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, proto_dummy, NULL, &k, &t);
+        assert(subparser);
+        mux_subparser_unref(&subparser);
+    }
+
+    // Use the first ones again a bit later
+    timeval_add_sec(&t, 1);
+    for (uint32_t k = 0; k < 5; k++) {
+        struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &k, &t);
+        assert(subparser);
+        mux_subparser_unref(&subparser);
+    }
+
+    // So that the oldest of the others is sacrificed for a newcomer
+    uint64_t const infanticides = counter_read(&mux_proto_test.num_infanticide);
+    uint32_t const newcomer = 11;
+    struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, proto_dummy, NULL, &newcomer, &t);
+    assert(subparser);
+    mux_subparser_unref(&subparser);
+    assert(counter_read(&mux_proto_test.num_infanticide) == infanticides + 1);
+
+    for (uint32_t k = 0; k <= newcomer; k++) {
+        subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &k, &t);
+        assert(!subparser == (k == 5));
+        mux_subparser_unref(&subparser);
+    }
+
+    parser_unref(&parser);
+    doomer_run();
+}
+
+/*
+ * Check that children of a lower class are sacrificed first, whatever their age
+ */
+
+static bool has_child(struct mux_parser *mux_parser, uint32_t k, struct timeval const *t)
+{
+    struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &k, t);
+    bool const ret = !!subparser;
+    mux_subparser_unref(&subparser);
+    return ret;
+}
+
+static void flow_class_check(void)
+{
+    mux_proto_test.num_max_children = 10;
+    struct parser *parser = mux_proto_test.proto.ops->parser_new(&mux_proto_test.proto);
+    mux_proto_test.num_max_children = 0;
+    assert(parser);
+    struct mux_parser *mux_parser = DOWNCAST(parser, parser, mux_parser);
+
+    // All established but 7
+    struct timeval t = now;
+    for (uint32_t k = 0; k <= 10; k++) {
+        struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, proto_dummy, NULL, &k, &t);
+        assert(subparser);
+        if (k != 7) mux_subparser_promote(subparser, MUX_FLOW_ESTABLISHED);
+        mux_subparser_promote(subparser, MUX_FLOW_EMBRYONIC);   // never demoted
+        mux_subparser_unref(&subparser);
+    }
+
+    // A flood of newcomers only kill each others (and 7)
+    timeval_add_sec(&t, 1);
+    uint64_t const embryonic = counter_read(&mux_proto_test.num_evictions[MUX_FLOW_EMBRYONIC]);
+    for (uint32_t k = 11; k < 100; k++) {
+        struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, proto_dummy, NULL, &k, &t);
+        assert(subparser);
+        mux_subparser_unref(&subparser);
+    }
+    assert(counter_read(&mux_proto_test.num_evictions[MUX_FLOW_EMBRYONIC]) == embryonic + 89);
+    for (uint32_t k = 0; k <= 10; k++) assert(has_child(mux_parser, k, &t) == (k != 7));
+    assert(has_child(mux_parser, 99, &t));
+
+    // Once there is no other embryonic child, the least recently used established one goes
+    struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &(uint32_t){ 99 }, &t);
+    assert(subparser);
+    mux_subparser_promote(subparser, MUX_FLOW_ACTIVE);
+    mux_subparser_unref(&subparser);
+    timeval_add_sec(&t, 1);
+    for (uint32_t k = 1; k <= 10; k++) if (k != 7) assert(has_child(mux_parser, k, &t));
+    uint64_t const established = counter_read(&mux_proto_test.num_evictions[MUX_FLOW_ESTABLISHED]);
+    subparser = mux_subparser_lookup(mux_parser, proto_dummy, NULL, &(uint32_t){ 100 }, &t);
+    assert(subparser);
+    mux_subparser_unref(&subparser);
+    assert(counter_read(&mux_proto_test.num_evictions[MUX_FLOW_ESTABLISHED]) == established + 1);
+    assert(! has_child(mux_parser, 0, &t));
+    assert(has_child(mux_parser, 99, &t));
+
+    parser_unref(&parser);
+    doomer_run();
+}
+
+/*
+ * Benchmark lookups with various number of threads
+ */
+
+#define NB_LOOKUPS 200000
+
+static void *lookup_thread(void *mux_parser_)
+{
+    struct mux_parser *mux_parser = mux_parser_;
+    unsigned seed = (uintptr_t)pthread_self();
+
+    enter_multi_region();
+    for (unsigned l = 0; l < NB_LOOKUPS; l++) {
+        uint32_t const k = rand_r(&seed) % NB_CHILDREN;
+        struct mux_subparser *subparser = mux_subparser_lookup(mux_parser, NULL, NULL, &k, &now);
+        assert(subparser);
+        mux_subparser_unref(&subparser);
+    }
+    leave_protected_region();
+
+    return NULL;
+}
+
+static void lookup_bench(bool lockfree)
+{
+    struct mux_parser *mux_parser = populate(lockfree);
+
+    for (unsigned nb_threads = 1; nb_threads <= 32; nb_threads *= 2) {
+        pthread_t pth[nb_threads];
+        struct timeval start, stop;
+        timeval_set_now(&start);
+        for (unsigned t = 0; t < nb_threads; t++) {
+            assert(0 == pthread_create(pth+t, NULL, lookup_thread, mux_parser));
+        }
+        for (unsigned t = 0; t < nb_threads; t++) {
+            assert(0 == pthread_join(pth[t], NULL));
+        }
+        timeval_set_now(&stop);
+        int64_t const dt = MAX(timeval_sub(&stop, &start), 1);
+        printf("%s, %2u threads: %8.0f lookups/ms\n", lockfree ? "lock-free":"locked   ", nb_threads, (double)nb_threads * NB_LOOKUPS * 1000. / dt);
+    }
+
+    struct parser *parser = &mux_parser->parser;
+    parser_unref(&parser);
+    doomer_run();
+}
+
+int main(void)
+{
+    log_init();
+    ext_init();
+    objalloc_init();
+    proto_init();
+    pkt_wait_list_init();
+    ref_init();
+    log_set_level(LOG_INFO, NULL);
+    log_set_file("mux_check.log");
+    timeval_set_now(&now);
+    test_proto_ctor();
+
+    lookup_check(false);
+    lookup_check(true);
+    grow_check();
+    flow_cache_check();
+    infanticide_check();
+    flow_class_check();
+    lookup_bench(false);
+    lookup_bench(true);
+
+    mux_proto_dtor(&mux_proto_test);
+    doomer_stop();
+    ref_fini();
+    pkt_wait_list_fini();
+    proto_fini();
+    objalloc_fini();
+    ext_fini();
+    log_fini();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,85 @@
+#!../src/junkie -c
+; vim:syntax=scheme expandtab
+!#
+
+(use-modules (rnrs io ports))
+
+(display "Testing partitioned pcap reading\n")
+
+(define logfile "partitions.log");
+(false-if-exception (delete-file logfile))
+(set-log-file logfile)
+(set-log-level 7)
+(set-log-level 3 "mutex")
+
+(set-quit-when-done #f)
+
+; The writer output must be the same whether the file was partitioned or not
+(load-plugin "../plugins/writer/.libs/writer.so")
+
+(define (wait-completion)
+  (while (not (null? (iface-names)))
+         (usleep 100)))
+
+(define (play open-fn file)
+  (reset-digests)
+  (open-fn file)
+  (wait-completion))
+
+; Frames and bytes seen by each protocol
+(define (counters)
+  (map (lambda (p)
+         (let ((stats (proto-stats p)))
+           (list p (assq-ref stats 'num-frames) (assq-ref stats 'num-bytes))))
+       (proto-names)))
+
+(define (diff-counters after before)
+  (map (lambda (a b)
+         (list (car a) (- (cadr a) (cadr b)) (- (caddr a) (caddr b))))
+       after before))
+
+; Returns the counters that were incremented while playing this file,
+; and the content of the pcap the writer saved meanwhile
+(define (play-and-count open-fn file)
+  (let* ((savefile (tmpnam))
+         (conf     (make-capture-conf savefile 'pcap))
+         (before   (counters)))
+    (capture-start conf)
+    (play open-fn file)
+    (capture-stop conf)
+    (let* ((port  (open-file-input-port savefile))
+           (saved (get-bytevector-all port)))
+      (close-port port)
+      (delete-file savefile)
+      (cons saved (diff-counters (counters) before)))))
+
+(define (check file)
+  (let* ((path    (string-append (getenv "srcdir") "/pcap/" file))
+         (single  (play-and-count open-pcap path))
+         (split   (play-and-count (lambda (f) (open-pcap-partitioned f 4)) path)))
+    (simple-format #t "Checking ~a~%" file)
+    (if (not (equal? (car single) (car split)))
+        (simple-format #t "Saved frames differ~%"))
+    (assert (equal? (car single) (car split)))
+    (for-each (lambda (s p)
+                (if (not (equal? s p))
+                    (simple-format #t "Single threaded: ~a, partitioned: ~a~%" s p))
+                (assert (equal? s p)))
+              (cdr single) (cdr split))))
+
+(define files
+  '("http/http_multiline.pcap"
+    "dns/dns.pcap"
+    "gre/sample.pcap"
+    "eth/qinq.pcap"
+    "mysql/select.pcap"
+    "icmp/destination-unreachable.pcap"))
+
+(for-each check files)
+
+; Again, with the leading partitions waiting for the slowest one after each output
+(set-cap-merge-max-pending 1)
+(for-each check files)
+
+;; good enough!
+(exit 0)
@@ -8,6 +8,7 @@
 #include <junkie/tools/miscmacs.h>
 #include <junkie/tools/ext.h>
 #include <junkie/tools/objalloc.h>
+#include <junkie/proto/cap.h>
 #include "pkt_wait_list.c"
 
 #undef LOG_CAT
@@ -232,6 +233,75 @@ static void reassembly_check(void)
     assert(0 == memcmp(msg, msg2, NB_ELEMS(msg)));
 }
 
+/*
+ * Check that packets from a capture buffer are kept there instead of being copied
+ */
+
+static void retain_check(void)
+{
+    wl_check_setup();
+    size_t const tot_size = cap_buf_tot_size;
+
+    struct parser *cap_parser = proto_cap->ops->parser_new(proto_cap);
+    assert(cap_parser);
+    struct cap_buf *buf = cap_buf_new(sizeof(msg));
+    assert(buf);
+    memcpy(buf->data, msg, sizeof(msg));
+    assert(cap_buf_tot_size == tot_size + sizeof(msg));
+
+    struct cap_proto_info info;
+    proto_info_ctor(&info.info, cap_parser, NULL, 0, sizeof(msg));
+    info.dev_id = 0;
+    info.tv = now;
+    info.buf = buf;
+
+    uint64_t const copied = counter_read(&config.bytes_copied);
+    uint64_t const referenced = counter_read(&config.bytes_referenced);
+    uint64_t const pinned = counter_read(&config.bytes_pinned);
+    unsigned const half = sizeof(msg) / 2;
+
+    // The second half is within the buffer, so it's retained
+    assert(PROTO_OK == pkt_wait_list_add(&wl, half, sizeof(msg), false, 0, false, &info.info, 0, buf->data + half, sizeof(msg) - half, sizeof(msg) - half, &now, sizeof(msg), buf->data));
+    assert(buf->refs == 2);
+    assert(counter_read(&config.bytes_referenced) == referenced + sizeof(msg));
+    assert(counter_read(&config.bytes_copied) == copied);
+    assert(counter_read(&config.bytes_pinned) == pinned + buf->size);
+    struct pkt_wait *pkt = LIST_FIRST(&wl.pkts);
+    assert(pkt && pkt->buf == buf && pkt->packet == buf->data);
+
+    // The first half is not, so it's copied
+    uint8_t first[sizeof(msg)];
+    memcpy(first, msg, half);
+    assert(PROTO_OK == pkt_wait_list_add(&wl, 0, half, false, 0, false, &info.info, 0, first, half, half, &now, half, first));
+    assert(buf->refs == 2);
+    assert(counter_read(&config.bytes_copied) == copied + half);
+    pkt = LIST_FIRST(&wl.pkts);
+    assert(pkt && ! pkt->buf && pkt->packet == pkt->copy);
+    assert(counter_read(&config.bytes_pinned) == pinned + buf->size);
+
+    uint8_t *msg2 = pkt_wait_list_reassemble(&wl, 0, sizeof(msg));
+    assert(msg2);
+    assert(0 == memcmp(msg, msg2, sizeof(msg)));
+    objfree(msg2);
+
+    // Once the capture layer left it the buffer is pinned by the waiting list alone
+    size_t const pinned_size = cap_buf_pinned_size;
+    size_t const buf_size = buf->size;
+    struct cap_buf *held = buf;
+    cap_buf_leave(&buf);
+    assert(! buf);
+    assert(held->refs == 1);
+    assert(cap_buf_pinned_size == pinned_size + buf_size);
+
+    // Once the packets are gone so is the buffer
+    pkt_wait_list_dtor(&wl);
+    assert(cap_buf_pinned_size == pinned_size);
+    assert(cap_buf_tot_size == tot_size);
+
+    parser_unref(&cap_parser);
+    wl_check_teardown();
+}
+
 /*
  * Startup
  */
@@ -243,6 +313,7 @@ int main(void)
     objalloc_init();
     proto_init();
     pkt_wait_list_init();
+    cap_init();
     ref_init();
     srand(time(NULL));
     log_set_level(LOG_INFO, NULL);  // DEBUG make the test too slow
@@ -255,9 +326,11 @@ int main(void)
     for (unsigned t = 0; t < 1000; t++) {
         reassembly_check();
     }
+    retain_check();
 
     doomer_stop();
     ref_fini();
+    cap_fini();
     pkt_wait_list_fini();
     proto_fini();
     objalloc_fini();
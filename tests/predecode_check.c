@@ -0,0 +1,212 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+#include <ftw.h>
+#include "predecode.c"
+
+/*
+ * Check a few handcrafted frames
+ */
+
+static uint8_t const eth_ip_tcp[] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0x08, 0x00,    // Ethernet
+    0x45, 0x00, 0x00, 0x28, 0x12, 0x34, 0x40, 0x00, 0x40, 0x06, 0x00, 0x00,                // IPv4, TCP
+    0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0x02,
+    0x04, 0xd2, 0x00, 0x50, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,                // TCP 1234 -> 80
+    0x50, 0x02, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static void swap(uint8_t *a, uint8_t *b, size_t len)
+{
+    uint8_t tmp[16];
+    memcpy(tmp, a, len);
+    memcpy(a, b, len);
+    memcpy(b, tmp, len);
+}
+
+static void simple_check(void)
+{
+    struct frame_desc desc;
+    uint8_t frame[128];
+
+    // Plain TCP
+    memcpy(frame, eth_ip_tcp, sizeof(eth_ip_tcp));
+    frame_predecode(&desc, frame, sizeof(eth_ip_tcp));
+    assert(desc.ip_version == 4 && desc.ip_proto == 6);
+    assert(desc.l3_offset == 14 && desc.l4_offset == 34);
+    assert(desc.depth == 0 && ! desc.fragment);
+    assert(desc.flow_hash != 0);
+    assert(desc.flow_hash == frame_flow_hash(frame, sizeof(eth_ip_tcp)));
+
+    // Other way around
+    uint32_t const h = desc.flow_hash;
+    swap(frame + 26, frame + 30, 4);
+    swap(frame + 34, frame + 36, 2);
+    assert(frame_flow_hash(frame, sizeof(eth_ip_tcp)) == h);
+
+    // Another port is another flow
+    frame[35] ++;
+    assert(frame_flow_hash(frame, sizeof(eth_ip_tcp)) != h);
+
+    // With a VLAN tag
+    memcpy(frame, eth_ip_tcp, 12);
+    frame[12] = 0x81; frame[13] = 0x00; frame[14] = 0x00; frame[15] = 0x2a;
+    memcpy(frame + 16, eth_ip_tcp + 12, sizeof(eth_ip_tcp) - 12);
+    frame_predecode(&desc, frame, sizeof(eth_ip_tcp) + 4);
+    assert(desc.l3_offset == 18 && desc.l4_offset == 38);
+    assert(desc.flow_hash == h);
+
+    // Truncated
+    frame_predecode(&desc, frame, 30);
+    assert(desc.ip_version == 0 && desc.flow_hash == 0);
+
+    // A fragment does not use the ports
+    memcpy(frame, eth_ip_tcp, sizeof(eth_ip_tcp));
+    frame[20] = 0x20;   // More Fragments
+    frame_predecode(&desc, frame, sizeof(eth_ip_tcp));
+    assert(desc.fragment && desc.l4_offset == 0 && desc.l3_offset == 14);
+    uint32_t const frag_h = desc.flow_hash;
+    frame[34] ++;
+    assert(frame_flow_hash(frame, sizeof(eth_ip_tcp)) == frag_h);
+
+    // Within VXLAN
+    static uint8_t const outer[] = {
+        0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0x08, 0x00,
+        0x45, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x11, 0x00, 0x00,                // IPv4, UDP
+        0x0a, 0x00, 0x00, 0x01, 0x0a, 0x00, 0x00, 0x02,
+        0x30, 0x39, 0x12, 0xb5, 0x00, 0x00, 0x00, 0x00,                                        // UDP to 4789
+        0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,                                        // VXLAN
+    };
+    memcpy(frame, outer, sizeof(outer));
+    memcpy(frame + sizeof(outer), eth_ip_tcp, sizeof(eth_ip_tcp));
+    frame_predecode(&desc, frame, sizeof(outer) + sizeof(eth_ip_tcp));
+    assert(desc.depth == 1 && desc.ip_proto == 6);
+    assert(desc.l3_offset == sizeof(outer) + 14 && desc.l4_offset == sizeof(outer) + 34);
+    assert(desc.flow_hash == h);
+
+    // But if the inner frame is not IP, the outer UDP is the flow
+    frame[sizeof(outer) + 12] = 0x08; frame[sizeof(outer) + 13] = 0x06;   // ARP
+    frame_predecode(&desc, frame, sizeof(outer) + sizeof(eth_ip_tcp));
+    assert(desc.depth == 0 && desc.ip_proto == 17);
+    assert(desc.l3_offset == 14 && desc.l4_offset == 34);
+}
+
+/*
+ * Load the frames of the test pcaps
+ */
+
+#define MAX_FRAMES 100000
+
+static struct frame frames[MAX_FRAMES];
+static unsigned num_frames;
+
+static uint32_t read_u32(uint8_t const *p, bool swap)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static int add_pcap(char const *path, struct stat const unused_ *sb, int type, struct FTW unused_ *ftw)
+{
+    size_t const path_len = strlen(path);
+    if (type != FTW_F || path_len < 5 || 0 != strcmp(path + path_len - 5, ".pcap")) return 0;
+
+    FILE *f = fopen(path, "r");
+    if (! f) return 0;
+    uint8_t hdr[24];
+    if (1 != fread(hdr, sizeof(hdr), 1, f)) goto quit;
+    uint32_t const magic = read_u32(hdr, false);
+    bool const swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    if (! swap && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) goto quit;
+    if (read_u32(hdr + 20, swap) != 1) goto quit;   // Ethernet only
+
+    uint8_t rec[16];
+    while (num_frames < MAX_FRAMES && 1 == fread(rec, sizeof(rec), 1, f)) {
+        uint32_t const caplen = read_u32(rec + 8, swap);
+        if (caplen > 65536) break;
+        uint8_t *data = malloc(caplen);
+        assert(data);
+        if (1 != fread(data, caplen, 1, f)) {
+            free(data);
+            break;
+        }
+        frames[num_frames].cap_len = frames[num_frames].wire_len = caplen;
+        frames[num_frames].data = data;
+        num_frames ++;
+    }
+quit:
+    fclose(f);
+    return 0;
+}
+
+/*
+ * Check the descriptors of all these frames, and bench
+ */
+
+static void corpus_check(struct frame_desc const *descs)
+{
+    unsigned num_ip = 0, num_l4 = 0, num_tunneled = 0;
+    for (unsigned f = 0; f < num_frames; f++) {
+        struct frame_desc const *desc = descs + f;
+        assert(desc->flow_hash == frame_flow_hash(frames[f].data, frames[f].cap_len));
+        if (! desc->ip_version) {
+            assert(desc->flow_hash == 0);
+            continue;
+        }
+        num_ip ++;
+        assert(desc->l3_offset < frames[f].cap_len);
+        assert(frames[f].data[desc->l3_offset] >> 4 == desc->ip_version);
+        if (desc->l4_offset) {
+            num_l4 ++;
+            assert(desc->l4_offset > desc->l3_offset && desc->l4_offset <= frames[f].cap_len);
+        }
+        if (desc->depth) num_tunneled ++;
+    }
+    printf("%u frames, %u IP, %u with transport header, %u tunneled\n", num_frames, num_ip, num_l4, num_tunneled);
+}
+
+static uint64_t cycles(void)
+{
+#   if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_ia32_rdtsc();
+#   else
+    return 0;
+#   endif
+}
+
+static void bench(struct frame_desc *descs)
+{
+    if (! num_frames) return;
+
+#   define NB_ROUNDS 100
+#   define BURST 100
+    uint64_t const start = cycles();
+    for (unsigned r = 0; r < NB_ROUNDS; r++) {
+        for (unsigned f = 0; f < num_frames; f += BURST) {
+            frames_predecode(descs + f, frames + f, MIN(BURST, num_frames - f));
+        }
+    }
+    uint64_t const predecode_cycles = cycles() - start;
+    printf("predecode: %.1f cycles/frame\n", (double)predecode_cycles / ((double)NB_ROUNDS * num_frames));
+}
+
+int main(void)
+{
+    simple_check();
+
+    (void)nftw(STRIZE(SRCDIR) "/pcap", add_pcap, 10, 0);
+    struct frame_desc *descs = malloc(MAX(num_frames, 1) * sizeof(*descs));
+    assert(descs);
+    frames_predecode(descs, frames, num_frames);
+    corpus_check(descs);
+    bench(descs);
+
+    free(descs);
+    for (unsigned f = 0; f < num_frames; f++) free((void *)frames[f].data);
+    return EXIT_SUCCESS;
+}
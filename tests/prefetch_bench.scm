@@ -0,0 +1,68 @@
+#!../src/junkie -c
+; vim:syntax=scheme expandtab
+!#
+
+(use-modules (ice-9 ftw))
+
+(display "Benchmarking prefetch-distance on the pcap corpus\n")
+
+(define logfile "prefetch_bench.log");
+(false-if-exception (delete-file logfile))
+(set-log-file logfile)
+(set-log-level 3)
+
+(set-quit-when-done #f)
+
+(define (wait-completion)
+  (while (not (null? (iface-names)))
+         (usleep 100)))
+
+; All the pcaps of the corpus
+(define pcaps
+  (let ((files '()))
+    (ftw (string-append (getenv "srcdir") "/pcap")
+         (lambda (path stat flag)
+           (if (and (eq? flag 'regular) (string-suffix? ".pcap" path))
+               (set! files (cons path files)))
+           #t))
+    (sort files string<?)))
+
+; Frames and bytes seen by each protocol
+(define (counters)
+  (map (lambda (p)
+         (let ((stats (proto-stats p)))
+           (list p (assq-ref stats 'num-frames) (assq-ref stats 'num-bytes))))
+       (proto-names)))
+
+(define (diff-counters after before)
+  (map (lambda (a b)
+         (list (car a) (- (cadr a) (cadr b)) (- (caddr a) (caddr b))))
+       after before))
+
+(define nb-rounds 20)
+
+; Returns the real time it took to play the whole corpus nb-rounds times with
+; this prefetch distance, and the counters that were incremented meanwhile
+(define (play distance)
+  (set-prefetch-distance distance)
+  (let ((before (counters))
+        (start  (get-internal-real-time)))
+    (do ((r 0 (1+ r))) ((>= r nb-rounds))
+      (for-each (lambda (file)
+                  (reset-digests)
+                  (open-pcap file)
+                  (wait-completion))
+                pcaps))
+    (cons (- (get-internal-real-time) start)
+          (diff-counters (counters) before))))
+
+(play 0)    ; warm up
+(let* ((without (play 0))
+       (with    (play 4))
+       (ms      (lambda (t) (quotient (* 1000 t) internal-time-units-per-second))))
+  (simple-format #t "prefetch-distance 0: ~a ms, 4: ~a ms~%" (ms (car without)) (ms (car with)))
+  ; Prefetching must not change what's parsed
+  (assert (equal? (cdr without) (cdr with))))
+
+;; good enough!
+(exit 0)
@@ -0,0 +1,178 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#undef NDEBUG
+#include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+#include <junkie/tools/miscmacs.h>
+#include <junkie/tools/log.h>
+#include <junkie/tools/mutex.h>
+#include <junkie/tools/ref.h>
+
+/* Doomed objects are not freed but merely flagged as deleted, so that we can
+ * check that no thread ever sees a deleted object from within its region. */
+struct obj {
+    struct ref ref;
+    bool volatile deleted;
+};
+
+static unsigned num_deleted;
+
+static void obj_del(struct ref *ref)
+{
+    struct obj *obj = DOWNCAST(ref, ref, obj);
+    assert(! obj->deleted);
+    obj->deleted = true;
+    num_deleted ++;   // only the doomer run from the main thread deletes
+}
+
+static void obj_ctor(struct obj *obj)
+{
+    ref_ctor(&obj->ref, obj_del);
+    obj->deleted = false;
+}
+
+// Since we stopped the doomer thread the epoch advances only when we run it
+static void run_doomer(unsigned times)
+{
+    while (times--) doomer_run();
+}
+
+/*
+ * A thread in its region while an object is doomed delays its deletion
+ */
+
+static struct obj *volatile shared;
+static pthread_barrier_t entered, checked, left;
+static bool rescue;
+
+static void *holder(void unused_ *dummy)
+{
+    enter_multi_region();
+    struct obj *obj = shared;
+    pthread_barrier_wait(&entered);
+    pthread_barrier_wait(&checked); // main thread dooms the object meanwhile
+    assert(! obj->deleted);
+    if (rescue) (void)ref(&obj->ref);   // from 0 to 1
+    leave_protected_region();
+    pthread_barrier_wait(&left);
+    return NULL;
+}
+
+static void region_check(void)
+{
+    assert(0 == pthread_barrier_init(&entered, NULL, 2));
+    assert(0 == pthread_barrier_init(&checked, NULL, 2));
+    assert(0 == pthread_barrier_init(&left, NULL, 2));
+
+    for (unsigned r = 0; r < 2; r++) {
+        rescue = r == 1;
+        num_deleted = 0;
+        struct obj obj;
+        obj_ctor(&obj);
+        shared = &obj;
+
+        pthread_t pth;
+        assert(0 == pthread_create(&pth, NULL, holder, NULL));
+        pthread_barrier_wait(&entered);
+
+        shared = NULL;
+        unref(&obj.ref);
+        run_doomer(5);
+        assert(! obj.deleted);  // the holder may still use it
+
+        pthread_barrier_wait(&checked);
+        pthread_barrier_wait(&left);
+        run_doomer(5);
+        assert(obj.deleted == ! rescue);
+
+        if (rescue) {   // then it can be doomed again
+            unref(&obj.ref);
+            run_doomer(5);
+            assert(obj.deleted);
+        }
+        assert(num_deleted == 1);
+        assert(0 == pthread_join(pth, NULL));
+    }
+
+    pthread_barrier_destroy(&entered);
+    pthread_barrier_destroy(&checked);
+    pthread_barrier_destroy(&left);
+}
+
+/*
+ * Many threads reading a pointer that's constantly replaced
+ */
+
+#define NB_READERS 6
+#define NB_ROUNDS 20000
+
+static struct obj objs[NB_ROUNDS];
+static bool volatile stop;
+
+static void *reader(void unused_ *dummy)
+{
+    while (! stop) {
+        enter_multi_region();
+        struct obj *obj = shared;
+        for (unsigned i = 0; i < 10; i++) {
+            assert(! obj->deleted);
+            sched_yield();
+        }
+        leave_protected_region();
+    }
+    return NULL;
+}
+
+static void stress_check(void)
+{
+    num_deleted = 0;
+    obj_ctor(objs + 0);
+    shared = objs + 0;
+
+    pthread_t pth[NB_READERS];
+    for (unsigned t = 0; t < NB_ELEMS(pth); t++) {
+        assert(0 == pthread_create(pth+t, NULL, reader, NULL));
+    }
+
+    for (unsigned r = 1; r < NB_ROUNDS; r++) {
+        obj_ctor(objs + r);
+        struct obj *prev = __sync_lock_test_and_set(&shared, objs + r);
+        unref(&prev->ref);
+        if (0 == r % 64) run_doomer(1);
+    }
+
+    stop = true;
+    for (unsigned t = 0; t < NB_ELEMS(pth); t++) {
+        assert(0 == pthread_join(pth[t], NULL));
+    }
+
+    // Now that no one is in its region every replaced object must go
+    run_doomer(5);
+    assert(num_deleted == NB_ROUNDS - 1);
+    assert(! shared->deleted);
+    unref(&shared->ref);
+    run_doomer(5);
+    assert(num_deleted == NB_ROUNDS);
+}
+
+int main(void)
+{
+    log_init();
+    mutex_init();
+    ref_init();
+    log_set_level(LOG_DEBUG, NULL);
+    log_set_file("ref_check.log");
+
+    doomer_stop();  // we run the doomer ourself
+    region_check();
+    stress_check();
+
+    ref_fini();
+    mutex_fini();
+    log_fini();
+    return EXIT_SUCCESS;
+}
@@ -1,6 +1,8 @@
 // -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
 // vim:sw=4 ts=4 sts=4 expandtab
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #undef NDEBUG
 #include <assert.h>
 #include <time.h>
@@ -237,6 +239,10 @@ static struct parser *eth_parser;
 static unsigned num_okfn_calls;
 static unsigned num_gets, num_resps;
 static struct proto_subscriber sub;
+// The HTTP infos we were given, in order, and the ones of the in-order run
+static char http_infos[NB_ELEMS(pkts)][1024], ref_http_infos[NB_ELEMS(pkts)][1024];
+static unsigned num_http_infos, num_ref_http_infos;
+static int64_t extra_bytes_base;
 
 static void okfn(struct proto_subscriber unused_ *s, struct proto_info const *last, size_t unused_ cap_len, uint8_t const unused_ *packet, struct timeval const unused_ *now)
 {
@@ -245,6 +251,8 @@ static void okfn(struct proto_subscriber unused_ *s, struct proto_info const *la
 
     if (last->parser->proto == proto_http) {
         struct http_proto_info const *info = DOWNCAST(last, info, http_proto_info);
+        assert(num_http_infos < NB_ELEMS(http_infos));
+        snprintf(http_infos[num_http_infos++], sizeof(http_infos[0]), "%s", last->parser->proto->ops->info_2_str(last));
         if ((info->set_values & HTTP_METHOD_SET) && info->method == HTTP_METHOD_GET) {
             assert(num_gets < 2);
             if (num_gets == 0) assert(info->strs[info->url+1] == 'g');  // check GETs order
@@ -264,10 +272,25 @@ static void setup(void)
     timeval_set_now(&now);
     eth_parser = proto_eth->ops->parser_new(proto_eth);
     assert(eth_parser);
-    num_okfn_calls = num_gets = num_resps = 0;
+    num_okfn_calls = num_gets = num_resps = num_http_infos = 0;
+    struct mux_proto *mux_proto = DOWNCAST(proto_tcp, proto, mux_proto);
+    extra_bytes_base = counter_read(&mux_proto->extra_bytes);
     hook_subscriber_ctor(&pkt_hook, &sub, okfn);
 }
 
+// How many bytes TCP subparsers allocated on top of their struct since setup (ie. reordering lists)
+static int64_t tcp_extra_bytes(void)
+{
+    struct mux_proto *mux_proto = DOWNCAST(proto_tcp, proto, mux_proto);
+    return (int64_t)counter_read(&mux_proto->extra_bytes) - extra_bytes_base;
+}
+
+static void parse_pkt(unsigned p)
+{
+    SLOG(LOG_DEBUG, "Sending Packet %u", p);
+    assert(PROTO_OK == proto_parse(eth_parser, NULL, 0, pkts[p].payload, pkts[p].size, pkts[p].size, &now, pkts[p].size, pkts[p].payload));
+}
+
 static void teardown(void)
 {
     hook_subscriber_dtor(&pkt_hook, &sub);
@@ -280,12 +303,41 @@ static void simple_check(void)
     setup();
 
     for (unsigned p = 0 ; p < NB_ELEMS(pkts); p++) {
-        assert(PROTO_OK == proto_parse(eth_parser, NULL, 0, pkts[p].payload, pkts[p].size, pkts[p].size, &now, pkts[p].size, pkts[p].payload));
+        parse_pkt(p);
+        assert(tcp_extra_bytes() == 0); // no reordering list for an in-order flow
+    }
+    assert(num_okfn_calls == NB_ELEMS(pkts));
+    assert(num_gets == 2);
+    assert(num_resps == 2);
+
+    assert(num_http_infos >= 4);
+    memcpy(ref_http_infos, http_infos, sizeof(ref_http_infos));
+    num_ref_http_infos = num_http_infos;
+
+    teardown();
+}
+
+// Check that the reordering lists are allocated at the first gap only, and that we then parse the same
+static void gap_check(void)
+{
+    setup();
+
+    static unsigned const order[] = { 0, 1, 2, 6, 3, 4, 5, 7, 8 };  // the ACK of the 204 before the first GET
+    assert(NB_ELEMS(order) == NB_ELEMS(pkts));
+    for (unsigned o = 0; o < NB_ELEMS(order); o++) {
+        parse_pkt(order[o]);
+        if (o < 3) assert(tcp_extra_bytes() == 0);
+        else assert(tcp_extra_bytes() > 0);
     }
     assert(num_okfn_calls == NB_ELEMS(pkts));
     assert(num_gets == 2);
     assert(num_resps == 2);
 
+    assert(num_http_infos == num_ref_http_infos);
+    for (unsigned i = 0; i < num_http_infos; i++) {
+        assert(0 == strcmp(http_infos[i], ref_http_infos[i]));
+    }
+
     teardown();
 }
 
@@ -301,8 +353,7 @@ static void random_check(void)
         unsigned p = num_sent < 2 ? num_sent : random() % NB_ELEMS(pkts); // send the first syn first, then random
         while (sent[p]) p = (p+1) % NB_ELEMS(pkts);
         sent[p] = true;
-        SLOG(LOG_DEBUG, "Sending Packet %u", p);
-        assert(PROTO_OK == proto_parse(eth_parser, NULL, 0, pkts[p].payload, pkts[p].size, pkts[p].size, &now, pkts[p].size, pkts[p].payload));
+        parse_pkt(p);
     }
     assert(num_okfn_calls == NB_ELEMS(pkts));
     assert(num_gets == 2);
@@ -332,6 +383,7 @@ int main(void)
     log_set_file("tcp_reorder_check.log");
 
     simple_check();
+    gap_check();
     for (unsigned num_rand = 0; num_rand < 100; num_rand++) random_check();
 
     doomer_stop();
@@ -0,0 +1,245 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#undef NDEBUG
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <junkie/tools/miscmacs.h>
+#include <junkie/tools/log.h>
+#include <junkie/tools/mutex.h>
+#include <junkie/tools/timer_wheel.h>
+
+/*
+ * Fire timers at random expiries, some of which are rearmed or cancelled
+ */
+
+#define NB_TIMERS 5000
+
+static struct obj {
+    struct timer timer;
+    time_t expiry;      // when it's supposed to fire (0 if not armed)
+    unsigned num_fired;
+    bool rearm;         // rearm it from the fire callback, once
+} objs[NB_TIMERS];
+
+static time_t cur_time;
+
+static void fire(struct timer_wheel *wheel, struct timer *timer, time_t now)
+{
+    struct obj *obj = DOWNCAST(timer, timer, obj);
+    assert(now == cur_time);
+    assert(obj->expiry && obj->expiry <= now);
+    assert(! timer_is_armed(timer));
+    obj->num_fired ++;
+    obj->expiry = 0;
+
+    if (obj->rearm) {
+        obj->rearm = false;
+        obj->expiry = now + 1 + rand() % 100;
+        timer_arm(wheel, timer, obj->expiry);
+    }
+
+    // Firing a timer may cancel another one that expired at the same time
+    struct obj *other = objs + rand() % NB_TIMERS;
+    if (other != obj && other->expiry && other->expiry <= now && rand() % 4 == 0) {
+        timer_cancel(wheel, &other->timer);
+        other->expiry = 0;
+    }
+}
+
+static time_t random_delay(void)
+{
+    switch (rand() % 4) {
+        case 0: return rand() % TIMER_WHEEL_SLOTS;
+        case 1: return rand() % 5000;
+        case 2: return rand() % 200000; // beyond the wheel span
+        default: return 100 + rand() % 200;
+    }
+}
+
+static void random_check(time_t start)
+{
+    struct timer_wheel wheel;
+    timer_wheel_ctor(&wheel, fire);
+    cur_time = start;
+    (void)timer_wheel_advance(&wheel, cur_time);
+
+    for (unsigned o = 0; o < NB_ELEMS(objs); o++) {
+        timer_ctor(&objs[o].timer);
+        objs[o].expiry = cur_time + random_delay();
+        objs[o].num_fired = 0;
+        objs[o].rearm = rand() % 10 == 0;
+        timer_arm(&wheel, &objs[o].timer, objs[o].expiry);
+    }
+    assert(wheel.num_timers == NB_ELEMS(objs));
+
+    while (wheel.num_timers > 0) {
+        cur_time += rand() % 3 ? 1 : rand() % 1000;
+        (void)timer_wheel_advance(&wheel, cur_time);
+
+        // No armed timer is late
+        for (unsigned o = 0; o < NB_ELEMS(objs); o++) {
+            assert(! objs[o].expiry || objs[o].expiry > cur_time);
+            assert(timer_is_armed(&objs[o].timer) == !! objs[o].expiry);
+        }
+
+        // Rearm or cancel a few
+        for (unsigned n = 0; n < 10; n++) {
+            struct obj *obj = objs + rand() % NB_TIMERS;
+            if (! obj->expiry) continue;
+            if (rand() % 2) {
+                obj->expiry = cur_time + 1 + random_delay();
+                timer_arm(&wheel, &obj->timer, obj->expiry);
+            } else {
+                timer_cancel(&wheel, &obj->timer);
+                obj->expiry = 0;
+            }
+        }
+    }
+
+    for (unsigned o = 0; o < NB_ELEMS(objs); o++) {
+        assert(! timer_is_armed(&objs[o].timer));
+        assert(objs[o].num_fired <= 2);
+    }
+    assert(! timer_wheel_first(&wheel));
+    timer_wheel_dtor(&wheel);
+}
+
+/*
+ * A timer that is due is fired even if the wheel jumps far ahead, and flush fires them all
+ */
+
+static void jump_check(void)
+{
+    struct timer_wheel wheel;
+    timer_wheel_ctor(&wheel, fire);
+    cur_time = 1000000000;
+    for (unsigned o = 0; o < 3; o++) {
+        timer_ctor(&objs[o].timer);
+        objs[o].num_fired = 0;
+        objs[o].rearm = false;
+    }
+    objs[0].expiry = cur_time + 3;
+    objs[1].expiry = cur_time + 3000000;
+    objs[2].expiry = 1; // already expired
+    for (unsigned o = 0; o < 3; o++) timer_arm(&wheel, &objs[o].timer, objs[o].expiry);
+    assert(timer_wheel_first(&wheel));
+
+    assert(1 == timer_wheel_advance(&wheel, cur_time));
+    assert(objs[2].num_fired == 1);
+    cur_time += 1000;
+    assert(1 == timer_wheel_advance(&wheel, cur_time));
+    assert(objs[0].num_fired == 1);
+    assert(objs[1].expiry && wheel.num_timers == 1);
+
+    // Flush does not wait for expiry (but our fire callback checks it)
+    objs[1].expiry = cur_time;
+    assert(1 == timer_wheel_flush(&wheel, cur_time));
+    assert(objs[1].num_fired == 1);
+    assert(wheel.num_timers == 0 && ! timer_wheel_first(&wheel));
+    timer_wheel_dtor(&wheel);
+}
+
+/*
+ * Timers armed on a fresh wheel (which does not know the time yet), then
+ * advanced to a real date, are neither fired late nor cascaded all the way
+ * from the epoch.
+ */
+
+static void fire_once(struct timer_wheel unused_ *wheel, struct timer *timer, time_t now)
+{
+    struct obj *obj = DOWNCAST(timer, timer, obj);
+    assert(now == cur_time);
+    assert(obj->expiry && obj->expiry <= now);
+    obj->num_fired ++;
+    obj->expiry = 0;
+}
+
+static void fresh_check(void)
+{
+    time_t const date = 1700000000;
+
+    for (unsigned pass = 0; pass < 2; pass++) {
+        struct timer_wheel wheel;
+        timer_wheel_ctor(&wheel, fire_once);
+        if (pass == 1) {    // A wheel that was advanced once, long ago
+            cur_time = 1000;
+            (void)timer_wheel_advance(&wheel, cur_time);
+        }
+
+        clock_t const start = clock();
+        for (unsigned o = 0; o < NB_ELEMS(objs); o++) {
+            timer_ctor(&objs[o].timer);
+            objs[o].expiry = date + 1 + o % 600;
+            objs[o].num_fired = 0;
+            objs[o].rearm = false;
+            timer_arm(&wheel, &objs[o].timer, objs[o].expiry);
+        }
+
+        // About half of them are due
+        cur_time = date + 300;
+        unsigned num_due = 0;
+        for (unsigned o = 0; o < NB_ELEMS(objs); o++) num_due += objs[o].expiry <= cur_time;
+        assert(num_due == timer_wheel_advance(&wheel, cur_time));
+        for (unsigned o = 0; o < NB_ELEMS(objs); o++) {
+            assert(objs[o].num_fired == (objs[o].expiry == 0));
+            assert(! objs[o].expiry || objs[o].expiry > cur_time);
+        }
+        // This used to take seconds
+        assert(clock() - start < CLOCKS_PER_SEC / 2);
+
+        // The others fire on time
+        while (wheel.num_timers > 0) {
+            cur_time ++;
+            (void)timer_wheel_advance(&wheel, cur_time);
+            for (unsigned o = 0; o < NB_ELEMS(objs); o++) {
+                assert(! objs[o].expiry || objs[o].expiry > cur_time);
+            }
+        }
+        assert(cur_time == date + 600);
+        timer_wheel_dtor(&wheel);
+    }
+}
+
+/*
+ * The timers thread calls the tickers
+ */
+
+static unsigned volatile num_ticks;
+
+static void tick(struct timer_ticker unused_ *ticker)
+{
+    num_ticks ++;
+}
+
+static void ticker_check(void)
+{
+    struct timer_ticker ticker;
+    timer_ticker_ctor(&ticker, "test ticker", tick);
+    for (unsigned t = 0; t < 30 && num_ticks < 2; t++) usleep(100000);
+    timer_ticker_dtor(&ticker);
+    assert(num_ticks >= 1);
+}
+
+int main(void)
+{
+    log_init();
+    mutex_init();
+    timer_wheel_init();
+    log_set_level(LOG_DEBUG, NULL);
+    log_set_file("timer_wheel_check.log");
+
+    srand(42);
+    random_check(1);
+    random_check(1234567890);
+    jump_check();
+    fresh_check();
+    ticker_check();
+
+    timer_wheel_fini();
+    mutex_fini();
+    log_fini();
+    return EXIT_SUCCESS;
+}